@@ -20,7 +20,10 @@
 #include "lepp3/ObstacleEvaluator.hpp"
 #include "lepp3/SurfaceEvaluator.hpp"
 #include "lepp3/util/FileManager.hpp"
+#include "lepp3/util/MetricsExporter.hpp"
 #include "lepp3/util/OfflineVideoSource.hpp"
+#include "lepp3/util/ContainerVideoSource.hpp"
+#include "lepp3/pose/RecordedPoseService.hpp"
 
 #include "lola/PoseService.h"
 
@@ -64,6 +67,10 @@ protected:
    * having sub-steps.
    */
   virtual void init() override {
+    // Exporting the latency metrics is optional.
+    if (toml_tree_.find("Metrics"))
+      initMetrics();
+
     // The pose service is optional.
     // Compatibility for offline use.
     if (toml_tree_.find("PoseService"))
@@ -96,6 +103,24 @@ protected:
 
   }
 
+  void initMetrics() {
+    std::string const sink = getTomlValue<std::string>(toml_tree_, "Metrics.export");
+    std::string const path = getTomlValue<std::string>(toml_tree_, "Metrics.path");
+    int const interval = getOptionalTomlValue(toml_tree_, "Metrics.interval_ms", 1000);
+
+    MetricsSink metrics_sink;
+    if (sink == "file") {
+      metrics_sink = MetricsSink::File;
+    } else if (sink == "socket") {
+      metrics_sink = MetricsSink::UnixSocket;
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown Metrics export: " << sink;
+      throw std::runtime_error(ss.str());
+    }
+    metrics_exporter_ = std::make_shared<MetricsExporter>(metrics_sink, path, interval);
+  }
+
   void initRobot() {
     // Check requirements
     if (!this->pose_service()) {
@@ -131,7 +156,27 @@ protected:
     int const port = getTomlValue<int>(v, "port", "aggregators[RobotAggregator].");
     int const delay = getOptionalTomlValue(v, "delay", 0);
 
-    boost::shared_ptr<AsyncRobotService> async_robot_service(new AsyncRobotService(ip, target, port, delay));
+    TransportOptions options;
+    options.queueSize = getOptionalTomlValue(v, "queue_size", static_cast<int>(options.queueSize));
+    options.coalesceMs = getOptionalTomlValue(v, "coalesce_ms", options.coalesceMs);
+    options.staleMs = getOptionalTomlValue(v, "stale_ms", options.staleMs);
+    options.rateLimit = 1000.0 * getOptionalTomlValue(v, "rate_limit_kbps", 0.0);
+    options.burst = 1000.0 * getOptionalTomlValue(v, "burst_kb", options.burst / 1000.0);
+    options.maxBatch = getOptionalTomlValue(v, "max_batch", static_cast<int>(options.maxBatch));
+    options.cloudRateLimit = 1000.0 * getOptionalTomlValue(v, "cloud_rate_limit_kbps", 0.0);
+    options.imageRateLimit = 1000.0 * getOptionalTomlValue(v, "image_rate_limit_kbps", 0.0);
+    options.noDelay = getOptionalTomlValue(v, "no_delay", options.noDelay);
+    options.sendBufferSize = 1024 * getOptionalTomlValue(v, "send_buffer_kb", 0);
+    options.reconnectMinMs = getOptionalTomlValue(v, "reconnect_min_ms", options.reconnectMinMs);
+    options.reconnectMaxMs = getOptionalTomlValue(v, "reconnect_max_ms", options.reconnectMaxMs);
+    if (options.maxBatch == 0 || options.burst <= 0) {
+      throw std::runtime_error("aggregators[RobotAggregator].max_batch and burst_kb must be positive");
+    }
+    if (options.reconnectMinMs <= 0) {
+      throw std::runtime_error("aggregators[RobotAggregator].reconnect_min_ms must be positive");
+    }
+
+    boost::shared_ptr<AsyncRobotService> async_robot_service(new AsyncRobotService(ip, target, port, delay, options));
     async_robot_service->start();
     return async_robot_service;
   }
@@ -162,12 +207,15 @@ protected:
           FileManager fm(file_path);
           file_names = fm.getFileNames(".pcd");
       }
+      // the grabber publishes a cloud whenever the replay clock triggers it
       boost::shared_ptr<pcl::Grabber> interface(new pcl::PCDGrabber<PointT>(
           file_names,
-          30.0f,
-          true));
-      this->raw_source_ = boost::shared_ptr<VideoSource<PointT>>(
+          0,
+          getOptionalTomlValue(toml_tree_, "VideoSource.loop", true)));
+      boost::shared_ptr<GeneralGrabberVideoSource<PointT>> source(
           new GeneralGrabberVideoSource<PointT>(interface, this->pose_service()));
+      source->setReplayClock(getReplayClock(file_names.size()));
+      this->raw_source_ = source;
 
     } else if (type == "oni") {
       const std::string file_path = getTomlValue<std::string>(toml_tree_, "VideoSource.file_path");
@@ -193,8 +241,8 @@ protected:
       const std::vector<std::string> file_names = fm.getFileNames(".pcd");
       boost::shared_ptr<pcl::Grabber> pcd_interface(new pcl::PCDGrabber<PointT>(
           file_names,
-          30, // frame rate
-          true)); // video loop
+          0, // triggered by the replay clock
+          getOptionalTomlValue(toml_tree_, "VideoSource.loop", true)));
 
       boost::shared_ptr<cv::VideoCapture> img_interface;
       if (enable_rgb) {
@@ -213,14 +261,67 @@ protected:
         pose = PoseServiceFromFile(dir_path + "params.txt");
         this->pose_service_ = pose;
       }
-      this->raw_source_ = boost::shared_ptr<OfflineVideoSource<PointT>>(
+      boost::shared_ptr<OfflineVideoSource<PointT>> source(
           new OfflineVideoSource<PointT>(pcd_interface, img_interface, pose));
+      source->setReplayClock(getReplayClock(file_names.size()));
+      this->raw_source_ = source;
+
+    } else if (type == "container") {
+      const std::string file_path = FileManager::expandEnvironmentVars(getTomlValue<std::string>(toml_tree_, "VideoSource.file_path"));
+      bool enable_pose = getOptionalTomlValue(toml_tree_, "VideoSource.enable_pose", false);
+      std::cout << "container file path: " << file_path << std::endl;
+      std::shared_ptr<RecordingReader> reader(new RecordingReader(file_path));
+      std::cout << "container frames: " << reader->size() << std::endl;
+
+      std::shared_ptr<RecordedPoseService> pose;
+      if (enable_pose) {
+        if (this->pose_service()) {
+          throw std::runtime_error("Only one pose provider is supported (Service or offline file)");
+        }
+        pose = std::make_shared<RecordedPoseService>();
+        this->pose_service_ = pose;
+      }
+      this->raw_source_ = boost::shared_ptr<ContainerVideoSource<PointT>>(
+          new ContainerVideoSource<PointT>(reader, pose, getReplayClock(reader->size())));
 
     } else {
       throw "Invalid VideoSource";
     }
   }
 
+  /**
+   * Creates the clock pacing an offline source with `frames` frames, from the
+   * `VideoSource.frame_rate`, `replay_mode`, `replay_rate` and `loop` options.
+   * A lockstep replay also creates the barrier that the asynchronous stages
+   * report to.
+   */
+  std::shared_ptr<ReplayClock> getReplayClock(size_t frames) {
+    double const frame_rate = getOptionalTomlValue(toml_tree_, "VideoSource.frame_rate", 30.0);
+    double const rate = getOptionalTomlValue(toml_tree_, "VideoSource.replay_rate", 1.0);
+    bool const loop = getOptionalTomlValue(toml_tree_, "VideoSource.loop", true);
+    std::string const mode = getOptionalTomlValue<std::string>(toml_tree_, "VideoSource.replay_mode", "realtime");
+
+    ReplayMode replay_mode;
+    if (mode == "realtime") {
+      replay_mode = ReplayMode::RealTime;
+    } else if (mode == "scaled") {
+      replay_mode = ReplayMode::Scaled;
+    } else if (mode == "lockstep") {
+      replay_mode = ReplayMode::Lockstep;
+      replay_barrier_ = std::make_shared<ReplayBarrier>();
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown VideoSource replay_mode: " << mode;
+      throw std::runtime_error(ss.str());
+    }
+    if (frame_rate <= 0 || rate <= 0) {
+      throw std::runtime_error("VideoSource.frame_rate and VideoSource.replay_rate must be positive");
+    }
+    std::cout << "replay mode: " << mode << std::endl;
+
+    return std::make_shared<ReplayClock>(replay_mode, frame_rate, rate, replay_barrier_, loop ? 0 : frames);
+  }
+
   /**
    * Creates an instance of `FilteredVideoSource` based on the previously
    * acquired `VideoSource` object instance.
@@ -281,6 +382,10 @@ protected:
       applied_filters.push_back(filter->name());
       this->filtered_source_->addFilter(filter);
     }
+
+    if (getOptionalTomlValue(toml_tree_, "FilteredVideoSource.fused_filters", true)) {
+      this->filtered_source_->compileFilters();
+    }
   }
 
   void initPoseService() {
@@ -577,7 +682,56 @@ protected:
     std::cout << "entered initRecorder" << std::endl;
 
     std::string const outputPath = getTomlValue<std::string>(toml_tree_, "ObserverOptions.Recorder.output_folder");
-    this->recorder_.reset(new VideoRecorder<PointT>(outputPath));
+
+    int const queueSize = getOptionalTomlValue(toml_tree_, "ObserverOptions.Recorder.queue_size", 32);
+    if (queueSize < 1) {
+      throw std::runtime_error("ObserverOptions.Recorder.queue_size must be at least 1");
+    }
+    int const writerThreads = getOptionalTomlValue(toml_tree_, "ObserverOptions.Recorder.writer_threads", 1);
+    if (writerThreads < 1) {
+      throw std::runtime_error("ObserverOptions.Recorder.writer_threads must be at least 1");
+    }
+    std::string const fullPolicy = getOptionalTomlValue<std::string>(toml_tree_, "ObserverOptions.Recorder.full_policy", "block");
+    QueueFullPolicy policy;
+    if (fullPolicy == "block") {
+      policy = QueueFullPolicy::Block;
+    } else if (fullPolicy == "drop") {
+      policy = QueueFullPolicy::DropOldest;
+    } else if (fullPolicy == "spill") {
+      policy = QueueFullPolicy::Spill;
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown Recorder full_policy: " << fullPolicy;
+      throw std::runtime_error(ss.str());
+    }
+
+    std::string const format = getOptionalTomlValue<std::string>(toml_tree_, "ObserverOptions.Recorder.format", "files");
+    RecordingFormat recordingFormat;
+    if (format == "files") {
+      recordingFormat = RecordingFormat::Files;
+    } else if (format == "container") {
+      recordingFormat = RecordingFormat::Container;
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown Recorder format: " << format;
+      throw std::runtime_error(ss.str());
+    }
+    std::string const compression = getOptionalTomlValue<std::string>(toml_tree_, "ObserverOptions.Recorder.compression", "none");
+    RecordingCompression recordingCompression;
+    if (compression == "none") {
+      recordingCompression = RecordingCompression::None;
+    } else if (compression == "lz4") {
+      recordingCompression = RecordingCompression::Lz4;
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown Recorder compression: " << compression;
+      throw std::runtime_error(ss.str());
+    }
+
+    this->recorder_.reset(new VideoRecorder<PointT>(outputPath, queueSize, policy, writerThreads,
+                                                    recordingFormat, recordingCompression));
+    if (replay_barrier_)
+      this->recorder_->setReplayBarrier(replay_barrier_);
 
     const bool rec_cloud = getOptionalTomlValue(toml_tree_, "ObserverOptions.Recorder.cloud", true);
     const bool rec_rgb = getOptionalTomlValue(toml_tree_, "ObserverOptions.Recorder.rgb", false);
@@ -668,6 +822,21 @@ private:
     GMM::SegmenterParameters params;
     params.voxelGridResolution = getTomlValue<double>(v, "voxel_grid_resolution", "ObstacleDetection.Segmenter.");
 
+    std::string const em_mode = getOptionalTomlValue<std::string>(v, "em_mode", "points");
+    if (em_mode == "points") {
+      params.emMode = GMM::EmMode::Points;
+    } else if (em_mode == "voxels") {
+      params.emMode = GMM::EmMode::Voxels;
+    } else {
+      std::ostringstream ss;
+      ss << "Unknown GMM em_mode: " << em_mode;
+      throw std::runtime_error(ss.str());
+    }
+    params.emVoxelResolution = getOptionalTomlValue(v, "em_voxel_resolution", 0.02);
+    if (params.emVoxelResolution <= 0) {
+      throw std::runtime_error("ObstacleDetection.Segmenter.em_voxel_resolution must be positive");
+    }
+
     params.hardAssignmentStateResp = getOptionalTomlValue(v, "hard_assignment_state_resp", 0.9);
     params.statePiRemovalThreshold = getOptionalTomlValue(v, "state_pi_removal_threshold", 0.01);
     params.minVclusterPoints = getOptionalTomlValue(v, "min_vcluster_points", 10);
@@ -692,10 +861,46 @@ private:
     params.MAX_ITERATIONS = getTomlValue<int>(toml_tree_, "BasicSurfaceDetection.RANSAC.maxIterations");
     params.DISTANCE_THRESHOLD = getTomlValue<double>(toml_tree_, "BasicSurfaceDetection.RANSAC.distanceThreshold");
     params.MIN_FILTER_PERCENTAGE = getTomlValue<double>(toml_tree_, "BasicSurfaceDetection.RANSAC.minFilterPercentage");
-    params.EXPERIMENTAL_ENABLE_SURFACE_REUSE = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.RANSAC.experimental_enableSurfaceReuse", false);
+    // experimental_enableSurfaceReuse is the former name of the plane tracking
+    bool const surfaceReuse = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.RANSAC.experimental_enableSurfaceReuse", false);
+    params.TRACK_PLANES = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.PlaneTracking.enabled", surfaceReuse);
+    params.REDETECT_INTERVAL = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.PlaneTracking.redetectInterval", params.REDETECT_INTERVAL);
+    params.TRACKING_MIN_INLIERS = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.PlaneTracking.minInliers", params.TRACKING_MIN_INLIERS);
+    params.PARALLEL_RANSAC = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.enabled", false);
+    if (params.PARALLEL_RANSAC) {
+      params.PARALLEL_THREADS = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.threads", params.PARALLEL_THREADS);
+      params.PARALLEL_SEED = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.seed", static_cast<int>(params.PARALLEL_SEED));
+      params.BAND_HEIGHT = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.bandHeight", params.BAND_HEIGHT);
+      params.MIN_BAND_POINTS = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.minBandPoints", params.MIN_BAND_POINTS);
+      params.RANSAC_CONFIDENCE = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.ParallelRANSAC.confidence", params.RANSAC_CONFIDENCE);
+      if (params.PARALLEL_THREADS < 0 || !(params.BAND_HEIGHT > 0)
+          || !(params.RANSAC_CONFIDENCE > 0 && params.RANSAC_CONFIDENCE < 1)) {
+        throw std::runtime_error("BasicSurfaceDetection.ParallelRANSAC: threads must not be negative, "
+                                 "bandHeight must be positive and confidence must be between 0 and 1");
+      }
+    }
     params.DEVIATION_ANGLE = getTomlValue<double>(toml_tree_, "BasicSurfaceDetection.Classification.deviationAngle");
+    params.ORGANIZED = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.organized", false);
+    if (params.ORGANIZED) {
+      // The planes are found in the organized clouds, which the filtered
+      // source has to keep.
+      if (!this->filtered_source_ || !getOptionalTomlValue<std::string>(toml_tree_, "FilteredVideoSource.pre_filter").empty()) {
+        throw std::runtime_error("BasicSurfaceDetection.organized requires a FilteredVideoSource without a pre_filter");
+      }
+      params.ORGANIZED_MIN_INLIERS = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.Organized.minInliers", params.ORGANIZED_MIN_INLIERS);
+      params.ORGANIZED_ANGULAR_THRESHOLD = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.Organized.angularThreshold", params.ORGANIZED_ANGULAR_THRESHOLD);
+      params.NORMAL_SMOOTHING_SIZE = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.Organized.normalSmoothingSize", params.NORMAL_SMOOTHING_SIZE);
+      params.MAX_DEPTH_CHANGE_FACTOR = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.Organized.maxDepthChangeFactor", params.MAX_DEPTH_CHANGE_FACTOR);
+      this->filtered_source_->setKeepOrganized(true);
+    }
+    int const queueDepth = getOptionalTomlValue(toml_tree_, "BasicSurfaceDetection.queueDepth", 1);
+    if (queueDepth < 1) {
+      throw std::runtime_error("BasicSurfaceDetection.queueDepth must be at least 1");
+    }
 
-    surface_detector_.reset(new SurfaceDetector<PointT>(surface_detector_active_, params));
+    surface_detector_.reset(new SurfaceDetector<PointT>(surface_detector_active_, params, queueDepth));
+    if (replay_barrier_)
+      surface_detector_->setReplayBarrier(replay_barrier_);
     this->source()->FrameDataSubject::attachObserver(surface_detector_);
 
     ground_removal_ = true;
@@ -882,13 +1087,36 @@ private:
       }
       auto robotService = getRobotService(v);
 
+      std::string const image_encoding = getOptionalTomlValue<std::string>(v, "image_encoding", "raw");
+      ImageStreamOptions images;
+      if (image_encoding == "raw") {
+        images.encoding = ImageStreamOptions::Encoding::Raw;
+      } else if (image_encoding == "gray") {
+        images.encoding = ImageStreamOptions::Encoding::Gray;
+      } else if (image_encoding == "jpeg") {
+        images.encoding = ImageStreamOptions::Encoding::Jpeg;
+      } else {
+        throw std::runtime_error("aggregators[RobotAggregator].image_encoding must be raw, gray or jpeg");
+      }
+      images.jpegQuality = getOptionalTomlValue(v, "image_jpeg_quality", images.jpegQuality);
+      images.subsample = getOptionalTomlValue(v, "image_subsample", images.subsample);
+
       // attach to RGB data here since we always assume we're dealing with FrameDataObservers elsewhere...
       boost::shared_ptr<RobotAggregator> robotAggregator = boost::make_shared<RobotAggregator>(robotService,
                                                                                                update_frequency,
                                                                                                datatypes,
                                                                                                *this->robot(),
                                                                                                min_surface_height,
-                                                                                               surface_normal_tolerance);
+                                                                                               surface_normal_tolerance,
+                                                                                               images);
+      if (getOptionalTomlValue(v, "cloud_compression", false)) {
+        CloudCodecOptions codec;
+        codec.resolution = getOptionalTomlValue(v, "cloud_resolution", codec.resolution);
+        codec.voxels = getOptionalTomlValue(v, "cloud_voxels", codec.voxels);
+        codec.keyframeInterval = getOptionalTomlValue(v, "cloud_keyframe_interval", codec.keyframeInterval);
+        codec.lz4 = getOptionalTomlValue(v, "cloud_lz4", codec.lz4);
+        robotAggregator->setCloudCodec(codec);
+      }
       boost::static_pointer_cast<RGBDataSubject>(this->raw_source_)->attachObserver(robotAggregator);
       return robotAggregator;
 
@@ -983,6 +1211,15 @@ private:
   boost::shared_ptr<SurfaceTracker<PointT>> surface_tracker_;
   boost::shared_ptr<ConvexHullDetector> convex_hull_detector_;
   boost::shared_ptr<PlaneInlierFinder<PointT>> inlier_finder_;
+  /**
+   * Set in lockstep replay mode: the offline source waits on it for the
+   * asynchronous stages to finish each frame.
+   */
+  std::shared_ptr<ReplayBarrier> replay_barrier_;
+  /**
+   * Periodically exports the pipeline's latency histograms, if configured.
+   */
+  std::shared_ptr<MetricsExporter> metrics_exporter_;
 
   bool surface_detector_active_;
   bool obstacle_detector_active_;
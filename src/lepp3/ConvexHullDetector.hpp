@@ -4,13 +4,17 @@
 #include "lepp3/Typedefs.hpp"
 #include "lepp3/SurfaceData.hpp"
 #include "lepp3/GnuplotWriter.hpp"
-#include <pcl/surface/convex_hull.h>
-#include <pcl/filters/project_inliers.h>
-#include <set>
+#include "lepp3/util/Metrics.hpp"
+#include "lepp3/util/ConvexHull2D.h"
+#include "lepp3/util/Projection.h"
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <limits>
 #include <vector>
 
+#include <omp.h>
+
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
 #endif
@@ -18,102 +22,163 @@
 namespace lepp {
 
 /*
-* Triangle class that is needed to reduce the number of points of the convex hull to 8 points. 
+* Reduces a closed polygon to fewer vertices with the Visvalingam-Whyatt algorithm: the vertex that spans
+* the triangle of the smallest area with its two neighbors is removed, and the areas of its neighbors are
+* updated, until only the target number of vertices is left.
+*
+* The vertices form a doubly linked ring over an array, and are kept in an indexed binary min-heap by
+* their areas, so the areas of the neighbors are updated in place. The buffers are kept between calls,
+* so an instance must not be shared between threads.
 */
-struct Triangle
-{	
-	int num;
-	PointT 	*left, *mid, *right;
-	Triangle *leftTriangle, *rightTriangle;
-	double	area;
-
-	Triangle(int num, PointT *left, PointT *mid, PointT *right) : num(num), left(left), mid(mid), right(right)
-	{
-		computeArea();
-	}
-
+class HullReducer
+{
+public:
 	/*
-	* Triangles are compared by their area. If the area is the same the triangles' unique identifier is compared.
-	* This is necessary because Triangles are later inserted into a priority queue that relies on sets, and in
-	* sets there can only exist one single object for each key.
+	* Reduces the given polygon, given as consecutive pairs of 2D coordinates, in place to 'targetCount'
+	* vertices, keeping their order. A polygon with at most 'targetCount' vertices is left as it is, and
+	* so is every polygon if 'targetCount' is less than 3.
 	*/
-	static bool compare(Triangle *t1, Triangle *t2)
+	void reduce(std::vector<float> &polygon, size_t targetCount);
+
+private:
+	static const uint32_t REMOVED = ~uint32_t(0);
+
+	struct Vertex
 	{
-		if (t1->area < t2->area)
-			return true;
-		else if (t1->area > t2->area)
-			return false;
-		else if (t1->num < t2->num)
-			return true;
-		else
-			return false;
-	}
+		uint32_t prev, next;
+		// the squared cross product of the edges to the neighbors, which grows with the area
+		double area;
+	};
 
-	/*
-	* Set neighboring triangles in convex hull.
-	*/
-	void initNeighborTriangles(Triangle *leftT, Triangle *rightT)
+	// vertices are ordered by their areas; equal areas by their indices, so that the result is unique
+	bool before(uint32_t a, uint32_t b) const
 	{
-		leftTriangle = leftT;
-		rightTriangle = rightT;
+		return vertices_[a].area < vertices_[b].area
+			|| (vertices_[a].area == vertices_[b].area && a < b);
 	}
 
-	void computeArea()
+	void place(size_t slot, uint32_t v)
 	{
-		PointT a, b;
-		a.x = left->x - mid->x;
-		a.y = left->y - mid->y;
-		a.z = left->z - mid->z;
-
-		b.x = right->x - mid->x;
-		b.y = right->y - mid->y;
-		b.z = right->z - mid->z;
-	
-		area = (a.y * b.z - a.z * b.y) * (a.y * b.z - a.z * b.y) +
-			(a.z * b.x - a.x * b.z) * (a.z * b.x - a.x * b.z) +
-			(a.x * b.y - a.y * b.x) * (a.x * b.y - a.y * b.x);
+		heap_[slot] = v;
+		position_[v] = static_cast<uint32_t>(slot);
 	}
+
+	void computeArea(const std::vector<float> &polygon, uint32_t v);
+	void siftUp(size_t slot);
+	void siftDown(size_t slot);
+
+	std::vector<Vertex> vertices_;
+	std::vector<uint32_t> heap_;
+	size_t heapSize_ = 0;
+	// the slot of every vertex in the heap, or REMOVED
+	std::vector<uint32_t> position_;
 };
 
 
+inline void HullReducer::computeArea(const std::vector<float> &polygon, uint32_t v)
+{
+	const float *left = &polygon[2 * vertices_[v].prev];
+	const float *mid = &polygon[2 * v];
+	const float *right = &polygon[2 * vertices_[v].next];
+	const double ax = left[0] - mid[0], ay = left[1] - mid[1];
+	const double bx = right[0] - mid[0], by = right[1] - mid[1];
+	vertices_[v].area = (ax * by - ay * bx) * (ax * by - ay * bx);
+}
 
-/*
-* Priority queue for Triangle pointers. The standard priority queue of C++ does not have a change key 
-* and also no delete operation.
-* Thus, we use sets as an underlying data structure and implement the change key operation by deleting the old element
-* changing the key of the deleted element, and re-insert it. This still runs is O(log(n)) since sets in C++
-* are implemented with red-black-trees as an underlying data structure.
-*/
-class PrioQ
+inline void HullReducer::siftUp(size_t slot)
 {
-private:
-	std::set<Triangle *, bool (*)(Triangle *, Triangle *)> q;
-public:
-	PrioQ(bool (*func)(Triangle *, Triangle *)) : q(func) {}
-	void insert(Triangle *t)
+	const uint32_t v = heap_[slot];
+	while (slot > 0)
+	{
+		const size_t parent = (slot - 1) / 2;
+		if (!before(v, heap_[parent]))
+			break;
+		place(slot, heap_[parent]);
+		slot = parent;
+	}
+	place(slot, v);
+}
+
+inline void HullReducer::siftDown(size_t slot)
+{
+	const uint32_t v = heap_[slot];
+	for (;;)
 	{
-		q.insert(t);
+		size_t child = 2 * slot + 1;
+		if (child >= heapSize_)
+			break;
+		if (child + 1 < heapSize_ && before(heap_[child + 1], heap_[child]))
+			child++;
+		if (!before(heap_[child], v))
+			break;
+		place(slot, heap_[child]);
+		slot = child;
 	}
+	place(slot, v);
+}
 
-	Triangle* deleteMin()
+inline void HullReducer::reduce(std::vector<float> &polygon, size_t targetCount)
+{
+	const size_t n = polygon.size() / 2;
+	if (n <= targetCount || targetCount < 3)
+		return;
+
+	vertices_.resize(n);
+	heap_.resize(n);
+	position_.resize(n);
+	for (size_t v = 0; v < n; v++)
+	{
+		vertices_[v].prev = static_cast<uint32_t>((v + n - 1) % n);
+		vertices_[v].next = static_cast<uint32_t>((v + 1) % n);
+	}
+	for (size_t v = 0; v < n; v++)
 	{
-		Triangle *res = *(q.begin());
-		q.erase(q.begin());
-		return res;
+		computeArea(polygon, static_cast<uint32_t>(v));
+		place(v, static_cast<uint32_t>(v));
 	}
+	heapSize_ = n;
+	for (size_t slot = n / 2; slot-- > 0;)
+		siftDown(slot);
 
-	void changeKey(Triangle *t)
+	for (size_t remaining = n; remaining > targetCount; remaining--)
 	{
-		q.erase(t);
-		t->computeArea();
-		q.insert(t);
+		// remove the vertex with the smallest area from the heap and from the ring
+		const uint32_t v = heap_[0];
+		heapSize_--;
+		if (heapSize_ > 0)
+		{
+			place(0, heap_[heapSize_]);
+			siftDown(0);
+		}
+		position_[v] = REMOVED;
+
+		const uint32_t prev = vertices_[v].prev;
+		const uint32_t next = vertices_[v].next;
+		vertices_[prev].next = next;
+		vertices_[next].prev = prev;
+
+		// the areas of the neighbors may grow or shrink
+		computeArea(polygon, prev);
+		siftUp(position_[prev]);
+		siftDown(position_[prev]);
+		computeArea(polygon, next);
+		siftUp(position_[next]);
+		siftDown(position_[next]);
 	}
 
-	bool isEmpty()
+	// compact the remaining vertices
+	size_t kept = 0;
+	for (size_t v = 0; v < n; v++)
 	{
-		return q.empty();
+		if (position_[v] != REMOVED)
+		{
+			polygon[2 * kept] = polygon[2 * v];
+			polygon[2 * kept + 1] = polygon[2 * v + 1];
+			kept++;
+		}
 	}
-};
+	polygon.resize(2 * kept);
+}
 
 
 
@@ -121,6 +186,11 @@ public:
 * The ConvexHullDetector is a surface aggregator. It gets point clouds that represent the detected surfaces.
 * For each surface then it is computing the convex hull, and in a second step reduces the number of points
 * of the convex hull to a user defined number.
+*
+* All of this happens in the 2D frame of the surface's plane. The frame is kept with the hull of a tracked
+* surface, as long as the plane does not move away from it, so the old hull is merged with the new one
+* without being projected again, and the cost of a surface beyond finding its new hull only depends on
+* the number of hull vertices.
 */
 class ConvexHullDetector : public SurfaceDataObserver, public SurfaceDataSubject
 {
@@ -144,7 +214,26 @@ public:
 	static void projectPointOntoLineSegment(const PointT &seg1, const PointT &seg2, const PointT &p, PointT &projVec);
 
 private:
-	// after PCL detected a convex hull, it is shrinked to at most NUM_HULL_POINTS
+	/**
+	* The buffers used to compute hulls, one set per thread.
+	*/
+	struct HullWorkspace
+	{
+		util::ConvexHull2D engine;
+		HullReducer reducer;
+		std::vector<float> points2d;
+		std::vector<uint32_t> vertices;
+		std::vector<float> oldHull;
+		std::vector<float> newHull;
+		std::vector<float> combined;
+	};
+
+	// The frame of the old hull is kept while the plane of the surface is tilted against it by at most
+	// FRAME_MAX_TILT radians and passes at most FRAME_MAX_OFFSET meters from the origin of the frame.
+	static constexpr double FRAME_MAX_TILT = 0.02;
+	static constexpr double FRAME_MAX_OFFSET = 0.005;
+
+	// after the convex hull is detected, it is shrinked to at most NUM_HULL_POINTS
 	const int NUM_HULL_POINTS;
 
 	// When a new convex hull is merged with an old convex hull, all points of the new convex hull are
@@ -153,19 +242,41 @@ private:
 	// along the vector pointing to the closest boundary point of the new convex hull.
 	const double MERGE_UPDATE_PERCENTAGE;
 
-	// reduce the number of points in the given hull to 'numPoints'
-	void reduceConvHullPoints(PointCloudPtr &hull, int numPoints);
+	std::vector<HullWorkspace> workspaces_;
 
-	// uses the pcl function to compute the convex hull of the given point cloud.
-	void detectConvexHull(PointCloudConstPtr surface, PointCloudPtr &hull);
+	/**
+	* Whether the plane given by 'surfaceCoefficients' is still close enough to the plane of 'frame'.
+	*/
+	static bool frameFits(const util::Projection &frame, const pcl::ModelCoefficients &surfaceCoefficients);
 
 	/**
-	* Function gets a point cloud and a convex hull. It projects each point of the given cloud onto the 
-	* closest position of the border of the given convex hull. Each point of the given point cloud is then
-	* updated by moving it 'updatePercentage' percents in direction of its projection.
-	* The projected points are stored in 'projCloud'.
+	* Computes the convex hull of 'count' points, given as consecutive pairs of 2D coordinates, and stores
+	* its vertices in 'hull' in the same way. Like qhull, a degenerate set of points, which does not span
+	* an area, has an empty hull.
 	*/
-	void projectCloudOntoHull(PointCloudConstPtr cloud, PointCloudConstPtr hull, PointCloudPtr &projCloud, double updatePercentage);
+	void computeHull(const float *points, size_t count, HullWorkspace &workspace, std::vector<float> &hull);
+
+	/**
+	* Computes the convex hull of the given point cloud in the 2D coordinates of 'frame'.
+	*/
+	void detectConvexHull(PointCloudConstPtr surface, const util::Projection &frame,
+		HullWorkspace &workspace, std::vector<float> &hull);
+
+	/**
+	* Stores the old hull of the given surface in the 2D coordinates of 'frame' in 'oldHull'. A hull
+	* that was computed in the same frame is taken as it is.
+	*/
+	void oldHullInFrame(const SurfaceModel &surface, const util::Projection &frame, bool sameFrame,
+		std::vector<float> &oldHull);
+
+	/**
+	* Function gets a polygon and a convex hull, both given as consecutive pairs of 2D coordinates. It projects
+	* each vertex of the given polygon onto the closest position of the border of the given convex hull. Each
+	* vertex is then updated by moving it 'updatePercentage' percents in direction of its projection.
+	* The updated vertices are appended to 'projPolygon'.
+	*/
+	static void projectPolygonOntoHull(const std::vector<float> &polygon, const std::vector<float> &hull,
+		double updatePercentage, std::vector<float> &projPolygon);
 
 	/**
 	* Function gets old and new convex hull of surface point cloud. It 'merges' convex hulls of 2 consecutive frames.
@@ -174,108 +285,102 @@ private:
 	* Conversely, every point of the old hull is projected onto the closest position of the old convex hull,
 	* and updated by moving MERGE_UPDATE_PERCENTAGE in direction of its projection.
 	* Then, both projected point clouds are merged and a new convex hull is computed for this point cloud. 
-	* Finally, this cloud is stored in 'mergeHull'.
+	* Finally, this hull is stored in 'mergeHull'. All hulls are given in the same 2D frame.
 	*/
-	void mergeConvexHulls(PointCloudConstPtr oldHull, PointCloudConstPtr newHull, PointCloudPtr &mergeHull);
+	void mergeConvexHulls(const std::vector<float> &oldHull, const std::vector<float> &newHull,
+		HullWorkspace &workspace, std::vector<float> &mergeHull);
 
 	/**
-	* Project the given point cloud onto the surface specified by the surfaceCoefficients.
+	* Maps the vertices of the given hull from 'frame' onto the plane given by 'surfaceCoefficients'.
 	*/
-	void projectOnPlane(PointCloudConstPtr cloud,
-		const pcl::ModelCoefficients &surfaceCoefficients,
-		PointCloudPtr &projCloud);
+	static PointCloudPtr hullCloud(const std::vector<float> &hull, const util::Projection &frame,
+		const pcl::ModelCoefficients &surfaceCoefficients);
 };
 
 
 
-// use PCl to detect the convex hull of the given point cloud
-inline void ConvexHullDetector::detectConvexHull(PointCloudConstPtr surface, PointCloudPtr &hull)
+inline bool ConvexHullDetector::frameFits(const util::Projection &frame, const pcl::ModelCoefficients &surfaceCoefficients)
 {
-	hull = boost::shared_ptr<PointCloudT>(new PointCloudT());
-	pcl::ConvexHull<PointT> chull;
-	chull.setInputCloud (surface);
-	chull.reconstruct (*hull);
+	const Eigen::Vector3f normal(surfaceCoefficients.values[0], surfaceCoefficients.values[1], surfaceCoefficients.values[2]);
+	const double norm = normal.norm();
+	return frame.normal().dot(normal) >= std::cos(FRAME_MAX_TILT) * norm
+		&& std::abs(normal.dot(frame.origin()) + surfaceCoefficients.values[3]) <= FRAME_MAX_OFFSET * norm;
 }
 
 
-/*
-* Reduces the number of points of the given convex hull to 'numPoints'.
-* Algorithm works as follows:
-* For each three neighboring points ('left', 'mid', 'right') of the point cloud, compute the area of the formed triangle.
-* Delete the triangle with the smallest area, and the corresponding point 'mid'.
-* Update the area of the triangles that were neighbored to the deleted triangle.
-* Continue this process until there are only 'numPoints' left.
-* If given hull has less than 'numPoints' points, return it without running the algorithm.
-*/
-inline void ConvexHullDetector::reduceConvHullPoints(PointCloudPtr &hull, int numPoints)
+inline void ConvexHullDetector::computeHull(
+	const float *points,
+	size_t count,
+	HullWorkspace &workspace,
+	std::vector<float> &hull)
 {
-	// return if number of points in the given hull is smaller than 'numPoints'
-	int numHullPoints = hull->size();
-	if (numHullPoints <= numPoints)
+	hull.clear();
+	workspace.engine.compute(points, count, workspace.vertices);
+	if (workspace.vertices.size() < 3)
 		return;
 
-	// priority queue with triangles. Triangles are sorted by their area size, smalles area has highest priority.
-	PrioQ pq(Triangle::compare);
-	Triangle *triangleRef[numHullPoints];
-	for (int i = 0; i < numHullPoints; i++)
+	hull.resize(2 * workspace.vertices.size());
+	for (size_t i = 0; i < workspace.vertices.size(); i++)
 	{
-		triangleRef[i] = new Triangle(i, &(hull->at((numHullPoints+i-1) % numHullPoints)), &(hull->at(i)), &(hull->at((i+1) % numHullPoints)));
-		pq.insert(triangleRef[i]);
+		hull[2 * i] = points[2 * workspace.vertices[i]];
+		hull[2 * i + 1] = points[2 * workspace.vertices[i] + 1];
 	}
+}
 
-	// set up triangle data structure
-	for (int i = 0; i < numHullPoints; i++)
-		triangleRef[i]->initNeighborTriangles(triangleRef[(numHullPoints+i-1) % numHullPoints], triangleRef[(i+1) % numHullPoints]);
-	
-	// delete triangles until there are only 'numPoints' left
-	for (int i = numHullPoints; i > numPoints; i--)
-	{
-		Triangle *toBeDeletedTriangle = pq.deleteMin();
-		Triangle *leftTri = toBeDeletedTriangle->leftTriangle;
-		Triangle *rightTri = toBeDeletedTriangle->rightTriangle;
-
-		// update left and right triangle neighbors of neighboring triangles
-		leftTri->rightTriangle = toBeDeletedTriangle->rightTriangle;
-		rightTri->leftTriangle = toBeDeletedTriangle->leftTriangle;
-
-		// update left and right points of neighboring triangles
-		leftTri->right = toBeDeletedTriangle->right;
-		rightTri->left = toBeDeletedTriangle->left;
-
-		// update triangles in priority queue
-		pq.changeKey(leftTri);
-		pq.changeKey(rightTri);
-	}
 
-	// create point cloud only with the non-deleted 'mid' points.
-	PointCloudPtr smallHull = boost::shared_ptr<PointCloudT>(new PointCloudT());
-	Triangle *tri = pq.deleteMin();
-	for (int i = 0; i < numPoints; i++)
+inline void ConvexHullDetector::detectConvexHull(
+	PointCloudConstPtr surface,
+	const util::Projection &frame,
+	HullWorkspace &workspace,
+	std::vector<float> &hull)
+{
+	static_assert(sizeof(PointT) % sizeof(float) == 0,
+		"the points are expected to be made of packed floats");
+	const size_t numPoints = surface->size();
+	if (numPoints == 0)
 	{
-		smallHull->push_back(*(tri->mid));
-		tri = tri->leftTriangle;
+		hull.clear();
+		return;
 	}
-	hull = smallHull;
 
-	// delete all triangles
-	for (int i = 0; i < numHullPoints; i++)
-		delete triangleRef[i];
+	workspace.points2d.resize(2 * numPoints);
+	frame.project(reinterpret_cast<const float*>(&surface->points[0]), numPoints,
+		sizeof(PointT) / sizeof(float), workspace.points2d.data());
+	computeHull(workspace.points2d.data(), numPoints, workspace, hull);
 }
 
 
-inline void ConvexHullDetector::projectOnPlane(
-	PointCloudConstPtr cloud,
-	const pcl::ModelCoefficients &surfaceCoefficients,
-	PointCloudPtr &projCloud)
+inline void ConvexHullDetector::oldHullInFrame(
+	const SurfaceModel &surface,
+	const util::Projection &frame,
+	bool sameFrame,
+	std::vector<float> &oldHull)
 {
-	if (cloud->size() != 0)
+	LocalHullConstPtr localHull = surface.get_localHull();
+	if (sameFrame)
 	{
-		pcl::ProjectInliers<PointT> proj;
-		proj.setModelType(pcl::SACMODEL_PLANE);
-		proj.setInputCloud(cloud);
-		pcl::ModelCoefficients::Ptr coeffPtr = boost::shared_ptr<pcl::ModelCoefficients>(new pcl::ModelCoefficients(surfaceCoefficients));
-		proj.setModelCoefficients(coeffPtr);
-		proj.filter(*projCloud);
+		oldHull = localHull->vertices;
+	}
+	else if (localHull)
+	{
+		// map the vertices from the frame of the old hull
+		const std::vector<float> &vertices = localHull->vertices;
+		oldHull.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i += 2)
+		{
+			const Eigen::Vector2f p = frame(localHull->frame(vertices[i], vertices[i + 1]));
+			oldHull[i] = p[0];
+			oldHull[i + 1] = p[1];
+		}
+	}
+	else
+	{
+		// a hull that was set without its frame
+		PointCloudConstPtr hull = surface.get_hull();
+		oldHull.resize(2 * hull->size());
+		if (!hull->empty())
+			frame.project(reinterpret_cast<const float*>(&hull->points[0]), hull->size(),
+				sizeof(PointT) / sizeof(float), oldHull.data());
 	}
 }
 
@@ -302,66 +407,100 @@ inline void ConvexHullDetector::projectPointOntoLineSegment(const PointT &seg1,
 }
 
 
-inline void ConvexHullDetector::projectCloudOntoHull(PointCloudConstPtr cloud, PointCloudConstPtr hull, PointCloudPtr &projCloud, double updatePercentage)
+inline void ConvexHullDetector::projectPolygonOntoHull(
+	const std::vector<float> &polygon,
+	const std::vector<float> &hull,
+	double updatePercentage,
+	std::vector<float> &projPolygon)
 {
-	for (int i = 0; i < cloud->size(); i++)
+	const size_t hullSize = hull.size() / 2;
+	for (size_t i = 0; i < polygon.size(); i += 2)
 	{
-		PointT shortestProjVec;
-		double shortestDist = std::numeric_limits<double>::max();
-		const PointT &currentPoint = cloud->at(i);
+		const double px = polygon[i];
+		const double py = polygon[i + 1];
 
-		// find shortest distance between point of cloud and boundary of the hull
+		// find shortest distance between the vertex and boundary of the hull
 		// iterate over all line segments of the hull
-		for (int j = 0; j < hull->size(); j++)
+		double shortestDist = std::numeric_limits<double>::max();
+		double shortestX = 0, shortestY = 0;
+		for (size_t j = 0; j < hullSize; j++)
 		{
-			// compute distance between point of cloud and all line segments of the hull and take minimum
-			PointT projVec;
-			projectPointOntoLineSegment(hull->at(j), hull->at((j+1) % hull->size()), currentPoint, projVec);
-			double projVecDist = getVecLengthSquared(projVec);
-			if (projVecDist < shortestDist)
+			const size_t k = (j + 1) % hullSize;
+			const double sx = hull[2 * k] - hull[2 * j];
+			const double sy = hull[2 * k + 1] - hull[2 * j + 1];
+			const double segLen = sx * sx + sy * sy;
+			// t is on [0,1]. It gives the procentual position of the projection between both ends of the segment
+			const double t = segLen > 0
+				? std::max(0.0, std::min(1.0, (sx * (px - hull[2 * j]) + sy * (py - hull[2 * j + 1])) / segLen))
+				: 0.0;
+			const double projX = hull[2 * j] + t * sx - px;
+			const double projY = hull[2 * j + 1] + t * sy - py;
+			const double projDist = projX * projX + projY * projY;
+			if (projDist < shortestDist)
 			{
-				shortestDist = projVecDist;
-				shortestProjVec.x = projVec.x;
-				shortestProjVec.y = projVec.y;
-				shortestProjVec.z = projVec.z;
+				shortestDist = projDist;
+				shortestX = projX;
+				shortestY = projY;
 			}
 		}
 
-		if (hull->size() != 0)
-		{
-			// go from point of cloud 'updatePercentage' percent in direction of its projection onto the hull
-			PointT updatedPoint;
-			updatedPoint.x = currentPoint.x + updatePercentage * shortestProjVec.x;
-			updatedPoint.y = currentPoint.y + updatePercentage * shortestProjVec.y;
-			updatedPoint.z = currentPoint.z + updatePercentage * shortestProjVec.z;
-			projCloud->push_back(updatedPoint);
-		}
-		else
-		{
-			projCloud->push_back(currentPoint);
-		}
+		// go from the vertex 'updatePercentage' percent in direction of its projection onto the hull
+		projPolygon.push_back(px + updatePercentage * shortestX);
+		projPolygon.push_back(py + updatePercentage * shortestY);
 	}
 }
 
 
-inline void ConvexHullDetector::mergeConvexHulls(PointCloudConstPtr oldHull, PointCloudConstPtr newHull, PointCloudPtr &mergeHull)
+inline void ConvexHullDetector::mergeConvexHulls(
+	const std::vector<float> &oldHull,
+	const std::vector<float> &newHull,
+	HullWorkspace &workspace,
+	std::vector<float> &mergeHull)
 {
-	// Project points of old hull onto new hull
-	PointCloudPtr projNewOntoOld(new PointCloudT());
-	projectCloudOntoHull(newHull, oldHull, projNewOntoOld, 1-MERGE_UPDATE_PERCENTAGE);
-
-	// Project points of new hull onto old hull
-	PointCloudPtr projOldOntoNew(new PointCloudT());
-	projectCloudOntoHull(oldHull, newHull, projOldOntoNew, MERGE_UPDATE_PERCENTAGE);
+	// If the surface is detected for the first time, simply take the new hull.
+	if (oldHull.empty())
+	{
+		mergeHull = newHull;
+		return;
+	}
 
-	// merge both projections
-	PointCloudPtr combinedProj(new PointCloudT());
-	*combinedProj += *projNewOntoOld;
-	*combinedProj += *projOldOntoNew;
+	// Project points of new hull onto old hull, then points of old hull onto new hull
+	workspace.combined.clear();
+	projectPolygonOntoHull(newHull, oldHull, 1-MERGE_UPDATE_PERCENTAGE, workspace.combined);
+	projectPolygonOntoHull(oldHull, newHull, MERGE_UPDATE_PERCENTAGE, workspace.combined);
 
 	// compute convex hull of combined projection and reduce point size
-	detectConvexHull(combinedProj, mergeHull);
-	reduceConvHullPoints(mergeHull, NUM_HULL_POINTS);
+	computeHull(workspace.combined.data(), workspace.combined.size() / 2, workspace, mergeHull);
+	workspace.reducer.reduce(mergeHull, NUM_HULL_POINTS);
+}
+
+
+inline PointCloudPtr ConvexHullDetector::hullCloud(
+	const std::vector<float> &hull,
+	const util::Projection &frame,
+	const pcl::ModelCoefficients &surfaceCoefficients)
+{
+	PointCloudPtr cloud(new PointCloudT());
+	const size_t numVertices = hull.size() / 2;
+	if (numVertices == 0)
+		return cloud;
+
+	cloud->points.resize(numVertices);
+	frame.unproject(hull.data(), numVertices, reinterpret_cast<float*>(&cloud->points[0]),
+		sizeof(PointT) / sizeof(float));
+
+	// the frame may be slightly tilted against the surface: project the vertices onto its plane
+	const Eigen::Vector3f normal(surfaceCoefficients.values[0], surfaceCoefficients.values[1], surfaceCoefficients.values[2]);
+	const float normSquared = normal.squaredNorm();
+	for (PointT &p : cloud->points)
+	{
+		const float dist = (normal.dot(p.getVector3fMap()) + surfaceCoefficients.values[3]) / normSquared;
+		p.getVector3fMap() -= dist * normal;
+	}
+	cloud->width = numVertices;
+	cloud->height = 1;
+	cloud->is_dense = true;
+	return cloud;
 }
 
 
@@ -371,31 +510,33 @@ inline void ConvexHullDetector::updateSurfaces(SurfaceDataPtr surfaceData)
 	tracepoint(lepp3_trace_provider, convex_hull_detection_start);
 #endif
 
+	MetricsClock::time_point const start = MetricsClock::now();
+	workspaces_.resize(omp_get_max_threads());
+#pragma omp parallel for schedule(dynamic, 1)
 	for (int i = 0; i < surfaceData->surfaces.size(); i++)
 	{
+		HullWorkspace &workspace = workspaces_[omp_get_thread_num()];
+		SurfaceModel &surface = *surfaceData->surfaces[i];
+		const pcl::ModelCoefficients &coefficients = surface.get_planeCoefficients();
+
+		// keep the frame of the old hull while it fits the surface
+		LocalHullConstPtr oldLocalHull = surface.get_localHull();
+		const bool sameFrame = oldLocalHull && frameFits(oldLocalHull->frame, coefficients);
+		boost::shared_ptr<LocalHull> localHull(
+			new LocalHull(sameFrame ? oldLocalHull->frame : util::Projection(coefficients.values)));
+		oldHullInFrame(surface, localHull->frame, sameFrame, workspace.oldHull);
+
 		// detect new convex hull
-		PointCloudPtr newHull(new PointCloudT());
-		detectConvexHull(surfaceData->surfaces[i]->get_cloud(), newHull);
-		reduceConvHullPoints(newHull, NUM_HULL_POINTS);
-
-		// project old and new hull onto the same surface
-		PointCloudPtr projNewHull(new PointCloudT());
-		PointCloudPtr projOldHull(new PointCloudT());
-		projectOnPlane(PointCloudConstPtr(newHull), surfaceData->surfaces[i]->get_planeCoefficients(), projNewHull);
-		projectOnPlane(surfaceData->surfaces[i]->get_hull(), surfaceData->surfaces[i]->get_planeCoefficients(), projOldHull);
-
-
-		// merge convex hull with old convex hull of same surface. If the surface is detected for the first time,
-		// simply take the new cloud.
-		PointCloudPtr mergeHull(new PointCloudT());
-		mergeConvexHulls(projOldHull, projNewHull, mergeHull);
-		surfaceData->surfaces[i]->set_hull(mergeHull);
-
-		// write out files
-		//GnuplotWriter::writeHulls(surfaceData->frameNum, i, PointCloudConstPtr(projOldHull), 
-		//	PointCloudConstPtr(projNewHull), surfaceData->surfaces[i]->get_hull());		
+		detectConvexHull(surface.get_cloud(), localHull->frame, workspace, workspace.newHull);
+		workspace.reducer.reduce(workspace.newHull, NUM_HULL_POINTS);
+
+		// merge convex hull with old convex hull of same surface
+		mergeConvexHulls(workspace.oldHull, workspace.newHull, workspace, localHull->vertices);
+		surface.set_hull(hullCloud(localHull->vertices, localHull->frame, coefficients), localHull);
 	}
 
+	PipelineMetrics::instance().record(Stage::Hull, MetricsClock::now() - start);
+
 #ifdef LEPP3_ENABLE_TRACING
 	tracepoint(lepp3_trace_provider, convex_hull_detection_end);
 #endif
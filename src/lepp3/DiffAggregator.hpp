@@ -65,6 +65,17 @@ public:
    * Sets a function that will be called for every deleted obstacle.
    */
   void set_deleted_surface_callback(DeletedSurfaceCallback del_surface_cb) { del_surface_cb_ = del_surface_cb; }
+  /**
+   * Forgets all obstacles and surfaces found so far, so that the next frame
+   * is a snapshot in which all of them are new.
+   */
+  void reset() {
+    curr_ = -1;
+    previous_ids_.clear();
+    previous_surface_ids_.clear();
+    current_obstacles_.clear();
+    current_surfaces_.clear();
+  }
   /**
    * Implementation of the `FrameDataObserver` interface.
    */
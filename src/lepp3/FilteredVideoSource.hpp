@@ -6,8 +6,10 @@
 #include "lepp3/filter/cloud/post/CloudPostFilter.hpp"
 #include "lepp3/filter/cloud/pre/CloudPreFilter.hpp"
 #include "lepp3/FrameData.hpp"
+#include "lepp3/util/Metrics.hpp"
 
 #include <algorithm>
+#include <limits>
 #include <numeric>
 
 #include <pcl/common/transforms.h>
@@ -62,7 +64,9 @@ public:
    */
   FilteredVideoSource(boost::shared_ptr<VideoSource<PointT>> source)
       : VideoSource<PointT>(std::shared_ptr<lepp::PoseService>()),
-        source_(source) {}
+        source_(source),
+        fused_(false),
+        keep_organized_(false) {}
 
   /**
    * Implementation of the VideoSource interface.
@@ -88,6 +92,44 @@ public:
     point_filters_.push_back(filter);
   }
 
+  /**
+   * Switches the point filtering to the fused kernel, which applies all point
+   * filters to blocks of points at once instead of calling each filter's
+   * `apply` method point by point.
+   *
+   * Returns false (and keeps using the point-wise path) if any of the added
+   * filters cannot be expressed as a `FusedFilterStage`.
+   */
+  bool compileFilters() {
+    FusedFilterStage stage;
+    for (auto const& filter : point_filters_) {
+      if (!filter->fusedStage(stage)) {
+        LINFO << "Filter " << filter->name() << " cannot be fused; using point-wise filtering";
+        fused_ = false;
+        return false;
+      }
+    }
+    fused_ = true;
+    return true;
+  }
+
+  /**
+   * Returns whether the fused filter kernel is used.
+   */
+  bool fused() const { return fused_; }
+
+  /**
+   * Makes the source also emit the filtered cloud in the sensor's layout
+   * (`FrameData::organizedCloud`), in which the removed points are NaN
+   * rather than left out, so that organized algorithms can run on it. The
+   * post filter only applies to the unorganized cloud.
+   *
+   * Requires that no pre filter is set, since those do not keep the layout.
+   */
+  void setKeepOrganized(bool keep) {
+    keep_organized_ = keep;
+  }
+
   /**
    * Add a cloud filter to apply before the point filters
    */
@@ -120,6 +162,43 @@ private:
   boost::shared_ptr<lepp::CloudPreFilter<PointT>> pre_filter_;
   boost::shared_ptr<lepp::CloudPostFilter<PointT>> post_filter_;
 
+  /**
+   * Whether the point filters are executed by `kernel_`.
+   */
+  bool fused_;
+  FusedPointFilterKernel kernel_;
+  std::vector<FusedFilterStage> stages_;
+  /**
+   * Whether the organized cloud is emitted as well.
+   */
+  bool keep_organized_;
+
+  /**
+   * Applies the point filters one point at a time by calling their `apply`
+   * method, and passes the surviving points on to the post filter.
+   */
+  void applyPointwise(PointCloudT const& source_cloud, PointCloudT& filtered);
+
+  /**
+   * Applies the point filters with the fused kernel, and passes the surviving
+   * points on to the post filter.
+   */
+  void applyFused(PointCloudT const& source_cloud, PointCloudT& filtered);
+
+  /**
+   * Applies the point filters to the organized `source_cloud`, setting the
+   * removed points to NaN in `organized`, and passes the surviving points on
+   * to the post filter.
+   */
+  void applyOrganized(PointCloudT const& source_cloud, PointCloudT& organized, PointCloudT& filtered);
+
+  /**
+   * Sets the pose of the sensor in the frame of the filtered points on
+   * `organized`, by applying the affine stages of the point filters (e.g.
+   * the odometry transform) to the pose of `source_cloud`.
+   */
+  void setSensorPose(PointCloudT const& source_cloud, PointCloudT& organized) const;
+
   /**
   * Remove NaN points from input cloud.
   */
@@ -157,8 +236,7 @@ void FilteredVideoSource<PointT>::setOptions(const std::map<std::string, bool>&
 template<class PointT>
 void FilteredVideoSource<PointT>::updateFrame(
     FrameDataPtr frameData) {
-  Timer t;
-  t.start();
+  MetricsClock::time_point const start = MetricsClock::now();
 
   // Prepare the point-wise filters for a new frame.
   {
@@ -185,10 +263,120 @@ void FilteredVideoSource<PointT>::updateFrame(
   cloud_filtered->is_dense = true;
   cloud_filtered->sensor_origin_ = source_cloud->sensor_origin_;
 
+  PointCloudPtr organized;
+  if (keep_organized_ && source_cloud->isOrganized()) {
+    organized.reset(new PointCloudT());
+    applyOrganized(*source_cloud, *organized, filtered);
+    setSensorPose(*source_cloud, *organized);
+  } else if (fused_) {
+    applyFused(*source_cloud, filtered);
+  } else {
+    applyPointwise(*source_cloud, filtered);
+  }
+
+  // Now we obtain the fully filtered cloud...
+  if (this->post_filter_) {
+    this->post_filter_->getFiltered(filtered);
+  }
+  this->preprocessCloud(cloud_filtered);
+
+  // ...and we're done!
+  PipelineMetrics::instance().record(Stage::Filter, MetricsClock::now() - start);
+
+  //LTRACE << "Total included points " << cloud_filtered->size();
+  // Finally, the cloud that is emitted by this instance is the filtered cloud.
+  frameData->cloud = cloud_filtered;
+  frameData->organizedCloud = organized;
+  this->setNextFrame(frameData);
+  //cout << filtered.size() << "   " << cloud_filtered->size() << endl;
+}
+
+template<class PointT>
+void FilteredVideoSource<PointT>::applyFused(
+    PointCloudT const& source_cloud, PointCloudT& filtered) {
+  // The stage parameters may change with every frame (e.g. the odometry
+  // transform), so they are collected again after `prepareNext`.
+  stages_.resize(point_filters_.size());
+  for (size_t i = 0; i < point_filters_.size(); ++i) {
+    point_filters_[i]->fusedStage(stages_[i]);
+  }
+  kernel_.setStages(stages_);
+
+  if (!this->post_filter_) {
+    kernel_.apply(source_cloud, filtered);
+    return;
+  }
+
+  PointCloudT survivors;
+  kernel_.apply(source_cloud, survivors);
+  for (PointT& p : survivors) {
+    this->post_filter_->newPoint(p, filtered);
+  }
+}
+
+template<class PointT>
+void FilteredVideoSource<PointT>::applyOrganized(
+    PointCloudT const& source_cloud, PointCloudT& organized, PointCloudT& filtered) {
+  if (fused_) {
+    stages_.resize(point_filters_.size());
+    for (size_t i = 0; i < point_filters_.size(); ++i) {
+      point_filters_[i]->fusedStage(stages_[i]);
+    }
+    kernel_.setStages(stages_);
+    kernel_.mask(source_cloud, organized);
+  } else {
+    organized = source_cloud;
+    organized.is_dense = false;
+    float const nan = std::numeric_limits<float>::quiet_NaN();
+    for (PointT& p : organized) {
+      bool valid = pcl_isfinite(p.x) && pcl_isfinite(p.y) && pcl_isfinite(p.z);
+      for (size_t i = 0; valid && i < point_filters_.size(); ++i) {
+        valid = point_filters_[i]->apply(p);
+      }
+      if (!valid) {
+        p.x = p.y = p.z = nan;
+      }
+    }
+  }
+
+  // The unorganized cloud holds the same points, without the NaNs.
+  filtered.reserve(organized.size());
+  for (PointT const& p : organized) {
+    if (!pcl_isfinite(p.x))
+      continue;
+    PointT q = p;
+    if (this->post_filter_) {
+      this->post_filter_->newPoint(q, filtered);
+    } else {
+      filtered.push_back(q);
+    }
+  }
+}
+
+template<class PointT>
+void FilteredVideoSource<PointT>::setSensorPose(
+    PointCloudT const& source_cloud, PointCloudT& organized) const {
+  Eigen::Matrix3f rotation = source_cloud.sensor_orientation_.toRotationMatrix();
+  Eigen::Vector3f origin = source_cloud.sensor_origin_.head<3>();
+  FusedFilterStage stage;
+  for (auto const& filter : point_filters_) {
+    if (!filter->fusedStage(stage) || stage.kind != FusedFilterStage::AFFINE || stage.reject_all)
+      continue;
+    Eigen::Matrix3f const A = Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor> const>(stage.params);
+    rotation = A * rotation;
+    origin = A * origin + Eigen::Vector3f(stage.params[9], stage.params[10], stage.params[11]);
+  }
+  organized.sensor_origin_ << origin, 0;
+  organized.sensor_orientation_ = Eigen::Quaternionf(rotation);
+}
+
+template<class PointT>
+void FilteredVideoSource<PointT>::applyPointwise(
+    PointCloudT const& source_cloud, PointCloudT& filtered) {
   // Apply point-wise filters to each received point and then pass it to the
   // concrete implementation to figure out how to filter the entire cloud.
-  for (typename PointCloudT::const_iterator it = source_cloud->begin();
-       it != source_cloud->end();
+  for (typename PointCloudT::const_iterator it = source_cloud.begin();
+       it != source_cloud.end();
        ++it) {
     PointT p = *it;
     // Filter out NaN points already, since we're already iterating through the
@@ -216,22 +404,6 @@ void FilteredVideoSource<PointT>::updateFrame(
     }
 
   }
-
-  // Now we obtain the fully filtered cloud...
-  if (this->post_filter_) {
-    this->post_filter_->getFiltered(filtered);
-  }
-  this->preprocessCloud(cloud_filtered);
-
-  // ...and we're done!
-  t.stop();
-
-  //LTRACE << "Total included points " << cloud_filtered->size();
-  //PINFO << "Filtering took " << t.duration();
-  // Finally, the cloud that is emitted by this instance is the filtered cloud.
-  frameData->cloud = cloud_filtered;
-  this->setNextFrame(frameData);
-  //cout << filtered.size() << "   " << cloud_filtered->size() << endl;
 }
 
 }
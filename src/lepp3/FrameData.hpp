@@ -6,21 +6,28 @@
 #include "lepp3/models/ObjectModel.h"
 #include "lepp3/models/LolaKinematics.h"
 #include "lepp3/Typedefs.hpp"
+#include "lepp3/util/Metrics.hpp"
 
 namespace lepp {
 
 struct FrameData {
-  FrameData(long num) : frameNum(num),
+  FrameData(long num) : frameNum(num), captureTime(MetricsClock::now()),
                         cloudMinusSurfaces(new PointCloudT()),
                         surfaceDetectionIteration(-1), surfaceReferenceFrameNum(-1),
                         planeCoeffsIteration(-1), planeCoeffsReferenceFrameNum(-1) {}
 
   long frameNum;
+  // when the source received the frame; used to measure the frame's age
+  MetricsClock::time_point captureTime;
   long surfaceDetectionIteration;
   long surfaceReferenceFrameNum;
   long planeCoeffsIteration;
   long planeCoeffsReferenceFrameNum;
   PointCloudConstPtr cloud;
+  // the filtered cloud in the sensor's layout, with the removed points set to
+  // NaN; only set if the `FilteredVideoSource` keeps the clouds organized.
+  // Its sensor_origin_ and sensor_orientation_ hold the pose of the sensor.
+  PointCloudConstPtr organizedCloud;
   PointCloudPtr cloudMinusSurfaces;
   std::vector<SurfaceModelPtr> surfaces;
   std::vector<ObjectModelPtr> obstacles;
@@ -5,8 +5,12 @@
 #include "lepp3/FrameData.hpp"
 #include "lepp3/RGBData.hpp"
 #include "VideoSource.hpp"
+#include "lepp3/util/ReplayClock.hpp"
+
+#include <stdexcept>
 
 #include <pcl/io/openni2_grabber.h>
+#include <pcl/io/pcd_grabber.h>
 
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
@@ -59,6 +63,15 @@ public:
    */
   virtual void setOptions(const std::map<std::string, bool>& options) override;
 
+  /**
+   * Lets the given clock pace the frames instead of the grabber's own timer.
+   * The grabber must be a `pcl::PCDGrabber` with a frame rate of 0, which
+   * the clock triggers once per frame.
+   */
+  void setReplayClock(std::shared_ptr<ReplayClock> clock);
+
+  virtual bool finished() const override { return clock_ && clock_->finished(); }
+
 protected:
   /**
   * A reference to the Grabber instance that the VideoSource wraps.
@@ -80,10 +93,26 @@ protected:
    * the point cloud and/or image.
    */
   bool receive_cloud_, receive_image_;
+
+  std::shared_ptr<ReplayClock> clock_;
+  /**
+   * The wrapped grabber, if it is paced by the replay clock.
+   */
+  boost::shared_ptr<pcl::PCDGrabberBase> replay_grabber_;
 };
 
+template<class PointT>
+void GeneralGrabberVideoSource<PointT>::setReplayClock(std::shared_ptr<ReplayClock> clock) {
+  replay_grabber_ = boost::dynamic_pointer_cast<pcl::PCDGrabberBase>(interface_);
+  if (!replay_grabber_)
+    throw std::runtime_error("Only a PCD grabber can be paced by a replay clock");
+  clock_ = clock;
+}
+
 template<class PointT>
 GeneralGrabberVideoSource<PointT>::~GeneralGrabberVideoSource() {
+  if (clock_)
+    clock_->stop();
   // RAII: make sure to stop any running Grabber
   interface_->stop();
 }
@@ -143,7 +172,15 @@ void GeneralGrabberVideoSource<PointT>::open() {
     interface_->registerCallback(g);
   }
 
-  interface_->start();
+  if (clock_) {
+    // Every trigger publishes the next frame on the clock's thread and
+    // returns once it was handed to the observers. `start` would publish it
+    // on a thread of its own, so that consecutive frames could overlap.
+    boost::shared_ptr<pcl::PCDGrabberBase> grabber = replay_grabber_;
+    clock_->start([grabber] { grabber->trigger(); });
+  } else {
+    interface_->start();
+  }
 }
 
 /**
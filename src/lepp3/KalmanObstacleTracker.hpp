@@ -9,6 +9,7 @@
 #include "lepp3/ObstacleFilter.hpp"
 #include "lepp3/FrameData.hpp"
 
+#include "lepp3/util/Metrics.hpp"
 #include "lepp3/util/Timer.hpp"
 
 #include "deps/easylogging++.h"
@@ -60,6 +61,7 @@ public:
 
     virtual void updateFrame(FrameDataPtr frameData)
     {
+        MetricsClock::time_point const start = MetricsClock::now();
         std::unordered_set<int> remove_ids = known_ids_;
         for (const auto& obj : frameData->obstacleParams)
         {
@@ -77,6 +79,7 @@ public:
 
         // update kalman tracking for objects in current frame
         tracker_.update(frameData->obstacleParams);
+        PipelineMetrics::instance().record(Stage::Tracking, MetricsClock::now() - start);
 
         // pass results on down the pipeline
         notifyObservers(frameData);
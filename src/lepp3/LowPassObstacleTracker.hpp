@@ -6,6 +6,7 @@
 #include <map>
 
 #include "lepp3/FrameData.hpp"
+#include "lepp3/util/Metrics.hpp"
 
 #include "deps/easylogging++.h"
 
@@ -366,6 +367,7 @@ void LowPassObstacleTracker::updateFrame(FrameDataPtr frameData)
 {
   if (frameData->cloudMinusSurfaces->size() != 0)
   {
+    ScopedStageTimer stageTimer(Stage::Tracking);
     std::map<model_id_t, size_t> correspondence = matchToPrevious(frameData->obstacles);
     updateLostAndFound(correspondence);
     adaptTracked(correspondence, frameData->obstacles, frameData->frameNum);
@@ -0,0 +1,410 @@
+#ifndef lepp3_PARALLEL_PLANE_SEARCH_HPP__
+#define lepp3_PARALLEL_PLANE_SEARCH_HPP__
+
+#include <pcl/ModelCoefficients.h>
+#include <pcl/common/centroid.h>
+#include <pcl/common/eigen.h>
+#include <pcl/point_cloud.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace lepp {
+
+/**
+ * Finds planes perpendicular to gravity (whose normal is within a maximum
+ * tilt of the z-axis) by RANSAC, evaluating the hypotheses on all cores.
+ *
+ * Several planes are searched for at once: the points are split into bands
+ * around the peaks of the histogram of their heights, each of which usually
+ * holds a single surface, and every band runs its own RANSAC. Hypotheses are
+ * evaluated in rounds. After each round, the best model of every band is
+ * updated, and a band stops once enough hypotheses were tried to have found
+ * its plane with the requested confidence.
+ *
+ * Each hypothesis draws its sample from its own random stream, derived from
+ * the seed, the band and the number of the hypothesis, so the result depends
+ * neither on the number of threads nor on their timing: with a fixed seed,
+ * the same points always give the same planes.
+ */
+template<class PointT>
+class ParallelPlaneSearch {
+public:
+  struct Parameters {
+    // The maximum number of hypotheses tried per band
+    int MAX_ITERATIONS = 200;
+    // How close a point must be to a plane in order to be one of its inliers
+    double DISTANCE_THRESHOLD = 0.03;
+    // The maximum angle between the normal of a plane and the z-axis, in radians
+    double MAX_TILT = 0.26;
+    // The number of threads evaluating hypotheses; 0 uses OpenMP's default
+    int THREADS = 0;
+    // The seed of the random streams; 0 draws a random seed
+    unsigned SEED = 12345;
+    // The height of a bin of the histogram of heights, in meters
+    double BAND_HEIGHT = 0.04;
+    // The minimum number of points of a band and of a plane
+    int MIN_BAND_POINTS = 500;
+    // The probability with which the hypotheses tried in a band include one
+    // made of inliers of its plane only
+    double CONFIDENCE = 0.99;
+  };
+
+  struct Plane {
+    pcl::ModelCoefficients coefficients;
+    // indices into the searched cloud, in ascending order
+    std::vector<int> inliers;
+  };
+
+  explicit ParallelPlaneSearch(Parameters const& params);
+
+  /**
+   * Searches the given points of the cloud for planes, at most one per band,
+   * and stores them in `planes`, largest first. No point is an inlier of more
+   * than one of them.
+   */
+  void find(pcl::PointCloud<PointT> const& cloud,
+            std::vector<int> const& indices,
+            std::vector<Plane>& planes);
+
+private:
+  // The number of hypotheses every band evaluates per round
+  static int const ROUND = 32;
+
+  /**
+   * A range of consecutive points (in the order of `x_`, `y_`, `z_`) along
+   * with the state of its search.
+   */
+  struct Band {
+    size_t begin;
+    size_t end;
+    int tried;
+    int required;
+    size_t bestInliers;
+    Eigen::Vector4f best;
+  };
+
+  /**
+   * Sorts the points into the bins of the histogram of heights and finds the
+   * bands around its peaks.
+   */
+  void buildBands(pcl::PointCloud<PointT> const& cloud, std::vector<int> const& indices);
+
+  /**
+   * Runs RANSAC in all bands until each of them is done.
+   */
+  void search();
+
+  /**
+   * Draws the sample of the k-th hypothesis of the given band and fits a
+   * plane through it. Returns false if the sample is degenerate or the
+   * plane is too steep.
+   */
+  bool hypothesis(size_t band, int k, Eigen::Vector4f& model) const;
+
+  size_t countInliers(size_t begin, size_t end, Eigen::Vector4f const& model) const;
+
+  /**
+   * Refines the best model of each band by a least-squares fit over its
+   * inliers and collects the points of the planes, the largest one first.
+   */
+  void collect(pcl::PointCloud<PointT> const& cloud, std::vector<Plane>& planes);
+
+  static uint64_t mix(uint64_t x) {
+    // splitmix64
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  Parameters const params_;
+  uint64_t const seed_;
+  int const threads_;
+  double const minVertical_;
+
+  // The searched points, sorted by their bin, and their indices in the cloud
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+  std::vector<int> ids_;
+  std::vector<size_t> binStart_;
+  std::vector<char> claimed_;
+  std::vector<Band, Eigen::aligned_allocator<Band> > bands_;
+  // The number of inliers of the hypotheses of a round, and their models
+  std::vector<size_t> scores_;
+  std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > models_;
+  std::vector<int> inliers_;
+};
+
+template<class PointT>
+ParallelPlaneSearch<PointT>::ParallelPlaneSearch(Parameters const& params)
+    : params_(params),
+      seed_(params.SEED != 0 ? params.SEED : std::random_device()()),
+#ifdef _OPENMP
+      threads_(params.THREADS > 0 ? params.THREADS : omp_get_max_threads()),
+#else
+      threads_(1),
+#endif
+      minVertical_(std::cos(params.MAX_TILT)) {
+}
+
+template<class PointT>
+void ParallelPlaneSearch<PointT>::find(
+    pcl::PointCloud<PointT> const& cloud,
+    std::vector<int> const& indices,
+    std::vector<Plane>& planes) {
+  planes.clear();
+  buildBands(cloud, indices);
+  if (bands_.empty())
+    return;
+  search();
+  collect(cloud, planes);
+
+  // A plane that is tilted far enough to spread over many bins may not make
+  // a peak of the histogram; all points are searched before giving up.
+  if (planes.empty() && !(bands_.size() == 1 && bands_[0].begin == 0 && bands_[0].end == ids_.size())) {
+    bands_.assign(1, Band());
+    bands_[0].begin = 0;
+    bands_[0].end = ids_.size();
+    search();
+    collect(cloud, planes);
+  }
+}
+
+template<class PointT>
+void ParallelPlaneSearch<PointT>::buildBands(
+    pcl::PointCloud<PointT> const& cloud, std::vector<int> const& indices) {
+  bands_.clear();
+  size_t const minPoints = std::max(params_.MIN_BAND_POINTS, 3);
+  if (indices.size() < minPoints)
+    return;
+
+  float zmin = std::numeric_limits<float>::max();
+  float zmax = -std::numeric_limits<float>::max();
+  for (int i : indices) {
+    float const z = cloud.points[i].z;
+    zmin = std::min(zmin, z);
+    zmax = std::max(zmax, z);
+  }
+  // keeps the histogram small, however far the points are spread
+  size_t const MAX_BINS = 1 << 16;
+  double const height = std::max(params_.BAND_HEIGHT, (zmax - zmin) / (MAX_BINS - 1.0));
+  size_t const bins = static_cast<size_t>((zmax - zmin) / height) + 1;
+  auto const binOf = [&](float z) {
+    return std::min(static_cast<size_t>((z - zmin) / height), bins - 1);
+  };
+
+  // counting sort of the points by their bin
+  binStart_.assign(bins + 1, 0);
+  for (int i : indices)
+    ++binStart_[binOf(cloud.points[i].z) + 1];
+  for (size_t b = 0; b < bins; ++b)
+    binStart_[b + 1] += binStart_[b];
+  std::vector<size_t> next(binStart_.begin(), binStart_.end() - 1);
+  x_.resize(indices.size());
+  y_.resize(indices.size());
+  z_.resize(indices.size());
+  ids_.resize(indices.size());
+  for (int i : indices) {
+    PointT const& p = cloud.points[i];
+    size_t const at = next[binOf(p.z)]++;
+    x_[at] = p.x;
+    y_[at] = p.y;
+    z_[at] = p.z;
+    ids_[at] = i;
+  }
+
+  // A band spans a peak and its two neighboring bins, so that a plane that
+  // straddles the border of two bins is not cut.
+  for (size_t b = 0; b < bins; ++b) {
+    size_t const count = binStart_[b + 1] - binStart_[b];
+    bool const peak = count >= minPoints
+        && (b == 0 || count > binStart_[b] - binStart_[b - 1])
+        && (b + 1 == bins || count >= binStart_[b + 2] - binStart_[b + 1]);
+    if (!peak)
+      continue;
+    bands_.push_back(Band());
+    bands_.back().begin = binStart_[b > 0 ? b - 1 : 0];
+    bands_.back().end = binStart_[std::min(b + 2, bins)];
+  }
+  if (bands_.empty()) {
+    bands_.push_back(Band());
+    bands_[0].begin = 0;
+    bands_[0].end = ids_.size();
+  }
+}
+
+template<class PointT>
+void ParallelPlaneSearch<PointT>::search() {
+  for (Band& band : bands_) {
+    band.tried = 0;
+    band.required = params_.MAX_ITERATIONS;
+    band.bestInliers = 0;
+    band.best.setZero();
+  }
+
+  std::vector<size_t> active;
+  while (true) {
+    active.clear();
+    for (size_t i = 0; i < bands_.size(); ++i) {
+      if (bands_[i].tried < std::min(bands_[i].required, params_.MAX_ITERATIONS))
+        active.push_back(i);
+    }
+    if (active.empty())
+      break;
+
+    // Every round evaluates the same hypotheses, however they are spread
+    // over the threads, so its outcome is deterministic.
+    int const total = static_cast<int>(active.size()) * ROUND;
+    scores_.assign(total, 0);
+    models_.resize(total);
+    #pragma omp parallel for schedule(dynamic) num_threads(threads_)
+    for (int t = 0; t < total; ++t) {
+      size_t const b = active[t / ROUND];
+      Band const& band = bands_[b];
+      int const k = band.tried + t % ROUND;
+      if (k < params_.MAX_ITERATIONS && hypothesis(b, k, models_[t]))
+        scores_[t] = countInliers(band.begin, band.end, models_[t]);
+    }
+
+    // On a tie, the earlier hypothesis wins.
+    for (int t = 0; t < total; ++t) {
+      Band& band = bands_[active[t / ROUND]];
+      if (scores_[t] > band.bestInliers) {
+        band.bestInliers = scores_[t];
+        band.best = models_[t];
+      }
+    }
+    for (size_t b : active) {
+      Band& band = bands_[b];
+      band.tried += ROUND;
+      // The number of hypotheses needed to draw a sample of inliers only
+      // with the requested confidence, given the best inlier ratio so far
+      double const ratio = static_cast<double>(band.bestInliers) / (band.end - band.begin);
+      double const clean = ratio * ratio * ratio;
+      if (clean >= 1) {
+        band.required = 0;
+      } else if (clean > 0) {
+        double const required = std::log(1 - params_.CONFIDENCE) / std::log(1 - clean);
+        if (required < params_.MAX_ITERATIONS)
+          band.required = static_cast<int>(std::ceil(required));
+      }
+    }
+  }
+}
+
+template<class PointT>
+bool ParallelPlaneSearch<PointT>::hypothesis(size_t b, int k, Eigen::Vector4f& model) const {
+  Band const& band = bands_[b];
+  size_t const size = band.end - band.begin;
+  uint64_t state = mix(mix(seed_ + b) + static_cast<uint64_t>(k));
+
+  size_t sample[3];
+  for (int i = 0; i < 3; ++i) {
+    // a few redraws for distinct points; duplicates are rare in large bands
+    int attempts = 0;
+    do {
+      state = mix(state);
+      sample[i] = band.begin + state % size;
+    } while (++attempts < 8 && std::find(sample, sample + i, sample[i]) != sample + i);
+    if (std::find(sample, sample + i, sample[i]) != sample + i)
+      return false;
+  }
+
+  Eigen::Vector3f const p0(x_[sample[0]], y_[sample[0]], z_[sample[0]]);
+  Eigen::Vector3f const p1(x_[sample[1]], y_[sample[1]], z_[sample[1]]);
+  Eigen::Vector3f const p2(x_[sample[2]], y_[sample[2]], z_[sample[2]]);
+  Eigen::Vector3f normal = (p1 - p0).cross(p2 - p0);
+  float const norm = normal.norm();
+  if (!(norm > 1e-9f))
+    return false;
+  normal /= norm;
+  if (std::abs(normal[2]) < minVertical_)
+    return false;
+  if (normal[2] < 0)
+    normal = -normal;
+  model << normal, -normal.dot(p0);
+  return true;
+}
+
+template<class PointT>
+size_t ParallelPlaneSearch<PointT>::countInliers(
+    size_t begin, size_t end, Eigen::Vector4f const& model) const {
+  float const a = model[0], b = model[1], c = model[2], d = model[3];
+  float const threshold = params_.DISTANCE_THRESHOLD;
+  float const* x = x_.data();
+  float const* y = y_.data();
+  float const* z = z_.data();
+  size_t count = 0;
+  for (size_t i = begin; i < end; ++i)
+    count += std::abs(a * x[i] + b * y[i] + c * z[i] + d) < threshold;
+  return count;
+}
+
+template<class PointT>
+void ParallelPlaneSearch<PointT>::collect(
+    pcl::PointCloud<PointT> const& cloud, std::vector<Plane>& planes) {
+  size_t const minPoints = std::max(params_.MIN_BAND_POINTS, 3);
+  // the largest planes claim their points first
+  std::vector<size_t> order(bands_.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](size_t l, size_t r) {
+    return bands_[l].bestInliers > bands_[r].bestInliers;
+  });
+
+  claimed_.assign(ids_.size(), 0);
+  float const threshold = params_.DISTANCE_THRESHOLD;
+  for (size_t b : order) {
+    Band const& band = bands_[b];
+    if (band.bestInliers < minPoints)
+      continue;
+
+    // least-squares fit over the inliers within the band
+    Eigen::Vector4f model = band.best;
+    inliers_.clear();
+    for (size_t i = band.begin; i < band.end; ++i) {
+      if (std::abs(model[0] * x_[i] + model[1] * y_[i] + model[2] * z_[i] + model[3]) < threshold)
+        inliers_.push_back(ids_[i]);
+    }
+    Eigen::Matrix3f covariance;
+    Eigen::Vector4f centroid;
+    pcl::computeMeanAndCovarianceMatrix(cloud, inliers_, covariance, centroid);
+    float eigenValue;
+    Eigen::Vector3f normal;
+    pcl::eigen33(covariance, eigenValue, normal);
+    if (normal[2] < 0)
+      normal = -normal;
+    if (std::abs(normal[2]) >= minVertical_)
+      model << normal, -normal.dot(centroid.head<3>());
+
+    // The plane may reach beyond its band.
+    Plane plane;
+    for (size_t i = 0; i < ids_.size(); ++i) {
+      if (!claimed_[i] && std::abs(model[0] * x_[i] + model[1] * y_[i] + model[2] * z_[i] + model[3]) < threshold)
+        plane.inliers.push_back(i);
+    }
+    if (plane.inliers.size() < minPoints)
+      continue;
+    for (int& i : plane.inliers) {
+      claimed_[i] = 1;
+      i = ids_[i];
+    }
+    std::sort(plane.inliers.begin(), plane.inliers.end());
+    plane.coefficients.values.assign(model.data(), model.data() + 4);
+    planes.push_back(plane);
+  }
+}
+
+} // namespace lepp
+
+#endif
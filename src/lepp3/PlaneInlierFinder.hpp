@@ -3,14 +3,21 @@
 
 #include "lepp3/Typedefs.hpp"
 #include "lepp3/FrameData.hpp"
+#include "lepp3/util/Metrics.hpp"
 
-#include <pcl/filters/extract_indices.h>
-#include <pcl/sample_consensus/sac_model_plane.h>
 #include <pcl/ModelCoefficients.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 #include <omp.h>
 
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
 #endif
@@ -41,11 +48,36 @@ private:
 	/**
 	* Filter out all points that belong to a plane in the given cloud.
 	* Remove those points from the cloud and save the resulting cloud in cloudMinusSurfaces.
+	*
+	* Every thread marks the points of its share of the cloud in a bitmask and
+	* counts the ones it keeps; after a prefix sum over these counts, every
+	* thread copies its kept points to their final place in the output.
 	*/
 	void filterInliers(PointCloudConstPtr cloud, std::vector<pcl::ModelCoefficients>
 		&planeCoefficients, PointCloudPtr &cloudMinusSurfaces,
 	  const std::shared_ptr<lepp::LolaKinematicsParams> &lolaKinematics);
 
+	/**
+	* Sets the bits of the points in [begin, end) that lie on one of the
+	* planes in `planes_` (or too far from the robot) in `removed_`, whose
+	* words covering the range must be zero. `begin` must be a multiple of 64.
+	* Returns the number of points that are kept.
+	*/
+	size_t markInliers(PointCloudT const& cloud, size_t begin, size_t end,
+		Eigen::Vector3f const& odo_pos);
+
+	/**
+	* Copies the points in [begin, end) whose bits in `removed_` are not set
+	* to `out`.
+	*/
+	void copyKept(PointCloudT const& cloud, size_t begin, size_t end, PointT* out) const;
+
+	// The coefficients of the planes, scaled to unit normals, four per plane
+	std::vector<float> planes_;
+	// Reused between frames: one bit per point of the cloud, set if the point
+	// is removed, and the offset of the points kept by each thread in the output
+	std::vector<uint64_t> removed_;
+	std::vector<size_t> keptOffsets_;
 };
 
 
@@ -53,76 +85,158 @@ template<class PointT>
 void PlaneInlierFinder<PointT>::filterInliers(PointCloudConstPtr cloud,
 	std::vector<pcl::ModelCoefficients> &planeCoefficients, PointCloudPtr &cloudMinusSurfaces, const std::shared_ptr<lepp::LolaKinematicsParams> &lolaKinematics)
 {
-	/*
-	std::vector<double> scaledThresholds;
-	for (size_t i = 0; i < planeCoefficients.size(); ++i)
+	planes_.clear();
+	for (size_t j = 0; j < planeCoefficients.size(); j++)
+	{
+		std::vector<float> const &c = planeCoefficients[j].values;
+		float const norm = std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+		for (int k = 0; k < 4; ++k)
+			planes_.push_back(c[k] / norm);
+	}
+
+	// points that are too far away from lola's coordinate center are removed
+	// works similar to the bubble, only in the obstacle thread
+	Eigen::Vector3f odo_pos = Eigen::Vector3f::Zero();
+	if (apply_max_dist_)
 	{
-		pcl::ModelCoefficients &coeffs = planeCoefficients[i];
-		scaledThresholds.push_back(coeffs.values[0]*coeffs.values coeffs.values[1], coeffs.values[2]));
-	}*/
+		odo_pos = lepp::PoseService::getRobotPosition(*lolaKinematics);
+	}
 
-	std::vector<int> planeIndices;
-	// iterate over all points of point cloud
+	size_t const n = cloud->size();
+	size_t const words = (n + 63) / 64;
+	removed_.resize(words);
+	PointCloudT &result = *cloudMinusSurfaces;
 	#pragma omp parallel
 	{
-		std::vector<int> threadPlaneIndices;
-		// points that are too far away from lola's coordinate center are removed
-		// works similar to the bubble, only in the obstacle thread
-		Eigen::Vector3f odo_pos;
-		if (apply_max_dist_)
+		// every thread handles a contiguous range of whole words of the mask
+		size_t const threads = omp_get_num_threads();
+		size_t const thread = omp_get_thread_num();
+		size_t const firstWord = words * thread / threads;
+		size_t const lastWord = words * (thread + 1) / threads;
+		size_t const begin = std::min(n, 64 * firstWord);
+		size_t const end = std::min(n, 64 * lastWord);
+
+		#pragma omp single
+		keptOffsets_.assign(threads + 1, 0);
+
+		std::fill(removed_.begin() + firstWord, removed_.begin() + lastWord, 0);
+		keptOffsets_[thread + 1] = markInliers(*cloud, begin, end, odo_pos);
+
+		#pragma omp barrier
+		#pragma omp single
 		{
-			odo_pos = lepp::PoseService::getRobotPosition(*lolaKinematics);
+			for (size_t t = 0; t < threads; ++t)
+				keptOffsets_[t + 1] += keptOffsets_[t];
+			result.points.resize(keptOffsets_[threads]);
 		}
 
-		#pragma omp for schedule(guided)
-		for (size_t i = 0; i < cloud->size(); i++)
+		copyKept(*cloud, begin, end, result.points.data() + keptOffsets_[thread]);
+	}
+
+	result.header = cloud->header;
+	result.width = result.points.size();
+	result.height = 1;
+	result.is_dense = cloud->is_dense;
+	result.sensor_origin_ = cloud->sensor_origin_;
+	result.sensor_orientation_ = cloud->sensor_orientation_;
+}
+
+
+template<class PointT>
+size_t PlaneInlierFinder<PointT>::markInliers(PointCloudT const& cloud,
+	size_t begin, size_t end, Eigen::Vector3f const& odo_pos)
+{
+	float const threshold = MIN_DIST_TO_PLANE;
+	float const maxDistSquared = apply_max_dist_ ? MAX_DIST_FROM_ODO * MAX_DIST_FROM_ODO : 0;
+	size_t kept = 0;
+	size_t i = begin;
+
+#ifdef __SSE2__
+	static_assert(sizeof(PointT) == 4 * sizeof(float),
+		"the SSE2 kernel expects points made of four packed floats");
+	__m128 const sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 const thresholds = _mm_set1_ps(threshold);
+	// blocks of four points, tested against all planes at once
+	for (; i + 4 <= end; i += 4)
+	{
+		float const *p = &cloud.points[i].x;
+		__m128 x = _mm_loadu_ps(p);
+		__m128 y = _mm_loadu_ps(p + 4);
+		__m128 z = _mm_loadu_ps(p + 8);
+		__m128 w = _mm_loadu_ps(p + 12);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		__m128 remove = _mm_setzero_ps();
+		if (apply_max_dist_)
 		{
-			const PointT &p = cloud->at(i);
-
-			// points that are too far away from lola's coordinate center are removed
-			// works similar to the bubble, only in the obstacle thread
-			if (apply_max_dist_)
-			{
-				Eigen::Vector3f point_pos(p.x, p.y, p.z);
-				if ((point_pos - odo_pos).norm() > MAX_DIST_FROM_ODO)
-				{
-					threadPlaneIndices.push_back(i);
-					continue;
-				}
-			}
-
-			// iterate over all planes
-			for (size_t j = 0; j < planeCoefficients.size(); j++)
-			{
-				// compute distance of point to the currently considered plane
-				pcl::ModelCoefficients &coeffs = planeCoefficients[j];
-				double dist = pointToPlaneDistance(p, coeffs.values[0],
-					coeffs.values[1], coeffs.values[2], coeffs.values[3]);
-				if (dist < MIN_DIST_TO_PLANE)
-				{
-					// push cloud index of a point that belongs to a plane into a vector
-					threadPlaneIndices.push_back(i);
-					break;
-				}
-			}
+			__m128 const dx = _mm_sub_ps(x, _mm_set1_ps(odo_pos[0]));
+			__m128 const dy = _mm_sub_ps(y, _mm_set1_ps(odo_pos[1]));
+			__m128 const dz = _mm_sub_ps(z, _mm_set1_ps(odo_pos[2]));
+			__m128 const d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			remove = _mm_cmpgt_ps(d2, _mm_set1_ps(maxDistSquared));
 		}
+		for (size_t j = 0; j < planes_.size(); j += 4)
+		{
+			__m128 dist = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes_[j]), x), _mm_mul_ps(_mm_set1_ps(planes_[j + 1]), y));
+			dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(planes_[j + 2]), z));
+			dist = _mm_add_ps(dist, _mm_set1_ps(planes_[j + 3]));
+			remove = _mm_or_ps(remove, _mm_cmplt_ps(_mm_and_ps(dist, sign_mask), thresholds));
+		}
+
+		// begin is a multiple of 64, so a block never straddles two words
+		uint64_t const bits = _mm_movemask_ps(remove);
+		removed_[i / 64] |= bits << (i % 64);
+		kept += 4 - ((bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + (bits >> 3));
+	}
+#endif
 
-		// every thread copies his own thread indices into the global plane indices
-		#pragma omp critical
+	// the same test for the remaining points, in the same order of operations
+	for (; i < end; ++i)
+	{
+		PointT const &p = cloud.points[i];
+		bool remove = false;
+		if (apply_max_dist_)
+		{
+			float const dx = p.x - odo_pos[0];
+			float const dy = p.y - odo_pos[1];
+			float const dz = p.z - odo_pos[2];
+			remove = dx * dx + dy * dy + dz * dz > maxDistSquared;
+		}
+		for (size_t j = 0; j < planes_.size() && !remove; j += 4)
 		{
-			planeIndices.insert(std::end(planeIndices), std::begin(threadPlaneIndices), std::end(threadPlaneIndices));
+			float const dist = planes_[j] * p.x + planes_[j + 1] * p.y + planes_[j + 2] * p.z + planes_[j + 3];
+			remove = std::abs(dist) < threshold;
 		}
+		if (remove)
+			removed_[i / 64] |= uint64_t(1) << (i % 64);
+		else
+			++kept;
 	}
+	return kept;
+}
+
 
-	// filter out all points from the cloud that belong to a plane
-	pcl::ExtractIndices<PointT> extract;
-	pcl::PointIndices::Ptr allIndices(new pcl::PointIndices);
-	allIndices->indices = planeIndices;
-	extract.setInputCloud(cloud);
-	extract.setIndices(allIndices);
-	extract.setNegative(true);
-	// store the filered cloud in cloudMinusSurfaces
-	extract.filter(*cloudMinusSurfaces);
+template<class PointT>
+void PlaneInlierFinder<PointT>::copyKept(PointCloudT const& cloud,
+	size_t begin, size_t end, PointT* out) const
+{
+	for (size_t i = begin; i < end; )
+	{
+		uint64_t const word = removed_[i / 64];
+		if (word == 0 && i + 64 <= end)
+		{
+			// most words of the mask are empty
+			out = std::copy(cloud.points.begin() + i, cloud.points.begin() + i + 64, out);
+			i += 64;
+			continue;
+		}
+		size_t const wordEnd = std::min(end, i + 64);
+		for (; i < wordEnd; ++i)
+		{
+			if (!((word >> (i % 64)) & 1))
+				*out++ = cloud.points[i];
+		}
+	}
 }
 
 
@@ -134,8 +248,10 @@ void PlaneInlierFinder<PointT>::updateFrame(FrameDataPtr frameData)
         tracepoint(lepp3_trace_provider, plane_inlier_update_start);
 #endif
 
-	if (frameData->cloud->size() > 0)
+	if (frameData->cloud->size() > 0) {
+		ScopedStageTimer stageTimer(Stage::InlierRemoval);
 		filterInliers(frameData->cloud, frameData->planeCoefficients, frameData->cloudMinusSurfaces, frameData->lolaKinematics);
+	}
 
 #ifdef LEPP3_ENABLE_TRACING
         tracepoint(lepp3_trace_provider, plane_inlier_update_end);
@@ -1,15 +1,15 @@
 #ifndef lepp3_SURFACE_CLUSTERER_HPP__
 #define lepp3_SURFACE_CLUSTERER_HPP__
 
-#include <unordered_map>
+#include <numeric>
+#include <vector>
 
 #include "lepp3/Typedefs.hpp"
 #include "lepp3/SurfaceData.hpp"
+#include "lepp3/util/Metrics.hpp"
 #include "lepp3/util/Projection.h"
 #include "lepp3/util/VoxelGrid.h"
 
-#include <pcl/filters/project_inliers.h>
-
 #include <omp.h>
 
 #ifdef LEPP3_ENABLE_TRACING
@@ -42,57 +42,19 @@ private:
   /**
   * A plane might contain several non-connected planes that do not correspond
   * to the same surface. Thus, the planes are clustered into seperate surfaces
-  * in this function if necessary.
+  * in this function if necessary. The points of every surface are projected
+  * onto the plane.
   **/
   void cluster(
       PointCloudPtr plane,
       pcl::ModelCoefficients& planeCoefficients,
       std::vector<SurfaceModelPtr>& surfaces);
 
-  /**
-  * Project given surfaces on plane specified by the corresponding plane coefficients.
-  */
-  void projectOnPlane(SurfaceModelPtr surface);
-
-  /**
-   * Projects a 3d plane into 2D for faster processing
-   * Note: The function returns a 3D vector with z set to 1
-   */
-  std::vector<Eigen::Vector3f> project_to_2d_plane(const PointCloudT& cloud, const lepp::util::Projection& proj) const;
-
   // constant variables for clustering
   const double CLUSTER_TOLERANCE;
   const int MIN_CLUSTER_SIZE;
 };
 
-template<class PointT>
-void SurfaceClusterer<PointT>::projectOnPlane(SurfaceModelPtr surface) {
-  // project surface on corresponding plane
-  pcl::ProjectInliers<PointT> proj;
-  proj.setModelType(pcl::SACMODEL_PLANE);
-  proj.setInputCloud(surface->get_cloud());
-  pcl::ModelCoefficients::Ptr coeffPtr = boost::shared_ptr<pcl::ModelCoefficients>(
-      new pcl::ModelCoefficients(surface->get_planeCoefficients()));
-  proj.setModelCoefficients(coeffPtr);
-  PointCloudPtr tmp(new PointCloudT());
-  proj.filter(*tmp);
-  surface->set_cloud(tmp);
-}
-
-template<class PointT>
-std::vector<Eigen::Vector3f>
-SurfaceClusterer<PointT>::project_to_2d_plane(const PointCloudT& cloud, const lepp::util::Projection& proj) const {
-  std::vector<Eigen::Vector3f> result;
-  result.reserve(cloud.points.size());
-
-  for (const auto& pt : cloud.points) {
-    auto pt_2d = proj(pt.x, pt.y, pt.z);
-    result.emplace_back(pt_2d[0], pt_2d[1], 1.0f);
-  }
-
-  return result;
-}
-
 template<class PointT>
 void SurfaceClusterer<PointT>::cluster(
     PointCloudPtr plane,
@@ -103,37 +65,57 @@ void SurfaceClusterer<PointT>::cluster(
   tracepoint(lepp3_trace_provider, surface_cluster_start);
 #endif
 
-  lepp::util::Projection proj(planeCoefficients.values);
-  auto plane_2d = project_to_2d_plane(*plane, proj);
+  ScopedStageTimer stageTimer(Stage::Clustering);
 
-  lepp::util::VoxelGrid<2> voxelGrid(CLUSTER_TOLERANCE);
-  voxelGrid.build(plane_2d);
+  static_assert(sizeof(PointT) % sizeof(float) == 0,
+                "the points are expected to be made of packed floats");
+  const size_t stride = sizeof(PointT) / sizeof(float);
+  const size_t numPoints = plane->points.size();
 
-  std::unordered_map<size_t, PointCloudT> clusters;
+  // project the whole plane into 2D at once
+  lepp::util::Projection proj(planeCoefficients.values);
+  std::vector<float> plane2d(2 * numPoints);
+  if (numPoints > 0) {
+    proj.project(reinterpret_cast<const float*>(&plane->points[0]), numPoints, stride, plane2d.data());
+  }
 
-  for (size_t i = 0; i < plane_2d.size(); ++i) {
-    size_t cluster = voxelGrid.clusterForPoint(plane_2d[i]);
-    clusters[cluster].points.emplace_back(plane->points[i]);
+  lepp::util::VoxelGrid<2> voxelGrid(CLUSTER_TOLERANCE);
+  voxelGrid.build(plane2d.data(), numPoints, 2);
+
+  // sort the 2D points by their clusters, keeping their order within each
+  // cluster, so that every cluster is a contiguous range of the buffer
+  const size_t numClusters = voxelGrid.numClusters();
+  std::vector<size_t> offsets(numClusters + 1, 0);
+  for (size_t i = 0; i < numPoints; ++i) {
+    ++offsets[voxelGrid.clusterOfPoint(i) + 1];
+  }
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  std::vector<float> sorted2d(plane2d.size());
+  std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < numPoints; ++i) {
+    const size_t j = next[voxelGrid.clusterOfPoint(i)]++;
+    sorted2d[2 * j] = plane2d[2 * i];
+    sorted2d[2 * j + 1] = plane2d[2 * i + 1];
   }
 
   // cluster the current plane into seperate surfaces
   std::vector<SurfaceModelPtr> clusteredSurfaces;
 
-  for (auto& entry : clusters) {
-    auto& cloud = entry.second;
-
-    if (cloud.points.size() < MIN_CLUSTER_SIZE)
+  for (size_t c = 0; c < numClusters; ++c) {
+    const size_t size = offsets[c + 1] - offsets[c];
+    if (size < static_cast<size_t>(MIN_CLUSTER_SIZE))
       continue;
 
-    cloud.is_dense = true;
-    cloud.width = cloud.points.size();
-    cloud.height = 1;
-
-    clusteredSurfaces.push_back(
-        SurfaceModelPtr(new SurfaceModel(boost::make_shared<PointCloudT>(cloud), planeCoefficients)));
+    // mapping the 2D points back to 3D projects them onto the plane
+    PointCloudPtr cloud(new PointCloudT());
+    cloud->points.resize(size);
+    proj.unproject(&sorted2d[2 * offsets[c]], size, reinterpret_cast<float*>(&cloud->points[0]), stride);
+    cloud->is_dense = true;
+    cloud->width = size;
+    cloud->height = 1;
 
-    // project the found surfaces on corresponding plane
-    projectOnPlane(clusteredSurfaces.back());
+    clusteredSurfaces.push_back(SurfaceModelPtr(new SurfaceModel(cloud, planeCoefficients)));
   }
 
   //add clusetered surfaces to shared frameData variable
@@ -6,6 +6,9 @@
 #include "lepp3/SurfaceClusterer.hpp"
 #include "lepp3/FrameData.hpp"
 #include "lepp3/SurfaceData.hpp"
+#include "lepp3/util/BlockingQueue.hpp"
+#include "lepp3/util/ReplayClock.hpp"
+#include "lepp3/util/TripleBuffer.hpp"
 
 #include <vector>
 #include <thread>
@@ -17,17 +20,24 @@ template<class PointT>
 class SurfaceDetector : public FrameDataObserver, public FrameDataSubject,
                         public SurfaceDataObserver, public SurfaceDataSubject {
 public:
-  SurfaceDetector(bool surfaceDetectorActive, typename SurfaceFinder<PointT>::Parameters const& surfFinderParameters)
+  /**
+   * Creates a new surface detector and starts its worker threads.
+   *
+   * The ransac task always picks up the newest frame. `queueDepth` is the
+   * number of pending ransac results the cluster task may hold; when it falls
+   * behind, the oldest pending result is dropped so that it always operates
+   * on the most recent data.
+   */
+  SurfaceDetector(bool surfaceDetectorActive,
+                  typename SurfaceFinder<PointT>::Parameters const& surfFinderParameters,
+                  size_t queueDepth = 1)
       : surfaceDetectorActive(surfaceDetectorActive),
         finder_(new SurfaceFinder<PointT>(surfaceDetectorActive, surfFinderParameters)),
-        frameNum(1),
+        planeQueue_(queueDepth),
         surfaceDetectionIteration(0),
         surfaceReferenceFrameNum(0),
         planeCoeffsIteration(0),
-        planeCoeffsReferenceFrameNum(0),
-        exchangeCloud(PointCloudPtr(new PointCloudT())),
-        newInputCloud(false),
-        exit_threads_(false) {
+        planeCoeffsReferenceFrameNum(0) {
     // start surface pipeline thread
     if (surfaceDetectorActive) {
       threads_.emplace_back(&SurfaceDetector::clusterTask, this);
@@ -38,7 +48,9 @@ public:
   }
 
   virtual ~SurfaceDetector() {
-    exit_threads_ = true;
+    // closing the queues wakes up the workers, which then exit
+    cloudExchange_.close();
+    planeQueue_.close();
     for (auto& t : threads_) {
       t.join();
     }
@@ -55,40 +67,60 @@ public:
   */
   virtual void updateSurfaces(SurfaceDataPtr surfaceData);
 
+  /**
+   * Reports the frames handed over to the worker threads to the given barrier,
+   * so that a lockstep replay waits for them. Must be set before the first
+   * frame arrives.
+   */
+  void setReplayBarrier(std::shared_ptr<ReplayBarrier> barrier) { replayBarrier_ = barrier; }
+
 private:
+  /**
+   * A cloud handed over from the main pipeline to the ransac task.
+   */
+  struct CloudItem {
+    long frameNum;
+    PointCloudConstPtr cloud;
+    PointCloudConstPtr organizedCloud;
+  };
+
+  /**
+   * The result of one ransac iteration, handed over to the cluster task.
+   */
+  struct PlaneItem {
+    long frameNum;
+    std::vector<PointCloudPtr> planes;
+    std::vector<pcl::ModelCoefficients> planeCoefficients;
+  };
+
   boost::shared_ptr<SurfaceFinder<PointT> > finder_;
 
   // boolean indicating whether the surface detector was enabled in config files
   bool surfaceDetectorActive;
 
-  // mutex variables that limits access to exchangePlanes and
-  // exchangePlaneCoefficients variable
+  // mutex variables that limits access to exchangePlaneCoefficients variable
   std::mutex planeMutex;
   // mutex variable that limits access to exchangeSurfaces variable
   std::mutex surfaceMutex;
-  // mutex to fill exchangeCloud
-  std::mutex exchangeCloudMutex;
-
-  // the exchange planes and exchange coefficients are needed for communication of the
-  // ransac task and the surface detection/main thread. The ransac task fills both vectors
-  // with newly detected planes and their coefficients. The surface detection and main thread
-  // use these data in their computations.
-  std::vector<PointCloudPtr> exchangePlanes;
+
+  // the latest plane coefficients found by the ransac task. They are copied
+  // into every frame by the main thread.
   std::vector<pcl::ModelCoefficients> exchangePlaneCoefficients;
 
+  // the newest frame's cloud, handed to the ransac task without copying it;
+  // the cloud is shared with the rest of the pipeline and must not be modified
+  TripleBuffer<CloudItem> cloudExchange_;
+  // planes waiting to be processed by the cluster task
+  BlockingQueue<PlaneItem> planeQueue_;
+
+  // frames in flight on the worker threads are reported here, if set
+  std::shared_ptr<ReplayBarrier> replayBarrier_;
 
   /**
    * Container for all threads
    * Necessary to cleanly exit them
    */
   std::vector<std::thread> threads_;
-  /**
-   * Flag to signal threads to exit
-   */
-  bool exit_threads_;
-
-  // holds the last frame number
-  long frameNum;
 
   // counts the iterations the surface detection thread
   long surfaceDetectionIteration;
@@ -105,25 +137,17 @@ private:
   // this vector is the output from the surface detection pipeline (sufaceDetectionThread).
   std::vector<SurfaceModelPtr> exchangeSurfaces;
 
-  // when there is a new frame, the point cloud from the frame is copied into this
-  // exchange cloud. The exchange cloud is used by the SurfaceFinder to find new model
-  // coefficients. The point cloud in frame data cannot be used for this since the
-  // SurfaceFinder ransac algorithm runs in its own thread independently.
-  PointCloudPtr exchangeCloud;
-
-  // this boolean indicates whether there is a new input cloud and the model coefficients
-  // should be computed again
-  bool newInputCloud;
-
   /**
   * Method that is called by surfaceDetectionThread. It invokes the clustering and
-  * approximation of surfaces with convex hulls.
+  * approximation of surfaces with convex hulls whenever the ransac task
+  * delivers new planes.
   */
   void clusterTask();
 
   /**
   * Method that is called by ransac thread. It invokes the detection of surface
-  * coefficients and the corresponding planes using RANSAC
+  * coefficients and the corresponding planes using RANSAC whenever a new
+  * cloud is queued.
   */
   void ransacTask();
 
@@ -132,59 +156,60 @@ private:
 
 template<class PointT>
 void SurfaceDetector<PointT>::clusterTask() {
-  while (!exit_threads_) {
-    // copy planes from exchange variables to local variables
-    planeMutex.lock();
-    SurfaceDataPtr surfaceData(new SurfaceData(frameNum));
-    surfaceData->planes = exchangePlanes;
-    surfaceData->planeCoefficients = exchangePlaneCoefficients;
-    planeMutex.unlock();
-
+  PlaneItem item;
+  // blocks until new planes are available; returns false on shutdown
+  while (planeQueue_.pop(item)) {
     // invoke surface pipeline if there are any planes
-    if (surfaceData->planes.size() != 0)
+    if (item.planes.size() != 0) {
+      SurfaceDataPtr surfaceData(new SurfaceData(item.frameNum));
+      surfaceData->planes = std::move(item.planes);
+      surfaceData->planeCoefficients = std::move(item.planeCoefficients);
       SurfaceDataSubject::notifyObservers(surfaceData);
+    }
+
+    if (replayBarrier_)
+      replayBarrier_->leave();
   }
 }
 
 template<class PointT>
 void SurfaceDetector<PointT>::ransacTask() {
-  while (!exit_threads_) {
-    // copy cloud pointer to local variable
-    PointCloudPtr cloud;
-    bool computeNewCoefficients = false;
+  CloudItem item;
+  // blocks until a new cloud is available; returns false on shutdown
+  while (cloudExchange_.waitAndConsume(item)) {
+    assert(item.cloud);
+
+    // find planes and plane coefficients in current cloud
+    PlaneItem result;
+    result.frameNum = item.frameNum;
+    finder_->findSurfaces(item.cloud, result.planes, result.planeCoefficients, item.organizedCloud);
 
     {
-      std::lock_guard<std::mutex> lock(exchangeCloudMutex);
-      cloud = exchangeCloud;
-      computeNewCoefficients = newInputCloud;
-      newInputCloud = false;
-    }
-    assert(cloud);
-
-    // find plane coefficients with ransac if there is a new cloud set
-    if (computeNewCoefficients) {
-      // store current frame num before calling ransac
-      planeMutex.lock();
-      long tmpFrameNum = frameNum;
-      planeMutex.unlock();
-
-      // find planes and plane coefficients in current cloud
-      std::vector<PointCloudPtr> planes;
-      std::vector<pcl::ModelCoefficients> planeCoefficients;
-      finder_->findSurfaces(cloud, planes, planeCoefficients);
-
-      // copy detected planes and plane coefficients over in exchange variables
-      planeMutex.lock();
-      // copy back planes and plane coefficients into exchange variables
-      exchangePlanes = planes;
-      exchangePlaneCoefficients = planeCoefficients;
-      // increase the number of ransac iterations 
+      std::lock_guard<std::mutex> lock(planeMutex);
+      exchangePlaneCoefficients = result.planeCoefficients;
+      // increase the number of ransac iterations
       // (iterations to find planes and plane coefficients of current cloud)
       planeCoeffsIteration++;
       // store back frame num to which the computed coefficients belong
-      planeCoeffsReferenceFrameNum = tmpFrameNum;
-      planeMutex.unlock();
+      planeCoeffsReferenceFrameNum = item.frameNum;
     }
+
+    // hand the planes over to the surface pipeline
+    if (surfaceDetectorActive) {
+      if (replayBarrier_) {
+        replayBarrier_->enter();
+        std::vector<PlaneItem> evicted;
+        if (!planeQueue_.push(std::move(result), &evicted))
+          replayBarrier_->leave();
+        for (size_t i = 0; i < evicted.size(); ++i)
+          replayBarrier_->leave();
+      } else {
+        planeQueue_.push(std::move(result));
+      }
+    }
+
+    if (replayBarrier_)
+      replayBarrier_->leave();
   }
 }
 
@@ -208,16 +233,18 @@ void SurfaceDetector<PointT>::updateFrame(FrameDataPtr frameData) {
   // store the planeCoeffsIteration cound and planeCoeffsReferenceFrameNum in frameData
   frameData->planeCoeffsIteration = planeCoeffsIteration;
   frameData->planeCoeffsReferenceFrameNum = planeCoeffsReferenceFrameNum;
-  // store frame number of current frame
-  frameNum = frameData->frameNum;
   planeMutex.unlock();
 
-  // copy current point cloud into exchange variable
-  {
-    std::lock_guard<std::mutex> lock(exchangeCloudMutex);
-    exchangeCloud = PointCloudPtr(new PointCloudT(*frameData->cloud));
-    newInputCloud = true;
-  }
+  // hand the current point cloud over to the ransac task
+  CloudItem item;
+  item.frameNum = frameData->frameNum;
+  item.cloud = frameData->cloud;
+  item.organizedCloud = frameData->organizedCloud;
+  if (replayBarrier_)
+    replayBarrier_->enter();
+  // a cloud the ransac task never picked up is done as well
+  if (cloudExchange_.publish(std::move(item)) && replayBarrier_)
+    replayBarrier_->leave();
 
   if (surfaceDetectorActive) {
     // copy latest detected surfaces into frameData
@@ -1,15 +1,22 @@
 #ifndef lepp3_SURFACE_FINDER_HPP__
 #define lepp3_SURFACE_FINDER_HPP__
 
+#include "lepp3/ParallelPlaneSearch.hpp"
 #include "lepp3/Typedefs.hpp"
+#include "lepp3/util/Metrics.hpp"
 #include "lepp3/util/Timer.hpp"
 
-#include <pcl/filters/model_outlier_removal.h>
+#include <pcl/common/centroid.h>
+#include <pcl/common/eigen.h>
+#include <pcl/common/io.h>
+#include <pcl/features/integral_image_normal.h>
+#include <pcl/segmentation/organized_multi_plane_segmentation.h>
 #include <pcl/segmentation/sac_segmentation.h>
-#include <pcl/filters/extract_indices.h>
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
+#include <numeric>
 
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
@@ -20,6 +27,10 @@ namespace lepp {
 template<class PointT>
 class SurfaceFinder {
 public:
+  // The maximum angle between the normal of a surface and the vertical
+  // axis, in radians (~15 degrees).
+  static constexpr double MAX_TILT = 0.26;
+
   struct Parameters {
     int MAX_ITERATIONS;
 
@@ -32,33 +43,101 @@ public:
     // The function to classify segmented planes according to deviation in their normals
     double DEVIATION_ANGLE;
 
-    // Allows the reuse of old surface coefficients to trim down the pointcloud before
-    // trying to detect new surfaces. Can reduce runtime of findSurfaces().
-    // EXPERIMENTAL, and may produce unexpected results!
-    bool EXPERIMENTAL_ENABLE_SURFACE_REUSE;
+    // Whether the planes found in the previous frame are looked for first,
+    // refined by a least-squares fit over their inliers, so that RANSAC only
+    // runs on the points that are left.
+    bool TRACK_PLANES = false;
+    // Every this many frames, all planes are detected anew by RANSAC. Zero
+    // means only when no plane is tracked anymore.
+    int REDETECT_INTERVAL = 30;
+    // A tracked plane with fewer inliers than this is lost.
+    int TRACKING_MIN_INLIERS = 1000;
+
+    // Whether RANSAC runs on all cores, searching for several planes at once
+    // (see ParallelPlaneSearch), instead of for one plane at a time.
+    bool PARALLEL_RANSAC = false;
+    // The number of threads; 0 uses OpenMP's default
+    int PARALLEL_THREADS = 0;
+    // The seed of the parallel search; 0 draws a random seed
+    unsigned PARALLEL_SEED = 12345;
+    // The height of the bands the points are split into, in meters
+    double BAND_HEIGHT = 0.04;
+    // The minimum number of points of a band and of a plane found in it
+    int MIN_BAND_POINTS = 500;
+    // The confidence with which each band's plane is found
+    double RANSAC_CONFIDENCE = 0.99;
+
+    // Whether planes are found in the organized cloud, if the frames have
+    // one, by region growing over integral image normals instead of RANSAC.
+    bool ORGANIZED = false;
+    // The minimum number of points of a plane found in the organized cloud
+    int ORGANIZED_MIN_INLIERS = 1000;
+    // How much the normals of neighboring points of the same plane may
+    // differ, in degrees
+    double ORGANIZED_ANGULAR_THRESHOLD = 3.0;
+    // The size of the area (in pixels) that the normals are averaged over
+    double NORMAL_SMOOTHING_SIZE = 10.0;
+    // Neighbors whose depths differ by more than 2 * factor * (depth + 1) lie
+    // across an edge and do not contribute to each other's normals
+    double MAX_DEPTH_CHANGE_FACTOR = 0.02;
   };
 
   SurfaceFinder(bool surfaceDetectorActive, Parameters const& surfFinderParameters);
 
   /**
   * Segment the given cloud into surfaces. Store the found surfaces and surface model
-  * coefficients in 'surfaces' and 'surfaceCoefficients'. Subtract the found surfaces
-  * from the input cloud and store the remaining cloud in 'cloudMinusSurfaces'.
+  * coefficients in 'surfaces' and 'surfaceCoefficients'. The input cloud is not
+  * modified, so it can be shared with the rest of the pipeline without copying.
+  *
+  * If the finder works on organized clouds and `organized` (the same frame's
+  * cloud in the sensor's layout) is given, the planes are found in it instead.
+  * Its `sensor_origin_` and `sensor_orientation_` must hold the pose of the
+  * sensor in the frame of its points.
   */
   void findSurfaces(
-      PointCloudPtr cloud,
+      PointCloudConstPtr cloud,
       std::vector<PointCloudPtr>& planes,
-      std::vector<pcl::ModelCoefficients>& planeCoefficients);
+      std::vector<pcl::ModelCoefficients>& planeCoefficients,
+      PointCloudConstPtr organized = PointCloudConstPtr());
 
 private:
   /**
   * Detect all planes in the given point cloud and store those and their
   * coefficients in the given vectors.
   */
-  void findPlanes(PointCloudPtr& cloud_filtered,
+  void findPlanes(PointCloudConstPtr const& cloud,
                   std::vector<PointCloudPtr>& planes,
                   std::vector<pcl::ModelCoefficients>& planeCoefficients);
 
+  /**
+  * Removes the points claimed by a plane from `remainingIndices_` in a single
+  * pass, which keeps the rest in order.
+  */
+  void removeClaimed();
+
+  /**
+  * Looks for the planes of the previous frame in the given cloud and refines
+  * their coefficients by a least-squares fit over their inliers. The planes
+  * that are still found are classified and kept for the next frame; the
+  * points that are not part of any of them are left in `remainingIndices_`.
+  */
+  void trackPlanes(PointCloudConstPtr const& cloud);
+
+  /**
+  * Detect the planes perpendicular to gravity in the given organized cloud,
+  * by growing regions of similar normals, and store those and their
+  * coefficients in the given vectors. Runs in time linear in the size of
+  * the cloud.
+  *
+  * The normals and the regions are computed in the sensor's frame, since
+  * the integral image normals are flipped towards the sensor and take z to
+  * be the depth. The coefficients are transformed back into the frame of
+  * the cloud.
+  */
+  void findPlanesOrganized(PointCloudConstPtr const& cloud,
+                           std::vector<PointCloudPtr>& planes,
+                           std::vector<pcl::ModelCoefficients>& planeCoefficients);
+
   /**
   * If surface detector is disabled, only the ground has to be removed but all other
   * planes have to stay in place. For this only one plane (the ground) and its coefficients
@@ -70,11 +149,20 @@ private:
   /**
   * Several planes corresponding to the same surface might be detected.
   * Merge planes that have almost the same normal vector and z-intersection.
+  * The planes are collected as the indices of their inliers, in
+  * `foundIndices_` and `foundCoefficients_`.
   **/
-  void classify(PointCloudPtr const& cloud_planar_surface,
-                const pcl::ModelCoefficients& coeffs,
-                std::vector<PointCloudPtr>& planes,
-                std::vector<pcl::ModelCoefficients>& planeCoefficients);
+  void classify(std::vector<int> const& inliers,
+                const pcl::ModelCoefficients& coeffs);
+
+  /**
+  * Copies the points of the planes collected by `classify` out of the given
+  * cloud, once per plane, and appends them and their coefficients to the
+  * given vectors.
+  */
+  void emitPlanes(PointCloudConstPtr const& cloud,
+                  std::vector<PointCloudPtr>& planes,
+                  std::vector<pcl::ModelCoefficients>& planeCoefficients);
 
   /**
   * Returns the angle between two plane represented by their model coefficients.
@@ -83,14 +171,45 @@ private:
                   const pcl::ModelCoefficients& coeffs2);
 
 
-  //Previous plane coeffs are only used for tricking ransac, comment out for trial with the rest of the relevant part
+  // The planes found in the previous frame, which are tracked into the next one
   std::vector<pcl::ModelCoefficients> previous_plane_coeffs;
+  // The number of frames since RANSAC last searched the whole cloud
+  int framesSinceDetection_;
+  // The planes found in the current frame, as the indices of their inliers
+  std::vector<pcl::PointIndices> foundIndices_;
+  std::vector<pcl::ModelCoefficients> foundCoefficients_;
+  // The points that are not part of any plane yet, which RANSAC searches,
+  // and which points a plane has claimed. Reused between frames.
+  pcl::IndicesPtr remainingIndices_;
+  std::vector<char> claimed_;
+  // Reused by trackPlanes: the inliers of each tracked plane
+  std::vector<pcl::PointIndices> trackedIndices_;
 
   /**
   * Instance used to extract the planes from the input cloud.
   */
   pcl::SACSegmentation<PointT> segmentation_;
 
+  /**
+  * Used instead of `segmentation_` if RANSAC runs in parallel, along with the
+  * planes of its last search.
+  */
+  boost::shared_ptr<ParallelPlaneSearch<PointT> > parallelSearch_;
+  std::vector<typename ParallelPlaneSearch<PointT>::Plane> parallelPlanes_;
+
+  /**
+  * Instances used to extract the planes from organized clouds, along with
+  * the buffers they reuse between frames.
+  */
+  pcl::IntegralImageNormalEstimation<PointT, pcl::Normal> normalEstimation_;
+  pcl::OrganizedMultiPlaneSegmentation<PointT, pcl::Normal, pcl::Label> organizedSegmentation_;
+  pcl::PointCloud<pcl::Normal>::Ptr normals_;
+  // the organized cloud in the sensor's frame
+  PointCloudPtr sensorCloud_;
+  std::vector<pcl::ModelCoefficients> regionCoefficients_;
+  std::vector<pcl::PointIndices> regionIndices_;
+  const bool ORGANIZED;
+
   //max number of RANSAC iterations
   const int MAX_ITERATIONS;
 
@@ -103,18 +222,28 @@ private:
   // The function to classify segmented planes according to deviation in their normals
   const double DEVIATION_ANGLE;
 
-  const bool EXPERIMENTAL_ENABLE_SURFACE_REUSE;
+  const bool TRACK_PLANES;
+  const int REDETECT_INTERVAL;
+  const size_t TRACKING_MIN_INLIERS;
   // boolean indicating whether the surface detector was activated in config file
   bool surfaceDetectorActive;
 };
 
 template<class PointT>
 SurfaceFinder<PointT>::SurfaceFinder(bool surfaceDetectorActive, Parameters const& surfFinderParameters)
-    : surfaceDetectorActive(surfaceDetectorActive), MAX_ITERATIONS(surfFinderParameters.MAX_ITERATIONS),
+    : framesSinceDetection_(0),
+      remainingIndices_(new std::vector<int>()),
+      normals_(new pcl::PointCloud<pcl::Normal>()),
+      sensorCloud_(new PointCloudT()),
+      ORGANIZED(surfFinderParameters.ORGANIZED),
+      MAX_ITERATIONS(surfFinderParameters.MAX_ITERATIONS),
       DISTANCE_THRESHOLD(surfFinderParameters.DISTANCE_THRESHOLD),
       MIN_FILTER_PERCENTAGE(surfFinderParameters.MIN_FILTER_PERCENTAGE),
       DEVIATION_ANGLE(surfFinderParameters.DEVIATION_ANGLE),
-      EXPERIMENTAL_ENABLE_SURFACE_REUSE(surfFinderParameters.EXPERIMENTAL_ENABLE_SURFACE_REUSE)
+      TRACK_PLANES(surfFinderParameters.TRACK_PLANES),
+      REDETECT_INTERVAL(surfFinderParameters.REDETECT_INTERVAL),
+      TRACKING_MIN_INLIERS(std::max(surfFinderParameters.TRACKING_MIN_INLIERS, 1)),
+      surfaceDetectorActive(surfaceDetectorActive)
 {
   // Parameter initialization of the plane segmentation
   segmentation_.setOptimizeCoefficients(true);
@@ -123,7 +252,28 @@ SurfaceFinder<PointT>::SurfaceFinder(bool surfaceDetectorActive, Parameters cons
   segmentation_.setMaxIterations(MAX_ITERATIONS); // value recognized by Irem
   segmentation_.setDistanceThreshold(DISTANCE_THRESHOLD);
   segmentation_.setAxis(Eigen::Vector3f(0.0, 0.0, 1.0));
-  segmentation_.setEpsAngle(0.26); // allowed deviation of surface normals from vertical axis: ~15 degrees
+  segmentation_.setEpsAngle(MAX_TILT); // allowed deviation of surface normals from vertical axis: ~15 degrees
+
+  if (surfFinderParameters.PARALLEL_RANSAC) {
+    typename ParallelPlaneSearch<PointT>::Parameters searchParameters;
+    searchParameters.MAX_ITERATIONS = MAX_ITERATIONS;
+    searchParameters.DISTANCE_THRESHOLD = DISTANCE_THRESHOLD;
+    searchParameters.MAX_TILT = MAX_TILT;
+    searchParameters.THREADS = surfFinderParameters.PARALLEL_THREADS;
+    searchParameters.SEED = surfFinderParameters.PARALLEL_SEED;
+    searchParameters.BAND_HEIGHT = surfFinderParameters.BAND_HEIGHT;
+    searchParameters.MIN_BAND_POINTS = surfFinderParameters.MIN_BAND_POINTS;
+    searchParameters.CONFIDENCE = surfFinderParameters.RANSAC_CONFIDENCE;
+    parallelSearch_.reset(new ParallelPlaneSearch<PointT>(searchParameters));
+  }
+
+  // Parameter initialization of the organized plane segmentation
+  normalEstimation_.setNormalEstimationMethod(normalEstimation_.COVARIANCE_MATRIX);
+  normalEstimation_.setNormalSmoothingSize(surfFinderParameters.NORMAL_SMOOTHING_SIZE);
+  normalEstimation_.setMaxDepthChangeFactor(surfFinderParameters.MAX_DEPTH_CHANGE_FACTOR);
+  organizedSegmentation_.setMinInliers(surfFinderParameters.ORGANIZED_MIN_INLIERS);
+  organizedSegmentation_.setAngularThreshold(surfFinderParameters.ORGANIZED_ANGULAR_THRESHOLD * M_PI / 180.0);
+  organizedSegmentation_.setDistanceThreshold(DISTANCE_THRESHOLD);
 }
 
 
@@ -142,14 +292,12 @@ double SurfaceFinder<PointT>::getAngle(
 
 template<class PointT>
 void SurfaceFinder<PointT>::classify(
-    PointCloudPtr const& cloud_planar_surface,
-    const pcl::ModelCoefficients& coeffs,
-    std::vector<PointCloudPtr>& planes,
-    std::vector<pcl::ModelCoefficients>& planeCoefficients) {
+    std::vector<int> const& inliers,
+    const pcl::ModelCoefficients& coeffs) {
 
-  int size = planeCoefficients.size();
+  int size = foundCoefficients_.size();
   for (int i = 0; i < size; i++) {
-    double angle = getAngle(coeffs, planeCoefficients.at(i));
+    double angle = getAngle(coeffs, foundCoefficients_.at(i));
     // ax + by + cz + d = 0
     // two planes belong to the same surface if the angle of the normal vector
     // to the groud is roughly the same and if their 'height' (intersectionf of plane with z-axis)
@@ -157,19 +305,37 @@ void SurfaceFinder<PointT>::classify(
     // i.e. by z = -d/c
     if ((angle < DEVIATION_ANGLE || angle > 180 - DEVIATION_ANGLE) &&
         (std::abs(coeffs.values[3] / coeffs.values[2] -
-                  planeCoefficients.at(i).values[3] / planeCoefficients.at(i).values[2]) < 0.01)) {
-      *planes.at(i) += *cloud_planar_surface;
+                  foundCoefficients_.at(i).values[3] / foundCoefficients_.at(i).values[2]) < 0.01)) {
+      std::vector<int>& merged = foundIndices_.at(i).indices;
+      merged.insert(merged.end(), inliers.begin(), inliers.end());
       return;
     }
   }
-  planes.push_back(cloud_planar_surface);
-  planeCoefficients.push_back(coeffs);
+  foundIndices_.push_back(pcl::PointIndices());
+  foundIndices_.back().indices = inliers;
+  foundCoefficients_.push_back(coeffs);
+}
+
+
+template<class PointT>
+void SurfaceFinder<PointT>::emitPlanes(
+    PointCloudConstPtr const& cloud,
+    std::vector<PointCloudPtr>& planes,
+    std::vector<pcl::ModelCoefficients>& planeCoefficients) {
+  for (size_t i = 0; i < foundIndices_.size(); ++i) {
+    PointCloudPtr plane(new PointCloudT());
+    pcl::copyPointCloud(*cloud, foundIndices_[i], *plane);
+    // only the plane's points are copied; all of them are finite
+    plane->is_dense = true;
+    planes.push_back(plane);
+    planeCoefficients.push_back(foundCoefficients_[i]);
+  }
 }
 
 
 template<class PointT>
 void SurfaceFinder<PointT>::findPlanes(
-    PointCloudPtr& cloud_filtered,
+    PointCloudConstPtr const& cloud,
     std::vector<PointCloudPtr>& planes,
     std::vector<pcl::ModelCoefficients>& planeCoefficients) {
 
@@ -177,86 +343,76 @@ void SurfaceFinder<PointT>::findPlanes(
   tracepoint(lepp3_trace_provider, ransac_start);
 #endif
 
+  ScopedStageTimer stageTimer(Stage::Ransac);
   HiResTimer timer;
   timer.start();
-  // Instance that will be used to perform the elimination of unwanted points
-  // from the point cloud.
-  pcl::ExtractIndices<PointT> extract;
+  foundIndices_.clear();
+  foundCoefficients_.clear();
 
   // Will hold the indices of the next extracted plane within the loop
-  pcl::PointIndices::Ptr currentPlaneIndices(new pcl::PointIndices);
+  pcl::PointIndices currentPlaneIndices;
+
+  // The input cloud is never copied while the planes are extracted: RANSAC
+  // searches the indices of the points that are not part of a plane yet, and
+  // the points of each plane are copied out once, at the end.
+  std::vector<int>& remaining = *remainingIndices_;
+  claimed_.assign(cloud->size(), 0);
 
   // Remove planes until we reach x % of the original number of points
-  const size_t pointThreshold = MIN_FILTER_PERCENTAGE * cloud_filtered->size();
-
-  /************ TRICK RANSAC HERE ************Comment out with previous plane coeff variable above for trial********/
-  if (EXPERIMENTAL_ENABLE_SURFACE_REUSE)
-  { 
-      std::cout << "Tricking RANSAC, original size: " << cloud_filtered->points.size() << std::endl;
-      std::cout << "Previous Coeffs: " << previous_plane_coeffs.size() << std::endl;
-      for (size_t i = 0; i < previous_plane_coeffs.size(); i++)
-      {
-        PointCloudPtr currentPlane(new PointCloudT());
-        // PointCloudPtr plane_points (new pcl::PointCloud<PointT>);
-        pcl::PointIndices::Ptr plane_indices(new pcl::PointIndices);
-        pcl::ModelOutlierRemoval<PointT> plane_filter(true);
-        plane_filter.setModelCoefficients (previous_plane_coeffs[i]);
-        plane_filter.setThreshold (0.04);
-        plane_filter.setModelType (pcl::SACMODEL_PLANE);
-        plane_filter.setInputCloud (cloud_filtered);
-        plane_filter.filter (plane_indices->indices);
-
-        if (plane_indices->indices.size() < 1000)
-          continue;
-
-        std::cout << "Plane " << i << ": " << plane_indices->indices.size() << " inliers" << std::endl;
-
-        pcl::ExtractIndices<PointT> extract;
-        extract.setIndices(plane_indices);
-        extract.setInputCloud(cloud_filtered);
-        extract.setNegative(false);
-        extract.filter(*currentPlane);
-
-        extract.setNegative(true);
-        extract.filter(*cloud_filtered);
-
-        classify(currentPlane, previous_plane_coeffs[i], planes, planeCoefficients);
-      }
-      std::cout << "Tricking RANSAC, filtered size: " << cloud_filtered->points.size() << "/" << pointThreshold << std::endl;
+  const size_t pointThreshold = MIN_FILTER_PERCENTAGE * cloud->size();
+
+  // Planes that were found in the previous frame are looked for first, so
+  // that RANSAC only needs to search the points that are left.
+  if (TRACK_PLANES && !previous_plane_coeffs.empty()
+      && (REDETECT_INTERVAL <= 0 || framesSinceDetection_ + 1 < REDETECT_INTERVAL)) {
+    ++framesSinceDetection_;
+    trackPlanes(cloud);
+  } else {
+    framesSinceDetection_ = 0;
+    previous_plane_coeffs.clear();
+    remaining.resize(cloud->size());
+    std::iota(remaining.begin(), remaining.end(), 0);
   }
-  previous_plane_coeffs.clear(); 
-  
-  //******************TRICK RANSAC**************************/
-
-  bool first = true;
-  while (cloud_filtered->size() > pointThreshold) {
-    // Try to obtain the next plane...
-    pcl::ModelCoefficients currentPlaneCoefficients;
-    segmentation_.setInputCloud(cloud_filtered);
-    segmentation_.segment(*currentPlaneIndices, currentPlaneCoefficients);
-
-    // We didn't get any plane in this run. Therefore, there are no more planes
-    // to be removed from the cloud.
-    if (currentPlaneIndices->indices.size() == 0)
-      break;
-
-    // Cloud that holds a plane in each iteration, to be added to the total cloud.
-    PointCloudPtr currentPlane(new PointCloudT());
-
-    // Add the planar inliers to the cloud holding the surfaces
-    extract.setInputCloud(cloud_filtered);
-    extract.setIndices(currentPlaneIndices);
-    extract.setNegative(false);
-    extract.filter(*currentPlane);
-
-    // ... and remove those inliers from the input cloud
-    extract.setNegative(true);
-    extract.filter(*cloud_filtered);
-
-    //Classify the Cloud
-    classify(currentPlane, currentPlaneCoefficients, planes, planeCoefficients);
-    previous_plane_coeffs.push_back(currentPlaneCoefficients);
+
+  if (parallelSearch_) {
+    // Every search finds up to one plane per band of heights.
+    while (remaining.size() > pointThreshold) {
+      parallelSearch_->find(*cloud, remaining, parallelPlanes_);
+      if (parallelPlanes_.empty())
+        break;
+      for (size_t i = 0; i < parallelPlanes_.size(); ++i) {
+        std::vector<int> const& inliers = parallelPlanes_[i].inliers;
+        for (int j : inliers)
+          claimed_[j] = 1;
+        classify(inliers, parallelPlanes_[i].coefficients);
+        previous_plane_coeffs.push_back(parallelPlanes_[i].coefficients);
+      }
+      removeClaimed();
+    }
+  } else {
+    segmentation_.setInputCloud(cloud);
+    while (remaining.size() > pointThreshold) {
+      // Try to obtain the next plane...
+      pcl::ModelCoefficients currentPlaneCoefficients;
+      segmentation_.setIndices(remainingIndices_);
+      segmentation_.segment(currentPlaneIndices, currentPlaneCoefficients);
+
+      // We didn't get any plane in this run. Therefore, there are no more planes
+      // to be removed from the cloud.
+      if (currentPlaneIndices.indices.size() == 0)
+        break;
+
+      // The inliers are indices into the input cloud.
+      for (int i : currentPlaneIndices.indices)
+        claimed_[i] = 1;
+      removeClaimed();
+
+      //Classify the Cloud
+      classify(currentPlaneIndices.indices, currentPlaneCoefficients);
+      previous_plane_coeffs.push_back(currentPlaneCoefficients);
+    }
   }
+  emitPlanes(cloud, planes, planeCoefficients);
   timer.stop();
   std::cout << "Finding planes took " << timer.duration() << " ms." << std::endl;
 
@@ -266,6 +422,160 @@ void SurfaceFinder<PointT>::findPlanes(
 }
 
 
+template<class PointT>
+void SurfaceFinder<PointT>::removeClaimed() {
+  std::vector<int>& remaining = *remainingIndices_;
+  remaining.erase(
+      std::remove_if(remaining.begin(), remaining.end(),
+                     [this](int i) { return claimed_[i] != 0; }),
+      remaining.end());
+}
+
+
+template<class PointT>
+void SurfaceFinder<PointT>::trackPlanes(PointCloudConstPtr const& cloud) {
+  size_t const count = previous_plane_coeffs.size();
+  trackedIndices_.resize(count);
+  for (size_t k = 0; k < count; ++k)
+    trackedIndices_[k].indices.clear();
+  std::vector<int>& remaining = *remainingIndices_;
+  remaining.clear();
+
+  // A single pass assigns every point to the closest of the planes it lies
+  // on. The clouds are in world coordinates, so the planes of the previous
+  // frame stay where they were while the robot moves.
+  float const threshold = DISTANCE_THRESHOLD;
+  for (size_t i = 0; i < cloud->size(); ++i) {
+    PointT const& p = cloud->points[i];
+    int closest = -1;
+    float closestDistance = threshold;
+    for (size_t k = 0; k < count; ++k) {
+      std::vector<float> const& c = previous_plane_coeffs[k].values;
+      float const distance = std::abs(c[0] * p.x + c[1] * p.y + c[2] * p.z + c[3]);
+      if (distance < closestDistance) {
+        closest = k;
+        closestDistance = distance;
+      }
+    }
+    if (closest < 0)
+      remaining.push_back(i);
+    else
+      trackedIndices_[closest].indices.push_back(i);
+  }
+
+  std::vector<pcl::ModelCoefficients> tracked;
+  bool lost = false;
+  double const minVertical = std::cos(MAX_TILT);
+  for (size_t k = 0; k < count; ++k) {
+    std::vector<int> const& inliers = trackedIndices_[k].indices;
+    bool found = inliers.size() >= TRACKING_MIN_INLIERS;
+
+    Eigen::Vector3f normal;
+    Eigen::Vector4f centroid;
+    if (found) {
+      // The normal of the least-squares plane through the inliers is the
+      // direction in which they vary the least.
+      Eigen::Matrix3f covariance;
+      pcl::computeMeanAndCovarianceMatrix(*cloud, inliers, covariance, centroid);
+      float eigenValue;
+      pcl::eigen33(covariance, eigenValue, normal);
+      std::vector<float> const& previous = previous_plane_coeffs[k].values;
+      if (normal.dot(Eigen::Vector3f(previous[0], previous[1], previous[2])) < 0)
+        normal = -normal;
+      found = std::abs(normal[2]) >= minVertical;
+    }
+    if (!found) {
+      // RANSAC gets to look at the points of a lost plane again.
+      remaining.insert(remaining.end(), inliers.begin(), inliers.end());
+      lost = true;
+      continue;
+    }
+
+    pcl::ModelCoefficients coeffs;
+    coeffs.values.resize(4);
+    coeffs.values[0] = normal[0];
+    coeffs.values[1] = normal[1];
+    coeffs.values[2] = normal[2];
+    coeffs.values[3] = -normal.dot(centroid.head<3>());
+
+    classify(inliers, coeffs);
+    tracked.push_back(coeffs);
+  }
+  previous_plane_coeffs.swap(tracked);
+
+  if (lost)
+    std::sort(remaining.begin(), remaining.end());
+}
+
+template<class PointT>
+void SurfaceFinder<PointT>::findPlanesOrganized(
+    PointCloudConstPtr const& cloud,
+    std::vector<PointCloudPtr>& planes,
+    std::vector<pcl::ModelCoefficients>& planeCoefficients) {
+  ScopedStageTimer stageTimer(Stage::Ransac);
+  foundIndices_.clear();
+  foundCoefficients_.clear();
+
+  // The points are in world coordinates, in which the ground lies at z = 0;
+  // they are moved into the frame of the sensor, whose pose the cloud holds.
+  Eigen::Matrix3f const rotation = cloud->sensor_orientation_.toRotationMatrix();
+  Eigen::Vector3f const origin = cloud->sensor_origin_.head<3>();
+  Eigen::Matrix3f const toSensor = rotation.transpose();
+  PointCloudT& sensor = *sensorCloud_;
+  sensor.points.resize(cloud->size());
+  sensor.width = cloud->width;
+  sensor.height = cloud->height;
+  sensor.is_dense = false;
+  for (size_t i = 0; i < cloud->size(); ++i) {
+    PointT const& p = cloud->points[i];
+    PointT& q = sensor.points[i];
+    q = p;
+    // removed points stay NaN
+    if (pcl_isfinite(p.x))
+      q.getVector3fMap() = toSensor * (p.getVector3fMap() - origin);
+  }
+
+  normalEstimation_.setInputCloud(sensorCloud_);
+  normalEstimation_.compute(*normals_);
+
+  regionCoefficients_.clear();
+  regionIndices_.clear();
+  organizedSegmentation_.setInputNormals(normals_);
+  organizedSegmentation_.setInputCloud(sensorCloud_);
+  organizedSegmentation_.segment(regionCoefficients_, regionIndices_);
+
+  double const minVertical = std::cos(MAX_TILT);
+  for (size_t i = 0; i < regionCoefficients_.size(); ++i) {
+    std::vector<float> const& values = regionCoefficients_[i].values;
+    float const norm = Eigen::Vector3f(values[0], values[1], values[2]).norm();
+    if (!(norm > 0))
+      continue;
+    // n . (R^T (p - origin)) + d = 0 is (R n) . p + d - (R n) . origin = 0
+    Eigen::Vector3f normal = rotation * Eigen::Vector3f(values[0], values[1], values[2]) / norm;
+    float offset = values[3] / norm - normal.dot(origin);
+    // the same restriction as the RANSAC model's: only planes perpendicular
+    // to gravity are surfaces
+    if (std::abs(normal[2]) < minVertical)
+      continue;
+    // all surfaces are reported with their normals pointing up
+    if (normal[2] < 0) {
+      normal = -normal;
+      offset = -offset;
+    }
+
+    pcl::ModelCoefficients coeffs;
+    coeffs.values.resize(4);
+    coeffs.values[0] = normal[0];
+    coeffs.values[1] = normal[1];
+    coeffs.values[2] = normal[2];
+    coeffs.values[3] = offset;
+
+    // the indices are the same in both frames
+    classify(regionIndices_[i].indices, coeffs);
+  }
+  emitPlanes(cloud, planes, planeCoefficients);
+}
+
 template<class PointT>
 void SurfaceFinder<PointT>::removeNonGroundCoefficients(
     std::vector<PointCloudPtr>& planes,
@@ -298,11 +608,15 @@ void SurfaceFinder<PointT>::removeNonGroundCoefficients(
 
 template<class PointT>
 void SurfaceFinder<PointT>::findSurfaces(
-    PointCloudPtr cloud,
+    PointCloudConstPtr cloud,
     std::vector<PointCloudPtr>& planes,
-    std::vector<pcl::ModelCoefficients>& planeCoefficients) {
+    std::vector<pcl::ModelCoefficients>& planeCoefficients,
+    PointCloudConstPtr organized) {
   // extract those planes that are considered as surfaces and put them in cloud_surfaces_
-  findPlanes(cloud, planes, planeCoefficients);
+  if (ORGANIZED && organized && organized->isOrganized())
+    findPlanesOrganized(organized, planes, planeCoefficients);
+  else
+    findPlanes(cloud, planes, planeCoefficients);
 
   if (!surfaceDetectorActive)
     // remove all coefficients from planeCoefficients except for the ground coefficients
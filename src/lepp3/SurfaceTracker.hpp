@@ -3,6 +3,7 @@
 
 #include "lepp3/SurfaceData.hpp"
 #include "lepp3/Typedefs.hpp"
+#include "lepp3/util/Metrics.hpp"
 #include <pcl/surface/concave_hull.h>
 #include <pcl/surface/convex_hull.h>
 
@@ -27,10 +28,11 @@ public:
 	 * Create a new `BlendVisitor` will update the given surface in the argument using the class parameters.
 	 */
 	BlendVisitors(model_id_t id, mesh_handle_t mh, int colorID, Coordinate translation_vec, PointCloudConstPtr hull, 
-		pcl::ModelCoefficients oldCoefficients) :
+		LocalHullConstPtr localHull, pcl::ModelCoefficients oldCoefficients) :
 			id(id), mh(mh), colorID(colorID),
 			translation_vec(translation_vec), 
 			hull(hull), 
+			localHull(localHull),
 			oldCoefficients(oldCoefficients) {
 	}
 	void visitSurface(SurfaceModel &newPlane)
@@ -48,7 +50,7 @@ public:
 		newPlane.translateCenterPoint(translation_vec);
 
 		// set convex hull to old convex hull (this is used by the convex hull detector later on)
-		newPlane.set_hull(hull);
+		newPlane.set_hull(hull, localHull);
 
 		// Take average of old and new model coefficients
 		pcl::ModelCoefficients mergeCoefficients (newPlane.get_planeCoefficients());
@@ -63,6 +65,7 @@ private:
 	mesh_handle_t mh;
 	Coordinate const translation_vec;
 	PointCloudConstPtr hull;
+	LocalHullConstPtr localHull;
 	pcl::ModelCoefficients oldCoefficients;
 };
 
@@ -391,7 +394,8 @@ void SurfaceTracker<PointT>::adaptTracked(
 
 		// Blend the old surface into the new one
 		BlendVisitors blender(oldSurfaceModel->id(), oldSurfaceModel->get_meshHandle(), oldSurfaceModel->get_colorID(),
-			translation_vec, oldSurfaceModel->get_hull(), oldSurfaceModel->get_planeCoefficients());
+			translation_vec, oldSurfaceModel->get_hull(), oldSurfaceModel->get_localHull(),
+			oldSurfaceModel->get_planeCoefficients());
 		tracked_models_[model_id]->accept(blender);
 	}
 }
@@ -507,6 +511,7 @@ void SurfaceTracker<PointT>::updateSurfaces(SurfaceDataPtr surfaceData)
 #ifdef LEPP3_ENABLE_TRACING
     tracepoint(lepp3_trace_provider, surface_tracker_update_start);
 #endif
+	MetricsClock::time_point const start = MetricsClock::now();
 	std::map<int, size_t> correspondence = matchToPrevious(surfaceData->surfaces);
     updateLostAndFound(correspondence);
 	adaptTracked(correspondence, surfaceData->surfaces);
@@ -516,6 +521,7 @@ void SurfaceTracker<PointT>::updateSurfaces(SurfaceDataPtr surfaceData)
     // copy materialized models
     std::vector<SurfaceModelPtr> materializedModelsCopy(materialized_models_.begin(), materialized_models_.end());
     surfaceData->surfaces = materializedModelsCopy;
+	PipelineMetrics::instance().record(Stage::SurfaceTracking, MetricsClock::now() - start);
 
 	notifyObservers(surfaceData);
 #ifdef LEPP3_ENABLE_TRACING
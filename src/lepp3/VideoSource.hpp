@@ -47,6 +47,12 @@ public:
    */
   virtual void setOptions(const std::map<std::string, bool>& options) = 0;
 
+  /**
+   * Returns true once a source replaying a finite recording has published
+   * all of its frames. Live sources never finish.
+   */
+  virtual bool finished() const { return false; }
+
 protected:
   /**
    * Convenience method for subclasses to indicate that a new cloud has been
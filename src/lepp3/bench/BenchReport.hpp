@@ -0,0 +1,187 @@
+#ifndef LEPP3_BENCH_BENCH_REPORT_H__
+#define LEPP3_BENCH_BENCH_REPORT_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace lepp {
+namespace bench {
+
+/**
+ * Collects the latencies of repeated runs of one benchmark case and
+ * summarizes them.
+ */
+class LatencySamples {
+public:
+  LatencySamples() : items_(0) {}
+
+  /**
+   * Records one run that took `ms` milliseconds and processed `items` items
+   * (e.g. points or obstacles).
+   */
+  void add(double ms, size_t items = 0) {
+    samples_.push_back(ms);
+    items_ += items;
+  }
+
+  size_t count() const { return samples_.size(); }
+
+  /**
+   * Returns the p-th percentile (0 <= p <= 100) using linear interpolation
+   * between the closest ranks.
+   */
+  double percentile(double p) const {
+    if (samples_.empty())
+      return 0;
+    std::vector<double> sorted(samples_);
+    std::sort(sorted.begin(), sorted.end());
+    double const rank = p / 100.0 * (sorted.size() - 1);
+    size_t const lo = static_cast<size_t>(std::floor(rank));
+    size_t const hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (rank - lo) * (sorted[hi] - sorted[lo]);
+  }
+
+  double mean() const {
+    double sum = 0;
+    for (double s : samples_) sum += s;
+    return samples_.empty() ? 0 : sum / samples_.size();
+  }
+
+  double total() const {
+    double sum = 0;
+    for (double s : samples_) sum += s;
+    return sum;
+  }
+
+  size_t items() const { return items_; }
+
+private:
+  std::vector<double> samples_;
+  size_t items_;
+};
+
+/**
+ * Measures the wall time of `fn` in milliseconds.
+ */
+template<class Fn>
+double timeMs(Fn&& fn) {
+  typedef std::chrono::steady_clock clock;
+  clock::time_point const start = clock::now();
+  fn();
+  return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+}
+
+/**
+ * The results of a benchmark run, serializable to JSON.
+ *
+ * Every case is identified by a stage name and a variant (e.g. the filter
+ * combination), and reports latency percentiles in milliseconds and the
+ * throughput in runs and items per second.
+ */
+class BenchReport {
+public:
+  /**
+   * Adds a piece of free-form metadata (scene, seed, ...) to the report.
+   */
+  void setMeta(std::string const& key, std::string const& value) {
+    meta_[key] = "\"" + escape(value) + "\"";
+  }
+
+  void setMeta(std::string const& key, double value) {
+    std::ostringstream ss;
+    writeNumber(ss, value);
+    meta_[key] = ss.str();
+  }
+
+  /**
+   * Adds the summary of a case. `extra` holds additional numeric results,
+   * such as accuracy figures.
+   */
+  void addCase(std::string const& stage, std::string const& variant, LatencySamples const& samples,
+               std::map<std::string, double> const& extra = std::map<std::string, double>()) {
+    Case c;
+    c.stage = stage;
+    c.variant = variant;
+    c.samples = samples;
+    c.extra = extra;
+    cases_.push_back(c);
+  }
+
+  void writeJson(std::ostream& out) const {
+    out << "{\n  \"meta\": {";
+    bool first = true;
+    for (auto const& m : meta_) {
+      out << (first ? "\n" : ",\n") << "    \"" << escape(m.first) << "\": " << m.second;
+      first = false;
+    }
+    out << "\n  },\n  \"cases\": [";
+    for (size_t i = 0; i < cases_.size(); ++i) {
+      Case const& c = cases_[i];
+      double const seconds = c.samples.total() / 1000.0;
+      out << (i == 0 ? "\n" : ",\n")
+          << "    {\"stage\": \"" << escape(c.stage) << "\""
+          << ", \"variant\": \"" << escape(c.variant) << "\""
+          << ", \"runs\": " << c.samples.count();
+      writeField(out, "mean_ms", c.samples.mean());
+      writeField(out, "p50_ms", c.samples.percentile(50));
+      writeField(out, "p90_ms", c.samples.percentile(90));
+      writeField(out, "p99_ms", c.samples.percentile(99));
+      writeField(out, "max_ms", c.samples.percentile(100));
+      writeField(out, "runs_per_s", seconds > 0 ? c.samples.count() / seconds : 0);
+      writeField(out, "items_per_s", seconds > 0 ? c.samples.items() / seconds : 0);
+      for (auto const& e : c.extra) {
+        writeField(out, e.first, e.second);
+      }
+      out << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+private:
+  struct Case {
+    std::string stage;
+    std::string variant;
+    LatencySamples samples;
+    std::map<std::string, double> extra;
+  };
+
+  /**
+   * Writes a number as a JSON value. NaN and infinity have no JSON
+   * representation, so they are written as `null`.
+   */
+  static void writeNumber(std::ostream& out, double value) {
+    if (std::isfinite(value)) {
+      out << value;
+    } else {
+      out << "null";
+    }
+  }
+
+  static void writeField(std::ostream& out, std::string const& key, double value) {
+    out << ", \"" << escape(key) << "\": ";
+    writeNumber(out, value);
+  }
+
+  static std::string escape(std::string const& s) {
+    std::string r;
+    for (char c : s) {
+      if (c == '"' || c == '\\') r += '\\';
+      r += c;
+    }
+    return r;
+  }
+
+  std::map<std::string, std::string> meta_;
+  std::vector<Case> cases_;
+};
+
+}  // namespace bench
+}  // namespace lepp
+
+#endif
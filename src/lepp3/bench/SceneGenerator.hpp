@@ -0,0 +1,291 @@
+#ifndef LEPP3_BENCH_SCENE_GENERATOR_H__
+#define LEPP3_BENCH_SCENE_GENERATOR_H__
+
+#include "lepp3/Typedefs.hpp"
+#include "lepp3/models/LolaKinematics.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace lepp {
+namespace bench {
+
+/**
+ * Parameters that control how the primitives of a synthetic scene are turned
+ * into a point cloud.
+ */
+struct SceneParameters {
+  // seed of the random number generator; equal seeds give equal clouds
+  unsigned seed = 42;
+  // number of samples per square meter of surface
+  double density = 2500.0;
+  // standard deviation of the gaussian noise added to every coordinate [m]
+  double noise = 0.002;
+  // fraction of the points that are replaced by NaN points
+  double nanFraction = 0.0;
+  // if true, the cloud is rendered into a width x height grid as seen by the
+  // virtual camera, otherwise all samples are returned as an unordered cloud
+  bool organized = false;
+  int width = 640;
+  int height = 480;
+};
+
+/**
+ * Procedurally generates point clouds of simple scenes for benchmarking.
+ *
+ * The scene is described in the LOLA world frame (z pointing up) by adding
+ * primitives (planes, stairs, boxes, cylinders and spheres), whose surfaces
+ * are sampled uniformly. A virtual pinhole camera, placed at a typical robot
+ * head height and looking along the x-axis, is used to render organized
+ * clouds and to express clouds in camera coordinates, so that the point
+ * filters can be exercised with realistic input.
+ */
+class SceneGenerator {
+public:
+  SceneGenerator(SceneParameters const& params)
+      : params_(params), rng_(params.seed) {
+    // camera 1.2m above the ground, looking along x and pitched 30deg down
+    double const pitch = 30.0 * M_PI / 180.0;
+    camera_position_ = Eigen::Vector3f(0, 0, 1.2);
+    // rows are the camera axes (right, down, forward) in world coordinates
+    camera_rotation_.row(0) = Eigen::Vector3f(0, -1, 0);
+    camera_rotation_.row(1) = Eigen::Vector3f(-std::sin(pitch), 0, -std::cos(pitch));
+    camera_rotation_.row(2) = Eigen::Vector3f(std::cos(pitch), 0, -std::sin(pitch));
+  }
+
+  /**
+   * Adds a horizontal rectangle at the given height.
+   */
+  void addGroundPlane(float xmin, float xmax, float ymin, float ymax, float z = 0) {
+    sampleRectangle(Eigen::Vector3f(xmin, ymin, z),
+                    Eigen::Vector3f(xmax - xmin, 0, 0),
+                    Eigen::Vector3f(0, ymax - ymin, 0));
+  }
+
+  /**
+   * Adds a staircase ascending along the x-axis, starting at `origin` (the
+   * front bottom center of the first step).
+   */
+  void addStairs(Eigen::Vector3f const& origin, int steps, float rise, float run, float width) {
+    for (int i = 0; i < steps; ++i) {
+      Eigen::Vector3f const corner = origin + Eigen::Vector3f(i * run, -width / 2, i * rise);
+      // riser
+      sampleRectangle(corner, Eigen::Vector3f(0, width, 0), Eigen::Vector3f(0, 0, rise));
+      // tread
+      sampleRectangle(corner + Eigen::Vector3f(0, 0, rise),
+                      Eigen::Vector3f(run, 0, 0), Eigen::Vector3f(0, width, 0));
+    }
+  }
+
+  /**
+   * Adds an axis-aligned box with the given center and edge lengths.
+   */
+  void addBox(Eigen::Vector3f const& center, Eigen::Vector3f const& size) {
+    Eigen::Vector3f const lo = center - size / 2;
+    Eigen::Vector3f const ex(size.x(), 0, 0), ey(0, size.y(), 0), ez(0, 0, size.z());
+    sampleRectangle(lo, ex, ey);
+    sampleRectangle(lo + ez, ex, ey);
+    sampleRectangle(lo, ex, ez);
+    sampleRectangle(lo + ey, ex, ez);
+    sampleRectangle(lo, ey, ez);
+    sampleRectangle(lo + ex, ey, ez);
+  }
+
+  /**
+   * Adds the mantle and top of an upright cylinder standing on `base`.
+   */
+  void addCylinder(Eigen::Vector3f const& base, float radius, float height) {
+    std::uniform_real_distribution<float> unit(0, 1);
+    size_t const mantle = samples(2 * M_PI * radius * height);
+    for (size_t i = 0; i < mantle; ++i) {
+      float const phi = 2 * M_PI * unit(rng_);
+      points_.push_back(base + Eigen::Vector3f(radius * std::cos(phi), radius * std::sin(phi), height * unit(rng_)));
+    }
+    size_t const top = samples(M_PI * radius * radius);
+    for (size_t i = 0; i < top; ++i) {
+      float const phi = 2 * M_PI * unit(rng_);
+      float const r = radius * std::sqrt(unit(rng_));
+      points_.push_back(base + Eigen::Vector3f(r * std::cos(phi), r * std::sin(phi), height));
+    }
+  }
+
+  /**
+   * Adds a sphere.
+   */
+  void addSphere(Eigen::Vector3f const& center, float radius) {
+    std::normal_distribution<float> normal(0, 1);
+    size_t const n = samples(4 * M_PI * radius * radius);
+    for (size_t i = 0; i < n; ++i) {
+      Eigen::Vector3f dir(normal(rng_), normal(rng_), normal(rng_));
+      points_.push_back(center + radius * dir.normalized());
+    }
+  }
+
+  /**
+   * Builds the cloud of the current scene in world coordinates, with noise
+   * and NaN points applied. An organized cloud also holds the pose of the
+   * camera.
+   */
+  PointCloudPtr generate() {
+    PointCloudPtr cloud(new PointCloudT());
+    std::normal_distribution<float> noise(0, params_.noise);
+    std::uniform_real_distribution<double> unit(0, 1);
+    float const nan = std::numeric_limits<float>::quiet_NaN();
+
+    std::vector<Eigen::Vector3f> noisy;
+    noisy.reserve(points_.size());
+    for (Eigen::Vector3f const& p : points_) {
+      noisy.push_back(params_.noise > 0
+                      ? Eigen::Vector3f(p + Eigen::Vector3f(noise(rng_), noise(rng_), noise(rng_)))
+                      : p);
+    }
+
+    if (!params_.organized) {
+      cloud->reserve(noisy.size());
+      for (Eigen::Vector3f const& p : noisy) {
+        if (unit(rng_) < params_.nanFraction) {
+          cloud->push_back(PointT(nan, nan, nan));
+        } else {
+          cloud->push_back(PointT(p.x(), p.y(), p.z()));
+        }
+      }
+      cloud->width = cloud->size();
+      cloud->height = 1;
+      cloud->is_dense = params_.nanFraction <= 0;
+      return cloud;
+    }
+
+    // z-buffer render into the camera image; empty pixels stay NaN
+    int const w = params_.width, h = params_.height;
+    double const f = 525.0 * w / 640.0;
+    std::vector<float> depth(w * h, std::numeric_limits<float>::infinity());
+    cloud->points.assign(w * h, PointT(nan, nan, nan));
+    for (Eigen::Vector3f const& p : noisy) {
+      Eigen::Vector3f const c = camera_rotation_ * (p - camera_position_);
+      if (c.z() <= 0.1f)
+        continue;
+      int const u = static_cast<int>(std::floor(f * c.x() / c.z() + (w - 1) / 2.0 + 0.5));
+      int const v = static_cast<int>(std::floor(f * c.y() / c.z() + (h - 1) / 2.0 + 0.5));
+      if (u < 0 || u >= w || v < 0 || v >= h)
+        continue;
+      int const idx = v * w + u;
+      if (c.z() < depth[idx]) {
+        depth[idx] = c.z();
+        cloud->points[idx] = PointT(p.x(), p.y(), p.z());
+      }
+    }
+    for (PointT& pt : cloud->points) {
+      if (unit(rng_) < params_.nanFraction)
+        pt = PointT(nan, nan, nan);
+    }
+    cloud->width = w;
+    cloud->height = h;
+    cloud->is_dense = false;
+    // the pose of the camera, as the FilteredVideoSource records it
+    cloud->sensor_origin_ << camera_position_, 0;
+    cloud->sensor_orientation_ = Eigen::Quaternionf(Eigen::Matrix3f(camera_rotation_.transpose()));
+    return cloud;
+  }
+
+  /**
+   * Returns a copy of the given world frame cloud in the coordinate system of
+   * the virtual camera, i.e. what the point filters receive from the sensor.
+   */
+  PointCloudPtr toCameraFrame(PointCloudT const& world) const {
+    PointCloudPtr cloud(new PointCloudT(world));
+    for (PointT& pt : cloud->points) {
+      Eigen::Vector3f const c = camera_rotation_ * (pt.getVector3fMap() - camera_position_);
+      pt.x = c.x();
+      pt.y = c.y();
+      pt.z = c.z();
+    }
+    cloud->sensor_origin_ = Eigen::Vector4f::Zero();
+    cloud->sensor_orientation_ = Eigen::Quaternionf::Identity();
+    return cloud;
+  }
+
+  /**
+   * Returns kinematics for which the `RobotOdoTransformer` maps camera frame
+   * points back into the world frame of the scene.
+   */
+  LolaKinematicsParams cameraKinematics() const {
+    LolaKinematicsParams params = LolaKinematicsParams();
+    for (int i = 0; i < 3; ++i) {
+      params.t_wr_cl[i] = camera_position_[i];
+      params.t_stance_odo[i] = 0;
+      for (int j = 0; j < 3; ++j) {
+        params.R_wr_cl[i][j] = camera_rotation_(i, j);
+      }
+    }
+    params.phi_z_odo = 0;
+    return params;
+  }
+
+  /**
+   * Number of noise-free surface samples in the scene.
+   */
+  size_t size() const { return points_.size(); }
+
+private:
+  size_t samples(double area) const {
+    return static_cast<size_t>(area * params_.density);
+  }
+
+  /**
+   * Uniformly samples the parallelogram spanned by `u` and `v` at `origin`.
+   */
+  void sampleRectangle(Eigen::Vector3f const& origin, Eigen::Vector3f const& u, Eigen::Vector3f const& v) {
+    std::uniform_real_distribution<float> unit(0, 1);
+    size_t const n = samples(u.cross(v).norm());
+    for (size_t i = 0; i < n; ++i) {
+      points_.push_back(origin + unit(rng_) * u + unit(rng_) * v);
+    }
+  }
+
+  SceneParameters const params_;
+  std::mt19937 rng_;
+  std::vector<Eigen::Vector3f> points_;
+
+  Eigen::Vector3f camera_position_;
+  Eigen::Matrix3f camera_rotation_;
+};
+
+/**
+ * The scenes known to the benchmark, selected by name.
+ */
+inline bool buildScene(std::string const& name, SceneGenerator& gen) {
+  if (name == "ground") {
+    gen.addGroundPlane(0.3, 4.0, -1.5, 1.5);
+  } else if (name == "stairs") {
+    gen.addGroundPlane(0.3, 1.5, -1.5, 1.5);
+    gen.addStairs(Eigen::Vector3f(1.5, 0, 0), 6, 0.08, 0.3, 1.2);
+  } else if (name == "staircase") {
+    // a long flight of shallow steps: many planes for RANSAC to extract
+    gen.addGroundPlane(0.3, 1.0, -1.5, 1.5);
+    gen.addStairs(Eigen::Vector3f(1.0, 0, 0), 16, 0.05, 0.2, 1.6);
+  } else if (name == "obstacles") {
+    gen.addGroundPlane(0.3, 4.0, -1.5, 1.5);
+    gen.addBox(Eigen::Vector3f(1.6, 0.4, 0.15), Eigen::Vector3f(0.3, 0.3, 0.3));
+    gen.addCylinder(Eigen::Vector3f(2.0, -0.5, 0), 0.12, 0.5);
+    gen.addSphere(Eigen::Vector3f(2.5, 0.2, 0.2), 0.2);
+  } else if (name == "mixed") {
+    gen.addGroundPlane(0.3, 1.5, -1.5, 1.5);
+    gen.addStairs(Eigen::Vector3f(1.5, 0.6, 0), 4, 0.1, 0.3, 0.8);
+    gen.addBox(Eigen::Vector3f(1.2, -0.5, 0.1), Eigen::Vector3f(0.2, 0.4, 0.2));
+    gen.addCylinder(Eigen::Vector3f(2.2, -0.6, 0), 0.1, 0.6);
+    gen.addSphere(Eigen::Vector3f(0.9, 0.3, 0.15), 0.15);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace bench
+}  // namespace lepp
+
+#endif
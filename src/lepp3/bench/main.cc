@@ -0,0 +1,824 @@
+/**
+ * A program that benchmarks the stages of the perception pipeline on
+ * synthetic scenes, without requiring a camera or a robot.
+ *
+ * Every stage is run in isolation on the output of the previous stages and
+ * the whole (synchronous) chain is run end to end. The latency percentiles
+ * and the throughput of every case are written as JSON, so that results can
+ * be compared across commits.
+ */
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pcl/filters/filter.h>
+#include <pcl/surface/convex_hull.h>
+
+#include "lepp3/Typedefs.hpp"
+#include "lepp3/FrameData.hpp"
+#include "lepp3/SurfaceData.hpp"
+#include "lepp3/FilteredVideoSource.hpp"
+#include "lepp3/SurfaceFinder.hpp"
+#include "lepp3/PlaneInlierFinder.hpp"
+#include "lepp3/SurfaceClusterer.hpp"
+#include "lepp3/ConvexHullDetector.hpp"
+#include "lepp3/LowPassObstacleTracker.hpp"
+#include "lepp3/KalmanObstacleTracker.hpp"
+#include "lepp3/filter/point/SensorCalibrationFilter.hpp"
+#include "lepp3/filter/point/BackgroundFilter.hpp"
+#include "lepp3/filter/point/CropFilter.hpp"
+#include "lepp3/filter/point/GroundFilter.hpp"
+#include "lepp3/obstacles/segmenter/euclidean/EuclideanSegmenter.hpp"
+#include "lepp3/obstacles/segmenter/gmm/GmmSegmenter.hpp"
+#include "lepp3/obstacles/object_approximator/MomentOfInertiaApproximator.hpp"
+#include "lepp3/obstacles/object_approximator/split/SplitApproximator.hpp"
+#include "lepp3/obstacles/object_approximator/split/CompositeSplitStrategy.hpp"
+#include "lepp3/obstacles/object_approximator/split/SplitConditions.hpp"
+#include "lepp3/util/ConvexHull2D.h"
+#include "lepp3/util/Projection.h"
+#include "lola/CloudCodec.h"
+#include "lola/OdoCoordinateTransformer.hpp"
+
+#include "lepp3/bench/BenchReport.hpp"
+#include "lepp3/bench/SceneGenerator.hpp"
+
+#include "deps/easylogging++.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+using namespace lepp;
+using namespace lepp::bench;
+
+namespace {
+
+/**
+ * Command line options of the benchmark.
+ */
+struct Options {
+  std::string scene = "mixed";
+  std::string output;
+  std::set<std::string> stages;
+  int iterations = 50;
+  int warmup = 5;
+  bool help = false;
+  SceneParameters scene_params;
+};
+
+void PrintUsage() {
+  std::cout << "Usage:" << std::endl
+            << "\tlepp3_bench [options]" << std::endl
+            << "\t\t--scene <ground|stairs|staircase|obstacles|mixed>  scene to generate (default mixed)" << std::endl
+            << "\t\t--iterations <n>    measured runs per case (default 50)" << std::endl
+            << "\t\t--warmup <n>        unmeasured runs per case (default 5)" << std::endl
+            << "\t\t--seed <n>          random seed of the scene (default 42)" << std::endl
+            << "\t\t--density <pts/m2>  surface sampling density (default 2500)" << std::endl
+            << "\t\t--noise <m>         gaussian noise stddev (default 0.002)" << std::endl
+            << "\t\t--nan <fraction>    fraction of NaN points (default 0)" << std::endl
+            << "\t\t--organized         render an organized 640x480 cloud" << std::endl
+            << "\t\t--stages <a,b,...>  only run the given stages (default all):" << std::endl
+            << "\t\t                    filters, surface_finder, plane_inliers, surface_clusterer," << std::endl
+            << "\t\t                    convex_hull, euclidean, gmm, approximators, trackers, end_to_end," << std::endl
+            << "\t\t                    cloud_codec" << std::endl
+            << "\t\t--output <file>     write the JSON report to a file instead of stdout" << std::endl;
+}
+
+bool ParseOptions(int argc, char* argv[], Options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string const arg = argv[i];
+    bool const has_value = i + 1 < argc;
+    if (arg == "--help" || arg == "-h") {
+      opts.help = true;
+      return true;
+    } else if (arg == "--organized") {
+      opts.scene_params.organized = true;
+    } else if (arg == "--scene" && has_value) {
+      opts.scene = argv[++i];
+    } else if (arg == "--iterations" && has_value) {
+      opts.iterations = std::atoi(argv[++i]);
+    } else if (arg == "--warmup" && has_value) {
+      opts.warmup = std::atoi(argv[++i]);
+    } else if (arg == "--seed" && has_value) {
+      opts.scene_params.seed = static_cast<unsigned>(std::atoi(argv[++i]));
+    } else if (arg == "--density" && has_value) {
+      opts.scene_params.density = std::atof(argv[++i]);
+    } else if (arg == "--noise" && has_value) {
+      opts.scene_params.noise = std::atof(argv[++i]);
+    } else if (arg == "--nan" && has_value) {
+      opts.scene_params.nanFraction = std::atof(argv[++i]);
+    } else if (arg == "--output" && has_value) {
+      opts.output = argv[++i];
+    } else if (arg == "--stages" && has_value) {
+      std::istringstream ss(argv[++i]);
+      std::string stage;
+      while (std::getline(ss, stage, ',')) {
+        opts.stages.insert(stage);
+      }
+    } else {
+      return false;
+    }
+  }
+  return opts.iterations > 0 && opts.warmup >= 0;
+}
+
+/**
+ * An odometry transformer with fixed kinematics, standing in for the
+ * `RobotOdoTransformer`, which needs a live `PoseService`.
+ */
+class FixedOdoTransformer : public OdoCoordinateTransformer<PointT> {
+public:
+  FixedOdoTransformer(LolaKinematicsParams const& params) : params_(params) {}
+
+  virtual const char* name() const override { return "RobotOdoTransformer"; }
+
+protected:
+  LolaKinematicsParams getNextParams() override { return params_; }
+
+private:
+  LolaKinematicsParams const params_;
+};
+
+/**
+ * Remembers the last frame it was notified of.
+ */
+class FrameSink : public FrameDataObserver {
+public:
+  virtual void updateFrame(FrameDataPtr frameData) override { last = frameData; }
+  FrameDataPtr last;
+};
+
+/**
+ * Remembers the last surface data it was notified of.
+ */
+class SurfaceSink : public SurfaceDataObserver {
+public:
+  virtual void updateSurfaces(SurfaceDataPtr surfaceData) override { last = surfaceData; }
+  SurfaceDataPtr last;
+};
+
+/**
+ * Runs the `SurfaceFinder` synchronously on every frame, standing in for the
+ * asynchronous `SurfaceDetector` in the end-to-end chain.
+ */
+class SyncSurfaceFinder : public FrameDataObserver, public FrameDataSubject {
+public:
+  SyncSurfaceFinder(SurfaceFinder<PointT>::Parameters const& params)
+      : finder_(true, params), iteration_(0) {}
+
+  virtual void updateFrame(FrameDataPtr frameData) override {
+    std::vector<PointCloudPtr> planes;
+    finder_.findSurfaces(frameData->cloud, planes, frameData->planeCoefficients);
+    // the GMM segmenter waits for a couple of ransac iterations
+    iteration_ += 21;
+    frameData->planeCoeffsIteration = iteration_;
+    frameData->planeCoeffsReferenceFrameNum = frameData->frameNum;
+    notifyObservers(frameData);
+  }
+
+private:
+  SurfaceFinder<PointT> finder_;
+  long iteration_;
+};
+
+SurfaceFinder<PointT>::Parameters SurfaceFinderParameters() {
+  SurfaceFinder<PointT>::Parameters params;
+  params.MAX_ITERATIONS = 200;
+  params.DISTANCE_THRESHOLD = 0.03;
+  params.MIN_FILTER_PERCENTAGE = 0.08;
+  params.DEVIATION_ANGLE = 4.0;
+  return params;
+}
+
+GMM::SegmenterParameters GmmParameters(GMM::EmMode mode = GMM::EmMode::Points) {
+  GMM::SegmenterParameters params;
+  params.voxelGridResolution = 0.1f;
+  params.minPersistentFrames = 1;
+  params.emMode = mode;
+  params.emVoxelResolution = 0.02f;
+  return params;
+}
+
+boost::shared_ptr<ObjectApproximator> SplitApproximator() {
+  boost::shared_ptr<CompositeSplitStrategy> strategy(new CompositeSplitStrategy);
+  strategy->addSplitCondition(std::make_shared<DepthLimitSplitCondition>(1));
+  return boost::shared_ptr<ObjectApproximator>(new SplitObjectApproximator(
+      boost::shared_ptr<ObjectApproximator>(new MomentOfInertiaObjectApproximator), strategy));
+}
+
+/**
+ * Drives all benchmark cases on one generated scene.
+ */
+class Benchmark {
+public:
+  Benchmark(Options const& opts) : opts_(opts), generator_(opts.scene_params) {
+    if (!buildScene(opts.scene, generator_)) {
+      throw std::runtime_error("Unknown scene: " + opts.scene);
+    }
+    world_raw_ = generator_.generate();
+    camera_raw_ = generator_.toCameraFrame(*world_raw_);
+
+    // the later stages receive clouds without NaN points, as produced by the
+    // FilteredVideoSource
+    world_.reset(new PointCloudT());
+    std::vector<int> index;
+    pcl::removeNaNFromPointCloud(*world_raw_, *world_, index);
+
+    report_.setMeta("scene", opts.scene);
+    report_.setMeta("seed", opts.scene_params.seed);
+    report_.setMeta("density", opts.scene_params.density);
+    report_.setMeta("noise", opts.scene_params.noise);
+    report_.setMeta("nan_fraction", opts.scene_params.nanFraction);
+    report_.setMeta("organized", opts.scene_params.organized ? 1 : 0);
+    report_.setMeta("points", world_raw_->size());
+    report_.setMeta("finite_points", world_->size());
+    report_.setMeta("iterations", opts.iterations);
+  }
+
+  void run() {
+    // the stages depend on each others' output, so they always run in order
+    benchFilters();
+    benchSurfaceFinder();
+    benchPlaneInliers();
+    benchSurfaceClusterer();
+    benchConvexHull();
+    benchEuclidean();
+    benchGmm();
+    benchApproximators();
+    benchTrackers();
+    benchEndToEnd();
+    benchCloudCodec();
+  }
+
+  BenchReport const& report() const { return report_; }
+
+private:
+  bool enabled(std::string const& stage) const {
+    return opts_.stages.empty() || opts_.stages.count(stage) > 0;
+  }
+
+  /**
+   * Runs `fn` for the warm-up and the measured iterations, recording the
+   * latency of the measured ones.
+   */
+  template<class Fn>
+  LatencySamples measure(size_t items, Fn fn) {
+    LatencySamples samples;
+    for (int i = 0; i < opts_.warmup + opts_.iterations; ++i) {
+      double const ms = timeMs([&] { fn(i); });
+      if (i >= opts_.warmup)
+        samples.add(ms, items);
+    }
+    return samples;
+  }
+
+  boost::shared_ptr<FilteredVideoSource<PointT>> filteredSource(
+      bool calib, bool background, bool odo, bool crop, bool ground) const {
+    boost::shared_ptr<FilteredVideoSource<PointT>> source(
+        new FilteredVideoSource<PointT>(boost::shared_ptr<VideoSource<PointT>>()));
+    // added in the order FileConfigParser::addFilters would sort them
+    if (calib)
+      source->addFilter(boost::shared_ptr<PointFilter<PointT>>(new SensorCalibrationFilter<PointT>(1.0117, -0.0100851)));
+    if (background)
+      source->addFilter(boost::shared_ptr<PointFilter<PointT>>(new BackgroundFilter<PointT>(2.8)));
+    if (odo)
+      source->addFilter(boost::shared_ptr<PointFilter<PointT>>(new FixedOdoTransformer(generator_.cameraKinematics())));
+    if (crop)
+      source->addFilter(boost::shared_ptr<PointFilter<PointT>>(new CropFilter<PointT>(4.0, -1.5, 1.5, -1.5)));
+    if (ground)
+      source->addFilter(boost::shared_ptr<PointFilter<PointT>>(new GroundFilter<PointT>(0.03)));
+    return source;
+  }
+
+  void benchFilters() {
+    if (!enabled("filters"))
+      return;
+
+    struct Combination {
+      char const* name;
+      bool calib, background, odo, crop, ground;
+    };
+    Combination const combinations[] = {
+        {"calibration", true, false, false, false, false},
+        {"calibration+background", true, true, false, false, false},
+        {"odo", false, false, true, false, false},
+        {"odo+crop+ground", false, false, true, true, true},
+        {"all", true, true, true, true, true},
+    };
+
+    for (Combination const& c : combinations) {
+      double pointwise_mean = 0;
+      for (int fused = 0; fused < 2; ++fused) {
+        boost::shared_ptr<FilteredVideoSource<PointT>> source =
+            filteredSource(c.calib, c.background, c.odo, c.crop, c.ground);
+        boost::shared_ptr<FrameSink> sink(new FrameSink);
+        source->FrameDataSubject::attachObserver(sink);
+        if (fused && !source->compileFilters()) {
+          continue;
+        }
+
+        LatencySamples samples = measure(camera_raw_->size(), [&](int i) {
+          FrameDataPtr frame(new FrameData(i));
+          frame->cloud = camera_raw_;
+          source->updateFrame(frame);
+        });
+
+        std::map<std::string, double> extra;
+        extra["output_points"] = sink->last->cloud->size();
+        if (fused) {
+          extra["speedup"] = pointwise_mean / samples.mean();
+        } else {
+          pointwise_mean = samples.mean();
+        }
+        report_.addCase("filters", std::string(c.name) + (fused ? "/fused" : "/pointwise"), samples, extra);
+      }
+    }
+  }
+
+  void benchSurfaceFinder() {
+    SurfaceFinder<PointT> finder(true, SurfaceFinderParameters());
+    std::vector<PointCloudPtr> planes;
+    std::vector<pcl::ModelCoefficients> coefficients;
+
+    if (enabled("surface_finder")) {
+      LatencySamples samples = measure(world_->size(), [&](int) {
+        planes.clear();
+        coefficients.clear();
+        finder.findSurfaces(world_, planes, coefficients);
+      });
+      std::map<std::string, double> extra;
+      extra["planes"] = planes.size();
+      report_.addCase("surface_finder", "ransac", samples, extra);
+
+      {
+        // the steady state of tracking: the same scene, frame after frame
+        SurfaceFinder<PointT>::Parameters params = SurfaceFinderParameters();
+        params.TRACK_PLANES = true;
+        params.REDETECT_INTERVAL = 0;
+        SurfaceFinder<PointT> tracking(true, params);
+        std::vector<PointCloudPtr> tracked_planes;
+        std::vector<pcl::ModelCoefficients> tracked_coefficients;
+        tracking.findSurfaces(world_, tracked_planes, tracked_coefficients);
+        LatencySamples tracked_samples = measure(world_->size(), [&](int) {
+          tracked_planes.clear();
+          tracked_coefficients.clear();
+          tracking.findSurfaces(world_, tracked_planes, tracked_coefficients);
+        });
+        std::map<std::string, double> tracked_extra;
+        tracked_extra["planes"] = tracked_planes.size();
+        tracked_extra["speedup"] = samples.mean() / tracked_samples.mean();
+        report_.addCase("surface_finder", "tracked", tracked_samples, tracked_extra);
+      }
+
+      {
+        SurfaceFinder<PointT>::Parameters params = SurfaceFinderParameters();
+        params.PARALLEL_RANSAC = true;
+        SurfaceFinder<PointT> parallel(true, params);
+        std::vector<PointCloudPtr> parallel_planes;
+        std::vector<pcl::ModelCoefficients> parallel_coefficients;
+        LatencySamples parallel_samples = measure(world_->size(), [&](int) {
+          parallel_planes.clear();
+          parallel_coefficients.clear();
+          parallel.findSurfaces(world_, parallel_planes, parallel_coefficients);
+        });
+        std::map<std::string, double> parallel_extra;
+        parallel_extra["planes"] = parallel_planes.size();
+        parallel_extra["speedup"] = samples.mean() / parallel_samples.mean();
+        report_.addCase("surface_finder", "parallel", parallel_samples, parallel_extra);
+      }
+
+      if (world_raw_->isOrganized()) {
+        SurfaceFinder<PointT>::Parameters params = SurfaceFinderParameters();
+        params.ORGANIZED = true;
+        SurfaceFinder<PointT> organized(true, params);
+        std::vector<PointCloudPtr> organized_planes;
+        std::vector<pcl::ModelCoefficients> organized_coefficients;
+        LatencySamples organized_samples = measure(world_raw_->size(), [&](int) {
+          organized_planes.clear();
+          organized_coefficients.clear();
+          organized.findSurfaces(world_, organized_planes, organized_coefficients, world_raw_);
+        });
+        std::map<std::string, double> organized_extra;
+        organized_extra["planes"] = organized_planes.size();
+        organized_extra["speedup"] = samples.mean() / organized_samples.mean();
+        report_.addCase("surface_finder", "organized", organized_samples, organized_extra);
+      }
+    } else {
+      finder.findSurfaces(world_, planes, coefficients);
+    }
+
+    planes_ = planes;
+    plane_coefficients_ = coefficients;
+  }
+
+  void benchPlaneInliers() {
+    PlaneInlierFinder<PointT> inliers(0.03);
+    boost::shared_ptr<FrameSink> sink(new FrameSink);
+    inliers.attachObserver(sink);
+
+    auto run = [&](int i) {
+      FrameDataPtr frame(new FrameData(i));
+      frame->cloud = world_;
+      frame->planeCoefficients = plane_coefficients_;
+      inliers.updateFrame(frame);
+    };
+    if (enabled("plane_inliers")) {
+      LatencySamples samples = measure(world_->size(), run);
+      std::map<std::string, double> extra;
+      extra["remaining_points"] = sink->last->cloudMinusSurfaces->size();
+      report_.addCase("plane_inliers", "default", samples, extra);
+    } else {
+      run(0);
+    }
+    obstacle_cloud_ = sink->last->cloudMinusSurfaces;
+  }
+
+  void benchSurfaceClusterer() {
+    SurfaceClusterer<PointT>::Parameters params;
+    params.CLUSTER_TOLERANCE = 0.05;
+    params.MIN_CLUSTER_SIZE = 750;
+    SurfaceClusterer<PointT> clusterer(params);
+    boost::shared_ptr<SurfaceSink> sink(new SurfaceSink);
+    clusterer.attachObserver(sink);
+
+    auto run = [&](int i) {
+      SurfaceDataPtr data(new SurfaceData(i));
+      data->planes = planes_;
+      data->planeCoefficients = plane_coefficients_;
+      clusterer.updateSurfaces(data);
+    };
+    size_t plane_points = 0;
+    for (auto const& plane : planes_) plane_points += plane->size();
+
+    if (enabled("surface_clusterer")) {
+      LatencySamples samples = measure(plane_points, run);
+      std::map<std::string, double> extra;
+      extra["surfaces"] = sink->last->surfaces.size();
+      report_.addCase("surface_clusterer", "default", samples, extra);
+    } else {
+      run(0);
+    }
+    surfaces_ = sink->last->surfaces;
+  }
+
+  /**
+   * Returns fresh copies of the clustered surfaces, without any hull.
+   */
+  SurfaceDataPtr freshSurfaces(int frame) const {
+    SurfaceDataPtr data(new SurfaceData(frame));
+    for (auto const& s : surfaces_) {
+      data->surfaces.push_back(SurfaceModelPtr(new SurfaceModel(s->get_cloud(), s->get_planeCoefficients())));
+    }
+    return data;
+  }
+
+  void benchConvexHull() {
+    ConvexHullDetector hulls(8, 0.2);
+    boost::shared_ptr<SurfaceSink> sink(new SurfaceSink);
+    hulls.attachObserver(sink);
+
+    if (enabled("convex_hull")) {
+      // new surfaces every run, so that no hulls are merged
+      LatencySamples detect;
+      for (int i = 0; i < opts_.warmup + opts_.iterations; ++i) {
+        SurfaceDataPtr data = freshSurfaces(i);
+        double const ms = timeMs([&] { hulls.updateSurfaces(data); });
+        if (i >= opts_.warmup)
+          detect.add(ms, data->surfaces.size());
+      }
+      report_.addCase("convex_hull", "detect", detect);
+
+      // the same surfaces every run: each new hull is merged with the old one
+      SurfaceDataPtr tracked = freshSurfaces(0);
+      LatencySamples merge = measure(tracked->surfaces.size(), [&](int) {
+        hulls.updateSurfaces(tracked);
+      });
+      report_.addCase("convex_hull", "detect+merge", merge);
+
+      benchHullEngines();
+    } else {
+      hulls.updateSurfaces(freshSurfaces(0));
+    }
+    if (sink->last)
+      surfaces_ = sink->last->surfaces;
+  }
+
+  /**
+   * Compares the 2D hull engine to qhull on flat square surfaces of growing
+   * size.
+   */
+  void benchHullEngines() {
+    for (size_t n : {100, 1000, 10000, 100000}) {
+      SceneParameters params = opts_.scene_params;
+      // a square meter with n points, exactly on the plane z = 0.5
+      params.density = n;
+      params.noise = 0;
+      params.nanFraction = 0;
+      params.organized = false;
+      SceneGenerator generator(params);
+      generator.addGroundPlane(0, 1, 0, 1, 0.5);
+      PointCloudPtr surface = generator.generate();
+      std::vector<float> const coefficients = {0, 0, 1, -0.5};
+
+      util::Projection proj(coefficients);
+      util::ConvexHull2D engine;
+      std::vector<float> points2d(2 * surface->size());
+      std::vector<uint32_t> vertices;
+      LatencySamples chain = measure(surface->size(), [&](int) {
+        proj.project(reinterpret_cast<float const*>(&surface->points[0]), surface->size(),
+                     sizeof(PointT) / sizeof(float), points2d.data());
+        engine.compute(points2d.data(), surface->size(), vertices);
+      });
+      std::map<std::string, double> chain_extra;
+      chain_extra["vertices"] = vertices.size();
+      report_.addCase("convex_hull", "monotone_chain/" + std::to_string(n), chain, chain_extra);
+
+      PointCloudT qhull_vertices;
+      LatencySamples qhull = measure(surface->size(), [&](int) {
+        pcl::ConvexHull<PointT> chull;
+        chull.setInputCloud(surface);
+        chull.reconstruct(qhull_vertices);
+      });
+      std::map<std::string, double> qhull_extra;
+      qhull_extra["vertices"] = qhull_vertices.size();
+      report_.addCase("convex_hull", "qhull/" + std::to_string(n), qhull, qhull_extra);
+    }
+  }
+
+  /**
+   * Runs the segmenter on the obstacle cloud, measuring the runs if `measured`
+   * is set. The segmentation of the last run is stored in `result`.
+   */
+  LatencySamples runSegmenter(ObstacleSegmenter& segmenter, bool measured,
+                              std::vector<ObjectModelParams>& result) {
+    boost::shared_ptr<FrameSink> sink(new FrameSink);
+    segmenter.FrameDataSubject::attachObserver(sink);
+
+    auto run = [&](int i) {
+      FrameDataPtr frame(new FrameData(i));
+      frame->cloud = world_;
+      frame->cloudMinusSurfaces = obstacle_cloud_;
+      frame->planeCoefficients = plane_coefficients_;
+      frame->planeCoeffsIteration = 21 + i;
+      segmenter.updateFrame(frame);
+    };
+    LatencySamples samples;
+    if (measured) {
+      samples = measure(obstacle_cloud_->size(), run);
+    } else {
+      // The results are needed downstream even when the stage is not
+      // measured, so at least one frame is run regardless of `--warmup`.
+      for (int i = 0; i < std::max(opts_.warmup, 1); ++i) run(i);
+    }
+    result = sink->last->obstacleParams;
+    return samples;
+  }
+
+  void benchEuclidean() {
+    EuclideanSegmenter segmenter(0.9);
+    LatencySamples samples = runSegmenter(segmenter, enabled("euclidean"), euclidean_params_);
+    if (enabled("euclidean")) {
+      std::map<std::string, double> extra;
+      extra["obstacles"] = euclidean_params_.size();
+      report_.addCase("segmenter", "euclidean", samples, extra);
+    }
+  }
+
+  void benchGmm() {
+    GmmSegmenter segmenter(GmmParameters(GMM::EmMode::Points));
+    LatencySamples samples = runSegmenter(segmenter, enabled("gmm"), gmm_params_);
+    if (!enabled("gmm"))
+      return;
+
+    std::map<std::string, double> extra;
+    extra["obstacles"] = gmm_params_.size();
+    report_.addCase("segmenter", "gmm", samples, extra);
+
+    // voxel-level EM, compared against the point-level result
+    std::vector<ObjectModelParams> voxel_params;
+    GmmSegmenter voxel_segmenter(GmmParameters(GMM::EmMode::Voxels));
+    LatencySamples voxel_samples = runSegmenter(voxel_segmenter, true, voxel_params);
+
+    extra.clear();
+    extra["obstacles"] = voxel_params.size();
+    extra["speedup"] = samples.mean() / voxel_samples.mean();
+    addGmmDrift(gmm_params_, voxel_params, extra);
+    report_.addCase("segmenter", "gmm/voxels", voxel_samples, extra);
+  }
+
+  /**
+   * Adds the deviation of the segmentation `actual` from `reference` to
+   * `extra`: the difference in the number of obstacles, the mean distance of
+   * each obstacle center to the closest reference center, and the ratio of
+   * points assigned to obstacles.
+   */
+  static void addGmmDrift(std::vector<ObjectModelParams> const& reference,
+                          std::vector<ObjectModelParams> const& actual,
+                          std::map<std::string, double>& extra) {
+    double distance = 0;
+    size_t reference_points = 0, actual_points = 0;
+    for (ObjectModelParams const& a : actual) {
+      double closest = std::numeric_limits<double>::infinity();
+      for (ObjectModelParams const& r : reference) {
+        closest = std::min(closest, static_cast<double>((a.center - r.center).norm()));
+      }
+      distance += closest;
+      actual_points += a.obstacleCloud->size();
+    }
+    for (ObjectModelParams const& r : reference) {
+      reference_points += r.obstacleCloud->size();
+    }
+    extra["obstacle_count_delta"] = static_cast<double>(actual.size()) - static_cast<double>(reference.size());
+    extra["center_drift_m"] = actual.empty() || reference.empty() ? 0 : distance / actual.size();
+    extra["assigned_points_ratio"] = reference_points > 0 ? static_cast<double>(actual_points) / reference_points : 0;
+  }
+
+  /**
+   * Returns a frame carrying the given segmentation result.
+   */
+  FrameDataPtr segmentedFrame(int i, std::vector<ObjectModelParams> const& params) const {
+    FrameDataPtr frame(new FrameData(i));
+    frame->cloud = world_;
+    frame->cloudMinusSurfaces = obstacle_cloud_;
+    frame->surfaces = surfaces_;
+    frame->obstacleParams = params;
+    return frame;
+  }
+
+  void benchApproximators() {
+    boost::shared_ptr<ObjectApproximator> moi(new MomentOfInertiaObjectApproximator);
+    boost::shared_ptr<ObjectApproximator> split = SplitApproximator();
+    boost::shared_ptr<FrameSink> sink(new FrameSink);
+    split->attachObserver(sink);
+
+    if (enabled("approximators")) {
+      LatencySamples samples = measure(euclidean_params_.size(), [&](int i) {
+        moi->updateFrame(segmentedFrame(i, euclidean_params_));
+      });
+      report_.addCase("approximator", "moment_of_inertia", samples);
+      samples = measure(euclidean_params_.size(), [&](int i) {
+        split->updateFrame(segmentedFrame(i, euclidean_params_));
+      });
+      report_.addCase("approximator", "split", samples);
+    } else {
+      split->updateFrame(segmentedFrame(0, euclidean_params_));
+    }
+    obstacles_ = sink->last->obstacles;
+  }
+
+  void benchTrackers() {
+    if (!enabled("trackers"))
+      return;
+
+    LowPassObstacleTracker low_pass;
+    LatencySamples samples = measure(obstacles_.size(), [&](int i) {
+      FrameDataPtr frame = segmentedFrame(i, euclidean_params_);
+      frame->obstacles = obstacles_;
+      low_pass.updateFrame(frame);
+    });
+    report_.addCase("tracker", "low_pass", samples);
+
+    KalmanTrackerFilter kalman(0.01f, 0.15f, 0.1f);
+    samples = measure(gmm_params_.size(), [&](int i) {
+      kalman.updateFrame(segmentedFrame(i, gmm_params_));
+    });
+    report_.addCase("tracker", "kalman", samples);
+  }
+
+  void benchEndToEnd() {
+    if (!enabled("end_to_end"))
+      return;
+
+    char const* const segmenters[] = {"euclidean", "gmm"};
+    for (char const* name : segmenters) {
+      boost::shared_ptr<FilteredVideoSource<PointT>> source = filteredSource(true, true, true, true, false);
+      source->compileFilters();
+      boost::shared_ptr<SyncSurfaceFinder> finder(new SyncSurfaceFinder(SurfaceFinderParameters()));
+      boost::shared_ptr<PlaneInlierFinder<PointT>> inliers(new PlaneInlierFinder<PointT>(0.03));
+      boost::shared_ptr<ObstacleSegmenter> segmenter;
+      if (std::string(name) == "gmm") {
+        segmenter.reset(new GmmSegmenter(GmmParameters()));
+      } else {
+        segmenter.reset(new EuclideanSegmenter(0.9));
+      }
+      boost::shared_ptr<ObjectApproximator> approx = SplitApproximator();
+      boost::shared_ptr<LowPassObstacleTracker> tracker(new LowPassObstacleTracker);
+      boost::shared_ptr<FrameSink> sink(new FrameSink);
+
+      source->FrameDataSubject::attachObserver(finder);
+      finder->attachObserver(inliers);
+      inliers->attachObserver(segmenter);
+      segmenter->FrameDataSubject::attachObserver(approx);
+      approx->attachObserver(tracker);
+      tracker->attachObserver(sink);
+
+      LatencySamples samples = measure(camera_raw_->size(), [&](int i) {
+        FrameDataPtr frame(new FrameData(i));
+        frame->cloud = camera_raw_;
+        source->updateFrame(frame);
+      });
+      std::map<std::string, double> extra;
+      extra["obstacles"] = sink->last ? sink->last->obstacles.size() : 0;
+      report_.addCase("end_to_end", name, samples, extra);
+    }
+  }
+
+  void benchCloudCodec() {
+    if (!enabled("cloud_codec"))
+      return;
+
+    // a second view of the scene, differing in the noise, for the deltas
+    PointCloudPtr const next_raw = generator_.generate();
+    PointCloudPtr next(new PointCloudT());
+    std::vector<int> index;
+    pcl::removeNaNFromPointCloud(*next_raw, *next, index);
+
+    struct Mode {
+      char const* name;
+      bool voxels;
+      int keyframe_interval;
+    };
+    Mode const modes[] = {
+        {"points", false, 1},
+        {"voxels/keyframe", true, 1},
+        {"voxels/delta", true, 1 << 30},
+    };
+    for (Mode const& mode : modes) {
+      for (int lz4 = 0; lz4 < 2; ++lz4) {
+#ifndef LEPP3_HAVE_LZ4
+        if (lz4)
+          continue;
+#endif
+        CloudCodecOptions options;
+        options.voxels = mode.voxels;
+        options.keyframeInterval = mode.keyframe_interval;
+        options.lz4 = lz4 != 0;
+        CloudEncoder encoder(options);
+
+        size_t bytes = 0;
+        LatencySamples samples = measure(world_->size(), [&](int i) {
+          bytes = encoder.encode(i % 2 ? *next : *world_).payload_size;
+        });
+        std::map<std::string, double> extra;
+        extra["bytes"] = bytes;
+        extra["bits_per_point"] = 8.0 * bytes / world_->size();
+        report_.addCase("cloud_codec", std::string(mode.name) + (lz4 ? "/lz4" : ""), samples, extra);
+      }
+    }
+  }
+
+  Options const opts_;
+  SceneGenerator generator_;
+  BenchReport report_;
+
+  PointCloudPtr world_raw_;
+  PointCloudPtr camera_raw_;
+  PointCloudPtr world_;
+
+  std::vector<PointCloudPtr> planes_;
+  std::vector<pcl::ModelCoefficients> plane_coefficients_;
+  PointCloudPtr obstacle_cloud_;
+  std::vector<SurfaceModelPtr> surfaces_;
+  std::vector<ObjectModelParams> euclidean_params_;
+  std::vector<ObjectModelParams> gmm_params_;
+  std::vector<ObjectModelPtr> obstacles_;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options opts;
+  if (!ParseOptions(argc, argv, opts)) {
+    PrintUsage();
+    return 1;
+  }
+  if (opts.help) {
+    PrintUsage();
+    return 0;
+  }
+
+  try {
+    Benchmark benchmark(opts);
+    benchmark.run();
+
+    if (opts.output.empty()) {
+      benchmark.report().writeJson(std::cout);
+    } else {
+      std::ofstream out(opts.output.c_str());
+      if (!out) {
+        std::cerr << "Cannot open output file " << opts.output << std::endl;
+        return 1;
+      }
+      benchmark.report().writeJson(out);
+      std::cerr << "Report written to " << opts.output << std::endl;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Benchmark error: \n\t" << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
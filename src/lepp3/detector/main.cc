@@ -56,8 +56,9 @@ int main(int argc, char* argv[]) {
 
     std::cout << "Waiting forever..." << std::endl;
     std::cout << "(^C to exit)" << std::endl;
-    while (true)
-      boost::this_thread::sleep(boost::posix_time::milliseconds(8000));
+    // only an offline source that does not loop ever finishes
+    while (!parser->raw_source() || !parser->raw_source()->finished())
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
   } catch (const std::exception& e) {
     std::cerr << "Fatal error: \n\t" << e.what() << std::endl;
     return 1;
@@ -32,6 +32,12 @@ public:
 
   virtual const char* name() const override { return "BackgroundFilter"; }
 
+  virtual bool fusedStage(FusedFilterStage& stage) const override {
+    stage = FusedFilterStage(FusedFilterStage::MAX_Z);
+    stage.params[0] = threshold_;
+    return true;
+  }
+
 private:
   double const threshold_;
 };
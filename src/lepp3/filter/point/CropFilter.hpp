@@ -34,6 +34,15 @@ public:
 
   virtual std::vector<std::string> dependencies() const override { return {"RobotOdoTransformer"}; }
 
+  virtual bool fusedStage(FusedFilterStage& stage) const override {
+    stage = FusedFilterStage(FusedFilterStage::XY_BOX);
+    stage.params[0] = xmin;
+    stage.params[1] = xmax;
+    stage.params[2] = ymin;
+    stage.params[3] = ymax;
+    return true;
+  }
+
 private:
   double const xmax;
   double const xmin;
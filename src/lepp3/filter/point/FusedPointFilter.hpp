@@ -0,0 +1,289 @@
+#ifndef LEPP3_FILTER_POINT_FUSED_POINT_FILTER_H__
+#define LEPP3_FILTER_POINT_FUSED_POINT_FILTER_H__
+
+#include "lepp3/Typedefs.hpp"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+namespace lepp {
+
+/**
+ * Describes a single point-wise operation of a `PointFilter` in a form that
+ * can be executed by the `FusedPointFilterKernel`.
+ *
+ * The meaning of the values in `params` depends on the kind of the stage:
+ *
+ *  - CALIBRATION: z' = p[0] * z + p[1]; x and y are scaled by p[0] + p[1] / z'
+ *  - AFFINE:      x' = A * x + r, with A stored row-major in p[0..8] and r in
+ *                 p[9..11]. If `reject_all` is set, every point is removed.
+ *  - MAX_Z:       keeps points with z < p[0]
+ *  - MIN_ABS_Z:   keeps points with |z| >= p[0]
+ *  - XY_BOX:      keeps points with p[0] < x < p[1] and p[2] < y < p[3]
+ */
+struct FusedFilterStage {
+  enum Kind { CALIBRATION, AFFINE, MAX_Z, MIN_ABS_Z, XY_BOX };
+
+  Kind kind;
+  float params[12];
+  bool reject_all;
+
+  explicit FusedFilterStage(Kind kind = MAX_Z) : kind(kind), reject_all(false) {
+    for (int i = 0; i < 12; ++i) params[i] = 0;
+  }
+};
+
+/**
+ * Applies a whole chain of point filters in a single pass over a cloud.
+ *
+ * Instead of calling a virtual `apply` for every filter and every point, the
+ * filter chain is described as a list of `FusedFilterStage`s. Points are then
+ * processed in blocks of four: the block is transposed into x/y/z lanes, every
+ * stage is applied to all lanes at once and the conditions of all stages are
+ * combined into a single keep mask, which is finally used to compact the
+ * surviving points into the output cloud.
+ *
+ * Points with non-finite coordinates are always removed, just like in the
+ * point-wise filtering path. All arithmetic is performed in single precision.
+ */
+class FusedPointFilterKernel {
+public:
+  /**
+   * Sets the stages that will be applied, in the given order.
+   */
+  void setStages(std::vector<FusedFilterStage> const& stages) {
+    stages_ = stages;
+  }
+
+  /**
+   * Filters `in` and appends all surviving points to `out`.
+   */
+  void apply(PointCloudT const& in, PointCloudT& out) const {
+    size_t const n = in.size();
+    size_t const offset = out.size();
+    out.points.resize(offset + n);
+
+    for (size_t i = 0; i < stages_.size(); ++i) {
+      if (stages_[i].kind == FusedFilterStage::AFFINE && stages_[i].reject_all) {
+        // the chain rejects every point; no need to look at them
+        out.points.resize(offset);
+        out.width = out.size();
+        out.height = 1;
+        return;
+      }
+    }
+
+    PointT const* src = n > 0 ? &in.points[0] : nullptr;
+    PointT* dst = n > 0 ? &out.points[offset] : nullptr;
+    size_t kept = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    kept = applyBlocks(src, n, dst, false);
+    i = n - n % 4;
+#endif
+    for (; i < n; ++i) {
+      PointT p = src[i];
+      if (applyScalar(p)) {
+        dst[kept++] = p;
+      }
+    }
+
+    out.points.resize(offset + kept);
+    out.width = out.size();
+    out.height = 1;
+  }
+
+  /**
+   * Filters `in` into `out` without removing any points: `out` keeps the
+   * layout of `in` (e.g. an organized cloud), and the coordinates of the
+   * points that do not survive are set to NaN.
+   */
+  void mask(PointCloudT const& in, PointCloudT& out) const {
+    size_t const n = in.size();
+    out.points.resize(n);
+    out.width = in.width;
+    out.height = in.height;
+    out.is_dense = false;
+
+    bool reject_all = false;
+    for (size_t i = 0; i < stages_.size(); ++i)
+      reject_all = reject_all || (stages_[i].kind == FusedFilterStage::AFFINE && stages_[i].reject_all);
+
+    PointT const* src = n > 0 ? &in.points[0] : nullptr;
+    PointT* dst = n > 0 ? &out.points[0] : nullptr;
+    size_t i = 0;
+#ifdef __SSE2__
+    if (!reject_all) {
+      applyBlocks(src, n, dst, true);
+      i = n - n % 4;
+    }
+#endif
+    for (; i < n; ++i) {
+      dst[i] = src[i];
+      if (reject_all || !applyScalar(dst[i]))
+        dst[i].x = dst[i].y = dst[i].z = std::numeric_limits<float>::quiet_NaN();
+    }
+  }
+
+private:
+  /**
+   * Applies all stages to a single point. Returns whether the point is kept.
+   */
+  bool applyScalar(PointT& p) const {
+    float x = p.x, y = p.y, z = p.z;
+    if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z))
+      return false;
+
+    for (size_t s = 0; s < stages_.size(); ++s) {
+      float const* c = stages_[s].params;
+      switch (stages_[s].kind) {
+        case FusedFilterStage::CALIBRATION: {
+          z = c[0] * z + c[1];
+          float const f = c[0] + c[1] / z;
+          x *= f;
+          y *= f;
+          break;
+        }
+        case FusedFilterStage::AFFINE: {
+          float const nx = c[9] + c[0] * x + c[1] * y + c[2] * z;
+          float const ny = c[10] + c[3] * x + c[4] * y + c[5] * z;
+          float const nz = c[11] + c[6] * x + c[7] * y + c[8] * z;
+          x = nx;
+          y = ny;
+          z = nz;
+          break;
+        }
+        case FusedFilterStage::MAX_Z:
+          if (!(z < c[0])) return false;
+          break;
+        case FusedFilterStage::MIN_ABS_Z:
+          if (std::abs(z) < c[0]) return false;
+          break;
+        case FusedFilterStage::XY_BOX:
+          if (!(x > c[0] && x < c[1] && y > c[2] && y < c[3])) return false;
+          break;
+      }
+    }
+
+    p.x = x;
+    p.y = y;
+    p.z = z;
+    return true;
+  }
+
+#ifdef __SSE2__
+  /**
+   * Processes all complete blocks of four points with SSE2 and writes the
+   * surviving points to `dst`. Returns the number of points written.
+   *
+   * With `keepLayout`, every point is written to the same index it has in
+   * `src`, and the coordinates of the removed ones are NaN.
+   */
+  size_t applyBlocks(PointT const* src, size_t n, PointT* dst, bool keepLayout) const {
+    static_assert(sizeof(PointT) == 4 * sizeof(float),
+                  "the SSE2 kernel expects points made of four packed floats");
+
+    __m128 const sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 const infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+    size_t kept = 0;
+    size_t const blocks = n / 4;
+    for (size_t b = 0; b < blocks; ++b) {
+      float const* p = &src[4 * b].x;
+      __m128 x = _mm_loadu_ps(p);
+      __m128 y = _mm_loadu_ps(p + 4);
+      __m128 z = _mm_loadu_ps(p + 8);
+      __m128 w = _mm_loadu_ps(p + 12);
+      _MM_TRANSPOSE4_PS(x, y, z, w);
+
+      // |v| < inf is false for both infinities and NaN
+      __m128 keep = _mm_and_ps(
+          _mm_and_ps(_mm_cmplt_ps(_mm_and_ps(x, sign_mask), infinity),
+                     _mm_cmplt_ps(_mm_and_ps(y, sign_mask), infinity)),
+          _mm_cmplt_ps(_mm_and_ps(z, sign_mask), infinity));
+
+      for (size_t s = 0; s < stages_.size(); ++s) {
+        float const* c = stages_[s].params;
+        switch (stages_[s].kind) {
+          case FusedFilterStage::CALIBRATION: {
+            __m128 const scale = _mm_set1_ps(c[0]);
+            __m128 const offset = _mm_set1_ps(c[1]);
+            z = _mm_add_ps(_mm_mul_ps(scale, z), offset);
+            __m128 const f = _mm_add_ps(scale, _mm_div_ps(offset, z));
+            x = _mm_mul_ps(x, f);
+            y = _mm_mul_ps(y, f);
+            break;
+          }
+          case FusedFilterStage::AFFINE: {
+            __m128 nx = _mm_add_ps(_mm_set1_ps(c[9]), _mm_mul_ps(_mm_set1_ps(c[0]), x));
+            nx = _mm_add_ps(nx, _mm_mul_ps(_mm_set1_ps(c[1]), y));
+            nx = _mm_add_ps(nx, _mm_mul_ps(_mm_set1_ps(c[2]), z));
+            __m128 ny = _mm_add_ps(_mm_set1_ps(c[10]), _mm_mul_ps(_mm_set1_ps(c[3]), x));
+            ny = _mm_add_ps(ny, _mm_mul_ps(_mm_set1_ps(c[4]), y));
+            ny = _mm_add_ps(ny, _mm_mul_ps(_mm_set1_ps(c[5]), z));
+            __m128 nz = _mm_add_ps(_mm_set1_ps(c[11]), _mm_mul_ps(_mm_set1_ps(c[6]), x));
+            nz = _mm_add_ps(nz, _mm_mul_ps(_mm_set1_ps(c[7]), y));
+            nz = _mm_add_ps(nz, _mm_mul_ps(_mm_set1_ps(c[8]), z));
+            x = nx;
+            y = ny;
+            z = nz;
+            break;
+          }
+          case FusedFilterStage::MAX_Z:
+            keep = _mm_and_ps(keep, _mm_cmplt_ps(z, _mm_set1_ps(c[0])));
+            break;
+          case FusedFilterStage::MIN_ABS_Z:
+            keep = _mm_and_ps(keep, _mm_cmpnlt_ps(_mm_and_ps(z, sign_mask), _mm_set1_ps(c[0])));
+            break;
+          case FusedFilterStage::XY_BOX:
+            keep = _mm_and_ps(keep, _mm_and_ps(
+                _mm_and_ps(_mm_cmpgt_ps(x, _mm_set1_ps(c[0])), _mm_cmplt_ps(x, _mm_set1_ps(c[1]))),
+                _mm_and_ps(_mm_cmpgt_ps(y, _mm_set1_ps(c[2])), _mm_cmplt_ps(y, _mm_set1_ps(c[3])))));
+            break;
+        }
+      }
+
+      int const mask = _mm_movemask_ps(keep);
+      if (keepLayout) {
+        // removed points become NaN in all three coordinates
+        __m128 const nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+        x = _mm_or_ps(_mm_and_ps(keep, x), _mm_andnot_ps(keep, nan));
+        y = _mm_or_ps(_mm_and_ps(keep, y), _mm_andnot_ps(keep, nan));
+        z = _mm_or_ps(_mm_and_ps(keep, z), _mm_andnot_ps(keep, nan));
+        _MM_TRANSPOSE4_PS(x, y, z, w);
+        _mm_storeu_ps(&dst[4 * b].x, x);
+        _mm_storeu_ps(&dst[4 * b + 1].x, y);
+        _mm_storeu_ps(&dst[4 * b + 2].x, z);
+        _mm_storeu_ps(&dst[4 * b + 3].x, w);
+        kept += 4;
+        continue;
+      }
+      if (mask == 0)
+        continue;
+
+      // back to one point per register; the fourth lane is left untouched
+      _MM_TRANSPOSE4_PS(x, y, z, w);
+      __m128 const rows[4] = {x, y, z, w};
+      for (int k = 0; k < 4; ++k) {
+        if (mask & (1 << k)) {
+          _mm_storeu_ps(&dst[kept].x, rows[k]);
+          ++kept;
+        }
+      }
+    }
+    return kept;
+  }
+#endif
+
+  std::vector<FusedFilterStage> stages_;
+};
+
+}  // namespace lepp
+
+#endif
@@ -34,6 +34,12 @@ public:
 
   virtual std::vector<std::string> dependencies() const override { return {"RobotOdoTransformer"}; }
 
+  virtual bool fusedStage(FusedFilterStage& stage) const override {
+    stage = FusedFilterStage(FusedFilterStage::MIN_ABS_Z);
+    stage.params[0] = threshold_;
+    return true;
+  }
+
 private:
   double const threshold_;
 };
@@ -1,6 +1,8 @@
 #ifndef LEPP3_FILTER_POINT_POINT_FILTER_H__
 #define LEPP3_FILTER_POINT_POINT_FILTER_H__
 
+#include "lepp3/filter/point/FusedPointFilter.hpp"
+
 #include <string>
 #include <vector>
 
@@ -31,6 +33,16 @@ public:
    * Make sure dependencies always have a lower order than the filter itself
    */
   virtual std::vector<std::string> dependencies() const { return {}; }
+
+  /**
+   * @brief Describes this filter as a stage of the fused filter kernel
+   *
+   * Filters that can be expressed as a `FusedFilterStage` fill in `stage`
+   * (using the parameters valid after the last `prepareNext` call) and return
+   * true. The default implementation returns false, which makes the
+   * `FilteredVideoSource` fall back to calling `apply` for every point.
+   */
+  virtual bool fusedStage(FusedFilterStage& stage) const { return false; }
 };
 
 }  // namespace lepp
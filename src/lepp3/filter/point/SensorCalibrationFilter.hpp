@@ -39,6 +39,13 @@ public:
 
   virtual const char* name() const override { return "SensorCalibrationFilter"; }
 
+  virtual bool fusedStage(FusedFilterStage& stage) const override {
+    stage = FusedFilterStage(FusedFilterStage::CALIBRATION);
+    stage.params[0] = scale_;
+    stage.params[1] = offset_;
+    return true;
+  }
+
 private:
   double const scale_;
   double const offset_;
@@ -1,14 +1,32 @@
 #ifndef SurfaceModel_H_
 #define SurfaceModel_H_
 
+#include <vector>
+
 #include "lepp3/Typedefs.hpp"
 #include "lepp3/models/Coordinate.h"
+#include "lepp3/util/Projection.h"
 
 
 namespace lepp {
 
 class SurfaceModel;
 
+/**
+* A convex hull in the 2D coordinates of the plane frame it was computed in. It is kept with the hull of a
+* tracked surface, so that the next hull can be merged with it without projecting it again.
+*/
+struct LocalHull
+{
+	LocalHull(const util::Projection &frame) : frame(frame) {}
+
+	util::Projection frame;
+	// the vertices as consecutive pairs of coordinates, counter-clockwise
+	std::vector<float> vertices;
+};
+
+typedef boost::shared_ptr<const LocalHull> LocalHullConstPtr;
+
 class SurfaceVisitor
 {
 public:
@@ -41,6 +59,7 @@ public:
 	int id() const {return id_;}
 	PointCloudConstPtr get_cloud() const {return cloud;}
 	PointCloudConstPtr get_hull() const {return hull;}
+	LocalHullConstPtr get_localHull() const {return localHull;}
 	const pcl::ModelCoefficients& get_planeCoefficients() const {return planeCoefficients;}
 	Eigen::Vector3d get_normal() { return Eigen::Vector3d(planeCoefficients.values[0],planeCoefficients.values[1],planeCoefficients.values[2]);}
 	int get_meshHandle() const {return mh_;}
@@ -52,8 +71,9 @@ public:
 	*/
 	void set_cloud(PointCloudConstPtr &new_cloud) {cloud = new_cloud;}
 	void set_cloud(PointCloudPtr &new_cloud) {cloud = new_cloud;}
-	void set_hull(PointCloudPtr &new_hull) {hull = new_hull;}
-	void set_hull(PointCloudConstPtr &new_hull) {hull = new_hull;}
+	void set_hull(PointCloudPtr &new_hull) {hull = new_hull; localHull.reset();}
+	void set_hull(PointCloudConstPtr &new_hull) {hull = new_hull; localHull.reset();}
+	void set_hull(PointCloudConstPtr new_hull, LocalHullConstPtr new_localHull) {hull = new_hull; localHull = new_localHull;}
 	void set_id(int id) {id_ = id;}
 	void set_planeCoefficients(pcl::ModelCoefficients &new_coefficients) {planeCoefficients = new_coefficients;}
 	void set_meshHandle(mesh_handle_t mh) {mh_ = mh;}
@@ -73,6 +93,8 @@ private:
 	PointCloudConstPtr cloud;
 	pcl::ModelCoefficients planeCoefficients;
 	PointCloudConstPtr hull;
+	// the same hull in its plane frame, if known
+	LocalHullConstPtr localHull;
 	Coordinate center;
 	double radius;
 	int colorID_;
@@ -1,6 +1,7 @@
 #include "ObjectApproximator.hpp"
 
 #include "lepp3/ConvexHullDetector.hpp"
+#include "lepp3/util/Metrics.hpp"
 
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
@@ -11,6 +12,7 @@ lepp::ObjectApproximator::ObjectApproximator(double max_squared_distance)
 }
 
 void lepp::ObjectApproximator::updateFrame(FrameDataPtr frameData) {
+  MetricsClock::time_point const start = MetricsClock::now();
   frameData->obstacles.clear();
 
   // iterate in reverse, we need to remove clouds for invalid obstacles
@@ -40,6 +42,7 @@ void lepp::ObjectApproximator::updateFrame(FrameDataPtr frameData) {
 
   // obstacles is in the wrong order because we iterated in reverse
   std::reverse(std::begin(frameData->obstacles), std::end(frameData->obstacles));
+  PipelineMetrics::instance().record(Stage::Approximation, MetricsClock::now() - start);
 
   notifyObservers(frameData);
 }
@@ -1,5 +1,7 @@
 #include "Segmenter.hpp"
 
+#include "lepp3/util/Metrics.hpp"
+
 #ifdef LEPP3_ENABLE_TRACING
 #include "lepp3/util/lepp3_tracepoint_provider.hpp"
 #endif
@@ -10,7 +12,10 @@ void lepp::ObstacleSegmenter::updateFrame(FrameDataPtr frameData) {
     tracepoint(lepp3_trace_provider, obstacle_segmenter_start);
 #endif
 
-    frameData->obstacleParams = extractObstacleParams(frameData->cloudMinusSurfaces);
+    {
+      ScopedStageTimer stageTimer(Stage::Segmentation);
+      frameData->obstacleParams = extractObstacleParams(frameData->cloudMinusSurfaces);
+    }
 
 #ifdef LEPP3_ENABLE_TRACING
     tracepoint(lepp3_trace_provider, obstacle_segmenter_end);
@@ -4,9 +4,22 @@
 namespace lepp {
 namespace GMM {
 
+// what the EM iteration of the segmenter operates on
+enum class EmMode {
+  // every point of the cloud
+  Points,
+  // the occupied cells of a voxel grid, weighted by their point count
+  Voxels,
+};
+
 struct SegmenterParameters {
   float voxelGridResolution;
 
+  // whether EM runs over points or over voxel moments
+  EmMode emMode = EmMode::Points;
+  // leaf size of the voxels used when emMode is Voxels, in meters
+  float emVoxelResolution = 0.02f;
+
   // this much state-responsibility is needed for a point to be "hard" assigned to a state
   float hardAssignmentStateResp = 0.9f;
   // states with GMM mixing coefficients (pi) lower than this will be removed
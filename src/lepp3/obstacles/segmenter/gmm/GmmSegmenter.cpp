@@ -2,6 +2,11 @@
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "deps/easylogging++.h"
 
@@ -11,16 +16,70 @@
 
 namespace {
 
-float log_probability_density_function(const lepp::GMM::State& state, const Eigen::Vector4f& point) {
-  const Eigen::Vector3f x = point.head<3>() - state.pos;
-  return state.logpdfConstantSummand - 0.5f * x.dot(state.obsCovarInv * x);
+// number of points the E-step processes at once; the log densities of a
+// block for all states should stay in the cache until they are normalized
+const size_t E_STEP_BLOCK_SIZE = 256;
+
+int maxThreads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int teamSize() {
+#ifdef _OPENMP
+  return omp_get_num_threads();
+#else
+  return 1;
+#endif
+}
+
+int threadNum() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
 }
 
-float probability_density_function(const lepp::GMM::State& state, const Eigen::Vector4f& point) {
-  const float lp = log_probability_density_function(state, point);
-  const float p = std::exp(lp);
+/**
+ * Turns the weighted log densities log(pi_k * pdf_k(x)) in row `i` of the
+ * column-major matrix `R` with `rows` rows and `K` columns into
+ * responsibilities, using log-sum-exp.
+ *
+ * Returns false and zeroes the row if the densities sum up to less than 0.001,
+ * i.e. the point has not enough probability support from any state.
+ */
+bool normalizeResponsibilities(float* R, size_t rows, size_t i, size_t K) {
+  static const float minLogNormalizer = std::log(0.001f);
+
+  float maxLog = -std::numeric_limits<float>::infinity();
+  for (size_t k = 0; k < K; k++) {
+    maxLog = std::max(maxLog, R[k * rows + i]);
+  }
+  float sum = 0.0f;
+  if (maxLog > -std::numeric_limits<float>::infinity()) {
+    for (size_t k = 0; k < K; k++) {
+      const float e = std::exp(R[k * rows + i] - maxLog);
+      R[k * rows + i] = e;
+      sum += e;
+    }
+  }
+
+  if (sum > 0.0f && maxLog + std::log(sum) > minLogNormalizer) {
+    const float inv = 1.0f / sum;
+    for (size_t k = 0; k < K; k++) {
+      R[k * rows + i] *= inv;
+    }
+    return true;
+  }
 
-  return std::isnan(p) ? 0.0f : p;
+  for (size_t k = 0; k < K; k++) {
+    R[k * rows + i] = 0.0f;
+  }
+  return false;
 }
 
 }
@@ -48,7 +107,6 @@ std::vector<lepp::ObjectModelParams> lepp::GmmSegmenter::extractObstacleParams(P
 
   voxel_grid_.build(*cloud.get());
 
-  const auto map = cloud->getMatrixXfMap();
   const size_t N = cloud->size(); // number of points
 
   // remove invalid states first (in reverse order because removeState does swap-with-end)
@@ -65,18 +123,23 @@ std::vector<lepp::ObjectModelParams> lepp::GmmSegmenter::extractObstacleParams(P
   if (states_.size() > state_main_vcluster.size())
     state_main_vcluster.resize(states_.size());
 
-  // R(i,j) = "responsibility" of state j for point i
-  MatrixXf R(N, states_.size());
-  // C(i,j) = points of state j that are in vcluster i (assuming a hard point-state assignment of sorts)
-  MatrixXi C = MatrixXi::Zero(voxel_grid_.numClusters(), states_.size());
-
-  Matrix4Xf VCMeans = Matrix4Xf::Zero(4, voxel_grid_.numClusters()); // vcluster means
-  std::vector<Matrix4f> VCSM; // vcluster scatter matrices
-  VCSM.resize(voxel_grid_.numClusters(), Matrix4f::Zero());
+  const size_t K = states_.size();
+  const size_t V = voxel_grid_.numClusters();
+  workspace_.reserve(N, K, V, maxThreads());
+  workspace_.loadPoints(*cloud);
 
-  VectorXi VCPointCounts = VectorXi::Zero(voxel_grid_.numClusters()); // general vcluster point count
+  if (parameters_.emMode == GMM::EmMode::Voxels)
+    e_step_voxels(N);
+  else
+    e_step(N);
 
-  e_step(cloud.get(), R, C, VCMeans, VCSM, VCPointCounts);
+  // R(i,j) = "responsibility" of state j for point i
+  const GMM::EmWorkspace::MatrixMapf R = workspace_.responsibilities(N, K);
+  // C(i,j) = points of state j that are in vcluster i (assuming a hard point-state assignment of sorts)
+  const GMM::EmWorkspace::MatrixMapi C = workspace_.vclusterStateCounts(V, K);
+  const GMM::EmWorkspace::Matrix4XMapf VCMeans = workspace_.vclusterMeans(V); // vcluster means
+  const auto& VCSM = workspace_.VCSM; // vcluster scatter matrices
+  const auto& VCPointCounts = workspace_.VCPointCounts; // general vcluster point count
 
   // total responsibilities for states
   const VectorXf rks = R.colwise().sum();
@@ -119,7 +182,7 @@ std::vector<lepp::ObjectModelParams> lepp::GmmSegmenter::extractObstacleParams(P
     }
   }
 
-  m_step(cloud.get(), R, C, rks, cks, newStates, removedStates);
+  m_step(N, R, C, rks, cks, newStates, removedStates);
 
   // Prepare results
   std::vector<ObjectModelParams> ret;
@@ -226,64 +289,265 @@ void lepp::GmmSegmenter::initialize(const PointCloudT* pc) {
   }
 }
 
-void lepp::GmmSegmenter::e_step(PointCloudT const* pc, Eigen::MatrixXf& R, Eigen::MatrixXi& C,
-                                Eigen::Matrix4Xf& VCMeans, std::vector<Eigen::Matrix4f>& VCSM,
-                                Eigen::VectorXi& VCPointCounts) {
+void lepp::GmmSegmenter::prepareStateCoeffs() {
+  // per-state constants of
+  //   log(pi * pdf(x)) = log(pi) + logpdfConstantSummand - 0.5 * (x - pos)^T * obsCovarInv * (x - pos)
+  // as [constant, pos (3), upper triangle of obsCovarInv (6)]
+  for (size_t k = 0; k < states_.size(); k++) {
+    const GMM::State& s = states_[k];
+    float* c = &workspace_.stateCoeffs[k * GMM::EmWorkspace::STATE_COEFFS];
+    c[0] = std::log(s.pi) + s.logpdfConstantSummand;
+    c[1] = s.pos.x();
+    c[2] = s.pos.y();
+    c[3] = s.pos.z();
+    c[4] = s.obsCovarInv(0, 0);
+    c[5] = s.obsCovarInv(0, 1) + s.obsCovarInv(1, 0);
+    c[6] = s.obsCovarInv(0, 2) + s.obsCovarInv(2, 0);
+    c[7] = s.obsCovarInv(1, 1);
+    c[8] = s.obsCovarInv(1, 2) + s.obsCovarInv(2, 1);
+    c[9] = s.obsCovarInv(2, 2);
+  }
+}
+
+void lepp::GmmSegmenter::e_step(size_t N) {
   using namespace Eigen;
 
-  const auto map = pc->getMatrixXfMap();
-  const size_t N = pc->size(); // number of points
+  const size_t K = states_.size();
+  const size_t V = voxel_grid_.numClusters();
+  GMM::EmWorkspace& ws = workspace_;
+  prepareStateCoeffs();
 
-  for (size_t i = 0; i < N; i++) {
-    const Vector4f x = map.col(i);
+  float* const R = ws.R.data();
+  const float* const px = ws.x.data();
+  const float* const py = ws.y.data();
+  const float* const pz = ws.z.data();
+  const long numBlocks = (N + E_STEP_BLOCK_SIZE - 1) / E_STEP_BLOCK_SIZE;
+  size_t numThreads = 1;
 
-    float normalizer = 0.0f;
-    for (size_t k = 0; k < states_.size(); k++) {
-      normalizer += states_[k].pi * probability_density_function(states_[k], x);
+#pragma omp parallel
+  {
+#pragma omp single nowait
+    numThreads = teamSize();
+
+    GMM::VclusterAccumulator& acc = ws.threads[threadNum()];
+    acc.reset(V, K);
+
+#pragma omp for schedule(static)
+    for (long b = 0; b < numBlocks; b++) {
+      const size_t begin = b * E_STEP_BLOCK_SIZE;
+      const size_t end = std::min(N, begin + E_STEP_BLOCK_SIZE);
+
+      // weighted log densities of all states, one state at a time so that
+      // the loop over the points vectorizes
+      for (size_t k = 0; k < K; k++) {
+        const float* c = &ws.stateCoeffs[k * GMM::EmWorkspace::STATE_COEFFS];
+        float* r = R + k * N;
+        for (size_t i = begin; i < end; i++) {
+          const float dx = px[i] - c[1];
+          const float dy = py[i] - c[2];
+          const float dz = pz[i] - c[3];
+          const float q = dx * (c[4] * dx + c[5] * dy + c[6] * dz) + dy * (c[7] * dy + c[8] * dz) + c[9] * dz * dz;
+          r[i] = c[0] - 0.5f * q;
+        }
+      }
+
+      for (size_t i = begin; i < end; i++) {
+        const Vector4f x(px[i], py[i], pz[i], 1.0f);
+        const int vcluster = voxel_grid_.clusterOfPoint(i);
+
+        if (normalizeResponsibilities(R, N, i, K)) {
+          for (size_t k = 0; k < K; k++) {
+            if (R[k * N + i] > parameters_.hardAssignmentStateResp) {
+              // this point likely "belongs" to state k, add contribution of state to vcluster of point
+              ++acc.C[k * V + vcluster];
+            }
+          }
+        }
+
+        // in addition, accumulate the vcluster mean and scatter matrix
+        // (however we only need this data for adding new states right now, so small performance gains cloud be obtained by computing this lazily)
+        acc.sums[vcluster] += x;
+        acc.scatter[vcluster].noalias() += x * x.transpose();
+        // cache vcluster for point
+        vcluster_point_table[i] = vcluster;
+      }
     }
+  }
+
+  mergeVclusterData(numThreads);
+}
 
-    const int vcluster = voxel_grid_.clusterForPoint(x);
+void lepp::GmmSegmenter::e_step_voxels(size_t N) {
+  using namespace Eigen;
+
+  const size_t K = states_.size();
+  const size_t V = voxel_grid_.numClusters();
+  GMM::EmWorkspace& ws = workspace_;
+  prepareStateCoeffs();
+
+  const size_t numVoxels = ws.buildVoxelMoments(N, parameters_.emVoxelResolution);
+  GMM::growTo(ws.Rv, numVoxels * K);
+  GMM::growTo(ws.voxelVcluster, numVoxels);
+  std::fill(ws.voxelVcluster.begin(), ws.voxelVcluster.begin() + numVoxels, -1);
+
+  float* const R = ws.R.data();
+  float* const Rv = ws.Rv.data();
+  size_t numThreads = 1;
+
+#pragma omp parallel
+  {
+#pragma omp single nowait
+    numThreads = teamSize();
+
+    GMM::VclusterAccumulator& acc = ws.threads[threadNum()];
+    acc.reset(V, K);
+
+    // the vcluster statistics are still gathered per point
+#pragma omp for schedule(static)
+    for (long i = 0; i < static_cast<long>(N); i++) {
+      const Vector4f x = ws.point(i);
+      const int vcluster = voxel_grid_.clusterOfPoint(i);
+      acc.sums[vcluster] += x;
+      acc.scatter[vcluster].noalias() += x * x.transpose();
+      vcluster_point_table[i] = vcluster;
+    }
 
-#ifdef DEBUG
-    if (vcluster < 0 || vcluster >= _voxelGrid.numClusters())
+#pragma omp single
     {
-      std::cout << vcluster << std::endl;
-      throw std::runtime_error("invalid vcluster for point");
+      // a voxel belongs to the vcluster of its first point
+      for (size_t i = 0; i < N; i++) {
+        int& vcluster = ws.voxelVcluster[ws.pointVoxel[i]];
+        if (vcluster < 0)
+          vcluster = vcluster_point_table[i];
+      }
     }
-#endif
 
-    for (size_t k = 0; k < states_.size(); k++) {
-      if (normalizer > 0.001f) {
-        R(i, k) = states_[k].pi * probability_density_function(states_[k], x) / normalizer;
+    // E-step on the voxels: the expected weighted log density of the points
+    // of a voxel with mean m and covariance S under a state is
+    //   log(pi) + logpdfConstantSummand - 0.5 * ((m - pos)^T * obsCovarInv * (m - pos) + tr(obsCovarInv * S))
+#pragma omp for schedule(static)
+    for (long v = 0; v < static_cast<long>(numVoxels); v++) {
+      const float* m = &ws.voxelMoments[v * GMM::EmWorkspace::VOXEL_MOMENTS];
+      const float n = m[0];
+      const float mx = m[1] / n, my = m[2] / n, mz = m[3] / n;
+      const float sxx = m[4] / n - mx * mx, sxy = m[5] / n - mx * my, sxz = m[6] / n - mx * mz;
+      const float syy = m[7] / n - my * my, syz = m[8] / n - my * mz, szz = m[9] / n - mz * mz;
+
+      for (size_t k = 0; k < K; k++) {
+        const float* c = &ws.stateCoeffs[k * GMM::EmWorkspace::STATE_COEFFS];
+        const float dx = mx - c[1];
+        const float dy = my - c[2];
+        const float dz = mz - c[3];
+        const float q = dx * (c[4] * dx + c[5] * dy + c[6] * dz) + dy * (c[7] * dy + c[8] * dz) + c[9] * dz * dz;
+        const float trace = c[4] * sxx + c[5] * sxy + c[6] * sxz + c[7] * syy + c[8] * syz + c[9] * szz;
+        Rv[k * numVoxels + v] = c[0] - 0.5f * (q + trace);
+      }
 
-        if (R(i, k) > parameters_.hardAssignmentStateResp) {
-          // this point likely "belongs" to state k, add contribution of state to vcluster of point
-          ++C(vcluster, k);
+      if (normalizeResponsibilities(Rv, numVoxels, v, K)) {
+        const int vcluster = ws.voxelVcluster[v];
+        for (size_t k = 0; k < K; k++) {
+          if (Rv[k * numVoxels + v] > parameters_.hardAssignmentStateResp) {
+            acc.C[k * V + vcluster] += static_cast<int>(n);
+          }
         }
-      } else {
-        // this point has not enough probability support from any state - ignore it entirely
-        R(i, k) = 0.0f;
       }
     }
 
-    ++VCPointCounts(vcluster);
-    // in addition, compute the vcluster mean and scatter matrix
-    // (however we only need this data for adding new states right now, so small performance gains cloud be obtained by computing this lazily)
-    {
-      Vector4f mean = VCMeans.col(vcluster);
-      const float c = mean.w() + 1.0f;
-      mean = (c - 1.0f) / c * mean + x / c;
-      mean.w() = c;
-      VCMeans.col(vcluster) = mean;
+    // map the responsibilities back to the points, which need them for the
+    // hard assignment to obstacles
+    for (size_t k = 0; k < K; k++) {
+      float* r = R + k * N;
+      const float* rv = Rv + k * numVoxels;
+#pragma omp for schedule(static) nowait
+      for (long i = 0; i < static_cast<long>(N); i++) {
+        r[i] = rv[ws.pointVoxel[i]];
+      }
+    }
+  }
 
-      VCSM[vcluster] += x * x.transpose();
+  mergeVclusterData(numThreads);
+}
+
+void lepp::GmmSegmenter::mergeVclusterData(size_t numThreads) {
+  using namespace Eigen;
+
+  const size_t K = states_.size();
+  const size_t V = voxel_grid_.numClusters();
+  GMM::EmWorkspace& ws = workspace_;
+
+  GMM::EmWorkspace::MatrixMapi C = ws.vclusterStateCounts(V, K);
+  GMM::EmWorkspace::Matrix4XMapf VCMeans = ws.vclusterMeans(V);
+  C.setZero();
+  VCMeans.setZero();
+  std::fill(ws.VCSM.begin(), ws.VCSM.begin() + V, Matrix4f::Zero());
+  for (size_t t = 0; t < numThreads; t++) {
+    GMM::VclusterAccumulator const& acc = ws.threads[t];
+    C += Map<const MatrixXi>(acc.C.data(), V, K);
+    for (size_t v = 0; v < V; v++) {
+      VCMeans.col(v) += acc.sums[v];
+      ws.VCSM[v] += acc.scatter[v];
     }
-    // cache vcluster for point
-    vcluster_point_table[i] = vcluster;
   }
+  for (size_t v = 0; v < V; v++) {
+    // the homogeneous coordinate sums up to the number of points
+    const float count = VCMeans(3, v);
+    ws.VCPointCounts[v] = static_cast<int>(count);
+    if (count > 0.0f) {
+      VCMeans.col(v).head<3>() /= count;
+    }
+  }
+}
+
+void lepp::GmmSegmenter::weightedMoments(size_t N, const float* r, Eigen::Vector4f& mean, Eigen::Matrix4f& cov) const {
+  const float* const px = workspace_.x.data();
+  const float* const py = workspace_.y.data();
+  const float* const pz = workspace_.z.data();
+
+  float w = 0, sx = 0, sy = 0, sz = 0;
+  float sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0, szz = 0;
+#pragma omp parallel for schedule(static) reduction(+:w,sx,sy,sz,sxx,sxy,sxz,syy,syz,szz)
+  for (long i = 0; i < static_cast<long>(N); i++) {
+    const float ri = r[i];
+    const float rx = ri * px[i], ry = ri * py[i], rz = ri * pz[i];
+    w += ri;
+    sx += rx;
+    sy += ry;
+    sz += rz;
+    sxx += rx * px[i];
+    sxy += rx * py[i];
+    sxz += rx * pz[i];
+    syy += ry * py[i];
+    syz += ry * pz[i];
+    szz += rz * pz[i];
+  }
+
+  mean << sx, sy, sz, w;
+  cov << sxx, sxy, sxz, sx,
+         sxy, syy, syz, sy,
+         sxz, syz, szz, sz,
+         sx, sy, sz, w;
 }
 
-void lepp::GmmSegmenter::m_step(PointCloudT const* pc, Eigen::MatrixXf const& R, Eigen::MatrixXi const& C,
+void lepp::GmmSegmenter::weightedVoxelMoments(size_t k, Eigen::Vector4f& mean, Eigen::Matrix4f& cov) const {
+  const size_t numVoxels = workspace_.numVoxels;
+  const float* rv = workspace_.Rv.data() + k * numVoxels;
+
+  float sum[GMM::EmWorkspace::VOXEL_MOMENTS] = {0};
+  for (size_t v = 0; v < numVoxels; v++) {
+    const float* m = &workspace_.voxelMoments[v * GMM::EmWorkspace::VOXEL_MOMENTS];
+    for (size_t j = 0; j < GMM::EmWorkspace::VOXEL_MOMENTS; j++) {
+      sum[j] += rv[v] * m[j];
+    }
+  }
+
+  mean << sum[1], sum[2], sum[3], sum[0];
+  cov << sum[4], sum[5], sum[6], sum[1],
+         sum[5], sum[7], sum[8], sum[2],
+         sum[6], sum[8], sum[9], sum[3],
+         sum[1], sum[2], sum[3], sum[0];
+}
+
+void lepp::GmmSegmenter::m_step(size_t N, GMM::EmWorkspace::MatrixMapf const& R, GMM::EmWorkspace::MatrixMapi const& C,
                                 Eigen::VectorXf const& rks,
                                 Eigen::VectorXi const& cks,
                                 std::vector<GMM::State>& newStates,
@@ -291,9 +555,6 @@ void lepp::GmmSegmenter::m_step(PointCloudT const* pc, Eigen::MatrixXf const& R,
 
   using namespace Eigen;
 
-  const auto map = pc->getMatrixXfMap();
-  const size_t N = pc->size(); // number of points
-
   for (size_t k = 0; k < states_.size(); k++) {
     if (rks(k) / N < parameters_.statePiRemovalThreshold)
       continue;
@@ -324,7 +585,7 @@ void lepp::GmmSegmenter::m_step(PointCloudT const* pc, Eigen::MatrixXf const& R,
         // fit a gaussian to each part of the vcluster the state "owns"
         Vector4f meanA, meanB;
         Matrix4f covA, covB;
-        fitSplittingGaussian(pc, R, k, vclusterMain, vclusterOther, meanA, meanB, covA, covB);
+        fitSplittingGaussian(N, R, k, vclusterMain, vclusterOther, meanA, meanB, covA, covB);
 
         // percentage of points in vclusterOther assigned to other states
         const float ot = (C.row(vclusterOther).sum() - splitPoints) / float(cks.sum() - cks(k));
@@ -359,13 +620,12 @@ void lepp::GmmSegmenter::m_step(PointCloudT const* pc, Eigen::MatrixXf const& R,
     // == end splitting ==
 
     // actual m-step
-    Vector4f mean = Vector4f::Zero();
-    Matrix4f cov = Matrix4f::Zero();
-    for (size_t i = 0; i < N; i++) {
-      const Vector4f x = map.col(i);
-      mean += R(i, k) * x;
-      cov += R(i, k) * x * x.transpose();
-    }
+    Vector4f mean;
+    Matrix4f cov;
+    if (parameters_.emMode == GMM::EmMode::Voxels)
+      weightedVoxelMoments(k, mean, cov);
+    else
+      weightedMoments(N, R.col(k).data(), mean, cov);
 
     mean /= rks(k);
     cov /= rks(k);
@@ -383,7 +643,7 @@ void lepp::GmmSegmenter::m_step(PointCloudT const* pc, Eigen::MatrixXf const& R,
   }
 }
 
-void lepp::GmmSegmenter::fitSplittingGaussian(PointCloudT const* pc, Eigen::MatrixXf const& R, size_t state,
+void lepp::GmmSegmenter::fitSplittingGaussian(size_t N, GMM::EmWorkspace::MatrixMapf const& R, size_t state,
                                               int vclusterA, int vclusterB, Eigen::Vector4f& outMeanA,
                                               Eigen::Vector4f& outMeanB,
                                               Eigen::Matrix4f& outCovA, Eigen::Matrix4f& outCovB) const {
@@ -392,17 +652,13 @@ void lepp::GmmSegmenter::fitSplittingGaussian(PointCloudT const* pc, Eigen::Matr
   outMeanA.setZero();
   outMeanB.setZero();
 
-  const auto map = pc->getMatrixXfMap();
-  const size_t N = pc->size(); // number of points
   float numA = 0.0f;
   float numB = 0.0f;
 
   for (size_t i = 0; i < N; i++) {
-    const Eigen::Vector4f x = map.col(i);
-
     if (R(i, state) > parameters_.hardAssignmentStateResp) {
-      const int vcluster = voxel_grid_.clusterForPoint(x);
-      if (vcluster == vclusterA) {
+      const Eigen::Vector4f x = workspace_.point(i);
+      if (vcluster_point_table[i] == vclusterA) {
         outMeanA += x;
         outCovA += x * x.transpose();
         numA += 1.0f;
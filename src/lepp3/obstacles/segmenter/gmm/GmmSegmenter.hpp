@@ -7,6 +7,7 @@
 #include "lepp3/util/VoxelGrid3D.h"
 
 #include "GmmData.hpp"
+#include "GmmWorkspace.hpp"
 
 #include <chrono>
 
@@ -45,16 +46,31 @@ private:
 
   void initialize(PointCloudT const* pc);
 
-  void e_step(PointCloudT const* pc, Eigen::MatrixXf& R, Eigen::MatrixXi& C,
-              Eigen::Matrix4Xf& VCMeans, std::vector<Eigen::Matrix4f>& VCSM,
-              Eigen::VectorXi& VCPointCounts);
+  // computes the E-step coefficients of all states
+  void prepareStateCoeffs();
 
-  void m_step(PointCloudT const* pc, Eigen::MatrixXf const& R, Eigen::MatrixXi const& C, Eigen::VectorXf const& rks,
-              Eigen::VectorXi const& cks, std::vector<GMM::State>& newStates, std::vector<int>& removedStates);
+  // computes the responsibilities R and the vcluster data of the workspace for the first N points
+  void e_step(size_t N);
+
+  // same as e_step, but evaluates the states on voxel moments instead of on every point
+  void e_step_voxels(size_t N);
+
+  // merges the per-thread vcluster data into the workspace
+  void mergeVclusterData(size_t numThreads);
+
+  void m_step(size_t N, GMM::EmWorkspace::MatrixMapf const& R, GMM::EmWorkspace::MatrixMapi const& C,
+              Eigen::VectorXf const& rks, Eigen::VectorXi const& cks, std::vector<GMM::State>& newStates,
+              std::vector<int>& removedStates);
+
+  // sums of r[i] * x_i and r[i] * x_i * x_i^T over the first N points (in homogeneous coordinates)
+  void weightedMoments(size_t N, const float* r, Eigen::Vector4f& mean, Eigen::Matrix4f& cov) const;
+
+  // the same sums for state k, computed from the voxel moments
+  void weightedVoxelMoments(size_t k, Eigen::Vector4f& mean, Eigen::Matrix4f& cov) const;
 
   //void emstep(const PointCloudT* pc, int frameNum);
   // fit two gaussians to both parts of the vclusters that are assigned to a state
-  void fitSplittingGaussian(PointCloudT const* pc, Eigen::MatrixXf const& R, size_t state,
+  void fitSplittingGaussian(size_t N, GMM::EmWorkspace::MatrixMapf const& R, size_t state,
                             int vclusterA, int vclusterB, Eigen::Vector4f& outMeanA, Eigen::Vector4f& outMeanB,
                             Eigen::Matrix4f& outCovA, Eigen::Matrix4f& outCovB) const;
 
@@ -73,6 +89,8 @@ private:
   // cached vclusters for points
   std::vector<int> vcluster_point_table;
   std::vector<int> state_main_vcluster;
+  // EM scratch memory, reused across frames
+  GMM::EmWorkspace workspace_;
 
   bool initialized_;
 };
@@ -0,0 +1,238 @@
+#ifndef LEPP_OBSTACLES_SEGMENTER_GMM_GMMWORKSPACE_H
+#define LEPP_OBSTACLES_SEGMENTER_GMM_GMMWORKSPACE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+#include "lepp3/Typedefs.hpp"
+
+namespace lepp {
+namespace GMM {
+
+/**
+ * Resizes `v` to hold at least `n` elements. Never shrinks, so that a buffer
+ * that is reused across frames stops allocating once it reached its peak size.
+ */
+template<class T, class Alloc>
+inline void growTo(std::vector<T, Alloc>& v, size_t n) {
+  if (v.size() < n)
+    v.resize(n);
+}
+
+/**
+ * Per-thread partial results of the E-step, merged once all points were
+ * visited.
+ */
+struct VclusterAccumulator {
+  // C(i,j) partial counts, stored column-major (vclusters x states)
+  std::vector<int> C;
+  // per-vcluster sum of points (w holds the number of points)
+  std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > sums;
+  // per-vcluster scatter matrices
+  std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > scatter;
+
+  void reset(size_t numVclusters, size_t numStates) {
+    growTo(C, numVclusters * numStates);
+    growTo(sums, numVclusters);
+    growTo(scatter, numVclusters);
+    std::fill(C.begin(), C.begin() + numVclusters * numStates, 0);
+    std::fill(sums.begin(), sums.begin() + numVclusters, Eigen::Vector4f::Zero());
+    std::fill(scatter.begin(), scatter.begin() + numVclusters, Eigen::Matrix4f::Zero());
+  }
+};
+
+/**
+ * Scratch memory of the GMM segmenter's EM iteration that persists across
+ * frames.
+ *
+ * All buffers only grow, so once the segmenter has seen its largest cloud and
+ * number of states, no allocations happen per frame anymore. The matrices used
+ * by the EM steps are `Eigen::Map`s over these buffers, sized for the current
+ * frame.
+ *
+ * Point coordinates are kept as a structure of arrays (one contiguous array
+ * per coordinate) so that the Mahalanobis distances of a state to a run of
+ * points can be computed with vector instructions.
+ */
+struct EmWorkspace {
+  using MatrixMapf = Eigen::Map<Eigen::MatrixXf>;
+  using MatrixMapi = Eigen::Map<Eigen::MatrixXi>;
+  using Matrix4XMapf = Eigen::Map<Eigen::Matrix4Xf>;
+
+  // point coordinates
+  std::vector<float> x, y, z;
+  // responsibilities, column-major (points x states)
+  std::vector<float> R;
+  // per-state coefficients used by the E-step, see GmmSegmenter::e_step
+  std::vector<float> stateCoeffs;
+  // merged vcluster data, see GmmSegmenter::extractObstacleParams
+  std::vector<int> C;
+  std::vector<float> VCMeans;
+  std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > VCSM;
+  std::vector<int> VCPointCounts;
+  // one accumulator per thread taking part in the E-step
+  std::vector<VclusterAccumulator> threads;
+
+  // == voxel-level EM ==
+  // number of occupied voxels in the current frame
+  size_t numVoxels = 0;
+  // index of the voxel of each point
+  std::vector<uint32_t> pointVoxel;
+  // moments of the points in each voxel, see VOXEL_MOMENTS
+  std::vector<float> voxelMoments;
+  // vcluster each voxel is assigned to
+  std::vector<int> voxelVcluster;
+  // responsibilities of the states for the voxels, column-major (voxels x states)
+  std::vector<float> Rv;
+
+  /**
+   * Makes sure all buffers can hold the data of a frame with `N` points, `K`
+   * states and `V` vclusters, processed by `numThreads` threads.
+   */
+  void reserve(size_t N, size_t K, size_t V, size_t numThreads) {
+    growTo(x, N);
+    growTo(y, N);
+    growTo(z, N);
+    growTo(R, N * K);
+    growTo(stateCoeffs, K * STATE_COEFFS);
+    growTo(C, V * K);
+    growTo(VCMeans, 4 * V);
+    growTo(VCSM, V);
+    growTo(VCPointCounts, V);
+    growTo(threads, numThreads);
+  }
+
+  /**
+   * Copies the coordinates of the points of `pc` into the `x`, `y` and `z`
+   * arrays.
+   */
+  void loadPoints(PointCloudT const& pc) {
+    size_t const N = pc.size();
+    for (size_t i = 0; i < N; ++i) {
+      x[i] = pc.points[i].x;
+      y[i] = pc.points[i].y;
+      z[i] = pc.points[i].z;
+    }
+  }
+
+  /**
+   * Returns the i-th point in homogeneous coordinates.
+   */
+  Eigen::Vector4f point(size_t i) const {
+    return Eigen::Vector4f(x[i], y[i], z[i], 1.0f);
+  }
+
+  /**
+   * Groups the first `N` loaded points into cubic voxels with the given leaf
+   * size and computes each voxel's moments. Returns the number of occupied
+   * voxels.
+   *
+   * Every voxel is stored as [n, sum x, sum y, sum z, sum xx, sum xy, sum xz,
+   * sum yy, sum yz, sum zz].
+   */
+  size_t buildVoxelMoments(size_t N, float resolution) {
+    growTo(pointVoxel, N);
+    growTo(voxelMoments, N * VOXEL_MOMENTS);
+    prepareVoxelTable(N);
+
+    const float inv = 1.0f / resolution;
+    numVoxels = 0;
+    for (size_t i = 0; i < N; ++i) {
+      const uint64_t key = voxelKey(std::floor(x[i] * inv), std::floor(y[i] * inv), std::floor(z[i] * inv));
+      const uint32_t v = findOrInsertVoxel(key);
+      pointVoxel[i] = v;
+
+      float* m = &voxelMoments[v * VOXEL_MOMENTS];
+      m[0] += 1.0f;
+      m[1] += x[i];
+      m[2] += y[i];
+      m[3] += z[i];
+      m[4] += x[i] * x[i];
+      m[5] += x[i] * y[i];
+      m[6] += x[i] * z[i];
+      m[7] += y[i] * y[i];
+      m[8] += y[i] * z[i];
+      m[9] += z[i] * z[i];
+    }
+    return numVoxels;
+  }
+
+  MatrixMapf responsibilities(size_t N, size_t K) { return MatrixMapf(R.data(), N, K); }
+
+  MatrixMapi vclusterStateCounts(size_t V, size_t K) { return MatrixMapi(C.data(), V, K); }
+
+  Matrix4XMapf vclusterMeans(size_t V) { return Matrix4XMapf(VCMeans.data(), 4, V); }
+
+  // number of floats stored per state in `stateCoeffs`
+  static size_t const STATE_COEFFS = 10;
+  // number of floats stored per voxel in `voxelMoments`
+  static size_t const VOXEL_MOMENTS = 10;
+
+private:
+  /**
+   * Makes room for up to `N` voxels in the open-addressing voxel table and
+   * invalidates its current content. Instead of clearing the table, the
+   * generation counter is bumped: slots tagged with an older generation are
+   * empty.
+   */
+  void prepareVoxelTable(size_t N) {
+    size_t capacity = 16;
+    while (capacity < 2 * N)
+      capacity *= 2;
+    if (capacity > tableKeys_.size()) {
+      tableKeys_.assign(capacity, 0);
+      tableValues_.assign(capacity, 0);
+      tableGeneration_.assign(capacity, 0);
+      generation_ = 0;
+    }
+    if (++generation_ == 0) {
+      // wrapped around; stale tags could look current again
+      std::fill(tableGeneration_.begin(), tableGeneration_.end(), 0);
+      generation_ = 1;
+    }
+  }
+
+  /**
+   * Returns the index of the voxel with the given key, adding a new voxel
+   * with zero moments if the key is not in the table yet.
+   */
+  uint32_t findOrInsertVoxel(uint64_t key) {
+    const size_t mask = tableKeys_.size() - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ull) >> 20 & mask;
+    while (tableGeneration_[slot] == generation_) {
+      if (tableKeys_[slot] == key)
+        return tableValues_[slot];
+      slot = (slot + 1) & mask;
+    }
+    tableGeneration_[slot] = generation_;
+    tableKeys_[slot] = key;
+    tableValues_[slot] = static_cast<uint32_t>(numVoxels);
+    std::fill(voxelMoments.begin() + numVoxels * VOXEL_MOMENTS,
+              voxelMoments.begin() + (numVoxels + 1) * VOXEL_MOMENTS, 0.0f);
+    return static_cast<uint32_t>(numVoxels++);
+  }
+
+  // packs the (21 bit, two's complement) cell coordinates into one key
+  static uint64_t voxelKey(float cx, float cy, float cz) {
+    const uint64_t mask = (1u << 21) - 1;
+    return ((static_cast<uint64_t>(static_cast<int64_t>(cx)) & mask) << 42)
+        | ((static_cast<uint64_t>(static_cast<int64_t>(cy)) & mask) << 21)
+        | (static_cast<uint64_t>(static_cast<int64_t>(cz)) & mask);
+  }
+
+  // open-addressing hash table (linear probing) from voxel key to voxel index
+  std::vector<uint64_t> tableKeys_;
+  std::vector<uint32_t> tableValues_;
+  std::vector<uint32_t> tableGeneration_;
+  uint32_t generation_ = 0;
+};
+
+} // namespace GMM
+} // namespace lepp
+
+#endif // LEPP_OBSTACLES_SEGMENTER_GMM_GMMWORKSPACE_H
@@ -0,0 +1,27 @@
+#include "lepp3/pose/RecordedPoseService.hpp"
+
+#include <iface_vis.h>
+
+void lepp::RecordedPoseService::setParams(lepp::LolaKinematicsParams const& params) {
+  std::shared_ptr<HR_Pose_Red> pose = std::make_shared<HR_Pose_Red>();
+  pose->version = 1;
+  pose->tick_counter = params.frame_num;
+  pose->stance = static_cast<uint8_t>(params.stance);
+  pose->stamp = params.stamp;
+  for (int i = 0; i < 3; ++i) {
+    pose->t_wr_cl[i] = params.t_wr_cl[i];
+    pose->t_stance_odo[i] = params.t_stance_odo[i];
+    for (int j = 0; j < 3; ++j) {
+      pose->R_wr_cl[3 * i + j] = params.R_wr_cl[i][j];
+    }
+  }
+  pose->phi_z_odo = params.phi_z_odo;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pose_ = pose;
+}
+
+std::shared_ptr<HR_Pose_Red> lepp::RecordedPoseService::getCurrentPose() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pose_;
+}
@@ -0,0 +1,38 @@
+#ifndef LEPP_POSE_RECORDED_POSE_SERVICE_H__
+#define LEPP_POSE_RECORDED_POSE_SERVICE_H__
+
+#include <memory>
+#include <mutex>
+
+#include "lepp3/pose/PoseService.hpp"
+
+namespace lepp {
+
+/**
+ * A `PoseService` that replays the poses stored alongside the frames of a
+ * recording. The video source playing the recording sets the pose of every
+ * frame right before publishing it, so the pose always matches the frame,
+ * regardless of seeking or looping.
+ */
+class RecordedPoseService : public PoseService {
+public:
+  /**
+   * Sets the pose reported from now on.
+   */
+  void setParams(LolaKinematicsParams const& params);
+
+  /**
+   * The pose only changes when the source sets it.
+   */
+  void triggerNextFrame() override {}
+
+private:
+  std::shared_ptr<HR_Pose_Red> getCurrentPose() const override;
+
+  mutable std::mutex mutex_;
+  std::shared_ptr<HR_Pose_Red> pose_;
+};
+
+}
+
+#endif
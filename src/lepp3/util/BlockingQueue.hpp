@@ -0,0 +1,167 @@
+#ifndef LEPP3_BLOCKING_QUEUE_H_
+#define LEPP3_BLOCKING_QUEUE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace lepp {
+
+/**
+ * What `BlockingQueue::push` does when the queue is full.
+ */
+enum class QueueFullPolicy {
+  // drop the oldest queued item; the producer never blocks
+  DropOldest,
+  // wait until a consumer made room
+  Block,
+  // queue the item anyway, growing the queue beyond its capacity
+  Spill,
+};
+
+/**
+ * A bounded FIFO queue for handing work items from producer threads to
+ * consumer threads.
+ *
+ * Consumers block in `pop` until an item is available, so idle worker threads
+ * do not consume any CPU time. What `push` does when the queue is full is
+ * decided by the queue's `QueueFullPolicy`:
+ *
+ *  - DropOldest (default): the oldest queued item is dropped, so consumers
+ *    always work on the most recent data. The producer never blocks.
+ *  - Block: the producer waits until a consumer made room.
+ *  - Spill: the item is queued anyway, growing the queue beyond its capacity.
+ *    Nothing is lost and the producer never blocks, at the cost of memory.
+ *
+ * Calling `close` wakes up all waiting consumers. Items that are already
+ * queued can still be popped; once the queue is drained `pop` returns false,
+ * which is the signal for the worker to exit.
+ */
+template<class T>
+class BlockingQueue {
+public:
+  /**
+   * Creates a new queue that holds at most `capacity` items. A capacity of
+   * zero is treated as one.
+   */
+  explicit BlockingQueue(size_t capacity, QueueFullPolicy policy = QueueFullPolicy::DropOldest)
+      : capacity_(capacity == 0 ? 1 : capacity),
+        policy_(policy),
+        closed_(false),
+        dropped_(0),
+        spilled_(0) {}
+
+  /**
+   * Enqueues the given item, applying the queue's `QueueFullPolicy` if the
+   * queue is full. Returns false if the queue has been closed and the item was
+   * discarded.
+   *
+   * If `evicted` is given, items dropped to make room are moved into it, so
+   * the producer can account for them.
+   */
+  bool push(T item, std::vector<T>* evicted = nullptr) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (policy_ == QueueFullPolicy::Block) {
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+      }
+      if (closed_) {
+        return false;
+      }
+      if (items_.size() >= capacity_) {
+        if (policy_ == QueueFullPolicy::Spill) {
+          ++spilled_;
+        } else {
+          while (items_.size() >= capacity_) {
+            if (evicted)
+              evicted->push_back(std::move(items_.front()));
+            items_.pop_front();
+            ++dropped_;
+          }
+        }
+      }
+      items_.push_back(std::move(item));
+    }
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Blocks until an item is available and moves it into `item`.
+   * Returns false only when the queue was closed and has been drained.
+   */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    if (policy_ == QueueFullPolicy::Block) {
+      lock.unlock();
+      not_full_.notify_one();
+    }
+    return true;
+  }
+
+  /**
+   * Closes the queue: further pushes are rejected and all blocked consumers
+   * and producers are woken up.
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  /**
+   * Returns the number of items currently waiting in the queue.
+   */
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  /**
+   * Returns how many items have been discarded because the queue was full.
+   */
+  size_t dropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+  QueueFullPolicy policy() const { return policy_; }
+
+  /**
+   * Returns how many items were queued beyond the capacity (Spill policy).
+   */
+  size_t spilled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return spilled_;
+  }
+
+private:
+  size_t const capacity_;
+  QueueFullPolicy const policy_;
+  std::deque<T> items_;
+  bool closed_;
+  size_t dropped_;
+  size_t spilled_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_BLOCKING_QUEUE_H_
@@ -0,0 +1,121 @@
+#ifndef LEPP3_CONTAINER_VIDEO_SOURCE_H_
+#define LEPP3_CONTAINER_VIDEO_SOURCE_H_
+
+#include <atomic>
+#include <memory>
+
+#include "lepp3/FrameData.hpp"
+#include "lepp3/RGBData.hpp"
+#include "lepp3/VideoSource.hpp"
+#include "lepp3/pose/RecordedPoseService.hpp"
+#include "lepp3/util/RecordingContainer.hpp"
+#include "lepp3/util/ReplayClock.hpp"
+
+#ifdef LEPP3_ENABLE_TRACING
+#include "lepp3/util/lepp3_tracepoint_provider.hpp"
+#endif
+
+namespace lepp {
+
+/**
+ * Plays back a recording container written by lepp::VideoRecorder.
+ *
+ * Frames are read and published on the replay thread of the given
+ * `ReplayClock`, which also decides their pace. The RGB image of a frame, if
+ * recorded, is published right after its cloud. If a `RecordedPoseService`
+ * is given, it is set to the recorded pose of each frame before the frame is
+ * published. After the last frame, the playback continues at the first one.
+ */
+template<class PointT>
+class ContainerVideoSource : public VideoSource<PointT> {
+public:
+  ContainerVideoSource(std::shared_ptr<RecordingReader> reader,
+                       std::shared_ptr<RecordedPoseService> pose_service,
+                       std::shared_ptr<ReplayClock> clock);
+
+  virtual ~ContainerVideoSource();
+
+  virtual void open();
+
+  virtual void setOptions(const std::map<std::string, bool>& options) {}
+
+  virtual bool finished() const { return clock_->finished(); }
+
+  /**
+   * Continues the playback at the given frame.
+   */
+  void seek(size_t frame) { next_frame_ = frame; }
+
+private:
+  /**
+   * Reads and publishes the next frame; called by the clock.
+   */
+  void publishNextFrame();
+
+  std::shared_ptr<RecordingReader> reader_;
+  std::shared_ptr<RecordedPoseService> pose_;
+  std::shared_ptr<ReplayClock> clock_;
+
+  std::atomic<size_t> next_frame_;
+  RecordedFrame<PointT> frame_;
+  long frameCount;
+};
+
+template<class PointT>
+ContainerVideoSource<PointT>::ContainerVideoSource(
+    std::shared_ptr<RecordingReader> reader,
+    std::shared_ptr<RecordedPoseService> pose_service,
+    std::shared_ptr<ReplayClock> clock)
+    : VideoSource<PointT>(pose_service),
+      reader_(reader),
+      pose_(pose_service),
+      clock_(clock),
+      next_frame_(0),
+      frameCount(0) {
+}
+
+template<class PointT>
+ContainerVideoSource<PointT>::~ContainerVideoSource() {
+  clock_->stop();
+}
+
+template<class PointT>
+void ContainerVideoSource<PointT>::open() {
+  if (reader_->size() == 0)
+    return;
+  clock_->start([this] { publishNextFrame(); });
+}
+
+template<class PointT>
+void ContainerVideoSource<PointT>::publishNextFrame() {
+  size_t idx = next_frame_++;
+  if (idx >= reader_->size()) {
+    idx = 0;
+    next_frame_ = 1;
+  }
+  reader_->read(idx, frame_);
+
+#ifdef LEPP3_ENABLE_TRACING
+  tracepoint(lepp3_trace_provider, new_depth_frame);
+#endif
+  if (pose_ && frame_.hasPose)
+    pose_->setParams(frame_.pose);
+
+  if (frame_.cloud) {
+    FrameDataPtr frameData(new FrameData(++frameCount));
+    frameData->cloud = frame_.cloud;
+    this->setNextFrame(frameData);
+  }
+
+  if (!frame_.image.empty()) {
+#ifdef LEPP3_ENABLE_TRACING
+    tracepoint(lepp3_trace_provider, new_rgb_frame);
+#endif
+    RGBDataPtr rgbData(new RGBData(frameCount, frame_.image));
+    this->setNextFrame(rgbData);
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+#include "ConvexHull2D.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// below this many points, a comparison sort beats the radix sort
+const size_t MIN_RADIX_POINTS = 1024;
+
+// below this many points, culling them is not worth a pass
+const size_t MIN_CULL_POINTS = 64;
+
+/**
+ * Maps a float to an integer with the same order.
+ */
+uint32_t orderedBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  // -0 and 0 are the same point
+  if (bits == 0x80000000u) {
+    bits = 0;
+  }
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+/**
+ * Twice the signed area of the triangle o, a, b; positive if it turns
+ * counter-clockwise.
+ */
+double cross(const float* o, const float* a, const float* b) {
+  return (static_cast<double>(a[0]) - o[0]) * (static_cast<double>(b[1]) - o[1])
+      - (static_cast<double>(a[1]) - o[1]) * (static_cast<double>(b[0]) - o[0]);
+}
+}
+
+bool lepp::util::ConvexHull2D::contains(const float* polygon, size_t size, const float* point) {
+  if (size < 3) {
+    return false;
+  }
+  // the wedge at the first vertex that contains the point
+  const float* first = polygon;
+  if (cross(first, polygon + 2, point) <= 0 || cross(first, polygon + 2 * (size - 1), point) >= 0) {
+    return false;
+  }
+  size_t low = 1;
+  size_t high = size - 1;
+  while (high - low > 1) {
+    const size_t mid = (low + high) / 2;
+    if (cross(first, polygon + 2 * mid, point) > 0) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return cross(polygon + 2 * low, polygon + 2 * high, point) > 0;
+}
+
+void lepp::util::ConvexHull2D::cull(const float* points, size_t count) {
+  // the extreme points in eight directions, in counter-clockwise order,
+  // starting with the leftmost one
+  uint32_t extremes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  float values[8];
+  for (size_t i = 0; i < count; ++i) {
+    const float x = points[2 * i];
+    const float y = points[2 * i + 1];
+    const float directions[8] = {-x, -x - y, -y, x - y, x, x + y, y, y - x};
+    for (size_t d = 0; d < 8; ++d) {
+      if (0 == i || directions[d] > values[d]) {
+        values[d] = directions[d];
+        extremes[d] = static_cast<uint32_t>(i);
+      }
+    }
+  }
+
+  float octagon[16];
+  size_t size = 0;
+  for (size_t d = 0; d < 8; ++d) {
+    const float* p = points + 2 * extremes[d];
+    if (size > 0 && octagon[2 * size - 2] == p[0] && octagon[2 * size - 1] == p[1]) {
+      continue;
+    }
+    octagon[2 * size] = p[0];
+    octagon[2 * size + 1] = p[1];
+    ++size;
+  }
+  while (size > 1 && octagon[0] == octagon[2 * size - 2] && octagon[1] == octagon[2 * size - 1]) {
+    --size;
+  }
+
+  // the points strictly inside the octagon are inside the hull
+  candidates_.clear();
+  for (size_t i = 0; i < count; ++i) {
+    if (!contains(octagon, size, points + 2 * i)) {
+      candidates_.push_back(static_cast<uint32_t>(i));
+    }
+  }
+}
+
+void lepp::util::ConvexHull2D::sortPoints(const float* points) {
+  const size_t count = candidates_.size();
+  entries_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    const uint32_t index = candidates_[i];
+    entries_[i].key = (static_cast<uint64_t>(orderedBits(points[2 * index])) << 32)
+        | orderedBits(points[2 * index + 1]);
+    entries_[i].index = index;
+  }
+
+  if (count < MIN_RADIX_POINTS) {
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+      return a.key < b.key;
+    });
+  } else {
+    // LSD radix sort of four 16-bit digits; the digits that are equal for
+    // all points are skipped
+    const size_t RADIX = 1 << 16;
+    counts_.resize(RADIX);
+    scratch_.resize(count);
+    for (int shift = 0; shift < 64; shift += 16) {
+      std::fill(counts_.begin(), counts_.end(), 0);
+      for (const Entry& e : entries_) {
+        ++counts_[(e.key >> shift) & (RADIX - 1)];
+      }
+      if (counts_[(entries_[0].key >> shift) & (RADIX - 1)] == count) {
+        continue;
+      }
+      size_t offset = 0;
+      for (size_t& c : counts_) {
+        const size_t n = c;
+        c = offset;
+        offset += n;
+      }
+      for (const Entry& e : entries_) {
+        scratch_[counts_[(e.key >> shift) & (RADIX - 1)]++] = e;
+      }
+      entries_.swap(scratch_);
+    }
+  }
+
+  order_.resize(count);
+  sorted_.resize(2 * count);
+  for (size_t i = 0; i < count; ++i) {
+    order_[i] = entries_[i].index;
+    sorted_[2 * i] = points[2 * order_[i]];
+    sorted_[2 * i + 1] = points[2 * order_[i] + 1];
+  }
+}
+
+void lepp::util::ConvexHull2D::compute(const float* points, size_t count, std::vector<uint32_t>& hull) {
+  hull.clear();
+  if (count <= 1) {
+    hull.assign(count, 0);
+    return;
+  }
+  if (count >= MIN_CULL_POINTS) {
+    cull(points, count);
+  } else {
+    candidates_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      candidates_[i] = static_cast<uint32_t>(i);
+    }
+  }
+  sortPoints(points);
+  count = candidates_.size();
+
+  // The lower chain from left to right, then the upper chain back; the
+  // first point of each chain is the last point of the other one. The chains
+  // hold positions in the sorted order until the end.
+  const float* sorted = sorted_.data();
+  hull.resize(2 * count);
+  size_t k = 0;
+  for (size_t i = 0; i < count; ++i) {
+    while (k >= 2 && cross(sorted + 2 * hull[k - 2], sorted + 2 * hull[k - 1], sorted + 2 * i) <= 0) {
+      --k;
+    }
+    hull[k++] = static_cast<uint32_t>(i);
+  }
+  const size_t lower = k + 1;
+  for (size_t i = count - 1; i-- > 0;) {
+    while (k >= lower && cross(sorted + 2 * hull[k - 2], sorted + 2 * hull[k - 1], sorted + 2 * i) <= 0) {
+      --k;
+    }
+    hull[k++] = static_cast<uint32_t>(i);
+  }
+  // the last point closes the ring
+  hull.resize(k - 1);
+
+  // all points coincide
+  if (hull.size() == 2 && entries_[hull[0]].key == entries_[hull[1]].key) {
+    hull.resize(1);
+  }
+  for (auto& vertex : hull) {
+    vertex = order_[vertex];
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lepp {
+namespace util {
+/**
+ * Computes the convex hull of points in a plane with Andrew's monotone chain.
+ *
+ * Many points are first culled with the Akl-Toussaint heuristic: those
+ * strictly inside the octagon of the extreme points in eight directions
+ * cannot be vertices. The rest are sorted once, with a radix sort if there
+ * are many of them, and both chains are found in a single linear pass. The
+ * buffers are kept between calls, so an instance must not be shared between
+ * threads.
+ */
+class ConvexHull2D {
+public:
+  /**
+   * Computes the hull of `count` points, given as consecutive pairs of
+   * coordinates at `points`. The indices of the vertices are written to
+   * `hull` in counter-clockwise order; points on the edges of the hull are
+   * not vertices. Fewer than three vertices are found for degenerate input.
+   */
+  void compute(const float* points, size_t count, std::vector<uint32_t>& hull);
+
+  /**
+   * Whether the point lies strictly inside the convex polygon with `size`
+   * vertices, given counter-clockwise as consecutive pairs of coordinates.
+   * Takes O(log size) steps.
+   */
+  static bool contains(const float* polygon, size_t size, const float* point);
+
+private:
+  /**
+   * Collects the indices of the points that may be vertices into
+   * `candidates_`.
+   */
+  void cull(const float* points, size_t count);
+
+  /**
+   * Sorts the candidates by x, then by y, into `order_`, and their
+   * coordinates into `sorted_`.
+   */
+  void sortPoints(const float* points);
+
+  struct Entry {
+    uint64_t key;
+    uint32_t index;
+  };
+
+  std::vector<uint32_t> candidates_;
+  std::vector<Entry> entries_;
+  std::vector<Entry> scratch_;
+  std::vector<size_t> counts_;
+  std::vector<uint32_t> order_;
+  std::vector<float> sorted_;
+};
+}
+}
@@ -0,0 +1,270 @@
+#ifndef LEPP3_UTIL_METRICS_H_
+#define LEPP3_UTIL_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lepp {
+
+/**
+ * The clock used for all pipeline latency measurements.
+ */
+typedef std::chrono::steady_clock MetricsClock;
+
+/**
+ * The pipeline stages whose latencies are tracked by `PipelineMetrics`.
+ */
+enum class Stage {
+  Filter,
+  Ransac,
+  InlierRemoval,
+  Clustering,
+  Hull,
+  SurfaceTracking,
+  Segmentation,
+  Approximation,
+  // obstacle tracking
+  Tracking,
+  Aggregation,
+  // quantizing and compressing a point cloud for the robot
+  CloudEncode,
+  // scaling and compressing an RGB image for the robot
+  ImageEncode,
+  Send,
+  // time from the grabber callback until a message about the frame was sent
+  // to the robot
+  FrameAge,
+  Count
+};
+
+inline char const* stageName(Stage stage) {
+  static char const* const names[] = {
+    "filter", "ransac", "inlier_removal", "clustering", "hull", "surface_tracking",
+    "segmentation", "approximation", "tracking", "aggregation", "cloud_encode",
+    "image_encode", "send",
+    "frame_age"
+  };
+  return names[static_cast<size_t>(stage)];
+}
+
+/**
+ * The counters tracked by `PipelineMetrics`. All of them are totals since the
+ * start, except for `QueueDepth`, which is the current value.
+ */
+enum class Counter {
+  // bytes and messages written to the robot
+  BytesSent,
+  MessagesSent,
+  // messages waiting to be sent to the robot
+  QueueDepth,
+  // connections to the robot that were lost and re-established
+  Reconnects,
+  Count
+};
+
+inline char const* counterName(Counter counter) {
+  static char const* const names[] = {
+    "bytes_sent", "messages_sent", "queue_depth", "reconnects"
+  };
+  return names[static_cast<size_t>(counter)];
+}
+
+/**
+ * A fixed-size histogram of latencies in microseconds in the style of
+ * HdrHistogram: the buckets are linear within each power of two, so every
+ * value is recorded with a relative error of at most 1/16, up to about 71
+ * minutes. Larger values are counted in the last bucket.
+ *
+ * `record` is lock-free (a few relaxed atomic additions), so it can be called
+ * from any pipeline thread; `snapshot` may run concurrently with it.
+ */
+class LatencyHistogram {
+public:
+  // values below 2^SUB_BITS get a bucket each
+  static int const SUB_BITS = 5;
+  static uint64_t const SUB_COUNT = uint64_t(1) << SUB_BITS;
+  static uint64_t const HALF_COUNT = SUB_COUNT / 2;
+  static int const MAX_BITS = 32;
+  static size_t const BUCKETS = SUB_COUNT + (MAX_BITS - SUB_BITS) * HALF_COUNT;
+
+  /**
+   * The bucket counts of a histogram at one point in time, along with the
+   * statistics derived from them.
+   */
+  struct Snapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS, 0);
+
+    double mean() const { return count > 0 ? static_cast<double>(sum) / count : 0; }
+
+    /**
+     * The value below which the fraction `q` (in [0, 1]) of the recorded
+     * values lies, accurate to the bucket width.
+     */
+    uint64_t percentile(double q) const {
+      if (count == 0)
+        return 0;
+      uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+      if (rank < 1)
+        rank = 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+          return bucketUpper(i);
+      }
+      return bucketUpper(BUCKETS - 1);
+    }
+
+    uint64_t max() const { return percentile(1.0); }
+
+    /**
+     * The values recorded since `earlier`, a previous snapshot of the same
+     * histogram.
+     */
+    Snapshot since(Snapshot const& earlier) const {
+      Snapshot d;
+      d.count = count - earlier.count;
+      d.sum = sum - earlier.sum;
+      for (size_t i = 0; i < BUCKETS; ++i)
+        d.buckets[i] = buckets[i] - earlier.buckets[i];
+      return d;
+    }
+  };
+
+  LatencyHistogram() : count_(0), sum_(0) {
+    for (auto& b : buckets_)
+      b.store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t us) {
+    buckets_[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(us, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Copies the current counts. Values recorded concurrently may or may not be
+   * included, and `count` may briefly disagree with the bucket total.
+   */
+  Snapshot snapshot() const {
+    Snapshot s;
+    s.count = count_.load(std::memory_order_relaxed);
+    s.sum = sum_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < BUCKETS; ++i)
+      s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    return s;
+  }
+
+  static size_t bucketIndex(uint64_t v) {
+    if (v < SUB_COUNT)
+      return static_cast<size_t>(v);
+    if (v >> MAX_BITS)
+      return BUCKETS - 1;
+    int const msb = 63 - __builtin_clzll(v);
+    int const shift = msb - SUB_BITS + 1;
+    return static_cast<size_t>(SUB_COUNT + (shift - 1) * HALF_COUNT + ((v >> shift) - HALF_COUNT));
+  }
+
+  /**
+   * The largest value that is counted in the given bucket.
+   */
+  static uint64_t bucketUpper(size_t i) {
+    if (i < SUB_COUNT)
+      return i;
+    uint64_t const shift = (i - SUB_COUNT) / HALF_COUNT + 1;
+    uint64_t const mantissa = (i - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+};
+
+/**
+ * The process-wide latency histograms, one per `Stage`, and counters.
+ *
+ * Recording is always on and cheap enough to stay on in production; the
+ * histograms are exported periodically by a `MetricsExporter`, if one is
+ * configured.
+ */
+class PipelineMetrics {
+public:
+  static PipelineMetrics& instance() {
+    static PipelineMetrics metrics;
+    return metrics;
+  }
+
+  LatencyHistogram& histogram(Stage stage) {
+    return histograms_[static_cast<size_t>(stage)];
+  }
+
+  void record(Stage stage, MetricsClock::duration d) {
+    int64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    histogram(stage).record(us > 0 ? static_cast<uint64_t>(us) : 0);
+  }
+
+  /**
+   * Records the age of a frame captured at `captureTime`. Frames without a
+   * capture time (the clock's epoch) are ignored.
+   */
+  void recordFrameAge(MetricsClock::time_point captureTime) {
+    if (captureTime != MetricsClock::time_point())
+      record(Stage::FrameAge, MetricsClock::now() - captureTime);
+  }
+
+  void add(Counter counter, uint64_t n) {
+    counters_[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void set(Counter counter, uint64_t value) {
+    counters_[static_cast<size_t>(counter)].store(value, std::memory_order_relaxed);
+  }
+
+  uint64_t counter(Counter counter) const {
+    return counters_[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+  }
+
+private:
+  PipelineMetrics() {
+    for (auto& c : counters_)
+      c.store(0, std::memory_order_relaxed);
+  }
+  PipelineMetrics(PipelineMetrics const&) = delete;
+  PipelineMetrics& operator=(PipelineMetrics const&) = delete;
+
+  std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> histograms_;
+  std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> counters_;
+};
+
+/**
+ * Records the time between its construction and destruction in the histogram
+ * of the given stage.
+ */
+class ScopedStageTimer {
+public:
+  explicit ScopedStageTimer(Stage stage)
+      : stage_(stage), start_(MetricsClock::now()) {}
+
+  ~ScopedStageTimer() {
+    PipelineMetrics::instance().record(stage_, MetricsClock::now() - start_);
+  }
+
+private:
+  ScopedStageTimer(ScopedStageTimer const&) = delete;
+  ScopedStageTimer& operator=(ScopedStageTimer const&) = delete;
+
+  Stage const stage_;
+  MetricsClock::time_point const start_;
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_UTIL_METRICS_H_
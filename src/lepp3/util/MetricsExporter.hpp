@@ -0,0 +1,167 @@
+#ifndef LEPP3_UTIL_METRICS_EXPORTER_H_
+#define LEPP3_UTIL_METRICS_EXPORTER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "lepp3/util/Metrics.hpp"
+
+namespace lepp {
+
+/**
+ * Where a `MetricsExporter` writes its reports to.
+ */
+enum class MetricsSink {
+  // appends one line per report to a file
+  File,
+  // sends one datagram per report to a local Unix socket
+  UnixSocket,
+};
+
+/**
+ * Periodically reports the latency histograms of `PipelineMetrics`.
+ *
+ * Every report covers the values recorded since the previous one and is a
+ * single line of JSON:
+ *
+ *   {"time_ms": <unix time>, "interval_ms": ..., "stages": {"filter":
+ *    {"count": ..., "mean_us": ..., "p50_us": ..., "p90_us": ...,
+ *     "p99_us": ..., "max_us": ...}, ...}, "counters": {"bytes_sent": ...,
+ *    ...}}
+ *
+ * Stages that did not record any value in the interval are left out. The
+ * counters are reported as they are, i.e. as totals since the start. A
+ * socket report that cannot be delivered (e.g. nobody is listening) is
+ * dropped.
+ */
+class MetricsExporter {
+public:
+  MetricsExporter(MetricsSink sink, std::string const& path, int intervalMs)
+      : sink_(sink),
+        path_(path),
+        interval_(std::chrono::milliseconds(intervalMs > 0 ? intervalMs : 1000)),
+        socket_(io_service_),
+        previous_(static_cast<size_t>(Stage::Count)),
+        stop_(false) {
+    if (sink_ == MetricsSink::File) {
+      file_.open(path_.c_str(), std::ios::out | std::ios::app);
+      if (!file_)
+        throw std::runtime_error("MetricsExporter: cannot open " + path_);
+    } else {
+      socket_.open();
+    }
+    takeSnapshots(previous_);
+    last_report_ = MetricsClock::now();
+    thread_ = std::thread(&MetricsExporter::run, this);
+  }
+
+  /**
+   * Writes a final report and stops the export thread.
+   */
+  ~MetricsExporter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_all();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  /**
+   * Returns the report covering the values recorded since the previous one.
+   */
+  std::string nextReport() {
+    std::vector<LatencyHistogram::Snapshot> current(previous_.size());
+    takeSnapshots(current);
+    MetricsClock::time_point const now = MetricsClock::now();
+
+    std::ostringstream ss;
+    ss << "{\"time_ms\": "
+       << std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count()
+       << ", \"interval_ms\": "
+       << std::chrono::duration_cast<std::chrono::milliseconds>(now - last_report_).count()
+       << ", \"stages\": {";
+    bool first = true;
+    for (size_t i = 0; i < current.size(); ++i) {
+      LatencyHistogram::Snapshot const d = current[i].since(previous_[i]);
+      if (d.count == 0)
+        continue;
+      if (!first)
+        ss << ", ";
+      first = false;
+      ss << "\"" << stageName(static_cast<Stage>(i)) << "\": {"
+         << "\"count\": " << d.count
+         << ", \"mean_us\": " << static_cast<uint64_t>(d.mean())
+         << ", \"p50_us\": " << d.percentile(0.5)
+         << ", \"p90_us\": " << d.percentile(0.9)
+         << ", \"p99_us\": " << d.percentile(0.99)
+         << ", \"max_us\": " << d.max() << "}";
+    }
+    ss << "}, \"counters\": {";
+    for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+      Counter const counter = static_cast<Counter>(i);
+      ss << (i > 0 ? ", " : "") << "\"" << counterName(counter) << "\": "
+         << PipelineMetrics::instance().counter(counter);
+    }
+    ss << "}}";
+
+    previous_.swap(current);
+    last_report_ = now;
+    return ss.str();
+  }
+
+private:
+  void takeSnapshots(std::vector<LatencyHistogram::Snapshot>& out) const {
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i] = PipelineMetrics::instance().histogram(static_cast<Stage>(i)).snapshot();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      wakeup_.wait_for(lock, interval_, [this] { return stop_; });
+      publish(nextReport());
+    }
+  }
+
+  void publish(std::string const& report) {
+    if (sink_ == MetricsSink::File) {
+      file_ << report << std::endl;
+      return;
+    }
+    boost::system::error_code ec;
+    socket_.send_to(boost::asio::buffer(report),
+                    boost::asio::local::datagram_protocol::endpoint(path_), 0, ec);
+  }
+
+  MetricsSink const sink_;
+  std::string const path_;
+  std::chrono::milliseconds const interval_;
+
+  std::ofstream file_;
+  boost::asio::io_service io_service_;
+  boost::asio::local::datagram_protocol::socket socket_;
+
+  std::vector<LatencyHistogram::Snapshot> previous_;
+  MetricsClock::time_point last_report_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_UTIL_METRICS_EXPORTER_H_
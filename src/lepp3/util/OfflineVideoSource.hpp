@@ -2,13 +2,16 @@
 #define OFFLINE_VIDEO_SOURCE_H_
 
 #include <memory>
+#include <stdexcept>
 
 #include <opencv2/opencv.hpp>
 #include <pcl/io/grabber.h>
+#include <pcl/io/pcd_grabber.h>
 
 #include "lepp3/FrameData.hpp"
 #include "lepp3/RGBData.hpp"
 #include "lepp3/VideoSource.hpp"
+#include "lepp3/util/ReplayClock.hpp"
 
 
 namespace lepp {
@@ -33,6 +36,15 @@ public:
 
   virtual void setOptions(const std::map<std::string, bool>& options) {}
 
+  /**
+   * Lets the given clock pace the frames instead of the grabber's own timer.
+   * The grabber must be a `pcl::PCDGrabber` with a frame rate of 0, which
+   * the clock triggers once per frame.
+   */
+  void setReplayClock(std::shared_ptr<ReplayClock> clock);
+
+  virtual bool finished() const { return clock_ && clock_->finished(); }
+
 protected:
   /**
    * Implementation of GeneralGrabberVideoSource::cloud_cb_ with the focus on
@@ -49,6 +61,12 @@ private:
   const boost::shared_ptr<cv::VideoCapture> rgb_interface_;
 
   long frameCount;
+
+  std::shared_ptr<ReplayClock> clock_;
+  /**
+   * The point cloud grabber, if it is paced by the replay clock.
+   */
+  boost::shared_ptr<pcl::PCDGrabberBase> replay_grabber_;
 };
 
 template<class PointT>
@@ -62,8 +80,18 @@ OfflineVideoSource<PointT>::OfflineVideoSource(
       frameCount(0) {
 }
 
+template<class PointT>
+void OfflineVideoSource<PointT>::setReplayClock(std::shared_ptr<ReplayClock> clock) {
+  replay_grabber_ = boost::dynamic_pointer_cast<pcl::PCDGrabberBase>(pcd_interface_);
+  if (!replay_grabber_)
+    throw std::runtime_error("Only a PCD grabber can be paced by a replay clock");
+  clock_ = clock;
+}
+
 template<class PointT>
 OfflineVideoSource<PointT>::~OfflineVideoSource() {
+  if (clock_)
+    clock_->stop();
   pcd_interface_->stop();
 
   if (rgb_interface_ && rgb_interface_->isOpened())
@@ -77,7 +105,15 @@ void OfflineVideoSource<PointT>::open() {
   boost::function<callback_t> f = boost::bind(
       &OfflineVideoSource::cloud_cb_, this, _1);
   pcd_interface_->registerCallback(f);
-  pcd_interface_->start();
+  if (clock_) {
+    // Every trigger publishes the next frame on the clock's thread and
+    // returns once it was handed to the observers; see
+    // `GeneralGrabberVideoSource::open`.
+    boost::shared_ptr<pcl::PCDGrabberBase> grabber = replay_grabber_;
+    clock_->start([grabber] { grabber->trigger(); });
+  } else {
+    pcd_interface_->start();
+  }
 }
 
 template<class PointT>
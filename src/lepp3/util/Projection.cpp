@@ -2,45 +2,98 @@
 
 #include <cmath>
 
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
 namespace {
 bool is_zero(double value, double EPSILON = 1.0e-5) {
   return (std::abs(value) < EPSILON);
 }
 }
 
-lepp::util::Projection::Projection(const std::vector<float>& coeff)
-    : proj_3d_to_2d_(2, 3) {
+lepp::util::Projection::Projection(const std::vector<float>& coeff) {
   // use a random point on the plane
   base_point_ << 0, 0, -coeff[3] / coeff[2];
 
-  Eigen::Vector3d n(coeff[0], coeff[1], coeff[2]);
-  n /= n.norm();
+  n_ << coeff[0], coeff[1], coeff[2];
+  n_ /= n_.norm();
 
   unsigned int y = 0;
   do {
-    Eigen::Vector3d v(1, y, 0);
-    e1_ = v.cross(n);
+    Eigen::Vector3f v(1, y++, 0);
+    e1_ = v.cross(n_);
   } while (is_zero(e1_.squaredNorm()));
   e1_ /= e1_.norm();
 
-  e2_ = e1_.cross(n);
+  e2_ = e1_.cross(n_);
 
   proj_3d_to_2d_ <<
                  e1_[0], e1_[1], e1_[2],
       e2_[0], e2_[1], e2_[2];
+  offset_ = -(proj_3d_to_2d_ * base_point_);
 }
 
 
-Eigen::Vector2d lepp::util::Projection::operator()(const Eigen::Vector3d& vec) const {
+Eigen::Vector2f lepp::util::Projection::operator()(const Eigen::Vector3f& vec) const {
   // remove base point
   // and split up into new base
-  return proj_3d_to_2d_ * (vec - base_point_);
+  return proj_3d_to_2d_ * vec + offset_;
 }
 
-Eigen::Vector3d lepp::util::Projection::operator()(const Eigen::Vector2d& vec) const {
+Eigen::Vector3f lepp::util::Projection::operator()(const Eigen::Vector2f& vec) const {
   // get 3d coordinates
   auto v = vec[0] * e1_ + vec[1] * e2_;
 
   // add base point
   return v + base_point_;
 }
+
+void lepp::util::Projection::project(const float* points, size_t count, size_t stride, float* out) const {
+  size_t i = 0;
+#ifdef __SSE2__
+  if (4 == stride) {
+    const __m128 e1x = _mm_set1_ps(e1_[0]);
+    const __m128 e1y = _mm_set1_ps(e1_[1]);
+    const __m128 e1z = _mm_set1_ps(e1_[2]);
+    const __m128 e2x = _mm_set1_ps(e2_[0]);
+    const __m128 e2y = _mm_set1_ps(e2_[1]);
+    const __m128 e2z = _mm_set1_ps(e2_[2]);
+    const __m128 o1 = _mm_set1_ps(offset_[0]);
+    const __m128 o2 = _mm_set1_ps(offset_[1]);
+    for (; i + 4 <= count; i += 4) {
+      const float* p = points + 4 * i;
+      __m128 x = _mm_loadu_ps(p);
+      __m128 y = _mm_loadu_ps(p + 4);
+      __m128 z = _mm_loadu_ps(p + 8);
+      __m128 w = _mm_loadu_ps(p + 12);
+      _MM_TRANSPOSE4_PS(x, y, z, w);
+      const __m128 u = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(e1x, x), _mm_mul_ps(e1y, y)),
+          _mm_add_ps(_mm_mul_ps(e1z, z), o1));
+      const __m128 v = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(e2x, x), _mm_mul_ps(e2y, y)),
+          _mm_add_ps(_mm_mul_ps(e2z, z), o2));
+      _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(u, v));
+      _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(u, v));
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    const float* p = points + stride * i;
+    out[2 * i] = e1_[0] * p[0] + e1_[1] * p[1] + (e1_[2] * p[2] + offset_[0]);
+    out[2 * i + 1] = e2_[0] * p[0] + e2_[1] * p[1] + (e2_[2] * p[2] + offset_[1]);
+  }
+}
+
+void lepp::util::Projection::unproject(const float* in, size_t count, float* points, size_t stride) const {
+  for (size_t i = 0; i < count; ++i) {
+    const float u = in[2 * i];
+    const float v = in[2 * i + 1];
+    float* p = points + stride * i;
+    p[0] = base_point_[0] + u * e1_[0] + v * e2_[0];
+    p[1] = base_point_[1] + u * e1_[1] + v * e2_[1];
+    p[2] = base_point_[2] + u * e1_[2] + v * e2_[2];
+  }
+}
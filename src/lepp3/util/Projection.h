@@ -1,36 +1,63 @@
 #pragma once
 
+#include <cstddef>
 #include <vector>
 #include <Eigen/Dense>
 
 namespace lepp {
 namespace util {
+/**
+ * Maps points onto the 2D coordinates of a plane, spanned by two orthonormal
+ * vectors, and back.
+ */
 class Projection {
 public:
   Projection(const std::vector<float>& coeff);
 
-  Eigen::Vector2d operator()(const Eigen::Vector3d& vec) const;
+  Eigen::Vector2f operator()(const Eigen::Vector3f& vec) const;
 
-  Eigen::Vector2d operator()(double x, double y, double z) const;
+  Eigen::Vector2f operator()(float x, float y, float z) const;
 
-  Eigen::Vector3d operator()(const Eigen::Vector2d& vec) const;
+  Eigen::Vector3f operator()(const Eigen::Vector2f& vec) const;
 
-  Eigen::Vector3d operator()(double x, double y) const;
+  Eigen::Vector3f operator()(float x, float y) const;
 
-private:
-  Eigen::Vector3d base_point_;
-  Eigen::Vector3d e1_;
-  Eigen::Vector3d e2_;
+  /**
+   * Projects `count` points, whose coordinates start every `stride` floats at
+   * `points`, and writes their 2D coordinates to `out` as consecutive pairs.
+   */
+  void project(const float* points, size_t count, size_t stride, float* out) const;
+
+  /**
+   * Maps `count` consecutive pairs of 2D coordinates back onto the plane and
+   * writes the coordinates of the 3D points every `stride` floats from
+   * `points`. Any floats between them are left untouched.
+   */
+  void unproject(const float* in, size_t count, float* points, size_t stride) const;
+
+  // the unit normal of the plane
+  const Eigen::Vector3f& normal() const { return n_; }
 
-  Eigen::MatrixXd proj_3d_to_2d_;
+  // the point of the plane with the 2D coordinates (0, 0)
+  const Eigen::Vector3f& origin() const { return base_point_; }
+
+private:
+  Eigen::Vector3f base_point_;
+  Eigen::Vector3f n_;
+  Eigen::Vector3f e1_;
+  Eigen::Vector3f e2_;
+
+  Eigen::Matrix<float, 2, 3> proj_3d_to_2d_;
+  // the 2D coordinates of the origin
+  Eigen::Vector2f offset_;
 };
 
-inline Eigen::Vector2d Projection::operator()(double x, double y, double z) const {
-  return (*this)(Eigen::Vector3d{x, y, z});
+inline Eigen::Vector2f Projection::operator()(float x, float y, float z) const {
+  return (*this)(Eigen::Vector3f{x, y, z});
 }
 
-inline Eigen::Vector3d Projection::operator()(double x, double y) const {
-  return (*this)(Eigen::Vector2d{x, y});
+inline Eigen::Vector3f Projection::operator()(float x, float y) const {
+  return (*this)(Eigen::Vector2f{x, y});
 }
 }
 }
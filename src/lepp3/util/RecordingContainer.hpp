@@ -0,0 +1,569 @@
+#ifndef LEPP3_RECORDING_CONTAINER_H_
+#define LEPP3_RECORDING_CONTAINER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <opencv2/core/core.hpp>
+
+#include "lepp3/models/LolaKinematics.h"
+
+#ifdef LEPP3_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace lepp {
+
+/**
+ * Compression applied to the cloud and image sections of a recording.
+ */
+enum class RecordingCompression {
+  None,
+  // per-section LZ4; requires building with LEPP3_HAVE_LZ4
+  Lz4,
+};
+
+/**
+ * The position of one frame in a recording container.
+ */
+struct RecordingIndexEntry {
+  uint64_t offset;
+  uint64_t frameNum;
+  int64_t captureUs;
+};
+
+/**
+ * A frame read back from a recording container. Elements that were not
+ * recorded are left empty.
+ */
+template<class PointT>
+struct RecordedFrame {
+  uint64_t frameNum;
+  int64_t captureUs;
+  typename pcl::PointCloud<PointT>::Ptr cloud;
+  cv::Mat image;
+  bool hasPose;
+  LolaKinematicsParams pose;
+};
+
+/**
+ * Format of the recording container, a single append-only file holding all
+ * recorded frames.
+ *
+ * Layout (all integers little endian, as written by the recording host):
+ *
+ *   file header   "LEPPREC1", u32 version, u32 reserved
+ *   frame chunk   "FRAM", u32 section count, u64 frame number,
+ *                 i64 capture time [us since epoch], u64 payload size,
+ *                 followed by the sections
+ *   ...
+ *   index         "INDX", u32 reserved, u64 frame count,
+ *                 per frame: u64 chunk offset, u64 frame number, i64 capture time
+ *   footer        u64 index offset, "LEPPIDX1"
+ *
+ * Each section of a chunk starts with u32 type, u32 codec, u64 raw size and
+ * u64 stored size, followed by the stored bytes. A frame holds any of a pose
+ * (`LolaKinematicsParams`), a point cloud (x, y, z floats) and an RGB image
+ * (raw pixels).
+ *
+ * The index and footer are written when the recording is finished. If they
+ * are missing (e.g. the recorder crashed), the reader rebuilds the index by
+ * walking the chunks, dropping a truncated last chunk.
+ */
+namespace recording {
+
+char const FILE_MAGIC[8] = {'L', 'E', 'P', 'P', 'R', 'E', 'C', '1'};
+char const FOOTER_MAGIC[8] = {'L', 'E', 'P', 'P', 'I', 'D', 'X', '1'};
+char const CHUNK_TAG[4] = {'F', 'R', 'A', 'M'};
+char const INDEX_TAG[4] = {'I', 'N', 'D', 'X'};
+uint32_t const VERSION = 1;
+
+size_t const FILE_HEADER_SIZE = 16;
+size_t const CHUNK_HEADER_SIZE = 32;
+size_t const SECTION_HEADER_SIZE = 24;
+size_t const FOOTER_SIZE = 16;
+
+enum SectionType : uint32_t {
+  POSE_SECTION = 1,
+  CLOUD_SECTION = 2,
+  IMAGE_SECTION = 3,
+};
+
+enum Codec : uint32_t {
+  CODEC_NONE = 0,
+  CODEC_LZ4 = 1,
+};
+
+template<class T>
+inline void put(std::string& out, T const& value) {
+  out.append(reinterpret_cast<char const*>(&value), sizeof(T));
+}
+
+template<class T>
+inline T get(char const* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+/**
+ * Appends a section holding `raw` to `out`, compressed if requested and
+ * worthwhile.
+ */
+inline void putSection(std::string& out, uint32_t type, std::string const& raw,
+                       RecordingCompression compression) {
+#ifdef LEPP3_HAVE_LZ4
+  if (compression == RecordingCompression::Lz4) {
+    int const bound = LZ4_compressBound(static_cast<int>(raw.size()));
+    std::string packed(bound, '\0');
+    int const n = LZ4_compress_default(raw.data(), &packed[0], static_cast<int>(raw.size()), bound);
+    // incompressible data (e.g. noise in the images) is stored as is
+    if (n > 0 && static_cast<size_t>(n) < raw.size()) {
+      put<uint32_t>(out, type);
+      put<uint32_t>(out, CODEC_LZ4);
+      put<uint64_t>(out, raw.size());
+      put<uint64_t>(out, n);
+      out.append(packed.data(), n);
+      return;
+    }
+  }
+#endif
+  put<uint32_t>(out, type);
+  put<uint32_t>(out, CODEC_NONE);
+  put<uint64_t>(out, raw.size());
+  put<uint64_t>(out, raw.size());
+  out.append(raw);
+}
+
+/**
+ * Returns the raw content of a section, decompressing it into `scratch` if
+ * needed.
+ */
+inline char const* sectionData(uint32_t codec, char const* stored, uint64_t storedSize,
+                               uint64_t rawSize, std::vector<char>& scratch) {
+  if (codec == CODEC_NONE) {
+    if (storedSize != rawSize)
+      throw std::runtime_error("Recording: corrupt section size");
+    return stored;
+  }
+  if (codec == CODEC_LZ4) {
+#ifdef LEPP3_HAVE_LZ4
+    if (scratch.size() < rawSize)
+      scratch.resize(rawSize);
+    int const n = LZ4_decompress_safe(stored, scratch.data(), static_cast<int>(storedSize), static_cast<int>(rawSize));
+    if (n < 0 || static_cast<uint64_t>(n) != rawSize)
+      throw std::runtime_error("Recording: corrupt LZ4 section");
+    return scratch.data();
+#else
+    throw std::runtime_error("Recording: LZ4 compressed recording, but built without LZ4 support");
+#endif
+  }
+  throw std::runtime_error("Recording: unknown section codec");
+}
+
+inline int64_t captureTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace recording
+
+/**
+ * Writes frames into a recording container.
+ *
+ * Encoding a frame (`encodeFrame`) is independent of the writer and can run
+ * on any thread, while `append` must be called in recording order.
+ */
+class RecordingWriter {
+public:
+  RecordingWriter(std::string const& file_name, RecordingCompression compression)
+      : compression_(compression), offset_(0), finished_(false) {
+#ifndef LEPP3_HAVE_LZ4
+    if (compression == RecordingCompression::Lz4)
+      throw std::runtime_error("Recording: LZ4 compression requested, but built without LZ4 support");
+#endif
+    out_.open(file_name.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out_.is_open())
+      throw std::runtime_error("Recording: cannot create " + file_name);
+
+    std::string header(recording::FILE_MAGIC, sizeof(recording::FILE_MAGIC));
+    recording::put<uint32_t>(header, recording::VERSION);
+    recording::put<uint32_t>(header, 0);
+    write(header);
+  }
+
+  ~RecordingWriter() {
+    try {
+      finish();
+    } catch (std::exception const&) {
+      // nothing sensible left to do; the reader rebuilds the index
+    }
+  }
+
+  RecordingCompression compression() const { return compression_; }
+
+  /**
+   * Serializes the elements of one frame into a chunk. Any of `cloud`,
+   * `image` and `pose` may be null.
+   */
+  template<class PointT>
+  static std::string encodeFrame(uint64_t frame_num, int64_t capture_us,
+                                 pcl::PointCloud<PointT> const* cloud,
+                                 cv::Mat const* image,
+                                 LolaKinematicsParams const* pose,
+                                 RecordingCompression compression) {
+    using namespace recording;
+    std::string payload;
+    uint32_t sections = 0;
+
+    if (pose) {
+      std::string raw;
+      raw.reserve(17 * sizeof(double) + 2 * sizeof(int32_t));
+      for (int i = 0; i < 3; ++i) put<double>(raw, pose->t_wr_cl[i]);
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j) put<double>(raw, pose->R_wr_cl[i][j]);
+      for (int i = 0; i < 3; ++i) put<double>(raw, pose->t_stance_odo[i]);
+      put<double>(raw, pose->phi_z_odo);
+      put<double>(raw, pose->stance);
+      put<int32_t>(raw, pose->frame_num);
+      put<int32_t>(raw, pose->stamp);
+      // too small to be worth compressing
+      putSection(payload, POSE_SECTION, raw, RecordingCompression::None);
+      ++sections;
+    }
+
+    if (cloud) {
+      std::string raw;
+      raw.reserve(16 + cloud->size() * 3 * sizeof(float));
+      put<uint32_t>(raw, cloud->width);
+      put<uint32_t>(raw, cloud->height);
+      put<uint32_t>(raw, cloud->is_dense ? 1 : 0);
+      put<uint32_t>(raw, static_cast<uint32_t>(cloud->size()));
+      for (PointT const& pt : cloud->points) {
+        float const xyz[3] = {pt.x, pt.y, pt.z};
+        raw.append(reinterpret_cast<char const*>(xyz), sizeof(xyz));
+      }
+      putSection(payload, CLOUD_SECTION, raw, compression);
+      ++sections;
+    }
+
+    if (image && !image->empty()) {
+      cv::Mat const continuous = image->isContinuous() ? *image : image->clone();
+      size_t const bytes = continuous.total() * continuous.elemSize();
+      std::string raw;
+      raw.reserve(16 + bytes);
+      put<int32_t>(raw, continuous.rows);
+      put<int32_t>(raw, continuous.cols);
+      put<int32_t>(raw, continuous.type());
+      put<int32_t>(raw, 0);
+      raw.append(reinterpret_cast<char const*>(continuous.data), bytes);
+      putSection(payload, IMAGE_SECTION, raw, compression);
+      ++sections;
+    }
+
+    std::string chunk(CHUNK_TAG, sizeof(CHUNK_TAG));
+    chunk.reserve(CHUNK_HEADER_SIZE + payload.size());
+    put<uint32_t>(chunk, sections);
+    put<uint64_t>(chunk, frame_num);
+    put<int64_t>(chunk, capture_us);
+    put<uint64_t>(chunk, payload.size());
+    chunk.append(payload);
+    return chunk;
+  }
+
+  /**
+   * Appends a chunk produced by `encodeFrame` to the recording.
+   */
+  void append(std::string const& chunk) {
+    if (chunk.size() < recording::CHUNK_HEADER_SIZE)
+      throw std::runtime_error("Recording: invalid chunk");
+    RecordingIndexEntry entry;
+    entry.offset = offset_;
+    entry.frameNum = recording::get<uint64_t>(chunk.data() + 8);
+    entry.captureUs = recording::get<int64_t>(chunk.data() + 16);
+    write(chunk);
+    index_.push_back(entry);
+  }
+
+  /**
+   * Writes the seek index and footer. No frames can be appended afterwards.
+   */
+  void finish() {
+    if (finished_)
+      return;
+    finished_ = true;
+
+    uint64_t const index_offset = offset_;
+    std::string index(recording::INDEX_TAG, sizeof(recording::INDEX_TAG));
+    recording::put<uint32_t>(index, 0);
+    recording::put<uint64_t>(index, index_.size());
+    for (RecordingIndexEntry const& e : index_) {
+      recording::put<uint64_t>(index, e.offset);
+      recording::put<uint64_t>(index, e.frameNum);
+      recording::put<int64_t>(index, e.captureUs);
+    }
+    recording::put<uint64_t>(index, index_offset);
+    index.append(recording::FOOTER_MAGIC, sizeof(recording::FOOTER_MAGIC));
+    write(index);
+    out_.close();
+  }
+
+  size_t frames() const { return index_.size(); }
+
+private:
+  void write(std::string const& bytes) {
+    if (!out_.is_open())
+      throw std::runtime_error("Recording: writer already finished");
+    out_.write(bytes.data(), bytes.size());
+    if (!out_)
+      throw std::runtime_error("Recording: write failed");
+    offset_ += bytes.size();
+  }
+
+  RecordingCompression const compression_;
+  std::ofstream out_;
+  uint64_t offset_;
+  std::vector<RecordingIndexEntry> index_;
+  bool finished_;
+};
+
+/**
+ * Random access to the frames of a recording container.
+ *
+ * Opening reads only the index, so any frame can be read with a single seek.
+ * Not thread safe; every reading thread needs its own reader.
+ */
+class RecordingReader {
+public:
+  explicit RecordingReader(std::string const& file_name) : file_name_(file_name) {
+    in_.open(file_name.c_str(), std::ios::binary);
+    if (!in_.is_open())
+      throw std::runtime_error("Recording: cannot open " + file_name);
+
+    in_.seekg(0, std::ios::end);
+    file_size_ = static_cast<uint64_t>(in_.tellg());
+
+    char header[recording::FILE_HEADER_SIZE];
+    if (!readAt(0, header, sizeof(header))
+        || std::memcmp(header, recording::FILE_MAGIC, sizeof(recording::FILE_MAGIC)) != 0) {
+      throw std::runtime_error("Recording: " + file_name + " is not a recording container");
+    }
+    if (recording::get<uint32_t>(header + 8) > recording::VERSION)
+      throw std::runtime_error("Recording: unsupported container version in " + file_name);
+
+    if (!readIndex())
+      rebuildIndex();
+  }
+
+  /**
+   * Number of frames in the recording.
+   */
+  size_t size() const { return index_.size(); }
+
+  RecordingIndexEntry const& entry(size_t i) const { return index_[i]; }
+
+  /**
+   * Reads the i-th frame of the recording.
+   */
+  template<class PointT>
+  void read(size_t i, RecordedFrame<PointT>& frame) {
+    using namespace recording;
+    if (i >= index_.size())
+      throw std::out_of_range("Recording: frame index out of range");
+
+    char header[CHUNK_HEADER_SIZE];
+    if (!readAt(index_[i].offset, header, sizeof(header))
+        || std::memcmp(header, CHUNK_TAG, sizeof(CHUNK_TAG)) != 0) {
+      throw std::runtime_error("Recording: corrupt chunk in " + file_name_);
+    }
+    uint32_t const sections = get<uint32_t>(header + 4);
+    uint64_t const payload_size = get<uint64_t>(header + 24);
+    if (payload_.size() < payload_size)
+      payload_.resize(payload_size);
+    if (!readAt(index_[i].offset + CHUNK_HEADER_SIZE, payload_.data(), payload_size))
+      throw std::runtime_error("Recording: truncated chunk in " + file_name_);
+
+    frame.frameNum = get<uint64_t>(header + 8);
+    frame.captureUs = get<int64_t>(header + 16);
+    frame.cloud.reset();
+    frame.image = cv::Mat();
+    frame.hasPose = false;
+
+    char const* p = payload_.data();
+    char const* const end = p + payload_size;
+    for (uint32_t s = 0; s < sections; ++s) {
+      if (end - p < static_cast<ptrdiff_t>(SECTION_HEADER_SIZE))
+        throw std::runtime_error("Recording: corrupt section in " + file_name_);
+      uint32_t const type = get<uint32_t>(p);
+      uint32_t const codec = get<uint32_t>(p + 4);
+      uint64_t const raw_size = get<uint64_t>(p + 8);
+      uint64_t const stored_size = get<uint64_t>(p + 16);
+      p += SECTION_HEADER_SIZE;
+      if (static_cast<uint64_t>(end - p) < stored_size)
+        throw std::runtime_error("Recording: corrupt section in " + file_name_);
+
+      char const* raw = sectionData(codec, p, stored_size, raw_size, scratch_);
+      switch (type) {
+      case POSE_SECTION:
+        decodePose(raw, raw_size, frame.pose);
+        frame.hasPose = true;
+        break;
+      case CLOUD_SECTION:
+        frame.cloud = decodeCloud<PointT>(raw, raw_size);
+        break;
+      case IMAGE_SECTION:
+        frame.image = decodeImage(raw, raw_size);
+        break;
+      default:
+        // sections added by later versions are skipped
+        break;
+      }
+      p += stored_size;
+    }
+  }
+
+private:
+  bool readAt(uint64_t offset, char* data, uint64_t size) {
+    if (offset + size > file_size_)
+      return false;
+    in_.clear();
+    in_.seekg(offset);
+    in_.read(data, size);
+    return static_cast<uint64_t>(in_.gcount()) == size;
+  }
+
+  /**
+   * Loads the index written by `RecordingWriter::finish`. Returns false if
+   * the recording has no (valid) index.
+   */
+  bool readIndex() {
+    using namespace recording;
+    if (file_size_ < FILE_HEADER_SIZE + FOOTER_SIZE)
+      return false;
+    char footer[FOOTER_SIZE];
+    if (!readAt(file_size_ - FOOTER_SIZE, footer, sizeof(footer))
+        || std::memcmp(footer + 8, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0) {
+      return false;
+    }
+    uint64_t const index_offset = get<uint64_t>(footer);
+    char header[16];
+    if (index_offset < FILE_HEADER_SIZE || !readAt(index_offset, header, sizeof(header))
+        || std::memcmp(header, INDEX_TAG, sizeof(INDEX_TAG)) != 0) {
+      return false;
+    }
+    uint64_t const count = get<uint64_t>(header + 8);
+    if (index_offset + sizeof(header) + count * 24 + FOOTER_SIZE != file_size_)
+      return false;
+
+    std::vector<char> entries(count * 24);
+    if (count > 0 && !readAt(index_offset + sizeof(header), entries.data(), entries.size()))
+      return false;
+    index_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      char const* e = &entries[i * 24];
+      index_[i].offset = get<uint64_t>(e);
+      index_[i].frameNum = get<uint64_t>(e + 8);
+      index_[i].captureUs = get<int64_t>(e + 16);
+    }
+    return true;
+  }
+
+  /**
+   * Recovers the index of an unfinished recording by walking its chunks.
+   */
+  void rebuildIndex() {
+    using namespace recording;
+    index_.clear();
+    uint64_t offset = FILE_HEADER_SIZE;
+    char header[CHUNK_HEADER_SIZE];
+    while (readAt(offset, header, sizeof(header))
+           && std::memcmp(header, CHUNK_TAG, sizeof(CHUNK_TAG)) == 0) {
+      uint64_t const next = offset + CHUNK_HEADER_SIZE + get<uint64_t>(header + 24);
+      if (next > file_size_)
+        break;
+      RecordingIndexEntry entry;
+      entry.offset = offset;
+      entry.frameNum = get<uint64_t>(header + 8);
+      entry.captureUs = get<int64_t>(header + 16);
+      index_.push_back(entry);
+      offset = next;
+    }
+  }
+
+  static void decodePose(char const* raw, uint64_t size, LolaKinematicsParams& pose) {
+    using recording::get;
+    if (size < 17 * sizeof(double) + 2 * sizeof(int32_t))
+      throw std::runtime_error("Recording: corrupt pose section");
+    char const* p = raw;
+    for (int i = 0; i < 3; ++i, p += sizeof(double)) pose.t_wr_cl[i] = get<double>(p);
+    for (int i = 0; i < 3; ++i)
+      for (int j = 0; j < 3; ++j, p += sizeof(double)) pose.R_wr_cl[i][j] = get<double>(p);
+    for (int i = 0; i < 3; ++i, p += sizeof(double)) pose.t_stance_odo[i] = get<double>(p);
+    pose.phi_z_odo = get<double>(p); p += sizeof(double);
+    pose.stance = get<double>(p); p += sizeof(double);
+    pose.frame_num = get<int32_t>(p); p += sizeof(int32_t);
+    pose.stamp = get<int32_t>(p);
+  }
+
+  template<class PointT>
+  static typename pcl::PointCloud<PointT>::Ptr decodeCloud(char const* raw, uint64_t size) {
+    using recording::get;
+    if (size < 16)
+      throw std::runtime_error("Recording: corrupt cloud section");
+    uint32_t const count = get<uint32_t>(raw + 12);
+    if (size < 16 + static_cast<uint64_t>(count) * 3 * sizeof(float))
+      throw std::runtime_error("Recording: corrupt cloud section");
+
+    typename pcl::PointCloud<PointT>::Ptr cloud(new pcl::PointCloud<PointT>());
+    cloud->points.resize(count);
+    float const* xyz = reinterpret_cast<float const*>(raw + 16);
+    for (uint32_t i = 0; i < count; ++i, xyz += 3) {
+      PointT& pt = cloud->points[i];
+      std::memcpy(&pt.x, xyz, sizeof(float));
+      std::memcpy(&pt.y, xyz + 1, sizeof(float));
+      std::memcpy(&pt.z, xyz + 2, sizeof(float));
+    }
+    cloud->width = get<uint32_t>(raw);
+    cloud->height = get<uint32_t>(raw + 4);
+    cloud->is_dense = get<uint32_t>(raw + 8) != 0;
+    if (static_cast<uint64_t>(cloud->width) * cloud->height != count) {
+      cloud->width = count;
+      cloud->height = 1;
+    }
+    return cloud;
+  }
+
+  static cv::Mat decodeImage(char const* raw, uint64_t size) {
+    using recording::get;
+    if (size < 16)
+      throw std::runtime_error("Recording: corrupt image section");
+    int const rows = get<int32_t>(raw);
+    int const cols = get<int32_t>(raw + 4);
+    int const type = get<int32_t>(raw + 8);
+    cv::Mat image(rows, cols, type);
+    size_t const bytes = image.total() * image.elemSize();
+    if (size < 16 + bytes)
+      throw std::runtime_error("Recording: corrupt image section");
+    std::memcpy(image.data, raw + 16, bytes);
+    return image;
+  }
+
+  std::string const file_name_;
+  std::ifstream in_;
+  uint64_t file_size_;
+  std::vector<RecordingIndexEntry> index_;
+  // buffers reused across reads
+  std::vector<char> payload_;
+  std::vector<char> scratch_;
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_RECORDING_CONTAINER_H_
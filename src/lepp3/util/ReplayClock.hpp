@@ -0,0 +1,179 @@
+#ifndef LEPP3_REPLAY_CLOCK_H_
+#define LEPP3_REPLAY_CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace lepp {
+
+/**
+ * How an offline source paces the frames it replays.
+ */
+enum class ReplayMode {
+  // at the rate the data was recorded with
+  RealTime,
+  // at the recorded rate times a multiplier
+  Scaled,
+  // as fast as possible: the next frame is only emitted once the previous
+  // one has been processed completely, including by asynchronous stages
+  Lockstep,
+};
+
+/**
+ * Tracks the frames that are still being processed by asynchronous stages of
+ * the pipeline, so that a lockstep replay can wait for them.
+ *
+ * A stage calls `enter` when it takes over a frame for processing on another
+ * thread and `leave` once it is done with it (or drops it).
+ */
+class ReplayBarrier {
+public:
+  ReplayBarrier() : pending_(0) {}
+
+  void enter() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+
+  void leave() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (pending_ > 0)
+        --pending_;
+      if (pending_ > 0)
+        return;
+    }
+    idle_.notify_all();
+  }
+
+  /**
+   * Blocks until no frame is being processed anymore.
+   */
+  void waitIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t pending_;
+};
+
+/**
+ * Paces the frames of an offline source according to a `ReplayMode`.
+ *
+ * The source hands a function publishing its next frame to `start`, which
+ * calls it on a replay thread. After every frame, the timed modes sleep until
+ * the next frame is due, while the lockstep mode waits until the
+ * `ReplayBarrier` is idle. A lockstep replay therefore does not depend on
+ * timing, and its duration measures the pipeline's throughput, which is
+ * printed once a finite replay ends.
+ */
+class ReplayClock {
+public:
+  /**
+   * `frameRate` is the rate the data was recorded with, `rate` the multiplier
+   * applied in `Scaled` mode. `frames` is the number of frames to replay
+   * before `finished` returns true, or zero to replay forever.
+   */
+  ReplayClock(ReplayMode mode, double frameRate, double rate,
+              std::shared_ptr<ReplayBarrier> barrier, size_t frames = 0)
+      : mode_(mode),
+        frame_rate_(mode == ReplayMode::Scaled ? frameRate * rate : frameRate),
+        barrier_(barrier),
+        frames_(frames),
+        emitted_(0),
+        running_(false) {}
+
+  ~ReplayClock() { stop(); }
+
+  ReplayMode mode() const { return mode_; }
+
+  /**
+   * The rate at which frames are emitted in the timed modes.
+   */
+  double frameRate() const { return frame_rate_; }
+
+  std::shared_ptr<ReplayBarrier> const& barrier() const { return barrier_; }
+
+  /**
+   * Starts calling `publishFrame` on the replay thread, once per frame, until
+   * all frames were replayed or `stop` is called.
+   */
+  void start(std::function<void()> publishFrame) {
+    if (running_.exchange(true))
+      return;
+    thread_ = std::thread(&ReplayClock::run, this, publishFrame);
+  }
+
+  /**
+   * Stops the replay thread. Must be called by the source before it is
+   * destroyed.
+   */
+  void stop() {
+    running_ = false;
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  /**
+   * Returns true once all frames to replay have been emitted; in lockstep
+   * mode, once the pipeline has also finished processing the last one.
+   */
+  bool finished() const { return frames_ > 0 && emitted_ >= frames_; }
+
+private:
+  ReplayMode const mode_;
+  double const frame_rate_;
+  std::shared_ptr<ReplayBarrier> const barrier_;
+  size_t const frames_;
+
+  std::atomic<size_t> emitted_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  void run(std::function<void()> publishFrame) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point const start = clock::now();
+    clock::time_point next_tick = start;
+    clock::duration const period = frame_rate_ > 0
+        ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / frame_rate_))
+        : clock::duration::zero();
+
+    while (running_ && !finished()) {
+      publishFrame();
+
+      if (mode_ == ReplayMode::Lockstep) {
+        // The frame only counts as emitted once the pipeline is done with it,
+        // as the program may exit as soon as the replay is finished.
+        if (barrier_)
+          barrier_->waitIdle();
+        ++emitted_;
+      } else {
+        ++emitted_;
+        if (period != clock::duration::zero()) {
+          next_tick += period;
+          std::this_thread::sleep_until(next_tick);
+        }
+      }
+    }
+
+    if (finished()) {
+      double const seconds = std::chrono::duration<double>(clock::now() - start).count();
+      std::cout << "Replayed " << emitted_ << " frames in " << seconds << " s ("
+                << (seconds > 0 ? emitted_ / seconds : 0) << " fps)" << std::endl;
+    }
+  }
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_REPLAY_CLOCK_H_
@@ -0,0 +1,126 @@
+#ifndef LEPP3_TRIPLE_BUFFER_H_
+#define LEPP3_TRIPLE_BUFFER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+namespace lepp {
+
+/**
+ * A single-producer/single-consumer exchange slot where the consumer always
+ * sees the newest published value.
+ *
+ * Three slots are rotated between the producer (back), the consumer (front)
+ * and a shared middle slot. Publishing and consuming only swap slot indices
+ * with a single atomic exchange, so neither side ever waits for the other
+ * while handing over a value. A value that is published before the consumer
+ * picked up the previous one simply replaces it.
+ *
+ * `T` is meant to be a cheap handle type, e.g. a shared pointer to an
+ * immutable point cloud, so that no data is copied on hand-over.
+ *
+ * For consumers that want to sleep until a value arrives, `waitAndConsume`
+ * is provided. The producer only touches the wake-up mutex if the consumer is
+ * actually asleep.
+ */
+template<class T>
+class TripleBuffer {
+public:
+  TripleBuffer()
+      : middle_(1), back_(0), front_(2), waiting_(false), closed_(false) {}
+
+  /**
+   * Publishes a new value. Returns true if a previously published value was
+   * never consumed and has been replaced by this one.
+   *
+   * Must only be called from the producer thread.
+   */
+  bool publish(T value) {
+    slots_[back_] = std::move(value);
+    unsigned const previous = middle_.exchange(back_ | FRESH);
+    back_ = previous & INDEX;
+
+    if (waiting_.load()) {
+      // the consumer is (about to go) asleep; take the lock so the
+      // notification cannot slip in between its check and its wait
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      wake_cond_.notify_one();
+    }
+    return (previous & FRESH) != 0;
+  }
+
+  /**
+   * Moves the newest published value into `value` if one is available.
+   * Returns false without touching `value` otherwise.
+   *
+   * Must only be called from the consumer thread.
+   */
+  bool consume(T& value) {
+    if (!(middle_.load() & FRESH))
+      return false;
+    front_ = middle_.exchange(front_) & INDEX;
+    // do not keep a reference to the consumed value in the buffer
+    value = std::move(slots_[front_]);
+    slots_[front_] = T();
+    return true;
+  }
+
+  /**
+   * Blocks until a new value is published and moves it into `value`.
+   * Returns false if the buffer was closed.
+   *
+   * Must only be called from the consumer thread.
+   */
+  bool waitAndConsume(T& value) {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    waiting_.store(true);
+    wake_cond_.wait(lock, [this] {
+      return closed_ || (middle_.load() & FRESH);
+    });
+    waiting_.store(false);
+    if (closed_)
+      return false;
+    return consume(value);
+  }
+
+  /**
+   * Wakes up a consumer blocked in `waitAndConsume` and makes all further
+   * calls to it return false.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    closed_ = true;
+    wake_cond_.notify_all();
+  }
+
+private:
+  static unsigned const INDEX = 0x3;
+  static unsigned const FRESH = 0x4;
+
+  T slots_[3];
+
+  /**
+   * Index of the shared slot, with the FRESH bit set when it holds a value
+   * the consumer has not seen yet.
+   */
+  std::atomic<unsigned> middle_;
+  /**
+   * The slot owned by the producer.
+   */
+  unsigned back_;
+  /**
+   * The slot owned by the consumer.
+   */
+  unsigned front_;
+
+  std::atomic<bool> waiting_;
+  bool closed_;
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cond_;
+};
+
+}  // namespace lepp
+
+#endif // LEPP3_TRIPLE_BUFFER_H_
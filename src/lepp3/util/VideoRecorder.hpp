@@ -1,12 +1,19 @@
 #ifndef LEPP3_VIDEO_RECORDER_H_
 #define LEPP3_VIDEO_RECORDER_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <vector>
 #include <boost/filesystem.hpp>
 
@@ -21,6 +28,9 @@
 #include "lepp3/RGBData.hpp"
 
 #include "lepp3/util/util.h"
+#include "lepp3/util/BlockingQueue.hpp"
+#include "lepp3/util/RecordingContainer.hpp"
+#include "lepp3/util/ReplayClock.hpp"
 #include "lepp3/debug/timer.hpp"
 
 
@@ -38,6 +48,16 @@ namespace {
 }
 
 namespace lepp {
+/**
+ * How the recorded frames are stored.
+ */
+enum class RecordingFormat {
+  // cloud_XXXX.pcd, image_XXXX.jpg and a line in params.txt per frame
+  Files,
+  // a single recording.lrec container
+  Container,
+};
+
 /**
   * A recorder module that receives a point cloud, an RGB image and a pose
   * (LolaKinematics) from the camera and the robot and saves them alongside
@@ -60,11 +80,53 @@ namespace lepp {
   *
   * Recording each of these elements are totally optional and could be set by
   * the `setMode` method.
+  *
+  * The observer callbacks never touch the disk: they only queue the elements
+  * of a frame, which are then encoded and written by one or more writer
+  * threads. What happens when the writers cannot keep up and the queue is
+  * full is decided by its `QueueFullPolicy`. Pose parameters are written to
+  * a single, persistent file in frame order, even with several writers.
+  *
+  * Instead of a file per cloud and image, all elements can be recorded into a
+  * single container file (see `RecordingWriter`), which can be played back by
+  * `ContainerVideoSource`.
   */
 template<class PointT>
 class VideoRecorder : public FrameDataObserver, public RGBDataObserver {
 public:
-  VideoRecorder(std::string const& outputPath);
+  /**
+   * Counters describing the state of the recording.
+   */
+  struct Stats {
+    // frames accepted into the queue
+    size_t queued;
+    // frames written to disk
+    size_t written;
+    // frames dropped because the queue was full
+    size_t dropped;
+    // frames queued beyond the queue capacity (Spill policy)
+    size_t spilled;
+    // frames that could not be written
+    size_t failed;
+    // frames waiting in the queue
+    size_t pending;
+  };
+
+  /**
+   * Creates a recorder writing to a new subdirectory of `outputPath`, with a
+   * queue of `queueSize` frames and `writerThreads` writer threads.
+   */
+  VideoRecorder(std::string const& outputPath,
+                size_t queueSize = 32,
+                QueueFullPolicy fullPolicy = QueueFullPolicy::Block,
+                int writerThreads = 1,
+                RecordingFormat format = RecordingFormat::Files,
+                RecordingCompression compression = RecordingCompression::None);
+
+  /**
+   * Waits until all queued elements have been written.
+   */
+  ~VideoRecorder();
 
   /**
    * Implementation of the FrameDataObserver interface.
@@ -82,21 +144,79 @@ public:
    */
   void setMode(bool cloud, bool rgb, bool pose);
 
+  /**
+   * Returns the current recording counters.
+   */
+  Stats stats() const;
+
+  /**
+   * Reports queued frames to the given barrier until they are written, so
+   * that a lockstep replay waits for them. Must be set before the first frame
+   * arrives.
+   */
+  void setReplayBarrier(std::shared_ptr<ReplayBarrier> barrier) { replay_barrier_ = barrier; }
+
 private:
   /**
-   * Write the current point cloud on disk.
+   * The elements of one frame that are still to be written.
+   */
+  struct RecordJob {
+    RecordJob() : seq(0), frame_num(0), capture_us(0), cloud_idx(-1), image_idx(-1), has_params(false) {}
+    // position of the job in the recording; pose parameters and container
+    // chunks are written in this order
+    uint64_t seq;
+    // number of the frame at the source and time it was received
+    long frame_num;
+    int64_t capture_us;
+    int cloud_idx;
+    typename pcl::PointCloud<PointT>::ConstPtr cloud;
+    int image_idx;
+    cv::Mat image;
+    bool has_params;
+    lepp::LolaKinematicsParams params;
+  };
+
+  /**
+   * Hands the job to the writer threads.
+   */
+  void enqueue(RecordJob job);
+
+  /**
+   * Body of a writer thread: writes queued jobs until the queue is closed.
    */
-  void savePointCloud(typename pcl::PointCloud<PointT>::ConstPtr cloud);
+  void writerTask();
 
   /**
-   * Write the current pose parameters in file.
+   * Encodes the job for the container and returns the chunk.
    */
-  void saveParams(lepp::LolaKinematicsParams const& params);
+  std::string encodeJob(RecordJob const& job) const;
 
   /**
-   * Save the current image on disk.
+   * Writes the job's files and returns its pose parameters line (if any).
    */
-  void saveImage(cv::Mat const& image);
+  std::string writeJobFiles(RecordJob const& job);
+
+  /**
+   * Marks the job with the given sequence number as done, writing its ordered
+   * output (a pose parameters line or a container chunk, if any) once all
+   * previous jobs are done as well.
+   */
+  void completeJob(uint64_t seq, std::string output);
+
+  /**
+   * Write the given point cloud on disk.
+   */
+  void savePointCloud(int idx, typename pcl::PointCloud<PointT>::ConstPtr cloud);
+
+  /**
+   * Format the given pose parameters as a line of the params file.
+   */
+  std::string formatParams(lepp::LolaKinematicsParams const& params) const;
+
+  /**
+   * Save the given image on disk.
+   */
+  void saveImage(int idx, cv::Mat const& image);
 
   /**
    * Recording options
@@ -118,10 +238,46 @@ private:
    *
    */
   bool cloud_lk_;
+  /**
+   * The cloud and pose of the current chain, waiting for the RGB image.
+   */
+  RecordJob pending_job_;
+  std::mutex chain_mutex_;
+
+  /**
+   * Queue between the observer callbacks and the writer threads.
+   */
+  BlockingQueue<RecordJob> queue_;
+  std::vector<std::thread> writers_;
+  /**
+   * Sequence number of the next queued job.
+   */
+  std::atomic<uint64_t> next_seq_;
+
+  RecordingFormat const format_;
+  /**
+   * The params file (Files format) or container (Container format), open for
+   * the whole recording, and the output of jobs that completed before some
+   * earlier job did.
+   */
+  std::ofstream params_out_;
+  std::unique_ptr<RecordingWriter> container_;
+  std::map<uint64_t, std::string> pending_output_;
+  uint64_t next_output_seq_;
+  std::mutex output_mutex_;
+
+  std::atomic<size_t> queued_, written_, dropped_, failed_;
+
+  std::shared_ptr<ReplayBarrier> replay_barrier_;
 };
 
 template<class PointT>
-VideoRecorder<PointT>::VideoRecorder(std::string const& outputPath)
+VideoRecorder<PointT>::VideoRecorder(std::string const& outputPath,
+                                     size_t queueSize,
+                                     QueueFullPolicy fullPolicy,
+                                     int writerThreads,
+                                     RecordingFormat format,
+                                     RecordingCompression compression)
     : path_(get_dir(outputPath)),
       params_file_name_("params.txt"),
       record_cloud_(true),
@@ -130,7 +286,15 @@ VideoRecorder<PointT>::VideoRecorder(std::string const& outputPath)
       cloud_idx_(-1),
       image_idx_(-1),
       params_idx_(-1),
-      cloud_lk_(false) {
+      cloud_lk_(false),
+      queue_(queueSize, fullPolicy),
+      next_seq_(0),
+      format_(format),
+      next_output_seq_(0),
+      queued_(0),
+      written_(0),
+      dropped_(0),
+      failed_(0) {
 
   namespace bfs = boost::filesystem;
   if (bfs::exists(path_)) {
@@ -142,19 +306,46 @@ VideoRecorder<PointT>::VideoRecorder(std::string const& outputPath)
     // change current path to the new directory
     bfs::current_path(path_);
 
-    // write header to tf_file
-    std::ofstream tf_fout(params_file_name_.c_str());
-    if (tf_fout.is_open()) {
-      tf_fout << "# t_wr_cl[0],\tt_wr_cl[1],\tt_wr_cl[2],\t"
-              << "R_wr_cl[0][0],\tR_wr_cl[0][1],\tR_wr_cl[0][2],\t"
-              << "R_wr_cl[1][0],\tR_wr_cl[1][1],\tR_wr_cl[1][2],\t"
-              << "R_wr_cl[2][0],\tR_wr_cl[2][1],\tR_wr_cl[2][2],\t"
-              << "t_stance_odo[0],\tt_stance_odo[1],\tt_stance_odo[2],\t"
-              << "phi_z_odo,\tstance,\tframe_num,\tstamp"
-              << std::endl;
-      tf_fout.close();
+    if (format_ == RecordingFormat::Container) {
+      // clouds, images and poses all go into a single container
+      container_.reset(new RecordingWriter("recording.lrec", compression));
+    } else {
+      // write header to tf_file and keep it open for the whole recording
+      params_out_.open(params_file_name_.c_str());
+      if (params_out_.is_open()) {
+        params_out_ << "# t_wr_cl[0],\tt_wr_cl[1],\tt_wr_cl[2],\t"
+                    << "R_wr_cl[0][0],\tR_wr_cl[0][1],\tR_wr_cl[0][2],\t"
+                    << "R_wr_cl[1][0],\tR_wr_cl[1][1],\tR_wr_cl[1][2],\t"
+                    << "R_wr_cl[2][0],\tR_wr_cl[2][1],\tR_wr_cl[2][2],\t"
+                    << "t_stance_odo[0],\tt_stance_odo[1],\tt_stance_odo[2],\t"
+                    << "phi_z_odo,\tstance,\tframe_num,\tstamp"
+                    << std::endl;
+      }
     }
   }
+
+  for (int i = 0; i < std::max(writerThreads, 1); ++i) {
+    writers_.push_back(std::thread(&VideoRecorder<PointT>::writerTask, this));
+  }
+}
+
+template<class PointT>
+VideoRecorder<PointT>::~VideoRecorder() {
+  // a chain still waiting for its image is recorded without it
+  if (cloud_lk_ && (record_cloud_ || record_pose_)) {
+    cloud_lk_ = false;
+    enqueue(std::move(pending_job_));
+  }
+  // the writers drain the queue before they exit
+  queue_.close();
+  for (std::thread& writer : writers_) {
+    writer.join();
+  }
+  if (container_)
+    container_->finish();
+  Stats const s = stats();
+  std::cout << "Recording finished: " << s.written << " written, "
+            << s.dropped << " dropped, " << s.failed << " failed" << std::endl;
 }
 
 template<class PointT>
@@ -168,64 +359,194 @@ void VideoRecorder<PointT>::setMode(bool cloud,
 
 template<class PointT>
 void VideoRecorder<PointT>::updateFrame(FrameDataPtr frameData) {
-  // Save the point cloud if
-  // 1. we are actually told to save it,
+  std::unique_lock<std::mutex> lock(chain_mutex_);
+  // Record the point cloud and pose if
+  // 1. we are actually told to record them,
   // 2. there is no previous cloud waiting for the completion of the recording
   //    chain.
-  if (cloud_lk_) {
+  if (cloud_lk_ || (!record_cloud_ && !record_pose_)) {
     return;
   }
 
+  RecordJob job;
+  job.frame_num = frameData->frameNum;
+  job.capture_us = recording::captureTimeUs();
   if (record_cloud_) {
     ++cloud_idx_;
-    savePointCloud(frameData->cloud);
-    // Set the cloud lock only if here is not the end of recording chain (if
-    // either rgb or pose is also going to be recorded)
-
-    if (record_rgb_)
-      cloud_lk_ = true;
+    job.cloud_idx = cloud_idx_;
+    // clouds are never modified once published, so sharing it is enough
+    job.cloud = frameData->cloud;
   }
 
-
   if (record_pose_) {
     ++params_idx_;
 
-    LolaKinematicsParams params(*frameData->lolaKinematics);
-    params.frame_num = params_idx_;
-    saveParams(params);
-    if (record_rgb_)
-      cloud_lk_ = true;
+    job.has_params = true;
+    job.params = *frameData->lolaKinematics;
+    job.params.frame_num = params_idx_;
+  }
+
+  if (record_rgb_) {
+    // the chain is completed (and queued) by the next image
+    pending_job_ = std::move(job);
+    cloud_lk_ = true;
+  } else {
+    lock.unlock();
+    enqueue(std::move(job));
   }
 }
 
 template<class PointT>
 void VideoRecorder<PointT>::updateFrame(RGBDataPtr rgbData) {
-  // Exception: Make the cloud lock ineffective, if we are not recording any
-  // point clouds.
-  if (!record_cloud_ && !record_pose_)
-    cloud_lk_ = true;
+  if (!record_rgb_)
+    return;
 
-  // Save the image if
-  // 1. we are actually told to save it,
-  // 2. there is already a [supposedly] saved point cloud.
-  // 3. there is no previous image waiting for the completion of the recording
-  //    chain.
-  if (record_rgb_) {
-    if (cloud_lk_) {
-      ++image_idx_;
-      saveImage(rgbData->image);
+  std::unique_lock<std::mutex> lock(chain_mutex_);
+  // Save the image if there is already a point cloud (or pose) waiting for it,
+  // or if it is the only thing we are recording.
+  RecordJob job;
+  if (!record_cloud_ && !record_pose_) {
+    job.frame_num = rgbData->frameNum;
+    job.capture_us = recording::captureTimeUs();
+  } else if (cloud_lk_) {
+    job = std::move(pending_job_);
+    pending_job_ = RecordJob();
+    // here is the end of recording chain. release all
+    // remaining locks.
+    cloud_lk_ = false;
+  } else {
+    return;
+  }
+
+  ++image_idx_;
+  job.image_idx = image_idx_;
+  // the image is only borrowed for the duration of the callback
+  job.image = rgbData->image.clone();
+  lock.unlock();
+  enqueue(std::move(job));
+}
+
+template<class PointT>
+typename VideoRecorder<PointT>::Stats VideoRecorder<PointT>::stats() const {
+  Stats s;
+  s.queued = queued_;
+  s.written = written_;
+  s.dropped = dropped_;
+  s.spilled = queue_.spilled();
+  s.failed = failed_;
+  s.pending = queue_.size();
+  return s;
+}
+
+template<class PointT>
+void VideoRecorder<PointT>::enqueue(RecordJob job) {
+  job.seq = next_seq_++;
+  uint64_t const seq = job.seq;
+
+  if (replay_barrier_)
+    replay_barrier_->enter();
+  std::vector<RecordJob> evicted;
+  if (queue_.push(std::move(job), &evicted)) {
+    ++queued_;
+  } else {
+    if (replay_barrier_)
+      replay_barrier_->leave();
+    // recorder is shutting down
+    ++dropped_;
+    completeJob(seq, std::string());
+  }
+  // dropped jobs never complete on their own
+  for (RecordJob const& e : evicted) {
+    ++dropped_;
+    --queued_;
+    completeJob(e.seq, std::string());
+    if (replay_barrier_)
+      replay_barrier_->leave();
+  }
+}
+
+template<class PointT>
+void VideoRecorder<PointT>::writerTask() {
+  RecordJob job;
+  while (queue_.pop(job)) {
+    std::string output;
+    if (container_) {
+      try {
+        output = encodeJob(job);
+      } catch (std::exception const& e) {
+        std::cerr << "VideoRecorder: encoding frame failed: " << e.what() << std::endl;
+        ++failed_;
+      }
+    } else {
+      output = writeJobFiles(job);
+    }
+    completeJob(job.seq, std::move(output));
+    // release the cloud and image before waiting for the next job
+    job = RecordJob();
+    if (replay_barrier_)
+      replay_barrier_->leave();
+  }
+}
+
+template<class PointT>
+std::string VideoRecorder<PointT>::encodeJob(RecordJob const& job) const {
+  return RecordingWriter::encodeFrame<PointT>(
+      job.frame_num, job.capture_us,
+      job.cloud ? job.cloud.get() : nullptr,
+      job.image.empty() ? nullptr : &job.image,
+      job.has_params ? &job.params : nullptr,
+      container_->compression());
+}
+
+template<class PointT>
+std::string VideoRecorder<PointT>::writeJobFiles(RecordJob const& job) {
+  // the pose is kept even if the cloud or image cannot be written
+  std::string const params_line = job.has_params ? formatParams(job.params) : std::string();
+  try {
+    if (job.cloud)
+      savePointCloud(job.cloud_idx, job.cloud);
+    if (!job.image.empty())
+      saveImage(job.image_idx, job.image);
+    ++written_;
+  } catch (std::exception const& e) {
+    std::cerr << "VideoRecorder: writing frame failed: " << e.what() << std::endl;
+    ++failed_;
+  }
+  return params_line;
+}
 
-      // here is the end of recording chain. release all
-      // remaining locks.
-      cloud_lk_ = false;
+template<class PointT>
+void VideoRecorder<PointT>::completeJob(uint64_t seq, std::string output) {
+  std::lock_guard<std::mutex> lock(output_mutex_);
+  pending_output_[seq] = std::move(output);
+  bool wrote = false;
+  while (!pending_output_.empty() && pending_output_.begin()->first == next_output_seq_) {
+    std::string const& out = pending_output_.begin()->second;
+    if (!out.empty()) {
+      if (container_) {
+        try {
+          container_->append(out);
+          ++written_;
+        } catch (std::exception const& e) {
+          std::cerr << "VideoRecorder: writing frame failed: " << e.what() << std::endl;
+          ++failed_;
+        }
+      } else {
+        params_out_ << out << '\n';
+        wrote = true;
+      }
     }
+    pending_output_.erase(pending_output_.begin());
+    ++next_output_seq_;
   }
+  if (wrote)
+    params_out_.flush();
 }
 
 template<class PointT>
-void VideoRecorder<PointT>::savePointCloud(typename pcl::PointCloud<PointT>::ConstPtr cloud) {
+void VideoRecorder<PointT>::savePointCloud(int idx, typename pcl::PointCloud<PointT>::ConstPtr cloud) {
   std::stringstream file_name;
-  file_name << "cloud_" << std::setfill('0') << std::setw(4) << cloud_idx_ << ".pcd";
+  file_name << "cloud_" << std::setfill('0') << std::setw(4) << idx << ".pcd";
 
   Timer t;
   t.start();
@@ -236,12 +557,12 @@ void VideoRecorder<PointT>::savePointCloud(typename pcl::PointCloud<PointT>::Con
 }
 
 template<class PointT>
-void VideoRecorder<PointT>::saveImage(cv::Mat const& image) {
+void VideoRecorder<PointT>::saveImage(int idx, cv::Mat const& image) {
   Timer t;
   t.start();
 
   std::stringstream file_name;
-  file_name << "image_" << std::setfill('0') << std::setw(4) << image_idx_ << ".jpg";
+  file_name << "image_" << std::setfill('0') << std::setw(4) << idx << ".jpg";
 
   cv::imwrite(file_name.str(), image);
   t.stop();
@@ -249,13 +570,9 @@ void VideoRecorder<PointT>::saveImage(cv::Mat const& image) {
 }
 
 template<class PointT>
-void VideoRecorder<PointT>::saveParams(LolaKinematicsParams const& params) {
-  Timer t;
-  t.start();
-  std::ofstream tf_fout_;
-  // open the file and add the current params to the end of it
-  tf_fout_.open(params_file_name_.c_str(), std::ofstream::app);
-  // write the parameters to the file
+std::string VideoRecorder<PointT>::formatParams(LolaKinematicsParams const& params) const {
+  std::ostringstream tf_fout_;
+  // write the parameters to the line
   for (size_t i = 0; i < 3; ++i) {
     tf_fout_ << params.t_wr_cl[i] << "\t";
   }
@@ -271,11 +588,7 @@ void VideoRecorder<PointT>::saveParams(LolaKinematicsParams const& params) {
   tf_fout_ << params.stance << "\t";
   tf_fout_ << params.frame_num << "\t";
   tf_fout_ << params.stamp;
-  tf_fout_ << std::endl;
-  // ... and close the file.
-  tf_fout_.close();
-  t.stop();
-  std::cout << "SAVING PARAMS TOOK: " << t.duration() << " ms" << std::endl;
+  return tf_fout_.str();
 }
 }
 #endif // LEPP3_VIDEO_RECORDER_H_
@@ -1,184 +1,245 @@
 #include "VoxelGrid.h"
 
-#include <stack>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace {
 const float DEFAULT_RESOLUTION = 0.1f;
+
+// below this many occupied cells, labeling them is not worth a thread team
+const size_t MIN_PARALLEL_CELLS = 4096;
 }
 
+template<size_t DIMENSIONS>
+constexpr typename lepp::util::VoxelGrid<DIMENSIONS>::key_type lepp::util::VoxelGrid<DIMENSIONS>::EMPTY_KEY;
+
+template<size_t DIMENSIONS>
+constexpr uint32_t lepp::util::VoxelGrid<DIMENSIONS>::NO_CELL;
+
 template<size_t DIMENSIONS>
 lepp::util::VoxelGrid<DIMENSIONS>::VoxelGrid(float resolution)
     : _resolution((resolution > 0.0f) ? resolution : DEFAULT_RESOLUTION) {
   _maxBounds = vector_float::Zero();
   _minBounds = vector_float::Zero();
 
-  constexpr int START = -1;
-  constexpr int END = 1;
-  std::array<int, DIMENSIONS> offsets;
-  offsets.fill(START);
-
+  // all offsets in {-1, 0, 1}^DIMENSIONS that are neither diagonal nor zero
   size_t count = 0;
-  size_t ptr = 0;
-  auto idx = [&]() { return DIMENSIONS - 1 - ptr; };
-  auto is_valid = [](const std::array<int, DIMENSIONS>& offsets) {
+  for (size_t code = 0; code < pow(3, DIMENSIONS); ++code) {
     size_t zeros = 0;
-    for (auto& v : offsets) {
-      if (0 == v) {
+    int64_t delta = 0;
+    size_t rest = code;
+    for (size_t i = 0; i < DIMENSIONS; ++i, rest /= 3) {
+      const int offset = static_cast<int>(rest % 3) - 1;
+      if (0 == offset) {
         ++zeros;
       }
+      delta += static_cast<int64_t>(offset) * (int64_t(1) << (KEY_BITS * i));
     }
-    return zeros != 0   // diagonal
-           && zeros != DIMENSIONS; // ourselves
-  };
-  auto fill_offsets = [this, &is_valid, &count](const std::array<int, DIMENSIONS>& offsets) {
-    if (!is_valid(offsets)) {
-      return;
+    if (zeros != 0 && zeros != DIMENSIONS && delta > 0) {
+      _forwardOffsets[count++] = static_cast<key_type>(delta);
     }
+  }
+}
 
-    for (size_t i = 0; i < DIMENSIONS; ++i) {
-      _cellOffsets(count, i) = offsets[i];
-    }
-    _cellOffsets(count, DIMENSIONS) = 0;
-    ++count;
-  };
-
-  fill_offsets(offsets);
-  while (ptr < DIMENSIONS) {
-    if (offsets[idx()] < END) {
-      ++offsets[idx()];
-      while (ptr > 0) {
-        --ptr;
-        offsets[idx()] = START;
-      }
-      fill_offsets(offsets);
-    } else {
-      ++ptr;
-    }
+template<size_t DIMENSIONS>
+auto lepp::util::VoxelGrid<DIMENSIONS>::cellKey(const float* point) const -> key_type {
+  key_type key = 0;
+  for (size_t i = 0; i < DIMENSIONS; ++i) {
+    const float cell = (point[i] - _minBounds(i)) / _resolution;
+    key |= static_cast<key_type>(static_cast<int64_t>(cell)) << (KEY_BITS * i);
+  }
+  return key;
+}
+
+template<size_t DIMENSIONS>
+size_t lepp::util::VoxelGrid<DIMENSIONS>::slotOf(key_type key) const {
+  const size_t mask = _tableKeys.size() - 1;
+  size_t slot = static_cast<size_t>((key * 0x9e3779b97f4a7c15ULL) >> (64 - _tableBits));
+  while (_tableKeys[slot] != key && _tableKeys[slot] != EMPTY_KEY) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+template<size_t DIMENSIONS>
+uint32_t lepp::util::VoxelGrid<DIMENSIONS>::findRoot(uint32_t cell) {
+  while (_parent[cell] != cell) {
+    // path halving
+    _parent[cell] = _parent[_parent[cell]];
+    cell = _parent[cell];
+  }
+  return cell;
+}
+
+template<size_t DIMENSIONS>
+void lepp::util::VoxelGrid<DIMENSIONS>::unite(uint32_t a, uint32_t b) {
+  a = findRoot(a);
+  b = findRoot(b);
+  if (a < b) {
+    _parent[b] = a;
+  } else if (b < a) {
+    _parent[a] = b;
   }
 }
 
 template<size_t DIMENSIONS>
 void lepp::util::VoxelGrid<DIMENSIONS>::build(const std::vector<vector_float>& data) {
-  using namespace Eigen;
+  static_assert(sizeof(vector_float) == (DIMENSIONS + 1) * sizeof(float),
+                "the points are expected to be packed");
+  build(data.empty() ? nullptr : data[0].data(), data.size(), DIMENSIONS + 1);
+}
 
-  _minBounds = data[0];
-  _maxBounds = data[0];
+template<size_t DIMENSIONS>
+void lepp::util::VoxelGrid<DIMENSIONS>::build(const float* coords, size_t count, size_t stride) {
+  _cellKeys.clear();
+  _pointCell.clear();
+  _numClusters = 0;
+  if (0 == count) {
+    _tableKeys.clear();
+    _tableCells.clear();
+    return;
+  }
 
-  for (auto& d : data) {
+  _minBounds = vector_float::Zero();
+  _maxBounds = vector_float::Zero();
+  for (size_t i = 0; i < DIMENSIONS; ++i) {
+    _minBounds(i) = coords[i];
+    _maxBounds(i) = coords[i];
+  }
+
+  for (size_t p = 0; p < count; ++p) {
+    const float* d = coords + p * stride;
     for (size_t i = 0; i < DIMENSIONS; ++i) {
-      _minBounds(i) = std::min(_minBounds(i), d(i));
-      _maxBounds(i) = std::max(_maxBounds(i), d(i));
+      _minBounds(i) = std::min(_minBounds(i), d[i]);
+      _maxBounds(i) = std::max(_maxBounds(i), d[i]);
     }
   }
 
   const float safetyMargin = 0.001f;
-  // add extra space - see below why
+  // add extra space, so that the coordinates of every occupied cell and of
+  // its neighbors are positive and a neighbor's key is a plain sum
   _minBounds.array() -= 2 * _resolution + safetyMargin;
   _maxBounds.array() += 2 * _resolution + safetyMargin;
 
-  const auto gridSize = calcGridSize();
-
+  const double maxCells = static_cast<double>((key_type(1) << KEY_BITS) - 1);
   for (size_t i = 0; i < DIMENSIONS; ++i) {
-    _numCells[i] = gridSize(i);
-  }
-  allocateGrid();
-
-  // cached neighbor offsets into the _grid array
-  Eigen::Array<int, _numCellNeighbors, 1> gridOffsets;
-  for (size_t i = 0; i < _numCellNeighbors; ++i) {
-    gridOffsets[i] = cellToGridIndex(_cellOffsets.row(i));
+    if (!((_maxBounds(i) - _minBounds(i)) / _resolution < maxCells)) {
+      throw std::runtime_error("VoxelGrid: the points span too many cells for the resolution");
+    }
   }
 
-  // clear the grid
-  std::fill(_grid.begin(), _grid.end(), EMPTY_CELL);
-
-  for (auto& d : data) {
-    const vector_float tmp = (d - _minBounds) / _resolution;
-    vector_int cellIndex = tmp.template cast<int>();
-
-    _grid[cellToGridIndex(cellIndex)] = UNVISITED_CELL;
+  // a table at most half full, however many points share a cell
+  _tableBits = 1;
+  while ((size_t(1) << _tableBits) < 2 * count) {
+    ++_tableBits;
   }
-
-  size_t curCluster = CLUSTERED_CELL_START;
-
-  // do a simple DFS with restarts to cluster the connected grid cells
-  std::stack<size_t> stack;
-  std::array<size_t, DIMENSIONS> cell_idx;
-  cell_idx.fill(1);
-  cell_idx[0] = 0; // to also visit the first value
-
-  size_t ptr = 0;
-  while (ptr < DIMENSIONS) {
-    if (cell_idx[ptr] == _numCells[ptr] - 1) {
-      ++ptr;
-      continue;
-    }
-    ++cell_idx[ptr];
-    while (ptr > 0) {
-      --ptr;
-      cell_idx[ptr] = 1;
+  _tableKeys.assign(size_t(1) << _tableBits, EMPTY_KEY);
+  _tableCells.assign(_tableKeys.size(), NO_CELL);
+
+  // insert the occupied cells; every point remembers its slot for now
+  _pointCell.resize(count);
+  for (size_t p = 0; p < count; ++p) {
+    const key_type key = cellKey(coords + p * stride);
+    const size_t slot = slotOf(key);
+    if (_tableKeys[slot] == EMPTY_KEY) {
+      _tableKeys[slot] = key;
+      _cellKeys.push_back(key);
     }
+    _pointCell[p] = static_cast<uint32_t>(slot);
+  }
 
-    const size_t gridIndex = cellToGridIndex(cell_idx);
-    if (_grid[gridIndex] == 1) {
-      stack.push(gridIndex);
-
-      while (!stack.empty()) {
-        const int gridIdx = stack.top();
-        stack.pop();
+  // Numbering the cells in the order of their keys makes the smallest cell
+  // of every cluster (and so the numbering of the clusters) independent of
+  // the order of the points.
+  std::sort(_cellKeys.begin(), _cellKeys.end());
+  const size_t numCells = _cellKeys.size();
+  for (size_t c = 0; c < numCells; ++c) {
+    _tableCells[slotOf(_cellKeys[c])] = static_cast<uint32_t>(c);
+  }
+  for (auto& cell : _pointCell) {
+    cell = _tableCells[cell];
+  }
 
-        _grid[gridIdx] = curCluster;
+  _parent.resize(numCells);
+  for (size_t c = 0; c < numCells; ++c) {
+    _parent[c] = static_cast<uint32_t>(c);
+  }
 
-        // visit all neighbors
-        for (size_t n = 0; n < _numCellNeighbors; n++) {
-          const size_t neighborGridIndex = gridIdx + gridOffsets[n];
-          if (_grid[neighborGridIndex] == 1) {
-            stack.push(neighborGridIndex);
-          }
+  // Every thread joins the cells of its own chunk of consecutive cells; the
+  // edges to later chunks are joined afterwards. A forward neighbor always
+  // comes after its cell, so a thread never touches another chunk's cells.
+  // As the keys are sorted, so are the keys of the neighbors in any one
+  // direction: they are found by a merge of the two sequences.
+#ifdef _OPENMP
+  const size_t threads = numCells >= MIN_PARALLEL_CELLS ? omp_get_max_threads() : 1;
+#else
+  const size_t threads = 1;
+#endif
+  _crossEdges.resize(threads);
+#pragma omp parallel for schedule(static) num_threads(threads)
+  for (long t = 0; t < static_cast<long>(threads); ++t) {
+    const size_t begin = numCells * t / threads;
+    const size_t end = numCells * (t + 1) / threads;
+    auto& cross = _crossEdges[t];
+    cross.clear();
+    for (const key_type offset : _forwardOffsets) {
+      size_t neighbor = begin;
+      for (size_t c = begin; c < end; ++c) {
+        const key_type key = _cellKeys[c] + offset;
+        while (neighbor < numCells && _cellKeys[neighbor] < key) {
+          ++neighbor;
+        }
+        if (neighbor == numCells) {
+          break;
+        }
+        if (_cellKeys[neighbor] != key) {
+          continue;
+        }
+        if (neighbor < end) {
+          unite(static_cast<uint32_t>(c), static_cast<uint32_t>(neighbor));
+        } else {
+          cross.emplace_back(static_cast<uint32_t>(c), static_cast<uint32_t>(neighbor));
         }
       }
-
-      ++curCluster;
     }
   }
-
-  _numClusters = curCluster - CLUSTERED_CELL_START;
-}
-
-template<size_t DIMENSIONS>
-auto lepp::util::VoxelGrid<DIMENSIONS>::calcGridSize() const
--> Eigen::Matrix<size_t, DIMENSIONS, 1> {
-  vector_float numCells = (_maxBounds - _minBounds) / _resolution;
-  numCells.unaryExpr(std::ptr_fun<float, float>(std::ceil));
-
-  vector_int nc = numCells.template cast<int>();
-  for (size_t i = 0; i < DIMENSIONS; ++i) {
-    if (nc[i] < 0) {
-      nc[i] = 0;
+  for (const auto& cross : _crossEdges) {
+    for (const auto& edge : cross) {
+      unite(edge.first, edge.second);
     }
   }
 
-  return nc.template head<DIMENSIONS>().
-      template cast<size_t>();
+  // the clusters are numbered in the order of their smallest cells
+  _cellCluster.resize(numCells);
+  for (size_t c = 0; c < numCells; ++c) {
+    const uint32_t root = findRoot(static_cast<uint32_t>(c));
+    _cellCluster[c] = (root == c) ? _numClusters++ : _cellCluster[root];
+  }
 }
 
 template<size_t DIMENSIONS>
-void lepp::util::VoxelGrid<DIMENSIONS>::allocateGrid() {
-  size_t num_cells = 1;
-
+auto lepp::util::VoxelGrid<DIMENSIONS>::cellCoordinates(size_t cell) const
+-> std::array<size_t, DIMENSIONS> {
+  const key_type mask = (key_type(1) << KEY_BITS) - 1;
+  std::array<size_t, DIMENSIONS> coordinates;
   for (size_t i = 0; i < DIMENSIONS; ++i) {
-    num_cells *= _numCells[i];
+    coordinates[i] = static_cast<size_t>((_cellKeys[cell] >> (KEY_BITS * i)) & mask);
   }
-
-  _grid.resize(num_cells);
+  return coordinates;
 }
 
 template<size_t DIMENSIONS>
 size_t lepp::util::VoxelGrid<DIMENSIONS>::clusterForPoint(const vector_float& point) const {
-  vector_float tmp = (point - _minBounds) / _resolution;
-  vector_int cellIndex = tmp.template cast<int>();
-
-  return _grid[cellToGridIndex(cellIndex)] - CLUSTERED_CELL_START;
+  const uint32_t cell = findCell(cellKey(point.data()));
+  if (cell == NO_CELL) {
+    return std::numeric_limits<size_t>::max();
+  }
+  return _cellCluster[cell];
 }
 
 // explicit instantiation
@@ -2,6 +2,8 @@
 #define LEPP3_UTIL_VOXELGRID_H
 
 #include <array>
+#include <cstdint>
+#include <utility>
 #include <vector>
 
 #include <Eigen/Dense>
@@ -12,15 +14,18 @@ constexpr size_t pow(size_t base, size_t exp) {
   return (0 == exp) ? 1 : base * pow(base, exp - 1);
 }
 
+/**
+ * Clusters points by the connected components of the grid cells they fall
+ * into; two cells are connected if they share a face (or, in 3D, an edge).
+ *
+ * Only the occupied cells are stored, in an open-addressing hash table keyed
+ * by their packed integer coordinates, so the cost of building the grid is
+ * proportional to the number of points and occupied cells, not to the volume
+ * of their bounding box.
+ */
 template<size_t DIMENSIONS>
 class VoxelGrid {
 public:
-  enum : size_t {
-    EMPTY_CELL = 0,
-    UNVISITED_CELL = 1,
-    CLUSTERED_CELL_START = 2,
-  };
-
   template<typename T>
   using vector_type = Eigen::Matrix<T, DIMENSIONS + 1, 1>;
   using vector_float = vector_type<float>;
@@ -32,9 +37,16 @@ public:
   // build the grid using the given data and fill the cells that contain points
   void build(const std::vector<vector_float>& data);
 
+  // build the grid from `count` points, whose DIMENSIONS coordinates start
+  // every `stride` floats at `coords`
+  void build(const float* coords, size_t count, size_t stride);
+
   // returns the cluster index for a given point (must be inside the grid)
   size_t clusterForPoint(const vector_float& point) const;
 
+  // returns the cluster index of the i-th point the grid was built from
+  size_t clusterOfPoint(size_t i) const { return _cellCluster[_pointCell[i]]; }
+
   size_t numClusters() const { return _numClusters; }
 
 protected:
@@ -42,33 +54,38 @@ protected:
 
   vector_float minBounds() const { return _minBounds; }
 
-  const std::array<size_t, DIMENSIONS>& numCells() const { return _numCells; }
+  // the occupied cells are numbered from 0, ordered by their last coordinate,
+  // then by the one before it, etc.
+  size_t numOccupiedCells() const { return _cellKeys.size(); }
 
-  const std::vector<size_t>& grid() const { return _grid; }
+  // the coordinates of an occupied cell, in cells from minBounds()
+  std::array<size_t, DIMENSIONS> cellCoordinates(size_t cell) const;
 
-  // map from a cell to an index into the _grid array
-  template<typename Cell>
-  size_t cellToGridIndex(const Cell& cellIndex) const {
-    size_t result = 0;
-    for (size_t i = DIMENSIONS; i > 0; --i) {
-      result *= _numCells[i - 1];
-      result += cellIndex[i - 1];
-    }
-    return result;
-  }
+  size_t cellCluster(size_t cell) const { return _cellCluster[cell]; }
 
-  template<typename ... Args>
-  size_t cellToGridIndexElements(Args&&...args) const {
-    return cellToGridIndex(std::vector<size_t>{std::forward<Args>(args)...});
-  }
+private:
+  typedef uint64_t key_type;
 
+  // the number of bits of each coordinate in a key
+  constexpr static unsigned KEY_BITS = 64 / DIMENSIONS;
+  constexpr static key_type EMPTY_KEY = ~key_type(0);
+  constexpr static uint32_t NO_CELL = ~uint32_t(0);
 
-private:
-  // calculate the number of grid cells in each dimension using min/max bounds and the resolution
-  Eigen::Matrix<size_t, DIMENSIONS, 1> calcGridSize() const;
+  // the key of the cell containing the point with the given coordinates
+  key_type cellKey(const float* point) const;
+
+  // the slot of the hash table holding the given key, or the empty slot
+  // where it would be inserted
+  size_t slotOf(key_type key) const;
+
+  // the occupied cell with the given key, or NO_CELL
+  uint32_t findCell(key_type key) const {
+    return _tableKeys.empty() ? NO_CELL : _tableCells[slotOf(key)];
+  }
 
-  // ensure enough space is allocted for the grid
-  void allocateGrid();
+  // union-find over the occupied cells; the root of a set is its smallest cell
+  uint32_t findRoot(uint32_t cell);
+  void unite(uint32_t a, uint32_t b);
 
 public:
   const float _resolution;
@@ -77,12 +94,25 @@ private:
   vector_float _maxBounds;
   vector_float _minBounds;
 
-  std::array<size_t, DIMENSIONS> _numCells;
-
-  Eigen::Matrix<int, _numCellNeighbors, DIMENSIONS + 1> _cellOffsets;
-
-  // 0: empty cell, 1: occupied but unvisited cell, 2...: cluster nr for cell + 2
-  std::vector<size_t> _grid;
+  // The differences between the key of a cell and the keys of those
+  // neighbors that have larger keys, i.e. half of the neighbors.
+  std::array<key_type, _numCellNeighbors / 2> _forwardOffsets;
+
+  // The hash table, with a power-of-two number of slots. An empty slot has
+  // the key EMPTY_KEY.
+  std::vector<key_type> _tableKeys;
+  std::vector<uint32_t> _tableCells;
+  unsigned _tableBits = 0;
+
+  // The keys of the occupied cells, in ascending order, their parents in the
+  // union-find forest and their clusters
+  std::vector<key_type> _cellKeys;
+  std::vector<uint32_t> _parent;
+  std::vector<size_t> _cellCluster;
+  // the cell of each point the grid was built from
+  std::vector<uint32_t> _pointCell;
+  // the edges between cells of different chunks, per thread
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> _crossEdges;
 
   size_t _numClusters = 0;
 };
@@ -0,0 +1,167 @@
+#include "lola/CloudCodec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+#ifdef LEPP3_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <iface_vision_cloud.hpp>
+
+#include "lepp3/util/Metrics.hpp"
+
+using am2b_iface::CompressedPointCloudMessage;
+
+namespace {
+  /**
+   * Sorts voxel keys, which use the lower 48 bits, with an LSD radix sort of
+   * three 16-bit digits; clouds have far too many points for a comparison
+   * sort to be cheap.
+   */
+  void sortKeys(std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch, std::vector<size_t>& counts) {
+    size_t const RADIX = 1 << 16;
+    counts.resize(RADIX);
+    scratch.resize(keys.size());
+    for (int shift = 0; shift < 48; shift += 16) {
+      std::fill(counts.begin(), counts.end(), 0);
+      for (uint64_t key : keys)
+        ++counts[(key >> shift) & (RADIX - 1)];
+      size_t offset = 0;
+      for (size_t& c : counts) {
+        size_t const n = c;
+        c = offset;
+        offset += n;
+      }
+      for (uint64_t key : keys)
+        scratch[counts[(key >> shift) & (RADIX - 1)]++] = key;
+      keys.swap(scratch);
+    }
+  }
+
+  bool quantizeCoord(float v, double scale, int16_t& q) {
+    double const steps = std::floor(v * scale + 0.5);
+    if (!(steps >= std::numeric_limits<int16_t>::min() && steps <= std::numeric_limits<int16_t>::max()))
+      return false;
+    q = static_cast<int16_t>(steps);
+    return true;
+  }
+}
+
+CloudEncoder::CloudEncoder(CloudCodecOptions const& options)
+    : options_(options), sequence_(0), since_keyframe_(-1), keyframe_sequence_(0),
+      last_was_keyframe_(false) {
+  if (!(options_.resolution > 0))
+    throw std::runtime_error("CloudEncoder: the resolution must be positive");
+#ifndef LEPP3_HAVE_LZ4
+  if (options_.lz4)
+    throw std::runtime_error("CloudEncoder: LZ4 compression requested, but built without LZ4 support");
+#endif
+}
+
+bool CloudEncoder::referenced() const {
+  return last_was_keyframe_ && options_.voxels && options_.keyframeInterval > 1;
+}
+
+void CloudEncoder::quantize(lepp::PointCloudT const& cloud) {
+  double const scale = 1.0 / options_.resolution;
+  points_.clear();
+  keys_.clear();
+  for (lepp::PointT const& p : cloud.points) {
+    int16_t x, y, z;
+    // NaN points fail the range check as well
+    if (!quantizeCoord(p.x, scale, x) || !quantizeCoord(p.y, scale, y) || !quantizeCoord(p.z, scale, z))
+      continue;
+    if (options_.voxels) {
+      keys_.push_back(am2b_iface::cloud::voxelKey(x, y, z));
+    } else {
+      points_.push_back(x);
+      points_.push_back(y);
+      points_.push_back(z);
+    }
+  }
+  if (options_.voxels) {
+    sortKeys(keys_, scratch_, counts_);
+    keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+  }
+}
+
+CompressedPointCloudMessage CloudEncoder::encode(lepp::PointCloudT const& cloud) {
+  lepp::MetricsClock::time_point const start = lepp::MetricsClock::now();
+  quantize(cloud);
+
+  CompressedPointCloudMessage msg;
+  msg.flags = 0;
+  msg.resolution = static_cast<float>(options_.resolution);
+  msg.sequence = ++sequence_;
+  raw_.clear();
+
+  if (!options_.voxels) {
+    msg.flags |= am2b_iface::CLOUD_KEYFRAME;
+    msg.count = static_cast<uint32_t>(points_.size() / 3);
+    msg.keyframe = msg.sequence;
+    char const* data = reinterpret_cast<char const*>(points_.data());
+    raw_.assign(data, data + points_.size() * sizeof(int16_t));
+    last_was_keyframe_ = true;
+  } else {
+    msg.flags |= am2b_iface::CLOUD_VOXELS;
+    msg.count = static_cast<uint32_t>(keys_.size());
+
+    bool keyframe = since_keyframe_ < 0 || options_.keyframeInterval <= 1
+        || since_keyframe_ + 1 >= options_.keyframeInterval;
+    if (!keyframe) {
+      removed_.clear();
+      added_.clear();
+      std::set_difference(keyframe_keys_.begin(), keyframe_keys_.end(), keys_.begin(), keys_.end(),
+                          std::back_inserter(removed_));
+      std::set_difference(keys_.begin(), keys_.end(), keyframe_keys_.begin(), keyframe_keys_.end(),
+                          std::back_inserter(added_));
+      // The scene changed too much for a delta to pay off.
+      keyframe = removed_.size() + added_.size() >= keys_.size();
+    }
+
+    if (keyframe) {
+      msg.flags |= am2b_iface::CLOUD_KEYFRAME;
+      am2b_iface::cloud::putKeys(raw_, keys_);
+      keyframe_keys_.swap(keys_);
+      keyframe_sequence_ = msg.sequence;
+      since_keyframe_ = 0;
+    } else {
+      am2b_iface::cloud::putKeys(raw_, removed_);
+      am2b_iface::cloud::putKeys(raw_, added_);
+      ++since_keyframe_;
+    }
+    msg.keyframe = keyframe_sequence_;
+    last_was_keyframe_ = keyframe;
+  }
+
+  compress(msg);
+  lepp::MetricsClock::duration const elapsed = lepp::MetricsClock::now() - start;
+  lepp::PipelineMetrics::instance().record(lepp::Stage::CloudEncode, elapsed);
+  msg.encode_us = static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  return msg;
+}
+
+void CloudEncoder::compress(CompressedPointCloudMessage& msg) {
+  msg.raw_size = static_cast<uint32_t>(raw_.size());
+#ifdef LEPP3_HAVE_LZ4
+  if (options_.lz4 && !raw_.empty()) {
+    int const bound = LZ4_compressBound(static_cast<int>(raw_.size()));
+    payload_.resize(bound);
+    int const n = LZ4_compress_default(raw_.data(), payload_.data(), static_cast<int>(raw_.size()), bound);
+    // incompressible payloads are sent as they are
+    if (n > 0 && static_cast<size_t>(n) < raw_.size()) {
+      payload_.resize(n);
+      msg.flags |= am2b_iface::CLOUD_LZ4;
+      msg.payload_size = static_cast<uint32_t>(n);
+      return;
+    }
+  }
+#endif
+  payload_.swap(raw_);
+  msg.payload_size = static_cast<uint32_t>(payload_.size());
+}
@@ -0,0 +1,108 @@
+#ifndef LOLA_CLOUD_CODEC_H__
+#define LOLA_CLOUD_CODEC_H__
+
+#include <cstdint>
+#include <vector>
+
+#include <iface_vision_msg.hpp>
+
+#include "lepp3/Typedefs.hpp"
+
+/**
+ * The options of a `CloudEncoder`.
+ */
+struct CloudCodecOptions {
+  /**
+   * The size of a quantization step, in meters. Coordinates are sent as
+   * multiples of it in an int16_t, so points farther than 32767 steps from
+   * the origin are left out.
+   */
+  double resolution = 0.002;
+  /**
+   * Whether points falling into the same voxel (a cube with the size of a
+   * quantization step) are sent only once. Deltas require it.
+   */
+  bool voxels = true;
+  /**
+   * Every this many clouds, a keyframe is sent; the clouds in between are
+   * sent as deltas against the last keyframe. With 1 (or without voxels),
+   * every cloud is a keyframe.
+   */
+  int keyframeInterval = 30;
+  /**
+   * Whether the payload is compressed with LZ4; requires building with
+   * LEPP3_HAVE_LZ4.
+   */
+  bool lz4 = false;
+};
+
+/**
+ * Encodes point clouds into `CompressedPointCloudMessage`s (see
+ * iface_vision_cloud.hpp for the format).
+ *
+ * Deltas refer to the last keyframe rather than to the previous cloud, so
+ * that dropping any delta (e.g. when the link cannot keep up) does not keep
+ * the receiver from decoding the following ones. Only the keyframes need to
+ * arrive. A new keyframe is sent once the delta would be larger than the
+ * keyframe itself.
+ */
+class CloudEncoder {
+public:
+  explicit CloudEncoder(CloudCodecOptions const& options);
+
+  /**
+   * Encodes the given cloud. Returns the message struct; the payload it
+   * describes is `payload()` until the next call.
+   */
+  am2b_iface::CompressedPointCloudMessage encode(lepp::PointCloudT const& cloud);
+
+  std::vector<char> const& payload() const { return payload_; }
+
+  /**
+   * Whether the receiver needs the last encoded cloud to decode later ones.
+   */
+  bool referenced() const;
+
+  /**
+   * Makes the next cloud a keyframe, e.g. because the receiver may not have
+   * received the last one.
+   */
+  void reset() { since_keyframe_ = -1; }
+
+  CloudCodecOptions const& options() const { return options_; }
+
+private:
+  /**
+   * Quantizes the finite points of the cloud that are in range into
+   * `points_`, or into the sorted voxel keys `keys_`.
+   */
+  void quantize(lepp::PointCloudT const& cloud);
+  /**
+   * Compresses `raw_` into `payload_` and fills in the sizes and the flag.
+   */
+  void compress(am2b_iface::CompressedPointCloudMessage& msg);
+
+  CloudCodecOptions const options_;
+  uint32_t sequence_;
+  /**
+   * The number of clouds since the last keyframe, or -1 if the next one
+   * must be a keyframe.
+   */
+  int since_keyframe_;
+  uint32_t keyframe_sequence_;
+  std::vector<uint64_t> keyframe_keys_;
+  bool last_was_keyframe_;
+
+  // Reused between clouds, so that encoding does not allocate in the steady
+  // state.
+  std::vector<int16_t> points_;
+  std::vector<uint64_t> keys_;
+  std::vector<uint64_t> scratch_;
+  std::vector<size_t> counts_;
+  std::vector<uint64_t> removed_;
+  std::vector<uint64_t> added_;
+  std::vector<char> raw_;
+  std::vector<char> payload_;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "lola/ImageStream.h"
+
+#include <stdexcept>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "deps/easylogging++.h"
+#include "lepp3/util/Metrics.hpp"
+
+using am2b_iface::CompressedImageMessage;
+
+ImageStream::ImageStream(boost::shared_ptr<RobotService> service, ImageStreamOptions const& options)
+    : service_(service), options_(options), skipped_(0) {
+  if (options_.subsample < 1)
+    throw std::runtime_error("ImageStream: the subsampling factor must be at least 1");
+  if (options_.jpegQuality < 0 || options_.jpegQuality > 100)
+    throw std::runtime_error("ImageStream: the JPEG quality must be between 0 and 100");
+  thread_ = std::thread(&ImageStream::run, this);
+}
+
+ImageStream::~ImageStream() {
+  pending_.close();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void ImageStream::post(cv::Mat const& image, long frame_num) {
+  // The grabber reuses its image, so it is copied before it is handed over.
+  Frame frame;
+  frame.image = image.clone();
+  frame.frameNum = frame_num;
+  if (pending_.publish(std::move(frame)))
+    ++skipped_;
+}
+
+void ImageStream::run() {
+  Frame frame;
+  while (pending_.waitAndConsume(frame)) {
+    // Whatever is encoded now would be dropped by the service.
+    if (!service_->isConnected())
+      continue;
+    try {
+      lepp::MetricsClock::time_point const start = lepp::MetricsClock::now();
+      cv::Mat const* image = &frame.image;
+      if (options_.subsample > 1) {
+        cv::resize(frame.image, scaled_,
+                   cv::Size(frame.image.cols / options_.subsample, frame.image.rows / options_.subsample),
+                   0, 0, cv::INTER_AREA);
+        image = &scaled_;
+      }
+      OutgoingMessage const msg = encode(*image, frame.frameNum, start);
+      lepp::PipelineMetrics::instance().record(lepp::Stage::ImageEncode, lepp::MetricsClock::now() - start);
+      service_->sendMessage(msg);
+    } catch (std::exception const& e) {
+      LERROR << "ImageStream: Cannot encode image " << frame.frameNum << ": " << e.what();
+    }
+  }
+}
+
+OutgoingMessage ImageStream::encode(cv::Mat const& image, long frame_num,
+                                    lepp::MetricsClock::time_point start) {
+  if (options_.encoding == ImageStreamOptions::Encoding::Raw)
+    return encoder_.encodeRGBImage(image, frame_num);
+
+  CompressedImageMessage msg;
+  msg.width = image.cols;
+  msg.height = image.rows;
+  if (options_.encoding == ImageStreamOptions::Encoding::Gray) {
+    cv::cvtColor(image, converted_, cv::COLOR_RGB2GRAY);
+    msg.format = am2b_iface::IMAGE_GRAY8;
+    payload_.assign(converted_.datastart, converted_.dataend);
+  } else {
+    // The grabber's images are RGB, while OpenCV encodes BGR.
+    cv::cvtColor(image, converted_, cv::COLOR_RGB2BGR);
+    std::vector<int> const params = { cv::IMWRITE_JPEG_QUALITY, options_.jpegQuality };
+    if (!cv::imencode(".jpg", converted_, payload_, params))
+      throw std::runtime_error("JPEG encoding failed");
+    msg.format = am2b_iface::IMAGE_JPEG;
+  }
+  msg.payload_size = static_cast<uint32_t>(payload_.size());
+  msg.encode_us = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+      lepp::MetricsClock::now() - start).count());
+  return encoder_.encodeImage(msg, reinterpret_cast<char const*>(payload_.data()), frame_num);
+}
@@ -0,0 +1,100 @@
+#ifndef LOLA_IMAGE_STREAM_H__
+#define LOLA_IMAGE_STREAM_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include "lepp3/util/TripleBuffer.hpp"
+#include "lola/MessageBuffer.h"
+#include "lola/RobotService.h"
+
+/**
+ * The options of an `ImageStream`.
+ */
+struct ImageStreamOptions {
+  enum class Encoding {
+    /**
+     * Uncompressed RGB, as `RGBMessage`s.
+     */
+    Raw,
+    /**
+     * Uncompressed 8-bit grayscale, as `CompressedImageMessage`s.
+     */
+    Gray,
+    /**
+     * JPEG, as `CompressedImageMessage`s.
+     */
+    Jpeg
+  };
+  Encoding encoding = Encoding::Raw;
+  /**
+   * The JPEG quality, from 0 to 100.
+   */
+  int jpegQuality = 80;
+  /**
+   * Images are scaled down by this factor in both dimensions before they
+   * are encoded.
+   */
+  int subsample = 1;
+};
+
+/**
+ * Sends the camera's RGB images to the robot, encoded on a thread of its
+ * own, so that neither the grabber nor the aggregator waits for the encoder.
+ *
+ * Only the newest image is encoded: an image that arrives while the previous
+ * one is still being encoded replaces any image that was waiting.
+ */
+class ImageStream {
+public:
+  ImageStream(boost::shared_ptr<RobotService> service, ImageStreamOptions const& options);
+  /**
+   * Stops the encoding thread; an image that is waiting is not sent.
+   */
+  ~ImageStream();
+
+  /**
+   * Hands over an RGB image; the image is copied, so the caller may reuse
+   * it right away. Must always be called from the same thread.
+   */
+  void post(cv::Mat const& image, long frame_num);
+
+  /**
+   * The number of images that were replaced by a newer one before they
+   * could be encoded.
+   */
+  size_t skipped() const { return skipped_; }
+
+private:
+  struct Frame {
+    cv::Mat image;
+    long frameNum = 0;
+  };
+
+  void run();
+  /**
+   * Encodes the given (possibly subsampled) image into a message; `start`
+   * is when the work on the image began.
+   */
+  OutgoingMessage encode(cv::Mat const& image, long frame_num, lepp::MetricsClock::time_point start);
+
+  boost::shared_ptr<RobotService> service_;
+  ImageStreamOptions const options_;
+  MessageEncoder encoder_;
+  lepp::TripleBuffer<Frame> pending_;
+  std::atomic<size_t> skipped_;
+
+  // Only used by the encoding thread; reused between images.
+  cv::Mat scaled_;
+  cv::Mat converted_;
+  std::vector<uchar> payload_;
+
+  std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include "lola/MessageBuffer.h"
+#include "lola/CloudCodec.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using am2b_iface::CompressedPointCloudMessage;
+using am2b_iface::Message_Type;
+using am2b_iface::MsgHeader;
+using am2b_iface::ObstacleMessage;
+using am2b_iface::PointCloudMessage;
+using am2b_iface::RGBMessage;
+using am2b_iface::SurfaceMessage;
+using am2b_iface::VisionMessageHeader;
+
+void intrusive_ptr_add_ref(MessageBuffer* buffer) {
+  buffer->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(MessageBuffer* buffer) {
+  if (buffer->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  // Keep the pool alive while the buffer is put back.
+  boost::shared_ptr<MessageBufferPool> pool;
+  pool.swap(buffer->pool_);
+  pool->release(buffer);
+}
+
+MessageBufferPool::~MessageBufferPool() {
+  for (MessageBuffer* buffer : free_)
+    delete buffer;
+}
+
+MessageBufferPtr MessageBufferPool::acquire(size_t size) {
+  MessageBuffer* buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Prefer the smallest buffer that fits; otherwise grow the largest one.
+    size_t best = free_.size();
+    for (size_t i = 0; i < free_.size(); ++i) {
+      size_t const cap = free_[i]->capacity();
+      if (best == free_.size()) {
+        best = i;
+        continue;
+      }
+      size_t const best_cap = free_[best]->capacity();
+      bool const fits = cap >= size;
+      bool const best_fits = best_cap >= size;
+      if ((fits && (!best_fits || cap < best_cap)) || (!fits && !best_fits && cap > best_cap))
+        best = i;
+    }
+    if (best < free_.size()) {
+      buffer = free_[best];
+      free_[best] = free_.back();
+      free_.pop_back();
+    } else {
+      ++allocated_;
+      // Make sure that returning the buffer never needs to allocate.
+      free_.reserve(allocated_);
+    }
+  }
+  if (!buffer)
+    buffer = new MessageBuffer();
+  buffer->bytes_.resize(size);
+  buffer->pool_ = shared_from_this();
+  return MessageBufferPtr(buffer);
+}
+
+size_t MessageBufferPool::allocated() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return allocated_;
+}
+
+void MessageBufferPool::release(MessageBuffer* buffer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(buffer);
+}
+
+char* MessageEncoder::prepare(OutgoingMessage& out, Message_Type type, long frame_num,
+                              size_t inline_size, size_t content_size) {
+  out.header.type = type;
+  out.header.len = static_cast<uint32_t>(content_size);
+  out.header.frame = static_cast<uint32_t>(frame_num);
+
+  MsgHeader const msg_header = {
+    am2b_iface::VISION_MESSAGE,
+    static_cast<am2b_iface::MsgLen>(sizeof(VisionMessageHeader) + content_size)
+  };
+  out.buffer = pool_->acquire(sizeof(MsgHeader) + sizeof(VisionMessageHeader) + inline_size);
+  char* data = out.buffer->data();
+  std::memcpy(data, &msg_header, sizeof(MsgHeader));
+  std::memcpy(data + sizeof(MsgHeader), &out.header, sizeof(VisionMessageHeader));
+  return data + sizeof(MsgHeader) + sizeof(VisionMessageHeader);
+}
+
+namespace {
+  // coalescing keys of the different kinds of messages
+  uint64_t const OBSTACLE_KEY = uint64_t(1) << 63;
+  uint64_t const SURFACE_KEY = uint64_t(1) << 62;
+  uint64_t const POINT_CLOUD_KEY = uint64_t(1) << 61;
+  uint64_t const RGB_IMAGE_KEY = uint64_t(1) << 60;
+}
+
+OutgoingMessage MessageEncoder::encode(ObstacleMessage const& msg, long frame_num,
+                                       lepp::MetricsClock::time_point captureTime) {
+  OutgoingMessage out;
+  out.captureTime = captureTime;
+  out.coalesceKey = OBSTACLE_KEY | (uint64_t(msg.model_id & 0x7fffffff) << 32) | msg.part_id;
+  out.droppable = msg.action == am2b_iface::MODIFY_SSV;
+  out.needsSuccessor = out.droppable;
+  char* content = prepare(out, Message_Type::Obstacle, frame_num, sizeof(msg), sizeof(msg));
+  std::memcpy(content, &msg, sizeof(msg));
+  return out;
+}
+
+OutgoingMessage MessageEncoder::encode(SurfaceMessage const& msg, long frame_num,
+                                       lepp::MetricsClock::time_point captureTime) {
+  OutgoingMessage out;
+  out.captureTime = captureTime;
+  out.coalesceKey = SURFACE_KEY | static_cast<uint32_t>(msg.id);
+  out.droppable = msg.action == am2b_iface::MODIFY_SURFACE;
+  out.needsSuccessor = out.droppable;
+  char* content = prepare(out, Message_Type::Surface, frame_num, sizeof(msg), sizeof(msg));
+  std::memcpy(content, &msg, sizeof(msg));
+  return out;
+}
+
+OutgoingMessage MessageEncoder::encodePointCloud(lepp::PointCloudConstPtr const& cloud, long frame_num,
+                                                 lepp::MetricsClock::time_point captureTime) {
+  size_t const points_size = cloud->points.size() * sizeof(lepp::PointT);
+
+  OutgoingMessage out;
+  out.captureTime = captureTime;
+  out.coalesceKey = POINT_CLOUD_KEY;
+  out.droppable = true;
+  out.messageClass = MessageClass::PointCloud;
+  char* content = prepare(out, Message_Type::PointCloud, frame_num,
+                          sizeof(PointCloudMessage), sizeof(PointCloudMessage) + points_size);
+  // PointCloudMessage's constructor copies (and leaks) the points, so the
+  // struct is written field by field. Its data pointer is meaningless to the
+  // receiver and sent as null.
+  uint32_t const format = sizeof(lepp::PointT);
+  uint32_t const count = static_cast<uint32_t>(cloud->points.size());
+  std::memset(content, 0, sizeof(PointCloudMessage));
+  std::memcpy(content + offsetof(PointCloudMessage, format), &format, sizeof(format));
+  std::memcpy(content + offsetof(PointCloudMessage, count), &count, sizeof(count));
+
+  // The cloud is immutable, so its points are sent straight from its memory.
+  out.payloadOwner = cloud;
+  out.payload = reinterpret_cast<char const*>(cloud->points.data());
+  out.payloadSize = points_size;
+  return out;
+}
+
+OutgoingMessage MessageEncoder::encodePointCloud(lepp::PointCloudConstPtr const& cloud, CloudEncoder& codec,
+                                                 long frame_num, lepp::MetricsClock::time_point captureTime) {
+  CompressedPointCloudMessage const msg = codec.encode(*cloud);
+  std::vector<char> const& payload = codec.payload();
+
+  OutgoingMessage out;
+  out.captureTime = captureTime;
+  out.coalesceKey = POINT_CLOUD_KEY;
+  // Deltas supersede each other, but not the keyframe they refer to.
+  out.droppable = !codec.referenced();
+  out.messageClass = MessageClass::PointCloud;
+  char* content = prepare(out, Message_Type::CompressedPointCloud, frame_num,
+                          sizeof(msg) + payload.size(), sizeof(msg) + payload.size());
+  std::memcpy(content, &msg, sizeof(msg));
+  std::memcpy(content + sizeof(msg), payload.data(), payload.size());
+  return out;
+}
+
+OutgoingMessage MessageEncoder::encodeRGBImage(cv::Mat const& image, long frame_num) {
+  if (CV_8UC3 != image.type()) {
+    std::ostringstream ss;
+    ss << "Unexpected image format: " << image.type();
+    throw std::runtime_error(ss.str());
+  }
+
+  size_t const row_size = 3 * image.cols;
+  size_t const pixels_size = row_size * image.rows;
+  RGBMessage const msg(nullptr, image.cols, image.rows);
+
+  OutgoingMessage out;
+  out.coalesceKey = RGB_IMAGE_KEY;
+  out.droppable = true;
+  out.messageClass = MessageClass::Image;
+  char* content = prepare(out, Message_Type::RGB_Image, frame_num,
+                          sizeof(msg) + pixels_size, sizeof(msg) + pixels_size);
+  std::memcpy(content, &msg, sizeof(msg));
+  char* pixels = content + sizeof(msg);
+  if (image.isContinuous()) {
+    std::memcpy(pixels, image.data, pixels_size);
+  } else {
+    for (int r = 0; r < image.rows; ++r)
+      std::memcpy(pixels + r * row_size, image.ptr(r), row_size);
+  }
+  return out;
+}
+
+OutgoingMessage MessageEncoder::encodeImage(am2b_iface::CompressedImageMessage const& msg, char const* payload,
+                                            long frame_num) {
+  OutgoingMessage out;
+  out.coalesceKey = RGB_IMAGE_KEY;
+  out.droppable = true;
+  out.messageClass = MessageClass::Image;
+  char* content = prepare(out, Message_Type::CompressedImage, frame_num,
+                          sizeof(msg) + msg.payload_size, sizeof(msg) + msg.payload_size);
+  std::memcpy(content, &msg, sizeof(msg));
+  std::memcpy(content + sizeof(msg), payload, msg.payload_size);
+  return out;
+}
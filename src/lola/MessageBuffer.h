@@ -0,0 +1,223 @@
+#ifndef LOLA_MESSAGE_BUFFER_H__
+#define LOLA_MESSAGE_BUFFER_H__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <iface_msg.hpp>
+#include <iface_vision_msg.hpp>
+
+#include "lepp3/Typedefs.hpp"
+#include "lepp3/util/Metrics.hpp"
+
+class CloudEncoder;
+class MessageBufferPool;
+
+/**
+ * A byte buffer that is handed out by a `MessageBufferPool`.
+ *
+ * Buffers are reference counted and go back to their pool once the last
+ * `MessageBufferPtr` to them is dropped. Their memory is kept, so that a
+ * buffer that is reused for messages of similar size does not allocate.
+ */
+class MessageBuffer {
+public:
+  char* data() { return bytes_.data(); }
+  char const* data() const { return bytes_.data(); }
+  size_t size() const { return bytes_.size(); }
+  size_t capacity() const { return bytes_.capacity(); }
+
+private:
+  friend class MessageBufferPool;
+  friend void intrusive_ptr_add_ref(MessageBuffer* buffer);
+  friend void intrusive_ptr_release(MessageBuffer* buffer);
+
+  MessageBuffer() : refs_(0) {}
+
+  std::atomic<int> refs_;
+  std::vector<char> bytes_;
+  /**
+   * The pool the buffer returns to; only set while the buffer is in use, so
+   * that the pool lives as long as any of its buffers is used.
+   */
+  boost::shared_ptr<MessageBufferPool> pool_;
+};
+
+typedef boost::intrusive_ptr<MessageBuffer> MessageBufferPtr;
+
+void intrusive_ptr_add_ref(MessageBuffer* buffer);
+void intrusive_ptr_release(MessageBuffer* buffer);
+
+/**
+ * A thread-safe pool of `MessageBuffer`s.
+ *
+ * `acquire` hands out the smallest free buffer that is large enough, so once
+ * the pool has seen the peak number of messages in flight, encoding a message
+ * does not allocate anymore.
+ */
+class MessageBufferPool : public boost::enable_shared_from_this<MessageBufferPool> {
+public:
+  MessageBufferPool() : allocated_(0) {}
+  ~MessageBufferPool();
+
+  /**
+   * Returns a buffer holding `size` (uninitialized) bytes.
+   */
+  MessageBufferPtr acquire(size_t size);
+
+  /**
+   * The number of buffers the pool has allocated so far.
+   */
+  size_t allocated() const;
+
+private:
+  friend void intrusive_ptr_release(MessageBuffer* buffer);
+
+  void release(MessageBuffer* buffer);
+
+  mutable std::mutex mutex_;
+  std::vector<MessageBuffer*> free_;
+  size_t allocated_;
+};
+
+/**
+ * The classes of messages that are queued separately when sent to the robot,
+ * in the order of their priority, so that small, latency-critical geometry
+ * updates are never queued behind large clouds or images.
+ */
+enum class MessageClass {
+  // obstacles and surfaces
+  Geometry,
+  PointCloud,
+  Image,
+  Count
+};
+
+/**
+ * A vision message encoded in the format in which it is sent to the robot:
+ * the `MsgHeader`, the `VisionMessageHeader` and the message content.
+ *
+ * The headers, the fixed-size message struct and any copied payload live in
+ * a pooled `buffer`. Large payloads that are immutable anyway (point clouds)
+ * are not copied: `payload` points into memory owned by `payloadOwner`, and
+ * the two parts are sent with a single scatter/gather write.
+ */
+struct OutgoingMessage {
+  MessageBufferPtr buffer;
+  boost::shared_ptr<void const> payloadOwner;
+  char const* payload = nullptr;
+  size_t payloadSize = 0;
+  am2b_iface::VisionMessageHeader header;
+  /**
+   * When the frame the message is about was received from the camera, or
+   * the clock's epoch if unknown.
+   */
+  lepp::MetricsClock::time_point captureTime;
+  /**
+   * Identifies the object (obstacle part, surface, point cloud or image) the
+   * message is about, or zero. A droppable message supersedes a droppable
+   * message with the same key that was not sent yet.
+   */
+  uint64_t coalesceKey = 0;
+  /**
+   * Whether the message only updates state that a later message replaces
+   * (modifications, point clouds, images), so that it may be dropped when
+   * the link cannot keep up. Creations and deletions are never dropped, or
+   * the robot's view of the scene would become inconsistent.
+   */
+  bool droppable = false;
+  /**
+   * Whether the droppable message may only be dropped once a newer message
+   * with the same key is queued. Modifications of obstacles and surfaces are
+   * not repeated unless the object changes again, so dropping the last one
+   * would leave the robot with an outdated object.
+   */
+  bool needsSuccessor = false;
+  MessageClass messageClass = MessageClass::Geometry;
+  /**
+   * When the message was queued for sending.
+   */
+  lepp::MetricsClock::time_point queuedAt;
+
+  bool empty() const { return !buffer; }
+
+  /**
+   * The number of bytes that are sent for this message.
+   */
+  size_t size() const { return (buffer ? buffer->size() : 0) + payloadSize; }
+
+  boost::array<boost::asio::const_buffer, 2> buffers() const {
+    boost::array<boost::asio::const_buffer, 2> b = {{
+      boost::asio::buffer(buffer->data(), buffer->size()),
+      boost::asio::buffer(payload, payloadSize)
+    }};
+    return b;
+  }
+};
+
+/**
+ * Encodes vision messages into `OutgoingMessage`s backed by a
+ * `MessageBufferPool`.
+ *
+ * Every message is encoded exactly once; point clouds are referenced rather
+ * than copied, RGB images are copied into the pooled buffer once (the camera
+ * reuses the memory of its images).
+ */
+class MessageEncoder {
+public:
+  MessageEncoder() : pool_(new MessageBufferPool()) {}
+
+  OutgoingMessage encode(am2b_iface::ObstacleMessage const& msg, long frame_num,
+                         lepp::MetricsClock::time_point captureTime);
+
+  OutgoingMessage encode(am2b_iface::SurfaceMessage const& msg, long frame_num,
+                         lepp::MetricsClock::time_point captureTime);
+
+  OutgoingMessage encodePointCloud(lepp::PointCloudConstPtr const& cloud, long frame_num,
+                                   lepp::MetricsClock::time_point captureTime);
+
+  /**
+   * Encodes the cloud as a `CompressedPointCloudMessage` with the given
+   * codec. A keyframe that later deltas refer to is never dropped.
+   */
+  OutgoingMessage encodePointCloud(lepp::PointCloudConstPtr const& cloud, CloudEncoder& codec,
+                                   long frame_num, lepp::MetricsClock::time_point captureTime);
+
+  /**
+   * Only images of type CV_8UC3 can be sent; others cause a `runtime_error`.
+   */
+  OutgoingMessage encodeRGBImage(cv::Mat const& image, long frame_num);
+
+  /**
+   * Encodes an image that was already compressed into `payload`, which is
+   * `msg.payload_size` bytes long.
+   */
+  OutgoingMessage encodeImage(am2b_iface::CompressedImageMessage const& msg, char const* payload,
+                              long frame_num);
+
+  MessageBufferPool const& pool() const { return *pool_; }
+
+private:
+  /**
+   * Creates a message of the given type whose buffer has room for `inline_size`
+   * bytes of content after the headers and whose total content (inline
+   * bytes and referenced payload) is `content_size` bytes long. Returns a
+   * pointer to the inline content.
+   */
+  char* prepare(OutgoingMessage& out, am2b_iface::Message_Type type, long frame_num,
+                size_t inline_size, size_t content_size);
+
+  boost::shared_ptr<MessageBufferPool> pool_;
+};
+
+#endif
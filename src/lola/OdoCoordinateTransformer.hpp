@@ -74,7 +74,7 @@ namespace lepp {
 template<class PointT>
 class OdoCoordinateTransformer : public lepp::PointFilter<PointT> {
 public:
-  OdoCoordinateTransformer() : current_frame_(-1) {}
+  OdoCoordinateTransformer() : current_frame_(-1), transform_params_() {}
 
   /**
    * `PointFilter` interface method.
@@ -86,6 +86,11 @@ public:
    */
   bool apply(PointT& original);
 
+  /**
+   * `PointFilter` interface method.
+   */
+  bool fusedStage(FusedFilterStage& stage) const override;
+
 protected:
   /**
    * Gets the kinematics parameters that should be used for constructing the
@@ -229,6 +234,23 @@ bool OdoCoordinateTransformer<PointT>::apply(PointT& original) {
   return true;
 }
 
+template<class PointT>
+bool OdoCoordinateTransformer<PointT>::fusedStage(FusedFilterStage& stage) const {
+  stage = FusedFilterStage(FusedFilterStage::AFFINE);
+  bool all = true;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      stage.params[3 * i + j] = transform_params_.A_odo_cam[i][j];
+      all = all && (transform_params_.A_odo_cam[i][j] == 0);
+    }
+    stage.params[9 + i] = transform_params_.r_odo_cam[i];
+    all = all && (transform_params_.r_odo_cam[i] == 0);
+  }
+  // a "null" transform removes all points, just like `apply` does
+  stage.reject_all = all;
+  return true;
+}
+
 /**
  * A concrete implementation of the transformer, which obtains its kinematics
  * information from the robot. Relies on a `PoseService` instance that it can
@@ -0,0 +1,104 @@
+#include "lola/OutgoingQueue.h"
+
+namespace {
+  size_t const INITIAL_CAPACITY = 64;
+}
+
+OutgoingQueue::OutgoingQueue(TransportOptions const& options)
+    : options_(options),
+      coalesce_window_(std::chrono::milliseconds(options.coalesceMs)),
+      stale_(std::chrono::milliseconds(options.staleMs)),
+      queue_(options.queueSize > 0 ? std::min(options.queueSize, INITIAL_CAPACITY) : INITIAL_CAPACITY) {
+}
+
+void OutgoingQueue::push(OutgoingMessage const& msg, lepp::MetricsClock::time_point now) {
+  ++stats_.queued;
+
+  if (msg.coalesceKey != 0 && msg.droppable && coalesce_window_ > lepp::MetricsClock::duration::zero()) {
+    // Look for an older version of the same object's state among the recently
+    // queued messages. A message that is not droppable (e.g. the creation of
+    // the object) must stay ahead of anything queued after it.
+    for (size_t i = queue_.size(); i-- > 0; ) {
+      OutgoingMessage const& queued = queue_[i];
+      if (now - queued.queuedAt > coalesce_window_)
+        break;
+      if (queued.coalesceKey != msg.coalesceKey)
+        continue;
+      if (queued.droppable) {
+        // The newer version is queued at the back, where it stays in order
+        // with the rest of its frame.
+        removed(queued);
+        queue_.erase(queue_.begin() + i);
+        ++stats_.coalesced;
+      }
+      break;
+    }
+  }
+
+  if (queue_.full())
+    queue_.set_capacity(2 * queue_.capacity());
+  queue_.push_back(msg);
+  queue_.back().queuedAt = now;
+  added(msg);
+
+  // The new message is queued first, since it may be what allows an older
+  // message about the same object to be dropped. If nothing can make room,
+  // the queue grows beyond its size.
+  if (options_.queueSize > 0 && queue_.size() > options_.queueSize)
+    dropOldest();
+}
+
+bool OutgoingQueue::mayDrop(OutgoingMessage const& msg) const {
+  if (!msg.droppable)
+    return false;
+  if (!msg.needsSuccessor)
+    return true;
+  auto const it = successors_.find(msg.coalesceKey);
+  return it != successors_.end() && it->second > 1;
+}
+
+bool OutgoingQueue::dropOldest() {
+  for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+    // Messages that need a successor are visited oldest first for each key,
+    // as `mayDrop` requires.
+    if (mayDrop(*it)) {
+      removed(*it);
+      queue_.erase(it);
+      ++stats_.dropped;
+      return true;
+    }
+  }
+  return false;
+}
+
+void OutgoingQueue::added(OutgoingMessage const& msg) {
+  if (msg.needsSuccessor)
+    ++successors_[msg.coalesceKey];
+}
+
+void OutgoingQueue::removed(OutgoingMessage const& msg) {
+  if (!msg.needsSuccessor)
+    return;
+  auto const it = successors_.find(msg.coalesceKey);
+  if (--it->second == 0)
+    successors_.erase(it);
+}
+
+bool OutgoingQueue::popBatch(std::vector<OutgoingMessage>& batch, lepp::MetricsClock::time_point now) {
+  batch.clear();
+  while (!queue_.empty() && batch.size() < options_.maxBatch) {
+    OutgoingMessage& front = queue_.front();
+    if (isStale(front, now)) {
+      ++stats_.stale;
+      removed(front);
+      queue_.pop_front();
+      continue;
+    }
+    if (!batch.empty() && front.header.frame != batch.front().header.frame)
+      break;
+    batch.push_back(front);
+    removed(front);
+    queue_.pop_front();
+  }
+  return !batch.empty();
+}
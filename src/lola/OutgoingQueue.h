@@ -0,0 +1,207 @@
+#ifndef LOLA_OUTGOING_QUEUE_H__
+#define LOLA_OUTGOING_QUEUE_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/circular_buffer.hpp>
+
+#include "lola/MessageBuffer.h"
+
+/**
+ * The options of the transport that sends vision messages to the robot.
+ */
+struct TransportOptions {
+  /**
+   * The number of messages that may wait to be sent. Once it is reached, the
+   * oldest droppable message is dropped. Messages that must not be dropped
+   * are always queued. Zero means unbounded.
+   */
+  size_t queueSize = 1024;
+  /**
+   * A droppable message supersedes a droppable message about the same object
+   * that was queued at most this long ago and not sent yet. Zero disables
+   * coalescing.
+   */
+  int coalesceMs = 100;
+  /**
+   * Droppable messages that waited longer than this are discarded instead of
+   * being sent. Zero disables the rule.
+   */
+  int staleMs = 500;
+  /**
+   * The sustained send rate, in bytes per second. Zero means unlimited.
+   */
+  double rateLimit = 0;
+  /**
+   * Caps of the send rate of point clouds and of images, in bytes per
+   * second, on top of `rateLimit`. Zero means uncapped.
+   */
+  double cloudRateLimit = 0;
+  double imageRateLimit = 0;
+  /**
+   * The number of bytes that may be sent at once after the link was idle.
+   */
+  double burst = 1e6;
+  /**
+   * The maximum number of messages written by a single write.
+   */
+  size_t maxBatch = 64;
+  /**
+   * Whether Nagle's algorithm is disabled on the connection, so that small
+   * messages are sent right away.
+   */
+  bool noDelay = true;
+  /**
+   * The size of the socket's send buffer, in bytes. Zero keeps the system's
+   * default.
+   */
+  int sendBufferSize = 0;
+  /**
+   * The delay before the first attempt to reconnect after the connection was
+   * lost or could not be established. It doubles with every failed attempt,
+   * up to `reconnectMaxMs`.
+   */
+  int reconnectMinMs = 100;
+  int reconnectMaxMs = 5000;
+};
+
+/**
+ * The queue of messages waiting to be sent to the robot.
+ *
+ * Messages are grouped into batches of messages about the same frame, which
+ * are written at once. While queued, a droppable message is superseded by a
+ * newer droppable message with the same coalescing key, and droppable
+ * messages are dropped when the queue is full or when they became stale.
+ * A message that needs a successor is only dropped once a newer message with
+ * its key is queued, so that the last state of an object always arrives.
+ *
+ * The queue is not thread-safe.
+ */
+class OutgoingQueue {
+public:
+  struct Stats {
+    size_t queued = 0;
+    size_t coalesced = 0;
+    size_t dropped = 0;
+    size_t stale = 0;
+    // dropped because the connection was lost
+    size_t disconnected = 0;
+  };
+
+  explicit OutgoingQueue(TransportOptions const& options);
+
+  /**
+   * Queues the given message, coalescing it with or evicting older messages.
+   */
+  void push(OutgoingMessage const& msg, lepp::MetricsClock::time_point now);
+
+  /**
+   * Moves the next batch to `batch`: the longest run of queued messages
+   * about the same frame, up to `maxBatch` messages. Stale messages are
+   * discarded on the way. Returns false if nothing is left to send.
+   */
+  bool popBatch(std::vector<OutgoingMessage>& batch, lepp::MetricsClock::time_point now);
+
+  /**
+   * Drops all queued messages, because the connection they were meant for
+   * was lost.
+   */
+  void clear() {
+    stats_.disconnected += queue_.size();
+    queue_.clear();
+    successors_.clear();
+  }
+
+  size_t size() const { return queue_.size(); }
+  bool empty() const { return queue_.empty(); }
+  Stats const& stats() const { return stats_; }
+
+private:
+  bool isStale(OutgoingMessage const& msg, lepp::MetricsClock::time_point now) const {
+    return mayDrop(msg) && stale_ > lepp::MetricsClock::duration::zero()
+        && now - msg.queuedAt > stale_;
+  }
+
+  /**
+   * Whether the given message may be dropped. A message that needs a
+   * successor may be dropped if another message with its key is queued, so
+   * this must only be asked of the oldest queued message with its key.
+   */
+  bool mayDrop(OutgoingMessage const& msg) const;
+
+  /**
+   * Drops the oldest message that may be dropped; returns false if there is
+   * none.
+   */
+  bool dropOldest();
+
+  /**
+   * Bookkeeping of the messages that need a successor, for every message
+   * that enters or leaves the queue.
+   */
+  void added(OutgoingMessage const& msg);
+  void removed(OutgoingMessage const& msg);
+
+  TransportOptions const options_;
+  lepp::MetricsClock::duration const coalesce_window_;
+  lepp::MetricsClock::duration const stale_;
+  boost::circular_buffer<OutgoingMessage> queue_;
+  /**
+   * The number of queued messages that need a successor, by key.
+   */
+  std::unordered_map<uint64_t, size_t> successors_;
+  Stats stats_;
+};
+
+/**
+ * A token bucket limiting the rate at which bytes are sent.
+ *
+ * The bucket holds up to `burst` tokens and is refilled with `rate` tokens
+ * per second; sending a byte takes a token. A batch larger than the bucket
+ * may be sent once the bucket is full, leaving it in debt.
+ */
+class TokenBucket {
+public:
+  TokenBucket(double rate, double burst)
+      : rate_(rate), burst_(burst), tokens_(burst), last_(lepp::MetricsClock::now()) {}
+
+  bool unlimited() const { return rate_ <= 0; }
+
+  /**
+   * How long to wait before `bytes` may be sent.
+   */
+  lepp::MetricsClock::duration delay(size_t bytes, lepp::MetricsClock::time_point now) {
+    if (unlimited())
+      return lepp::MetricsClock::duration::zero();
+    refill(now);
+    double const needed = std::min(static_cast<double>(bytes), burst_);
+    if (tokens_ >= needed)
+      return lepp::MetricsClock::duration::zero();
+    return std::chrono::duration_cast<lepp::MetricsClock::duration>(
+        std::chrono::duration<double>((needed - tokens_) / rate_));
+  }
+
+  void consume(size_t bytes, lepp::MetricsClock::time_point now) {
+    if (unlimited())
+      return;
+    refill(now);
+    tokens_ -= bytes;
+  }
+
+private:
+  void refill(lepp::MetricsClock::time_point now) {
+    double const elapsed = std::chrono::duration<double>(now - last_).count();
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    last_ = now;
+  }
+
+  double const rate_;
+  double const burst_;
+  double tokens_;
+  lepp::MetricsClock::time_point last_;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "lola/RobotAggregator.h"
 #include "deps/easylogging++.h"
 
+#include <algorithm>
+
 using namespace lepp;
 
 namespace {
@@ -45,6 +47,25 @@ private:
   int type_id_;
   double radius_;
 };
+
+/**
+ * The vertices of the hull of the given surface, laid out as a
+ * `SurfaceMessage` carries them: exactly eight, the last one repeated if the
+ * hull has fewer. The hull is reduced to at most `numHullPoints` vertices
+ * before, so nothing is cut off unless more than eight are configured.
+ */
+std::vector<float> messageVertices(SurfaceModel const& surface) {
+  size_t const MESSAGE_VERTICES = 8;
+  PointCloudConstPtr hull = surface.get_hull();
+  std::vector<float> vertices(3 * MESSAGE_VERTICES, 0);
+  for (size_t i = 0; i < MESSAGE_VERTICES && !hull->empty(); ++i) {
+    PointT const& point = hull->points[std::min(i, hull->size() - 1)];
+    vertices[3 * i] = point.x;
+    vertices[3 * i + 1] = point.y;
+    vertices[3 * i + 2] = point.z;
+  }
+  return vertices;
+}
 }  // namespace <anonymous>
 
 RobotAggregator::RobotAggregator(boost::shared_ptr<RobotService> service,
@@ -52,9 +73,10 @@ RobotAggregator::RobotAggregator(boost::shared_ptr<RobotService> service,
                                 std::vector<std::string> datatypes,
                                 Robot& robot,
                                 double min_surface_height,
-                                double surface_normal_tolerance
+                                double surface_normal_tolerance,
+                                ImageStreamOptions const& image_options
                               )
-    : service_(service), diff_(freq), next_id_(0),
+    : service_(service), diff_(freq), connection_id_(0), next_id_(0),
       min_surface_height(min_surface_height),
       surface_normal_tolerance(surface_normal_tolerance),
       robot_(robot) {
@@ -73,6 +95,9 @@ RobotAggregator::RobotAggregator(boost::shared_ptr<RobotService> service,
       std::cout << "RobotAggregator: Unexpected datatype '" << t << "'" << std::endl;
   }
 
+  if (send_images_)
+    image_stream_.reset(new ImageStream(service_, image_options));
+
   // Set up the callbacks that handle the particular cases.
   if (send_obstacles_)
   {
@@ -264,6 +289,25 @@ std::cout << "]" << std::endl;
   }
 }
 
+void RobotAggregator::resync(long frame_num) {
+  if (!robot_ids_.empty() || !robot_surface_ids_.empty()) {
+    LINFO << "RobotAggregator: Reconnected; sending "
+          << robot_ids_.size() << " obstacles and "
+          << robot_surface_ids_.size() << " surfaces again";
+  }
+  for (auto const& ids : robot_ids_)
+    sendDeleteObstacle(ids.second[0], frame_num);
+  robot_ids_.clear();
+  // Deleting erases the ID from the set.
+  std::set<int> const surface_ids(robot_surface_ids_);
+  for (int id : surface_ids)
+    sendDeleteSurface(id, frame_num);
+  diff_.reset();
+  // The robot may not have the keyframe the next delta would refer to.
+  if (cloud_encoder_)
+    cloud_encoder_->reset();
+}
+
 std::vector<ObjectModel*> RobotAggregator::getPrimitives(ObjectModel& model) const {
   FlattenVisitor flattener;
   model.accept(flattener);
@@ -274,106 +318,81 @@ void RobotAggregator::sendNew(ObjectModel& new_model, int model_id, int part_id,
   CoefsVisitor coefs;
   new_model.accept(coefs);
 
-  VisionMessage msg = VisionMessage(ObstacleMessage::SetMessage(
+  OutgoingMessage msg = encoder_.encode(ObstacleMessage::SetMessage(
       coefs.type_id(), model_id, part_id, coefs.radius(), coefs.coefs()),
-      frame_num);
+      frame_num, capture_time_);
   LINFO << "RobotAggregator: Creating new primitive ["
         << "type = " << coefs.type_id()
         << "; id = " << part_id
         << "]";
-  service_->sendMessage(msg);
+  batch_.push_back(msg);
 }
 
 void RobotAggregator::sendNew(SurfaceModel& new_surface, long frame_num) {
-  std::vector<float> vertices;
+  std::vector<float> vertices = messageVertices(new_surface);
   std::vector<float> normal = {new_surface.get_planeCoefficients().values[0],new_surface.get_planeCoefficients().values[1],new_surface.get_planeCoefficients().values[2]};
-  for(auto point : new_surface.get_hull()->points)
-  {
-    vertices.push_back(point.x);
-    vertices.push_back(point.y);
-    vertices.push_back(point.z);
-  }
 
-  VisionMessage msg = VisionMessage(SurfaceMessage::SetMessage(new_surface.id(), normal, vertices), frame_num);
+  OutgoingMessage msg = encoder_.encode(SurfaceMessage::SetMessage(new_surface.id(), normal, vertices), frame_num, capture_time_);
+  robot_surface_ids_.insert(new_surface.id());
 
   // LINFO << "RobotAggregator: Creating new surface ["
   //       << "id = " << new_surface.id()
   //       << "]";
-  service_->sendMessage(msg);
+  batch_.push_back(msg);
 }
 
 void RobotAggregator::sendDeleteObstacle(int id, long frame_num) {
   // LINFO << "RobotAggregator: Deleting a primitive id = "
   //       << id;
-  VisionMessage del = VisionMessage(ObstacleMessage::DeleteMessage(id), frame_num);
-  service_->sendMessage(del);
+  batch_.push_back(encoder_.encode(ObstacleMessage::DeleteMessage(id), frame_num, capture_time_));
 }
 
 void RobotAggregator::sendDeleteObstaclePart(int model_id, int part_id, long frame_num) {
   // LINFO << "RobotAggregator: Deleting a primitive id = "
   //       << part_id;
-  VisionMessage del = VisionMessage(ObstacleMessage::DeletePartMessage(model_id, part_id), frame_num);
-  service_->sendMessage(del);
+  batch_.push_back(encoder_.encode(ObstacleMessage::DeletePartMessage(model_id, part_id), frame_num, capture_time_));
 }
 
 void RobotAggregator::sendDeleteSurface(int id, long frame_num)
 {
   // LINFO << "RobotAggregator: Deleting surface: " << id;
-  VisionMessage msg = VisionMessage(SurfaceMessage::DeleteMessage(id), frame_num);
-  service_->sendMessage(msg);
+  OutgoingMessage msg = encoder_.encode(SurfaceMessage::DeleteMessage(id), frame_num, capture_time_);
+  robot_surface_ids_.erase(id);
+  batch_.push_back(msg);
 }
 
 void RobotAggregator::sendModify(ObjectModel& model, int model_id, int part_id, long frame_num) {
   CoefsVisitor coefs;
   model.accept(coefs);
-  VisionMessage msg = VisionMessage(ObstacleMessage::ModifyMessage(
+  OutgoingMessage msg = encoder_.encode(ObstacleMessage::ModifyMessage(
       coefs.type_id(), model_id, part_id, coefs.radius(), coefs.coefs()),
-      frame_num);
+      frame_num, capture_time_);
   LINFO << "RobotAggregator: Modifying existing primitive ["
             << "type = " << coefs.type_id()
             << "; id = " << model_id << " | " << part_id
             << "]";
-  service_->sendMessage(msg);
+  batch_.push_back(msg);
 }
 
 void RobotAggregator::sendModify(SurfaceModel& surface, long frame_num)
 {
-  std::vector<float> vertices;
+  std::vector<float> vertices = messageVertices(surface);
   std::vector<float> normal = {surface.get_planeCoefficients().values[0],surface.get_planeCoefficients().values[1],surface.get_planeCoefficients().values[2]};
-  for(auto point : surface.get_hull()->points)
-  {
-    vertices.push_back(point.x);
-    vertices.push_back(point.y);
-    vertices.push_back(point.z);
-  }
 
-  VisionMessage msg = VisionMessage(SurfaceMessage::ModifyMessage(surface.id(), normal, vertices), frame_num);
+  OutgoingMessage msg = encoder_.encode(SurfaceMessage::ModifyMessage(surface.id(), normal, vertices), frame_num, capture_time_);
 
   // LINFO << "RobotAggregator: Modifying existing surface ["
   //       << "id = " << surface.id()
   //      << "]";
-  service_->sendMessage(msg);
+  batch_.push_back(msg);
 }
 
 void RobotAggregator::sendPointCloud(PointCloudConstPtr cloud, long frame_num)
 {
-  unsigned char* pt_data = (unsigned char*)&cloud->points[0];
-  VisionMessage msg = VisionMessage(PointCloudMessage(pt_data, cloud->points.size(), sizeof(PointT)), frame_num);
-
-  service_->sendMessage(msg);
-}
-
-void RobotAggregator::sendRGBImage(cv::Mat const& image, long frame_num)
-{
-  const unsigned char* img_data = nullptr;
-  if (CV_8UC3 == image.type()) {
-    img_data = image.data;
-  } else {
-    std::ostringstream ss;
-    ss << "Unexpected image format: " << image.type();
-    throw std::runtime_error(ss.str());
+  if (cloud_encoder_) {
+    batch_.push_back(encoder_.encodePointCloud(cloud, *cloud_encoder_, frame_num, capture_time_));
+    return;
   }
-
-  VisionMessage msg = VisionMessage(RGBMessage(img_data, image.cols, image.rows), frame_num);
-  service_->sendMessage(msg);
+  // The points are not copied; the message keeps the cloud alive until sent.
+  batch_.push_back(encoder_.encodePointCloud(cloud, frame_num, capture_time_));
 }
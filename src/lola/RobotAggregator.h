@@ -6,19 +6,22 @@
 #include "lepp3/FrameData.hpp"
 #include "lepp3/RGBData.hpp"
 
+#include "lola/CloudCodec.h"
+#include "lola/ImageStream.h"
+#include "lola/MessageBuffer.h"
 #include "lola/RobotService.h"
 #include "lola/Robot.h"
 #include <iface_vision_msg.hpp>
 
+#include <memory>
+#include <set>
+
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 
 using namespace lepp;
-using am2b_iface::RGBMessage;
-using am2b_iface::VisionMessage;
 using am2b_iface::SurfaceMessage;
 using am2b_iface::ObstacleMessage;
-using am2b_iface::PointCloudMessage;
 using am2b_iface::Message_Type;
 
 /**
@@ -37,18 +40,40 @@ public:
   /**
    * Create a new `RobotAggregator` that will use the given service to
    * communicate to the robot and send status updates after every `freq` frames.
+   * If it sends images, they are encoded with the given options.
    */
   RobotAggregator(boost::shared_ptr<RobotService> service,
                   int freq,
                   std::vector<std::string> datatypes,
                   Robot& robot,
                   double min_surface_height = 0,
-                  double surface_normal_tolerance = 0
+                  double surface_normal_tolerance = 0,
+                  ImageStreamOptions const& image_options = ImageStreamOptions()
                 );
+  /**
+   * Makes the aggregator send point clouds as `CompressedPointCloudMessage`s
+   * encoded with the given options, rather than as raw `PointCloudMessage`s.
+   */
+  void setCloudCodec(CloudCodecOptions const& options) {
+    cloud_encoder_.reset(new CloudEncoder(options));
+  }
   /**
    * `FrameDataObserver` interface implementation.
    */
   void updateFrame(FrameDataPtr frameData) {
+    // Nothing could be delivered; everything is sent again once the service
+    // has reconnected.
+    if (!service_->isConnected())
+      return;
+
+    ScopedStageTimer stageTimer(Stage::Aggregation);
+    if (service_->connectionId() != connection_id_) {
+      connection_id_ = service_->connectionId();
+      resync(frameData->frameNum);
+    }
+    // The diff callbacks create their messages synchronously, so the messages
+    // created until the end of this call are about this frame.
+    capture_time_ = frameData->captureTime;
     // Just pass it on to find the diff!
     diff_.updateFrame(frameData);
 
@@ -56,14 +81,20 @@ public:
     {
       sendPointCloud(frameData->cloud, frameData->frameNum);
     }
+
+    // All messages about the frame are handed to the service at once.
+    service_->sendBatch(batch_);
+    batch_.clear();
   }
   /**
    * `RGBDataObserver` interface implementation.
    */
   void updateFrame(RGBDataPtr rgbData) {
-    if (send_images_)
+    // The images are encoded and sent on the stream's own thread, so that
+    // they never hold up the geometry.
+    if (image_stream_ && service_->isConnected())
     {
-      sendRGBImage(rgbData->image, rgbData->frameNum);
+      image_stream_->post(rgbData->image, rgbData->frameNum);
     }
 
   }
@@ -102,6 +133,14 @@ private:
    */
   void mod_surface_cb_(SurfaceModel& model, long frame_num);
 
+  /**
+   * Brings the robot up to date after a new connection was established: it
+   * may or may not have kept what was sent over the previous one, so all
+   * obstacles and surfaces it may know of are deleted, and the diff is reset,
+   * so that the current frame re-creates everything it contains.
+   */
+  void resync(long frame_num);
+
   /**
    * Obtains a list of pointers to the primitives that the given model is
    * composed of.
@@ -141,10 +180,6 @@ private:
    * Sends a point cloud to the remote host
    */
   void sendPointCloud(PointCloudConstPtr cloud, long frame_num);
-  /**
-   * Sends an RGB image to the remote host
-   */
-  void sendRGBImage(cv::Mat const& image, long frame_num);
   /**
    * Obtains the next ID that should be used for a primitive that the robot is
    * notified of.
@@ -160,6 +195,24 @@ private:
    * A handle to the service that is used to send notifications to the robot.
    */
   boost::shared_ptr<RobotService> service_;
+  /**
+   * Encodes the messages into pooled buffers that are shared with the
+   * service until they are sent.
+   */
+  MessageEncoder encoder_;
+  /**
+   * Compresses the point clouds, if set.
+   */
+  std::unique_ptr<CloudEncoder> cloud_encoder_;
+  /**
+   * Encodes and sends the RGB images, if they are sent.
+   */
+  std::unique_ptr<ImageStream> image_stream_;
+  /**
+   * The messages about the current frame, collected until the frame was
+   * processed.
+   */
+  std::vector<OutgoingMessage> batch_;
   /**
    * A handle to the robot facade.
    */
@@ -175,10 +228,23 @@ private:
    * each primitive SSV object that is found in the model composition.
    */
   std::map<int, std::vector<int> > robot_ids_;
+  /**
+   * The IDs of the surfaces that the robot was told of.
+   */
+  std::set<int> robot_surface_ids_;
+  /**
+   * The ID of the service's connection over which the robot was last told of
+   * the obstacles and surfaces.
+   */
+  unsigned long connection_id_;
   /**
    * The ID that can be assigned to the next new model (or rather model part).
    */
   int next_id_;
+  /**
+   * The capture time of the frame whose messages are currently being sent.
+   */
+  MetricsClock::time_point capture_time_;
 
   /**
    * Flags for enabling/disabling specific types of data from being collected
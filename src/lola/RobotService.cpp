@@ -1,21 +1,11 @@
 #include "RobotService.h"
+#include <algorithm>
 #include <boost/thread.hpp>
 
 #include "deps/easylogging++.h"
 #include <iface_msg.hpp>
 
 namespace {
-  /**
-   * Callback invoked when the async connect operation completes.
-   */
-  void connect_handler(boost::system::error_code const& error) {
-    if (!error) {
-      LINFO << "AsyncRobotService: Connected to remote host.";
-    } else {
-      LERROR << "AsyncRobotService:  Failed to connect to the remote host.";
-    }
-  }
-
   /**
    * A simple function that is used to spin up the io service event loop in a
    * dedicated thread.
@@ -29,63 +19,280 @@ namespace {
     io_service->run();
     LINFO << "AsyncRobotService: Exiting service thread...";
   }
-
-  /**
-   * A callback for write operations.
-   */
-  void write_handler(boost::system::error_code const& error,
-               std::size_t sent) {
-    if (!error) {
-      LINFO << "AsyncRobotService: Send complete. "
-            << "Sent " << sent << " bytes.";
-    } else {
-      LERROR << "AsyncRobotService: Error sending message.";
-    }
-  }
 }
 
 void AsyncRobotService::start() {
   // Start it up...
-  boost::asio::ip::tcp::endpoint endpoint(
+  endpoint_ = boost::asio::ip::tcp::endpoint(
     boost::asio::ip::address::from_string(remote_), port_);
   LINFO << "AsyncRobotService (" << remoteName_ << "): Initiating a connection asynchronously...";
-  socket_.async_connect(endpoint, connect_handler);
+  io_service_.post(boost::bind(&AsyncRobotService::connect, this));
   // Start the service thread in the background...
   boost::thread(boost::bind(service_thread, &io_service_));
 }
 
-void AsyncRobotService::inner_send(VisionMessage const& next_message) {
-  am2b_iface::MsgHeader msg_header = { am2b_iface::VISION_MESSAGE, (uint32_t)sizeof(VisionMessageHeader) + next_message.header.len };
-//  LINFO << "AsyncRobotService (" << remoteName_ << "): Sending a queued message: "
-//        << "msg == " << next_message;
-  // Synchronously send the message, i.e. block until the send is complete.
-  try {
-    sendBytes(reinterpret_cast<char const*>(&msg_header), sizeof(msg_header));
-    sendBytes(reinterpret_cast<char const*>(&next_message), sizeof(VisionMessageHeader));
-    sendBytes(next_message.content, next_message.header.len);
-  } catch (...) {
-    LERROR << "AsyncRobotService (" << remoteName_ << "): Error sending message.";
-  }
-  // After each sent message, we want to wait a pre-defined amount of time
-  // before sending the next one.
-  // This is because we do not want to overwhelm the robot with a large
-  // number of messages all sent in the same time.
-  boost::this_thread::sleep(message_timeout_);
-}
-
-void AsyncRobotService::sendBytes(char const* data, size_t length) {
-  size_t sent_bytes = 0;
-
-  do {
-    sent_bytes += socket_.send(boost::asio::buffer(&data[sent_bytes], length - sent_bytes));
-  } while (sent_bytes < length);
-}
-
-void AsyncRobotService::sendMessage(VisionMessage const& msg) {
-  // Just queue another message to be sent by the io_service thread.
-  // Since `inner_send` makes sure to wait after it's finished sending
-  // each message (i.e. the io_service thread is blocked), the queued
-  // messages will all be sent with a preset time delay between subsequent
-  // messages.
-  io_service_.post(boost::bind(&AsyncRobotService::inner_send, this, msg));
+void AsyncRobotService::connect() {
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+  socket_.async_connect(endpoint_,
+      boost::bind(&AsyncRobotService::onConnected, this, boost::asio::placeholders::error));
+}
+
+void AsyncRobotService::onConnected(boost::system::error_code const& error) {
+  if (error) {
+    LERROR << "AsyncRobotService (" << remoteName_ << "): Failed to connect to the remote host: "
+           << error.message();
+    scheduleReconnect();
+    return;
+  }
+
+  boost::system::error_code option_error;
+  socket_.set_option(boost::asio::ip::tcp::no_delay(options_.noDelay), option_error);
+  if (options_.sendBufferSize > 0 && !option_error)
+    socket_.set_option(boost::asio::socket_base::send_buffer_size(options_.sendBufferSize), option_error);
+  if (option_error)
+    LWARNING << "AsyncRobotService (" << remoteName_ << "): Cannot set socket options: "
+             << option_error.message();
+
+  LINFO << "AsyncRobotService (" << remoteName_ << "): Connected to remote host.";
+  backoff_ms_ = options_.reconnectMinMs;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (connection_id_ > 0) {
+      ++stats_.reconnects;
+      lepp::PipelineMetrics::instance().add(lepp::Counter::Reconnects, 1);
+    }
+    ++connection_id_;
+    connected_ = true;
+  }
+  startReading();
+}
+
+void AsyncRobotService::scheduleReconnect() {
+  reconnect_timer_.expires_from_now(boost::posix_time::milliseconds(backoff_ms_));
+  reconnect_timer_.async_wait(boost::bind(&AsyncRobotService::connect, this));
+  backoff_ms_ = std::min(2 * backoff_ms_, std::max(options_.reconnectMaxMs, options_.reconnectMinMs));
+}
+
+void AsyncRobotService::onDisconnected(boost::system::error_code const& error) {
+  // Both a failed write and the pending read report the same lost connection.
+  if (!connected_)
+    return;
+  LERROR << "AsyncRobotService (" << remoteName_ << "): Lost the connection: " << error.message();
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    connected_ = false;
+    for (Lane& lane : lanes_)
+      lane.queue.clear();
+    lepp::PipelineMetrics::instance().set(lepp::Counter::QueueDepth, 0);
+  }
+  // A running chain of writes ends once its current write fails or its
+  // timer expires, so it is left alone here.
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+  scheduleReconnect();
+}
+
+void AsyncRobotService::startReading() {
+  socket_.async_read_some(boost::asio::buffer(read_buffer_),
+      boost::bind(&AsyncRobotService::onRead, this,
+                  boost::asio::placeholders::error,
+                  boost::asio::placeholders::bytes_transferred));
+}
+
+void AsyncRobotService::onRead(boost::system::error_code const& error, size_t received) {
+  if (error) {
+    if (error != boost::asio::error::operation_aborted)
+      onDisconnected(error);
+    return;
+  }
+  // Whatever the robot sends is ignored.
+  startReading();
+}
+
+AsyncRobotService::Wake AsyncRobotService::startWriting() {
+  if (!writing_) {
+    writing_ = true;
+    return Wake::Write;
+  }
+  if (rate_wait_) {
+    rate_wait_ = false;
+    return Wake::RateWait;
+  }
+  return Wake::None;
+}
+
+void AsyncRobotService::wake(Wake wake) {
+  if (wake == Wake::Write)
+    io_service_.post(boost::bind(&AsyncRobotService::writeNext, this));
+  else if (wake == Wake::RateWait)
+    io_service_.post(boost::bind(&AsyncRobotService::cutRateWait, this));
+}
+
+void AsyncRobotService::cutRateWait() {
+  // If the timer already expired, its handler is on the way anyway.
+  boost::system::error_code ignored;
+  rate_timer_.cancel(ignored);
+}
+
+void AsyncRobotService::push(OutgoingMessage const& msg, lepp::MetricsClock::time_point now) {
+  lanes_[static_cast<size_t>(msg.messageClass)].queue.push(msg, now);
+}
+
+size_t AsyncRobotService::queueDepth() const {
+  size_t depth = 0;
+  for (Lane const& lane : lanes_)
+    depth += lane.queue.size();
+  return depth;
+}
+
+void AsyncRobotService::sendMessage(OutgoingMessage const& msg) {
+  // Just queue the message; if no write is in progress, the io_service
+  // thread is woken up to start one. Otherwise, the running chain of writes
+  // picks it up.
+  Wake wake_up = Wake::None;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (!connected_) {
+      ++stats_.notConnected;
+      return;
+    }
+    push(msg, lepp::MetricsClock::now());
+    lepp::PipelineMetrics::instance().set(lepp::Counter::QueueDepth, queueDepth());
+    wake_up = startWriting();
+  }
+  wake(wake_up);
+}
+
+void AsyncRobotService::sendBatch(std::vector<OutgoingMessage> const& msgs) {
+  if (msgs.empty())
+    return;
+  Wake wake_up = Wake::None;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (!connected_) {
+      stats_.notConnected += msgs.size();
+      return;
+    }
+    lepp::MetricsClock::time_point const now = lepp::MetricsClock::now();
+    for (OutgoingMessage const& msg : msgs)
+      push(msg, now);
+    lepp::PipelineMetrics::instance().set(lepp::Counter::QueueDepth, queueDepth());
+    wake_up = startWriting();
+  }
+  wake(wake_up);
+}
+
+AsyncRobotService::Stats AsyncRobotService::stats() {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  Stats stats = stats_;
+  for (Lane const& lane : lanes_) {
+    OutgoingQueue::Stats const& queue = lane.queue.stats();
+    stats.queue.queued += queue.queued;
+    stats.queue.coalesced += queue.coalesced;
+    stats.queue.dropped += queue.dropped;
+    stats.queue.stale += queue.stale;
+    stats.queue.disconnected += queue.disconnected;
+  }
+  stats.queueDepth = queueDepth();
+  return stats;
+}
+
+void AsyncRobotService::writeNext() {
+  lepp::MetricsClock::time_point const now = lepp::MetricsClock::now();
+  lepp::MetricsClock::duration const zero = lepp::MetricsClock::duration::zero();
+  lepp::MetricsClock::duration wait = lepp::MetricsClock::duration::max();
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    rate_wait_ = false;
+    if (!connected_) {
+      // The connection was lost while waiting; the chain ends here.
+      writing_ = false;
+      return;
+    }
+    // Batches may be larger than the burst, so the buckets only need to be
+    // out of debt; the batch's bytes are taken once it is written.
+    lepp::MetricsClock::duration const link_wait = bucket_.delay(1, now);
+    for (size_t i = 0; i < lanes_.size() && batch_.empty(); ++i) {
+      Lane& lane = lanes_[i];
+      if (lane.queue.empty())
+        continue;
+      lepp::MetricsClock::duration const lane_wait = std::max(link_wait, lane.bucket.delay(1, now));
+      if (lane_wait > zero) {
+        wait = std::min(wait, lane_wait);
+        continue;
+      }
+      if (lane.queue.popBatch(batch_, now))
+        batch_lane_ = i;
+    }
+    if (batch_.empty()) {
+      // Either everything is sent, or only lanes that have to wait for their
+      // rate limit are left.
+      if (wait == lepp::MetricsClock::duration::max()) {
+        writing_ = false;
+        return;
+      }
+      rate_wait_ = true;
+    }
+    lepp::PipelineMetrics::instance().set(lepp::Counter::QueueDepth, queueDepth());
+  }
+
+  if (batch_.empty()) {
+    rate_timer_.expires_from_now(boost::posix_time::microseconds(
+        std::chrono::duration_cast<std::chrono::microseconds>(wait).count() + 1));
+    rate_timer_.async_wait(boost::bind(&AsyncRobotService::writeNext, this));
+    return;
+  }
+
+  size_t bytes = 0;
+  for (OutgoingMessage const& msg : batch_)
+    bytes += msg.size();
+  bucket_.consume(bytes, now);
+  lanes_[batch_lane_].bucket.consume(bytes, now);
+
+//  LINFO << "AsyncRobotService (" << remoteName_ << "): Sending a batch of "
+//        << batch_.size() << " messages";
+  buffers_.clear();
+  for (OutgoingMessage const& msg : batch_) {
+    auto const b = msg.buffers();
+    buffers_.insert(buffers_.end(), b.begin(), b.end());
+  }
+  write_start_ = now;
+  boost::asio::async_write(socket_, buffers_,
+      boost::bind(&AsyncRobotService::onWritten, this,
+                  boost::asio::placeholders::error,
+                  boost::asio::placeholders::bytes_transferred));
+}
+
+void AsyncRobotService::onWritten(boost::system::error_code const& error, size_t sent) {
+  if (error) {
+    // Hand the buffers back to their pool; the batch is lost with the
+    // connection.
+    batch_.clear();
+    onDisconnected(error);
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    writing_ = false;
+    return;
+  }
+
+  lepp::PipelineMetrics& metrics = lepp::PipelineMetrics::instance();
+  metrics.record(lepp::Stage::Send, lepp::MetricsClock::now() - write_start_);
+  for (OutgoingMessage const& msg : batch_)
+    metrics.recordFrameAge(msg.captureTime);
+  metrics.add(lepp::Counter::BytesSent, sent);
+  metrics.add(lepp::Counter::MessagesSent, batch_.size());
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    stats_.bytesSent += sent;
+    stats_.messagesSent += batch_.size();
+  }
+  // Hand the buffers back to their pool.
+  batch_.clear();
+
+  if (message_timeout_.total_milliseconds() > 0) {
+    timer_.expires_from_now(message_timeout_);
+    timer_.async_wait(boost::bind(&AsyncRobotService::writeNext, this));
+  } else {
+    writeNext();
+  }
 }
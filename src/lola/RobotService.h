@@ -2,12 +2,15 @@
 #define LOLA_ROBOT_SERVICE_H__
 
 #include <boost/asio.hpp>
+#include <atomic>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
-#include "iface_vision_msg.hpp"
+#include <mutex>
+#include <vector>
 
-using am2b_iface::VisionMessage;
-using am2b_iface::VisionMessageHeader;
+#include "lola/MessageBuffer.h"
+#include "lola/OutgoingQueue.h"
 
 /**
  * An interface that needs to be implemented by concrete classes that can
@@ -21,8 +24,31 @@ public:
    * It is up to particular concrete `RobotService` implementations to decide
    * how the method goes about performing this operation and whether it blocks
    * or not.
+   *
+   * If the message has a capture time, the frame's age is recorded once the
+   * message was sent.
+   */
+  virtual void sendMessage(OutgoingMessage const& msg) = 0;
+  /**
+   * Sends all messages about one frame. Implementations may send them
+   * together.
+   */
+  virtual void sendBatch(std::vector<OutgoingMessage> const& msgs) {
+    for (OutgoingMessage const& msg : msgs)
+      sendMessage(msg);
+  }
+  /**
+   * Whether messages can currently be delivered to the robot. While they
+   * cannot, sent messages are dropped, so clients may as well not create
+   * them.
+   */
+  virtual bool isConnected() const { return true; }
+  /**
+   * Changes whenever a new connection to the robot is established. The robot
+   * may have lost whatever was sent over an earlier connection, so clients
+   * that only send changes need to send their full state again.
    */
-  virtual void sendMessage(VisionMessage const& msg) = 0;
+  virtual unsigned long connectionId() const { return 0; }
 };
 
 /**
@@ -30,6 +56,20 @@ public:
  * to the robot.
  *
  * It allows clients to asychronously send vision messages to the robot.
+ * Messages are queued in an `OutgoingQueue`, which coalesces and drops
+ * outdated messages, and written in per-frame batches, at a rate limited by a
+ * `TokenBucket`.
+ *
+ * Every `MessageClass` has a queue of its own, a lane. The next batch is
+ * always taken from the first lane (in the order of `MessageClass`) that has
+ * messages and whose own rate cap allows it, so that geometry never waits
+ * behind images or point clouds that are already queued; it only waits for
+ * the batch that is being written.
+ *
+ * The service keeps reconnecting, with an exponential backoff, whenever the
+ * connection cannot be established or is lost (e.g. because the robot's side
+ * restarted). While it is disconnected, messages are dropped right away
+ * instead of piling up in the queue.
  */
 class AsyncRobotService : public RobotService {
 public:
@@ -40,22 +80,44 @@ public:
    * No delay between subsequent messages is set.
    */
   AsyncRobotService(std::string const& remote, int port)
-      : remote_(remote), port_(port), socket_(io_service_),
-        message_timeout_(0) {}
+      : AsyncRobotService(remote, "", port, 0) {}
 
   /**
    * Creates a new `AsyncRobotService` instance that will try to send messages
    * to a robot on the given remote address (host name, port combination).
    *
-   * The delay between each subsequent sent message is set by the `delay`
-   * parameter.
+   * The delay between each subsequent sent batch of messages is set by the
+   * `delay` parameter.
    */
   AsyncRobotService(std::string const& remote, int port, int delay)
-      : remote_(remote), port_(port), socket_(io_service_),
-        message_timeout_(delay) {}
-  AsyncRobotService(std::string const& remote, std::string const& remoteName, int port, int delay)
+      : AsyncRobotService(remote, "", port, delay) {}
+  AsyncRobotService(std::string const& remote, std::string const& remoteName, int port, int delay,
+                    TransportOptions const& options = TransportOptions())
       : remote_(remote), remoteName_(remoteName), port_(port), socket_(io_service_),
-        message_timeout_(delay) {}
+        message_timeout_(delay), timer_(io_service_),
+        options_(options), writing_(false), rate_wait_(false), connected_(false), connection_id_(0),
+        bucket_(options.rateLimit, options.burst), rate_timer_(io_service_), batch_lane_(0),
+        reconnect_timer_(io_service_), backoff_ms_(options.reconnectMinMs) {
+    // The lanes are constructed in place; neither queues nor buckets can be
+    // copied.
+    lanes_.reserve(static_cast<size_t>(MessageClass::Count));
+    lanes_.emplace_back(options, 0);
+    lanes_.emplace_back(options, options.cloudRateLimit);
+    lanes_.emplace_back(options, options.imageRateLimit);
+  }
+  /**
+   * The counters of an `AsyncRobotService`.
+   */
+  struct Stats {
+    OutgoingQueue::Stats queue;
+    // messages that are currently queued
+    size_t queueDepth = 0;
+    // messages that were dropped because there was no connection
+    size_t notConnected = 0;
+    uint64_t bytesSent = 0;
+    uint64_t messagesSent = 0;
+    uint64_t reconnects = 0;
+  };
   /**
    * Starts up the service, initiating a connection to the robot.
    *
@@ -66,9 +128,24 @@ public:
   /**
    * Asynchronously sends a message to the robot.
    *
-   * The call never blocks.
+   * The call never blocks. The message's buffers are shared, not copied, and
+   * released once the message was written.
    */
-  void sendMessage(VisionMessage const& msg);
+  void sendMessage(OutgoingMessage const& msg);
+  /**
+   * Asynchronously sends the messages about one frame, which are queued at
+   * once and therefore written together.
+   */
+  void sendBatch(std::vector<OutgoingMessage> const& msgs);
+
+  bool isConnected() const { return connected_; }
+  unsigned long connectionId() const { return connection_id_; }
+
+  /**
+   * Returns how many messages and bytes were sent, queued and dropped so
+   * far, and how often the connection was re-established.
+   */
+  Stats stats();
 private:
   /**
    * The host name to send data to.
@@ -93,21 +170,138 @@ private:
 
   /**
    * A number of milliseconds that the service waits between subsequent
-   * messages that it sends to the robot.
+   * batches that it sends to the robot.
    */
   boost::posix_time::milliseconds message_timeout_;
+  /**
+   * Waits `message_timeout_` between two batches.
+   */
+  boost::asio::deadline_timer timer_;
+
+  TransportOptions const options_;
+  /**
+   * The queue of one `MessageClass`, along with the cap of its rate.
+   */
+  struct Lane {
+    Lane(TransportOptions const& options, double rateLimit)
+        : queue(options), bucket(rateLimit, options.burst) {}
+    /**
+     * Guarded by `queue_mutex_`.
+     */
+    OutgoingQueue queue;
+    /**
+     * Only used by the io_service thread.
+     */
+    TokenBucket bucket;
+  };
+  /**
+   * One lane per `MessageClass`, in the order of their priority.
+   */
+  std::vector<Lane> lanes_;
+  /**
+   * Whether a write (or the wait after one) is in progress on the io_service
+   * thread. Guarded by `queue_mutex_`, as is `rate_wait_`.
+   */
+  bool writing_;
+  /**
+   * Whether the chain of writes waits for a rate limit. Newly queued
+   * messages cut the wait short, since they may be in a lane that can be
+   * sent right away.
+   */
+  bool rate_wait_;
+  std::mutex queue_mutex_;
+  /**
+   * Whether the socket is connected. Only changed on the io_service thread,
+   * with `queue_mutex_` held, so that no message is queued after the queue
+   * was cleared when the connection was lost.
+   */
+  std::atomic<bool> connected_;
+  std::atomic<unsigned long> connection_id_;
+  /**
+   * The counters; guarded by `queue_mutex_`.
+   */
+  Stats stats_;
 
+  // The following are only used by the io_service thread.
+  /**
+   * Limits the rate of all lanes together.
+   */
+  TokenBucket bucket_;
+  /**
+   * Waits until a rate limit allows the next batch.
+   */
+  boost::asio::deadline_timer rate_timer_;
+  /**
+   * The batch that is currently written, and the index of its lane.
+   */
+  std::vector<OutgoingMessage> batch_;
+  size_t batch_lane_;
+  std::vector<boost::asio::const_buffer> buffers_;
+  lepp::MetricsClock::time_point write_start_;
+  boost::asio::ip::tcp::endpoint endpoint_;
+  /**
+   * Waits before the next attempt to connect.
+   */
+  boost::asio::deadline_timer reconnect_timer_;
+  int backoff_ms_;
+  /**
+   * The robot does not send anything; reading only detects that the
+   * connection was closed.
+   */
+  char read_buffer_[64];
+
+  /**
+   * Initiates a connection to the robot.
+   */
+  void connect();
+  void onConnected(boost::system::error_code const& error);
+  /**
+   * Tries to connect again after the current backoff, which is doubled for
+   * the next attempt.
+   */
+  void scheduleReconnect();
+  /**
+   * Closes the socket and drops all queued messages, since the robot may
+   * never receive them, then tries to reconnect.
+   */
+  void onDisconnected(boost::system::error_code const& error);
+  void startReading();
+  void onRead(boost::system::error_code const& error, size_t received);
+
+  /**
+   * Starts writing the next batch, if any. Runs on the io_service thread;
+   * the writes form a chain, so at most one is in progress at a time.
+   */
+  void writeNext();
+  /**
+   * Completion handler of the write of `batch_`. Waits `message_timeout_`,
+   * if set, before the next batch is written. This is because we do not
+   * want to overwhelm the robot with a large number of messages all sent at
+   * the same time.
+   */
+  void onWritten(boost::system::error_code const& error, size_t sent);
+  /**
+   * Makes sure the io_service thread writes the queued messages; must be
+   * called with `queue_mutex_` held. Returns what the caller needs to post
+   * to the io_service thread, if anything.
+   */
+  enum class Wake { None, Write, RateWait };
+  Wake startWriting();
+  /**
+   * Posts what `startWriting` asked for; called without the lock.
+   */
+  void wake(Wake wake);
   /**
-   * A helper function that performs the send of the message and then waits
-   * the predefined amount of time before returning. This way, the wait blocks
-   * the (io_service) thread and causes the next message that should be sent
-   * to be delayed the necessary amount of time.
+   * Cancels the wait for a rate limit, so that the lanes are looked at
+   * again.
    */
-  void inner_send(VisionMessage const& msg);
+  void cutRateWait();
   /**
-   * Helper method to send all bytes to the remote socket. To be used in inner_send.
+   * Queues the given messages into their lanes; must be called with
+   * `queue_mutex_` held.
    */
-  void sendBytes(char const* buffer, size_t length);
+  void push(OutgoingMessage const& msg, lepp::MetricsClock::time_point now);
+  size_t queueDepth() const;
 };
 
 #endif
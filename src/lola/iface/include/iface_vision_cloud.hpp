@@ -0,0 +1,135 @@
+#ifndef LOLA_VISION_CLOUD_H__
+#define LOLA_VISION_CLOUD_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+/*
+ * The payload of a CompressedPointCloudMessage (after LZ4 decompression, if
+ * CLOUD_LZ4 is set).
+ *
+ * Without CLOUD_VOXELS, the payload is a keyframe of `count` points of three
+ * int16_t each (x, y and z in multiples of `resolution`), in the order of the
+ * original cloud.
+ *
+ * With CLOUD_VOXELS, the cloud is a set of voxels of size `resolution`, each
+ * identified by its key (see voxelKey), and the payload is
+ *  - for a keyframe: the list of its keys;
+ *  - for a delta: the list of keys removed from the keyframe's set followed
+ *    by the list of keys added to it.
+ * A list of keys is stored as a varint with their number, followed by the
+ * keys in ascending order, each as the varint of its difference to the
+ * previous one (the first one to zero). Varints are unsigned LEB128.
+ */
+namespace am2b_iface
+{
+    namespace cloud
+    {
+      /**
+       * The key of the voxel with the given quantized coordinates; keys are
+       * ordered by x, then y, then z.
+       */
+      inline uint64_t voxelKey(int16_t x, int16_t y, int16_t z)
+      {
+        return (static_cast<uint64_t>(static_cast<uint16_t>(x) ^ 0x8000) << 32)
+             | (static_cast<uint64_t>(static_cast<uint16_t>(y) ^ 0x8000) << 16)
+             | (static_cast<uint64_t>(static_cast<uint16_t>(z) ^ 0x8000));
+      }
+
+      inline void voxelCoords(uint64_t key, int16_t& x, int16_t& y, int16_t& z)
+      {
+        x = static_cast<int16_t>(static_cast<uint16_t>(key >> 32) ^ 0x8000);
+        y = static_cast<int16_t>(static_cast<uint16_t>(key >> 16) ^ 0x8000);
+        z = static_cast<int16_t>(static_cast<uint16_t>(key) ^ 0x8000);
+      }
+
+      inline void putVarint(std::vector<char>& out, uint64_t v)
+      {
+        while (v >= 0x80)
+        {
+          out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+          v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+      }
+
+      /**
+       * Reads a varint at `in`, advancing it; returns false if the data ends
+       * before the varint does.
+       */
+      inline bool getVarint(char const*& in, char const* end, uint64_t& v)
+      {
+        v = 0;
+        for (int shift = 0; in != end && shift < 64; shift += 7)
+        {
+          uint8_t const byte = static_cast<uint8_t>(*in++);
+          v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+          if (!(byte & 0x80))
+            return true;
+        }
+        return false;
+      }
+
+      /**
+       * Appends a list of keys, which must be in ascending order.
+       */
+      inline void putKeys(std::vector<char>& out, std::vector<uint64_t> const& keys)
+      {
+        putVarint(out, keys.size());
+        uint64_t previous = 0;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+          putVarint(out, keys[i] - previous);
+          previous = keys[i];
+        }
+      }
+
+      /**
+       * Reads a list of keys at `in`, advancing it; returns false if the data
+       * is truncated.
+       */
+      inline bool getKeys(char const*& in, char const* end, std::vector<uint64_t>& keys)
+      {
+        uint64_t count = 0;
+        // every key takes at least one byte
+        if (!getVarint(in, end, count) || count > static_cast<uint64_t>(end - in))
+          return false;
+        keys.resize(count);
+        uint64_t previous = 0;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+          uint64_t gap = 0;
+          if (!getVarint(in, end, gap))
+            return false;
+          previous += gap;
+          keys[i] = previous;
+        }
+        return true;
+      }
+
+      /**
+       * Decodes the payload of a delta, given the keys of its keyframe, into
+       * the keys of the cloud. Returns false if the payload is truncated.
+       */
+      inline bool applyDelta(std::vector<uint64_t> const& keyframe,
+                             char const* in, char const* end,
+                             std::vector<uint64_t>& keys)
+      {
+        std::vector<uint64_t> removed, added;
+        if (!getKeys(in, end, removed) || !getKeys(in, end, added))
+          return false;
+        std::vector<uint64_t> kept;
+        kept.reserve(keyframe.size());
+        std::set_difference(keyframe.begin(), keyframe.end(), removed.begin(), removed.end(),
+                            std::back_inserter(kept));
+        keys.clear();
+        keys.reserve(kept.size() + added.size());
+        std::merge(kept.begin(), kept.end(), added.begin(), added.end(), std::back_inserter(keys));
+        return true;
+      }
+    }
+}
+
+#endif // LOLA_VISION_CLOUD_H__
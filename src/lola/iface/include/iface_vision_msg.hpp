@@ -16,7 +16,9 @@ namespace am2b_iface
       Obstacle = 0,
       Surface,
       RGB_Image,
-      PointCloud
+      PointCloud,
+      CompressedPointCloud,
+      CompressedImage
     };
 
     enum ObstacleType
@@ -408,6 +410,55 @@ namespace am2b_iface
       }
     };
 
+    enum CompressedPointCloudFlags
+    {
+      // the message holds the whole cloud; otherwise, it holds the changes to
+      // the voxels of the keyframe with the sequence number `keyframe`
+      CLOUD_KEYFRAME = 1,
+      // the points are a set of voxels, encoded as sorted voxel keys (see
+      // iface_vision_cloud.hpp); otherwise, they are a list of int16_t[3]
+      CLOUD_VOXELS = 2,
+      // the payload is LZ4 compressed
+      CLOUD_LZ4 = 4
+    };
+
+    /**
+     * A point cloud whose coordinates are quantized to multiples of
+     * `resolution`, so that they fit into an int16_t each. The payload of
+     * `payload_size` bytes follows the struct; see iface_vision_cloud.hpp for
+     * its format.
+     */
+    struct CompressedPointCloudMessage {
+      uint32_t flags;
+      uint32_t count;      // number of points of the decoded cloud
+      float resolution;    // size of a quantization step (m)
+      uint32_t sequence;   // number of the cloud, counting from 1
+      uint32_t keyframe;   // sequence number of the keyframe a delta applies to
+      uint32_t raw_size;   // size of the payload before compression
+      uint32_t payload_size;
+      uint32_t encode_us;  // time the sender spent encoding the cloud
+    };
+
+    enum CompressedImageFormat
+    {
+      // a JPEG file
+      IMAGE_JPEG = 0,
+      // width * height bytes of 8-bit grayscale pixels, row by row
+      IMAGE_GRAY8
+    };
+
+    /**
+     * An RGB camera image in a compressed or reduced format. The payload of
+     * `payload_size` bytes follows the struct.
+     */
+    struct CompressedImageMessage {
+      uint32_t format;
+      uint32_t width;      // of the sent image, which may have been subsampled
+      uint32_t height;
+      uint32_t payload_size;
+      uint32_t encode_us;  // time the sender spent encoding the image
+    };
+
     /**
      * A struct representing the header of all messages sent from the vision node
      */
@@ -442,6 +493,16 @@ namespace am2b_iface
             out << "RGB Image";
             break;
           }
+          case Message_Type::CompressedPointCloud:
+          {
+            out << "CompressedPointCloud";
+            break;
+          }
+          case Message_Type::CompressedImage:
+          {
+            out << "CompressedImage";
+            break;
+          }
           default:
           {
             out << "Unkown Message Type";
@@ -3,6 +3,8 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -10,6 +12,11 @@
 #include <tclap/CmdLine.h>
 #include <iface_msg.hpp>
 #include <iface_vision_msg.hpp>
+#include <iface_vision_cloud.hpp>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 using am2b_iface::VisionMessageHeader;
 using am2b_iface::Message_Type;
@@ -18,6 +25,8 @@ using am2b_iface::ObstacleMessage;
 using am2b_iface::SurfaceMessage;
 using am2b_iface::PointCloudMessage;
 using am2b_iface::RGBMessage;
+using am2b_iface::CompressedPointCloudMessage;
+using am2b_iface::CompressedImageMessage;
 
 
 /**
@@ -40,6 +49,177 @@ struct ParsedParams
 {
   unsigned int port = 0; // port to listen on
   bool verbose = false;
+  bool stats = false; // print a summary per second instead of every message
+};
+
+/**
+ * Decodes CompressedPointCloudMessages, keeping the last keyframe that the
+ * following deltas refer to. This is the reference for receivers of the
+ * format described in iface_vision_cloud.hpp.
+ */
+struct CloudDecoder
+{
+  uint32_t keyframe_sequence = 0;
+  std::vector<uint64_t> keyframe_keys;
+  std::vector<char> raw;
+  std::vector<uint64_t> keys;
+
+  /**
+   * Decodes the message into `points` (x, y, z in meters). Returns an error
+   * message, or an empty string on success.
+   */
+  std::string decode(CompressedPointCloudMessage const& msg, char const* payload,
+                     std::vector<float>& points)
+  {
+    char const* data = payload;
+    size_t size = msg.payload_size;
+    if (msg.flags & am2b_iface::CLOUD_LZ4)
+    {
+#ifdef HAVE_LZ4
+      raw.resize(msg.raw_size);
+      int const n = LZ4_decompress_safe(payload, raw.data(), static_cast<int>(msg.payload_size),
+                                        static_cast<int>(msg.raw_size));
+      if (n != static_cast<int>(msg.raw_size))
+        return "corrupt LZ4 payload";
+      data = raw.data();
+      size = raw.size();
+#else
+      return "LZ4 compressed, but built without LZ4 support";
+#endif
+    }
+    char const* const end = data + size;
+
+    points.clear();
+    if (!(msg.flags & am2b_iface::CLOUD_VOXELS))
+    {
+      if (size != 3 * sizeof(int16_t) * msg.count)
+        return "unexpected payload size";
+      for (size_t i = 0; i < 3 * msg.count; ++i)
+      {
+        int16_t q;
+        memcpy(&q, data + i * sizeof(q), sizeof(q));
+        points.push_back(q * msg.resolution);
+      }
+      return "";
+    }
+
+    if (msg.flags & am2b_iface::CLOUD_KEYFRAME)
+    {
+      if (!am2b_iface::cloud::getKeys(data, end, keys))
+        return "truncated keyframe";
+      keyframe_keys = keys;
+      keyframe_sequence = msg.sequence;
+    }
+    else
+    {
+      // a delta against a keyframe that was never received cannot be decoded
+      if (msg.keyframe != keyframe_sequence)
+        return "missing keyframe";
+      if (!am2b_iface::cloud::applyDelta(keyframe_keys, data, end, keys))
+        return "truncated delta";
+    }
+    if (keys.size() != msg.count)
+      return "unexpected number of points";
+    for (uint64_t key : keys)
+    {
+      int16_t x, y, z;
+      am2b_iface::cloud::voxelCoords(key, x, y, z);
+      points.push_back(x * msg.resolution);
+      points.push_back(y * msg.resolution);
+      points.push_back(z * msg.resolution);
+    }
+    return "";
+  }
+};
+
+/**
+ * Counts the received messages, so that the throughput of the sender can be
+ * measured.
+ */
+struct ReceiveStats
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  size_t messages[6] = {0, 0, 0, 0, 0, 0}; // per Message_Type
+  size_t bytes = 0;
+  uint32_t first_frame = 0;
+  uint32_t last_frame = 0;
+  // compressed point clouds
+  size_t cloud_points = 0;
+  size_t cloud_bytes = 0;
+  size_t keyframes = 0;
+  size_t undecodable = 0;
+  double encode_us = 0;
+  double decode_us = 0;
+  // compressed images
+  size_t image_pixels = 0;
+  size_t image_bytes = 0;
+  double image_encode_us = 0;
+
+  void addImage(CompressedImageMessage const& msg, size_t size)
+  {
+    image_pixels += static_cast<size_t>(msg.width) * msg.height;
+    image_bytes += size;
+    image_encode_us += msg.encode_us;
+  }
+
+  void addCloud(CompressedPointCloudMessage const& msg, size_t size, bool decoded, double decode_time_us)
+  {
+    cloud_points += msg.count;
+    cloud_bytes += size;
+    if (msg.flags & am2b_iface::CLOUD_KEYFRAME)
+      ++keyframes;
+    if (!decoded)
+      ++undecodable;
+    encode_us += msg.encode_us;
+    decode_us += decode_time_us;
+  }
+
+  void add(VisionMessageHeader const& header, size_t size)
+  {
+    if (header.type >= 0 && header.type < 6)
+      ++messages[header.type];
+    if (bytes == 0)
+      first_frame = header.frame;
+    bytes += size;
+    last_frame = header.frame;
+  }
+
+  // prints and resets the counters once per second
+  void printIfDue()
+  {
+    std::chrono::steady_clock::time_point const now = std::chrono::steady_clock::now();
+    double const seconds = std::chrono::duration<double>(now - start).count();
+    if (seconds < 1.0)
+      return;
+    std::printf("%.1f msgs/s (obstacles %zu, surfaces %zu, images %zu, clouds %zu, compressed clouds %zu, compressed images %zu), %.1f kB/s, frames %u-%u\n",
+                (messages[0] + messages[1] + messages[2] + messages[3] + messages[4] + messages[5]) / seconds,
+                messages[Message_Type::Obstacle], messages[Message_Type::Surface],
+                messages[Message_Type::RGB_Image], messages[Message_Type::PointCloud],
+                messages[Message_Type::CompressedPointCloud], messages[Message_Type::CompressedImage],
+                bytes / seconds / 1000.0, first_frame, last_frame);
+    size_t const clouds = messages[Message_Type::CompressedPointCloud];
+    if (clouds > 0)
+    {
+      // compared to sending the points as a PointCloudMessage of pcl::PointXYZ
+      double const uncompressed = 16.0 * cloud_points;
+      std::printf("  compressed clouds: %zu keyframes, %.0f points, %.2f bits/point (%.1fx smaller), encode %.0f us, decode %.0f us, %zu undecodable\n",
+                  keyframes, static_cast<double>(cloud_points) / clouds,
+                  cloud_points > 0 ? 8.0 * cloud_bytes / cloud_points : 0.0,
+                  cloud_bytes > 0 ? uncompressed / cloud_bytes : 0.0,
+                  encode_us / clouds, decode_us / clouds, undecodable);
+    }
+    size_t const images = messages[Message_Type::CompressedImage];
+    if (images > 0)
+    {
+      // compared to sending the pixels as an RGBMessage
+      std::printf("  compressed images: %.0f pixels, %.2f bits/pixel (%.1fx smaller), encode %.0f us\n",
+                  static_cast<double>(image_pixels) / images,
+                  image_pixels > 0 ? 8.0 * image_bytes / image_pixels : 0.0,
+                  image_bytes > 0 ? 3.0 * image_pixels / image_bytes : 0.0,
+                  image_encode_us / images);
+    }
+    *this = ReceiveStats();
+  }
 };
 
 
@@ -51,12 +231,14 @@ bool parse_args(int argc, char* argv[], ParsedParams* params)
     TCLAP::ValueArg<unsigned int> portArg("p","port","Port to listen on",true,0,"unsigned int");
     cmd.add( portArg );
     TCLAP::SwitchArg verboseSwitch("v","verbose","Verbose output", cmd, false);
+    TCLAP::SwitchArg statsSwitch("s","stats","Only print message and byte rates once per second", cmd, false);
 
     // Parse the argv array.
     cmd.parse( argc, argv );
     // Get the value parsed by each arg.
     params->port = portArg.getValue();
     params->verbose = verboseSwitch.getValue();
+    params->stats = statsSwitch.getValue();
 
   } catch (TCLAP::ArgException &e)  // catch any exceptions
   {
@@ -82,8 +264,11 @@ void failWithError(std::string s)
   exit(1);
 }
 
-void readDataFrom(int socket_remote, const sockaddr_in& si_other, bool verbose)
+void readDataFrom(int socket_remote, const sockaddr_in& si_other, bool verbose, bool stats)
 {
+  ReceiveStats receive_stats;
+  CloudDecoder cloud_decoder;
+  std::vector<float> cloud_points;
   std::vector<char> buf;
   buf.resize(BUFLEN); // init buffer to be at least BUFLEN; we'll expand it later if need be
 
@@ -164,6 +349,35 @@ void readDataFrom(int socket_remote, const sockaddr_in& si_other, bool verbose)
     }
 
     VisionMessageHeader* header = (VisionMessageHeader*)(buf.data() + sizeof(am2b_iface::MsgHeader));
+
+    // Compressed clouds are decoded in any case, as the receiver must keep
+    // track of the keyframes.
+    std::string cloud_error;
+    double decode_us = 0;
+    if (header->type == Message_Type::CompressedPointCloud)
+    {
+      char const* content = buf.data() + sizeof(am2b_iface::MsgHeader) + sizeof(VisionMessageHeader);
+      CompressedPointCloudMessage const* message = (CompressedPointCloudMessage const*)content;
+      std::chrono::steady_clock::time_point const decode_start = std::chrono::steady_clock::now();
+      if (header->len < sizeof(CompressedPointCloudMessage)
+          || header->len - sizeof(CompressedPointCloudMessage) < message->payload_size)
+        cloud_error = "truncated message";
+      else
+        cloud_error = cloud_decoder.decode(*message, content + sizeof(CompressedPointCloudMessage), cloud_points);
+      decode_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - decode_start).count();
+      if (stats)
+        receive_stats.addCloud(*message, total_received, cloud_error.empty(), decode_us);
+    }
+
+    if (stats)
+    {
+      if (header->type == Message_Type::CompressedImage && header->len >= sizeof(CompressedImageMessage))
+        receive_stats.addImage(*(CompressedImageMessage const*)(buf.data() + sizeof(am2b_iface::MsgHeader) + sizeof(VisionMessageHeader)),
+                               total_received);
+      receive_stats.add(*header, total_received);
+      receive_stats.printIfDue();
+      continue;
+    }
     std::cout << "Received VisionMessageHeader: " << *header << std::endl;
 
     switch (header->type)
@@ -207,6 +421,31 @@ void readDataFrom(int socket_remote, const sockaddr_in& si_other, bool verbose)
         std::cout << "\tHeight: " << message->height << std::endl;
         break;
       }
+      case Message_Type::CompressedPointCloud:
+      {
+        CompressedPointCloudMessage* message = (CompressedPointCloudMessage*)(buf.data() + sizeof(VisionMessageHeader) + sizeof(am2b_iface::MsgHeader));
+        std::cout << "Received CompressedPointCloud:" << std::endl;
+        std::cout << "\t" << ((message->flags & am2b_iface::CLOUD_KEYFRAME) ? "Keyframe" : "Delta")
+                  << " #" << message->sequence << " (keyframe #" << message->keyframe << ")"
+                  << ((message->flags & am2b_iface::CLOUD_VOXELS) ? ", voxels" : "")
+                  << ((message->flags & am2b_iface::CLOUD_LZ4) ? ", LZ4" : "") << std::endl;
+        std::cout << "\tNumber of points: " << message->count << " at " << message->resolution * 1000 << " mm" << std::endl;
+        std::cout << "\tPayload:          " << message->payload_size << " bytes (" << message->raw_size << " uncompressed)" << std::endl;
+        std::cout << "\tEncoded in " << message->encode_us << " us, decoded in " << decode_us << " us" << std::endl;
+        if (!cloud_error.empty())
+          std::cout << "\tCannot decode: " << cloud_error << std::endl;
+        break;
+      }
+      case Message_Type::CompressedImage:
+      {
+        CompressedImageMessage* message = (CompressedImageMessage*)(buf.data() + sizeof(VisionMessageHeader) + sizeof(am2b_iface::MsgHeader));
+        std::cout << "Received CompressedImage:" << std::endl;
+        std::cout << "\tFormat: " << (message->format == am2b_iface::IMAGE_JPEG ? "JPEG" : "Gray8") << std::endl;
+        std::cout << "\tWidth:  " << message->width  << std::endl;
+        std::cout << "\tHeight: " << message->height << std::endl;
+        std::cout << "\tPayload: " << message->payload_size << " bytes, encoded in " << message->encode_us << " us" << std::endl;
+        break;
+      }
       default:
       {
         std::cout << "UNKNOWN VisionMessage type: " << header->type << "!!" << std::endl;
@@ -216,7 +455,7 @@ void readDataFrom(int socket_remote, const sockaddr_in& si_other, bool verbose)
   }
 }
 
-void listen(unsigned int port, bool verbose)
+void listen(unsigned int port, bool verbose, bool stats)
 {
   struct sockaddr_in si_me, si_other;
   int s, s_other;
@@ -255,7 +494,7 @@ void listen(unsigned int port, bool verbose)
 
 
     // receive data from new connection
-    readDataFrom(s_other, si_other, verbose);
+    readDataFrom(s_other, si_other, verbose, stats);
 
     std::cout << "Connection to client terminated!" << std::endl;
     std::cout << "-------------------------------------" << std::endl << std::endl;;
@@ -284,7 +523,7 @@ int main(int argc, char* argv[])
   }
 #endif
 
-  listen(params.port, params.verbose);
+  listen(params.port, params.verbose, params.stats);
 
 #ifdef _WIN32
   if (WSACleanup() != 0)